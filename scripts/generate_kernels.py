@@ -0,0 +1,90 @@
+import sys
+from pathlib import Path
+
+# SHAPES
+
+# network shapes to specialize, can be overridden on the command line,
+# e.g. 'python generate_kernels.py 784,16,16,10 784,32,10'
+shapes = [[int(d) for d in arg.split(",")] for arg in sys.argv[1:]] or [[784, 16, 16, 10]]
+
+ROWS = 4  # rows of the weight matrix per register tile
+LANES = 4  # doubles per vector accumulator
+
+# CODE GENERATION
+
+
+def layer(l, n_in, n_out):
+    lines = [
+        f"// layer {l}: {n_in} -> {n_out}",
+        "{",
+        f"    const double *restrict x = a[{l - 1}];",
+        f"    const double *restrict w = network.weights[{l}];",
+        f"    const double *restrict b = network.biases[{l}];",
+        f"    double *restrict y = a[{l}];",
+    ]
+    n_vec = n_in - n_in % LANES
+    for start in range(0, n_out, ROWS):
+        rows = range(start, min(start + ROWS, n_out))
+        lines += ["    {"]
+        lines += [f"        v4d acc{r - start} = {{0, 0, 0, 0}};" for r in rows]
+        if n_vec:
+            lines += [
+                f"        for (int j = 0; j < {n_vec}; j += {LANES})",
+                "        {",
+                "            v4d xj = LOAD_V4D(x + j);",
+                *(
+                    f"            acc{r - start} += LOAD_V4D(w + {r * n_in} + j) * xj;"
+                    for r in rows
+                ),
+                "        }",
+            ]
+        for r in rows:
+            tail = "".join(f" + w[{r * n_in + j}] * x[{j}]" for j in range(n_vec, n_in))
+            lines += [
+                f"        y[{r}] = 1.0 / (1.0 + exp(-(SUM_V4D(acc{r - start}){tail} + b[{r}])));"
+            ]
+        lines += ["    }"]
+    lines += ["}"]
+    return lines
+
+
+def kernel(dims):
+    name = "forward_" + "_".join(map(str, dims))
+    body = ["double **a = network.neurons;", "a[0] = inputs;", ""]
+    for l in range(1, len(dims)):
+        body += layer(l, dims[l - 1], dims[l]) + [""]
+    return name, [
+        f"void {name}(Network network, double *inputs)",
+        "{",
+        *(("    " + line).rstrip() for line in body[:-1]),
+        "}",
+        "",
+    ]
+
+
+kernels = [kernel(dims) for dims in shapes]
+
+max_ndim = max(len(dims) for dims in shapes)
+code = [
+    f"/* automatically generated by '{Path(__file__).name}' */",
+    "",
+    *(line for (_, lines) in kernels for line in lines),
+    "typedef void (*ForwardKernel)(Network network, double *inputs);",
+    "",
+    "typedef struct",
+    "{",
+    "    int ndim;",
+    f"    int dims[{max_ndim}];",
+    "    ForwardKernel forward;",
+    "} SpecializedKernel;",
+    "",
+    "SpecializedKernel specialized_kernels[] = {",
+    *(
+        f"    {{{len(dims)}, {{{', '.join(map(str, dims))}}}, {name}}},"
+        for (dims, (name, _)) in zip(shapes, kernels)
+    ),
+    "};",
+    "",
+]
+
+(Path(__file__).parent.parent / "src" / "kernels.c").write_text("\n".join(code))
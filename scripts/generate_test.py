@@ -79,6 +79,40 @@ body = [
         for (name, tensor) in gradients
     ),
     "",
+    "// compare gradients of the 16-bit passes, undoing the loss scale",
+    *(
+        "\n".join(
+            [
+                "{",
+                f"    MixedPrecision *mixed = mixed_create(network, 1, {precision});",
+                "    mixed_zero_gradients(mixed, 0, network);",
+                "    double mixed_loss = mixed_sample(mixed, 0, network, inputs, label);",
+                f'    assert_close("{name} loss", 1, &loss, &mixed_loss, {tolerance});',
+                f"    for (int l = 1; l < {len(dims)}; l++)",
+                "    {",
+                "        for (int i = 0; i < dims[l] * dims[l - 1]; i++)",
+                "        {",
+                "            network.weights_grad[l][i] = mixed->weights_grad[0][l][i] / mixed->loss_scale;",
+                "        }",
+                "        for (int i = 0; i < dims[l]; i++)",
+                "        {",
+                "            network.biases_grad[l][i] = mixed->biases_grad[0][l][i] / mixed->loss_scale;",
+                "        }",
+                "    }",
+                *(
+                    f'    assert_close("{name} {grad}", {tensor.numel()}, {grad}, network.{dict(w="weights", b="biases")[grad[-2]]}_grad[{int(grad[-1])}], {tolerance});'
+                    for (grad, tensor) in gradients
+                ),
+                "    mixed_destroy(mixed, network);",
+                "}",
+            ]
+        )
+        for (name, precision, tolerance) in [
+            ("bf16", "PRECISION_BF16", 0.05),
+            ("fp16", "PRECISION_FP16", 0.005),
+        ]
+    ),
+    "",
     "// free gradients",
     *(f"free({name});" for (name, _) in gradients),
     "// free inputs and labels",
@@ -0,0 +1,236 @@
+/* automatically generated by 'generate_kernels.py' */
+
+void forward_784_16_16_10(Network network, double *inputs)
+{
+    double **a = network.neurons;
+    a[0] = inputs;
+
+    // layer 1: 784 -> 16
+    {
+        const double *restrict x = a[0];
+        const double *restrict w = network.weights[1];
+        const double *restrict b = network.biases[1];
+        double *restrict y = a[1];
+        {
+            v4d acc0 = {0, 0, 0, 0};
+            v4d acc1 = {0, 0, 0, 0};
+            v4d acc2 = {0, 0, 0, 0};
+            v4d acc3 = {0, 0, 0, 0};
+            for (int j = 0; j < 784; j += 4)
+            {
+                v4d xj = LOAD_V4D(x + j);
+                acc0 += LOAD_V4D(w + 0 + j) * xj;
+                acc1 += LOAD_V4D(w + 784 + j) * xj;
+                acc2 += LOAD_V4D(w + 1568 + j) * xj;
+                acc3 += LOAD_V4D(w + 2352 + j) * xj;
+            }
+            y[0] = 1.0 / (1.0 + exp(-(SUM_V4D(acc0) + b[0])));
+            y[1] = 1.0 / (1.0 + exp(-(SUM_V4D(acc1) + b[1])));
+            y[2] = 1.0 / (1.0 + exp(-(SUM_V4D(acc2) + b[2])));
+            y[3] = 1.0 / (1.0 + exp(-(SUM_V4D(acc3) + b[3])));
+        }
+        {
+            v4d acc0 = {0, 0, 0, 0};
+            v4d acc1 = {0, 0, 0, 0};
+            v4d acc2 = {0, 0, 0, 0};
+            v4d acc3 = {0, 0, 0, 0};
+            for (int j = 0; j < 784; j += 4)
+            {
+                v4d xj = LOAD_V4D(x + j);
+                acc0 += LOAD_V4D(w + 3136 + j) * xj;
+                acc1 += LOAD_V4D(w + 3920 + j) * xj;
+                acc2 += LOAD_V4D(w + 4704 + j) * xj;
+                acc3 += LOAD_V4D(w + 5488 + j) * xj;
+            }
+            y[4] = 1.0 / (1.0 + exp(-(SUM_V4D(acc0) + b[4])));
+            y[5] = 1.0 / (1.0 + exp(-(SUM_V4D(acc1) + b[5])));
+            y[6] = 1.0 / (1.0 + exp(-(SUM_V4D(acc2) + b[6])));
+            y[7] = 1.0 / (1.0 + exp(-(SUM_V4D(acc3) + b[7])));
+        }
+        {
+            v4d acc0 = {0, 0, 0, 0};
+            v4d acc1 = {0, 0, 0, 0};
+            v4d acc2 = {0, 0, 0, 0};
+            v4d acc3 = {0, 0, 0, 0};
+            for (int j = 0; j < 784; j += 4)
+            {
+                v4d xj = LOAD_V4D(x + j);
+                acc0 += LOAD_V4D(w + 6272 + j) * xj;
+                acc1 += LOAD_V4D(w + 7056 + j) * xj;
+                acc2 += LOAD_V4D(w + 7840 + j) * xj;
+                acc3 += LOAD_V4D(w + 8624 + j) * xj;
+            }
+            y[8] = 1.0 / (1.0 + exp(-(SUM_V4D(acc0) + b[8])));
+            y[9] = 1.0 / (1.0 + exp(-(SUM_V4D(acc1) + b[9])));
+            y[10] = 1.0 / (1.0 + exp(-(SUM_V4D(acc2) + b[10])));
+            y[11] = 1.0 / (1.0 + exp(-(SUM_V4D(acc3) + b[11])));
+        }
+        {
+            v4d acc0 = {0, 0, 0, 0};
+            v4d acc1 = {0, 0, 0, 0};
+            v4d acc2 = {0, 0, 0, 0};
+            v4d acc3 = {0, 0, 0, 0};
+            for (int j = 0; j < 784; j += 4)
+            {
+                v4d xj = LOAD_V4D(x + j);
+                acc0 += LOAD_V4D(w + 9408 + j) * xj;
+                acc1 += LOAD_V4D(w + 10192 + j) * xj;
+                acc2 += LOAD_V4D(w + 10976 + j) * xj;
+                acc3 += LOAD_V4D(w + 11760 + j) * xj;
+            }
+            y[12] = 1.0 / (1.0 + exp(-(SUM_V4D(acc0) + b[12])));
+            y[13] = 1.0 / (1.0 + exp(-(SUM_V4D(acc1) + b[13])));
+            y[14] = 1.0 / (1.0 + exp(-(SUM_V4D(acc2) + b[14])));
+            y[15] = 1.0 / (1.0 + exp(-(SUM_V4D(acc3) + b[15])));
+        }
+    }
+
+    // layer 2: 16 -> 16
+    {
+        const double *restrict x = a[1];
+        const double *restrict w = network.weights[2];
+        const double *restrict b = network.biases[2];
+        double *restrict y = a[2];
+        {
+            v4d acc0 = {0, 0, 0, 0};
+            v4d acc1 = {0, 0, 0, 0};
+            v4d acc2 = {0, 0, 0, 0};
+            v4d acc3 = {0, 0, 0, 0};
+            for (int j = 0; j < 16; j += 4)
+            {
+                v4d xj = LOAD_V4D(x + j);
+                acc0 += LOAD_V4D(w + 0 + j) * xj;
+                acc1 += LOAD_V4D(w + 16 + j) * xj;
+                acc2 += LOAD_V4D(w + 32 + j) * xj;
+                acc3 += LOAD_V4D(w + 48 + j) * xj;
+            }
+            y[0] = 1.0 / (1.0 + exp(-(SUM_V4D(acc0) + b[0])));
+            y[1] = 1.0 / (1.0 + exp(-(SUM_V4D(acc1) + b[1])));
+            y[2] = 1.0 / (1.0 + exp(-(SUM_V4D(acc2) + b[2])));
+            y[3] = 1.0 / (1.0 + exp(-(SUM_V4D(acc3) + b[3])));
+        }
+        {
+            v4d acc0 = {0, 0, 0, 0};
+            v4d acc1 = {0, 0, 0, 0};
+            v4d acc2 = {0, 0, 0, 0};
+            v4d acc3 = {0, 0, 0, 0};
+            for (int j = 0; j < 16; j += 4)
+            {
+                v4d xj = LOAD_V4D(x + j);
+                acc0 += LOAD_V4D(w + 64 + j) * xj;
+                acc1 += LOAD_V4D(w + 80 + j) * xj;
+                acc2 += LOAD_V4D(w + 96 + j) * xj;
+                acc3 += LOAD_V4D(w + 112 + j) * xj;
+            }
+            y[4] = 1.0 / (1.0 + exp(-(SUM_V4D(acc0) + b[4])));
+            y[5] = 1.0 / (1.0 + exp(-(SUM_V4D(acc1) + b[5])));
+            y[6] = 1.0 / (1.0 + exp(-(SUM_V4D(acc2) + b[6])));
+            y[7] = 1.0 / (1.0 + exp(-(SUM_V4D(acc3) + b[7])));
+        }
+        {
+            v4d acc0 = {0, 0, 0, 0};
+            v4d acc1 = {0, 0, 0, 0};
+            v4d acc2 = {0, 0, 0, 0};
+            v4d acc3 = {0, 0, 0, 0};
+            for (int j = 0; j < 16; j += 4)
+            {
+                v4d xj = LOAD_V4D(x + j);
+                acc0 += LOAD_V4D(w + 128 + j) * xj;
+                acc1 += LOAD_V4D(w + 144 + j) * xj;
+                acc2 += LOAD_V4D(w + 160 + j) * xj;
+                acc3 += LOAD_V4D(w + 176 + j) * xj;
+            }
+            y[8] = 1.0 / (1.0 + exp(-(SUM_V4D(acc0) + b[8])));
+            y[9] = 1.0 / (1.0 + exp(-(SUM_V4D(acc1) + b[9])));
+            y[10] = 1.0 / (1.0 + exp(-(SUM_V4D(acc2) + b[10])));
+            y[11] = 1.0 / (1.0 + exp(-(SUM_V4D(acc3) + b[11])));
+        }
+        {
+            v4d acc0 = {0, 0, 0, 0};
+            v4d acc1 = {0, 0, 0, 0};
+            v4d acc2 = {0, 0, 0, 0};
+            v4d acc3 = {0, 0, 0, 0};
+            for (int j = 0; j < 16; j += 4)
+            {
+                v4d xj = LOAD_V4D(x + j);
+                acc0 += LOAD_V4D(w + 192 + j) * xj;
+                acc1 += LOAD_V4D(w + 208 + j) * xj;
+                acc2 += LOAD_V4D(w + 224 + j) * xj;
+                acc3 += LOAD_V4D(w + 240 + j) * xj;
+            }
+            y[12] = 1.0 / (1.0 + exp(-(SUM_V4D(acc0) + b[12])));
+            y[13] = 1.0 / (1.0 + exp(-(SUM_V4D(acc1) + b[13])));
+            y[14] = 1.0 / (1.0 + exp(-(SUM_V4D(acc2) + b[14])));
+            y[15] = 1.0 / (1.0 + exp(-(SUM_V4D(acc3) + b[15])));
+        }
+    }
+
+    // layer 3: 16 -> 10
+    {
+        const double *restrict x = a[2];
+        const double *restrict w = network.weights[3];
+        const double *restrict b = network.biases[3];
+        double *restrict y = a[3];
+        {
+            v4d acc0 = {0, 0, 0, 0};
+            v4d acc1 = {0, 0, 0, 0};
+            v4d acc2 = {0, 0, 0, 0};
+            v4d acc3 = {0, 0, 0, 0};
+            for (int j = 0; j < 16; j += 4)
+            {
+                v4d xj = LOAD_V4D(x + j);
+                acc0 += LOAD_V4D(w + 0 + j) * xj;
+                acc1 += LOAD_V4D(w + 16 + j) * xj;
+                acc2 += LOAD_V4D(w + 32 + j) * xj;
+                acc3 += LOAD_V4D(w + 48 + j) * xj;
+            }
+            y[0] = 1.0 / (1.0 + exp(-(SUM_V4D(acc0) + b[0])));
+            y[1] = 1.0 / (1.0 + exp(-(SUM_V4D(acc1) + b[1])));
+            y[2] = 1.0 / (1.0 + exp(-(SUM_V4D(acc2) + b[2])));
+            y[3] = 1.0 / (1.0 + exp(-(SUM_V4D(acc3) + b[3])));
+        }
+        {
+            v4d acc0 = {0, 0, 0, 0};
+            v4d acc1 = {0, 0, 0, 0};
+            v4d acc2 = {0, 0, 0, 0};
+            v4d acc3 = {0, 0, 0, 0};
+            for (int j = 0; j < 16; j += 4)
+            {
+                v4d xj = LOAD_V4D(x + j);
+                acc0 += LOAD_V4D(w + 64 + j) * xj;
+                acc1 += LOAD_V4D(w + 80 + j) * xj;
+                acc2 += LOAD_V4D(w + 96 + j) * xj;
+                acc3 += LOAD_V4D(w + 112 + j) * xj;
+            }
+            y[4] = 1.0 / (1.0 + exp(-(SUM_V4D(acc0) + b[4])));
+            y[5] = 1.0 / (1.0 + exp(-(SUM_V4D(acc1) + b[5])));
+            y[6] = 1.0 / (1.0 + exp(-(SUM_V4D(acc2) + b[6])));
+            y[7] = 1.0 / (1.0 + exp(-(SUM_V4D(acc3) + b[7])));
+        }
+        {
+            v4d acc0 = {0, 0, 0, 0};
+            v4d acc1 = {0, 0, 0, 0};
+            for (int j = 0; j < 16; j += 4)
+            {
+                v4d xj = LOAD_V4D(x + j);
+                acc0 += LOAD_V4D(w + 128 + j) * xj;
+                acc1 += LOAD_V4D(w + 144 + j) * xj;
+            }
+            y[8] = 1.0 / (1.0 + exp(-(SUM_V4D(acc0) + b[8])));
+            y[9] = 1.0 / (1.0 + exp(-(SUM_V4D(acc1) + b[9])));
+        }
+    }
+}
+
+typedef void (*ForwardKernel)(Network network, double *inputs);
+
+typedef struct
+{
+    int ndim;
+    int dims[4];
+    ForwardKernel forward;
+} SpecializedKernel;
+
+SpecializedKernel specialized_kernels[] = {
+    {4, {784, 16, 16, 10}, forward_784_16_16_10},
+};
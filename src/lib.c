@@ -1,9 +1,30 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/perf_event.h>
 #include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
 #include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 // TYPES
 
@@ -19,6 +40,10 @@ typedef struct
     int size;
     int rows;
     int cols;
+    double *pixels; // large array holding the data of all images, NULL if every image owns its data
+    double *labels; // large array holding the labels of all images
+    int capacity;   // images in pixels and labels, splits may shrink size
+    int view;       // shares the images of another dataset, which frees them
 } Dataset;
 
 // PRINT UTILS
@@ -81,27 +106,64 @@ void print_progress(int progress, int max, int duration)
 
 // FUNCTIONAL UTILS
 
-int arg_max(double *prediction)
+// index of the largest of n values, the first one on ties
+int arg_max(int n, double *prediction)
 {
-    double max = 0.0;
     int index = 0;
-    for (int i = 0; i < 10; i++)
+    for (int i = 1; i < n; i++)
     {
-        if (prediction[i] > max)
+        if (prediction[i] > prediction[index])
         {
             index = i;
-            max = prediction[i];
-        };
+        }
     }
     return index;
 }
 
-double *random_array(int size)
+// RANDOM NUMBERS
+
+/*
+ * Counter-based generator: every number is a pure function of (seed, stream,
+ * counter), so results don't depend on which thread draws them or in which
+ * order. Streams are namespaced by purpose and combined with a layer, epoch
+ * or thread index.
+ */
+
+#define STREAM_WEIGHTS 0x100000000ull
+#define STREAM_BIASES 0x200000000ull
+#define STREAM_SHUFFLE 0x300000000ull
+#define STREAM_AUGMENT 0x400000000ull
+#define STREAM_SWEEP 0x500000000ull
+#define STREAM_FACTORIZE 0x600000000ull
+#define STREAM_REPLAY 0x700000000ull
+
+uint64_t rng_seed = 0;
+
+uint64_t rng_mix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+uint64_t rng_next(uint64_t stream, uint64_t counter)
+{
+    uint64_t x = rng_mix(rng_seed + 0x9e3779b97f4a7c15ull);
+    x = rng_mix(x ^ (stream * 0x9e3779b97f4a7c15ull));
+    return rng_mix(x ^ (counter * 0xd1b54a32d192ed03ull));
+}
+
+double rng_uniform(uint64_t stream, uint64_t counter)
+{
+    return (rng_next(stream, counter) >> 11) * 0x1.0p-53;
+}
+
+double *random_array(int size, uint64_t stream)
 {
     double *array = malloc(size * sizeof(double));
     for (int i = 0; i < size; i++)
     {
-        array[i] = (double)rand() / ((double)RAND_MAX) - 0.5;
+        array[i] = rng_uniform(stream, i) - 0.5;
     }
     return array;
 }
@@ -127,297 +189,6031 @@ double timestamp()
     return 0.000000001 * (1000000000 * start.tv_sec + start.tv_nsec);
 }
 
-// NETWORK
+// HARDWARE COUNTERS
 
-typedef struct Network
+/*
+ * Performance counters of a set of threads, read through perf_event_open and
+ * counting user space only. Counters the CPU, a virtual machine or the kernel
+ * does not provide stay closed and read as NAN. The task clock is a software
+ * event that works wherever perf_event_open is allowed at all; where it is
+ * not (seccomp, perf_event_paranoid), callers fall back to the wall clock.
+ */
+
+typedef enum
 {
-    double **neurons;
-    double **weights;
-    double **biases;
-    double **weights_grad;
-    double **biases_grad;
-    int *dims;
-    int ndim;
-} Network;
+    COUNTER_TASK_CLOCK, // CPU time in nanoseconds
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_L1_MISSES,  // L1 data cache read misses
+    COUNTER_LLC_MISSES, // last level cache misses
+    COUNTER_BRANCH_MISSES,
+    COUNTER_FP_VECTOR, // retired packed double instructions, Intel only
+    N_COUNTERS,
+} Counter;
 
-Network network_create(int ndim, int *dims)
+typedef struct
 {
-    Network network = {
-        .neurons = malloc(ndim * sizeof(double *)),
-        .weights = malloc(ndim * sizeof(double *)),
-        .biases = malloc(ndim * sizeof(double *)),
-        .weights_grad = malloc(ndim * sizeof(double *)),
-        .biases_grad = malloc(ndim * sizeof(double *)),
-        .dims = malloc(ndim * sizeof(int)),
-        ndim = ndim,
-    };
-    for (int i = 1; i < ndim; i++)
-    {
-        network.neurons[i] = random_array(dims[i]);
-        network.weights[i] = random_array(dims[i] * dims[i - 1]);
-        network.biases[i] = random_array(dims[i]);
-        network.weights_grad[i] = malloc(dims[i] * dims[i - 1] * sizeof(double));
-        network.biases_grad[i] = malloc(dims[i] * sizeof(double));
-    }
-    for (int i = 0; i < ndim; i++)
+    int n_threads;
+    int *fds;                  // [t * N_COUNTERS + c], -1 where the counter is unavailable
+    int available[N_COUNTERS]; // open on every thread
+    int error;                 // errno of the task clock, 0 if it opened
+} Counters;
+
+int counter_attr(Counter counter, struct perf_event_attr *attr)
+{
+    memset(attr, 0, sizeof(*attr));
+    attr->size = sizeof(*attr);
+    attr->type = PERF_TYPE_HARDWARE;
+    attr->exclude_kernel = 1;
+    attr->exclude_hv = 1;
+    attr->read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    switch (counter)
     {
-        network.dims[i] = dims[i];
+    case COUNTER_TASK_CLOCK:
+        attr->type = PERF_TYPE_SOFTWARE;
+        attr->config = PERF_COUNT_SW_TASK_CLOCK;
+        return 1;
+    case COUNTER_CYCLES:
+        attr->config = PERF_COUNT_HW_CPU_CYCLES;
+        return 1;
+    case COUNTER_INSTRUCTIONS:
+        attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+        return 1;
+    case COUNTER_L1_MISSES:
+        attr->type = PERF_TYPE_HW_CACHE;
+        attr->config = PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+        return 1;
+    case COUNTER_LLC_MISSES:
+        attr->config = PERF_COUNT_HW_CACHE_MISSES;
+        return 1;
+    case COUNTER_BRANCH_MISSES:
+        attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+        return 1;
+    case COUNTER_FP_VECTOR:
+#if defined(__x86_64__)
+        // FP_ARITH_INST_RETIRED with the 128, 256 and 512-bit packed double umasks
+        attr->type = PERF_TYPE_RAW;
+        attr->config = 0x54c7;
+        return __builtin_cpu_is("intel");
+#else
+        return 0;
+#endif
+    default:
+        return 0;
     }
-    return network;
 }
 
-void network_destroy(Network network)
+// counters of the threads with the given ids, 0 for the calling thread
+Counters counters_open(int n_threads, pid_t *threads)
 {
-    for (int i = 1; i < network.ndim; i++)
+    Counters counters = {.n_threads = n_threads, .fds = malloc((size_t)n_threads * N_COUNTERS * sizeof(int))};
+    for (int c = 0; c < N_COUNTERS; c++)
     {
-        free(network.neurons[i]);
-        free(network.weights[i]);
-        free(network.biases[i]);
-        free(network.weights_grad[i]);
-        free(network.biases_grad[i]);
+        struct perf_event_attr attr;
+        int supported = counter_attr(c, &attr);
+        counters.available[c] = supported;
+        for (int t = 0; t < n_threads; t++)
+        {
+            int fd = supported ? (int)syscall(SYS_perf_event_open, &attr, threads[t], -1, -1, PERF_FLAG_FD_CLOEXEC) : -1;
+            counters.fds[t * N_COUNTERS + c] = fd;
+            counters.available[c] &= fd >= 0;
+            if (fd < 0 && c == COUNTER_TASK_CLOCK)
+            {
+                counters.error = errno;
+            }
+        }
+        // a counter missing on some threads would undercount the others
+        for (int t = 0; !counters.available[c] && t < n_threads; t++)
+        {
+            if (counters.fds[t * N_COUNTERS + c] >= 0)
+            {
+                close(counters.fds[t * N_COUNTERS + c]);
+                counters.fds[t * N_COUNTERS + c] = -1;
+            }
+        }
     }
-    free(network.neurons);
-    free(network.weights);
-    free(network.biases);
-    free(network.weights_grad);
-    free(network.biases_grad);
-    free(network.dims);
+    return counters;
 }
 
-// MACHINE LEARNING
-
-double compute_loss(Network network, double *label)
+// whether any hardware counter is open, besides the task clock
+int counters_hardware(Counters counters)
 {
-    double loss = 0;
-    for (int i = 0; i < network.dims[network.ndim - 1]; i++)
+    for (int c = COUNTER_CYCLES; c < N_COUNTERS; c++)
     {
-        double tmp = network.neurons[network.ndim - 1][i] - label[i];
-        loss += tmp * tmp;
+        if (counters.available[c])
+        {
+            return 1;
+        }
     }
-    return loss;
+    return 0;
 }
 
-void forward(Network network, double *inputs)
+// sums of every counter over the threads, scaled up where the kernel multiplexed them
+void counters_read(Counters counters, double *values)
 {
-    network.neurons[0] = inputs;
-
-    int ndim = network.ndim;
-    int *dims = network.dims;
-    double **a = network.neurons;
-    double **w = network.weights;
-    double **b = network.biases;
-
-    for (int l = 1; l < ndim; l++)
+    for (int c = 0; c < N_COUNTERS; c++)
     {
-        for (int i = 0; i < dims[l]; i++)
+        values[c] = counters.available[c] ? 0 : NAN;
+        for (int t = 0; counters.available[c] && t < counters.n_threads; t++)
         {
-            a[l][i] = 0;
-            for (int j = 0; j < dims[l - 1]; j++)
+            uint64_t data[3]; // value, time enabled, time running
+            if (read(counters.fds[t * N_COUNTERS + c], data, sizeof(data)) == sizeof(data) && data[2] > 0)
             {
-                a[l][i] += w[l][i * dims[l - 1] + j] * a[l - 1][j];
+                values[c] += (double)data[0] * data[1] / data[2];
             }
-            a[l][i] += b[l][i];
-            a[l][i] = 1.0 / (1.0 + exp(-a[l][i]));
         }
     }
 }
 
-void backward(Network network, double *label)
+void counters_close(Counters counters)
 {
-    int ndim = network.ndim;
-    int *dims = network.dims;
-    double **a = network.neurons;
-    double **w = network.weights;
-    double **w_grad = network.weights_grad;
-    double **b_grad = network.biases_grad;
-
-    int l = ndim - 1;
-    for (int i = 0; i < dims[l]; i++)
+    for (int i = 0; counters.fds != NULL && i < counters.n_threads * N_COUNTERS; i++)
     {
-        b_grad[l][i] = 2 * (a[l][i] - label[i]) * a[l][i] * (1 - a[l][i]);
-        for (int j = 0; j < dims[l - 1]; j++)
+        if (counters.fds[i] >= 0)
         {
-            w_grad[l][i * dims[l - 1] + j] = a[l - 1][j] * b_grad[l][i];
+            close(counters.fds[i]);
         }
     }
+    free(counters.fds);
+}
 
-    for (int l = ndim - 2; l > 0; l--)
+// says which counters are missing, once before a table of them
+void print_counters_note(Counters counters)
+{
+    if (counters.error != 0)
     {
-        for (int i = 0; i < dims[l]; i++)
-        {
-            b_grad[l][i] = 0;
-            for (int j = 0; j < dims[l + 1]; j++)
-            {
-                b_grad[l][i] += w[l + 1][j * dims[l] + i] * b_grad[l + 1][j];
-            }
-            b_grad[l][i] *= a[l][i] * (1 - a[l][i]);
+        printf("performance counters unavailable (%s), timing with the wall clock only\n", strerror(counters.error));
+    }
+    else if (!counters_hardware(counters))
+    {
+        printf("hardware counters unavailable, only the CPU time is counted\n");
+    }
+}
 
-            for (int j = 0; j < network.dims[l - 1]; j++)
-            {
-                w_grad[l][i * dims[l - 1] + j] = a[l - 1][j] * b_grad[l][i];
-            }
+void print_counters_header(const char *label)
+{
+    printf("%s%-28s %10s %7s %6s %8s %8s %8s %6s%s\n", BOLD, label, "ms", "cpu %", "IPC", "L1d/ki", "LLC/ki", "br/ki",
+           "vec %", RESET);
+}
+
+// one row of the wall time and of rates of the counter deltas, '-' where they are unavailable
+void print_counters_row(const char *label, double seconds, double *counts)
+{
+    double instructions = counts[COUNTER_INSTRUCTIONS];
+    double rates[] = {
+        100 * counts[COUNTER_TASK_CLOCK] / 1e9 / seconds,
+        instructions / counts[COUNTER_CYCLES],
+        1000 * counts[COUNTER_L1_MISSES] / instructions,
+        1000 * counts[COUNTER_LLC_MISSES] / instructions,
+        1000 * counts[COUNTER_BRANCH_MISSES] / instructions,
+        100 * counts[COUNTER_FP_VECTOR] / instructions,
+    };
+    int widths[] = {7, 6, 8, 8, 8, 6};
+    int precisions[] = {0, 2, 2, 2, 2, 1};
+    printf("%-28s %10.3f", label, 1000 * seconds);
+    for (int r = 0; r < 6; r++)
+    {
+        if (isfinite(rates[r]))
+        {
+            printf(" %*.*f", widths[r], precisions[r], rates[r]);
+        }
+        else
+        {
+            printf(" %*s", widths[r], "-");
         }
     }
+    printf("\n");
 }
 
-double update_mini_batch(Network network, Image *images, int batch_size, double learning_rate)
+// PROFILING
+
+/*
+ * Wall time spent in the phases of training, accumulated over a whole run.
+ * Every phase is only recorded by one thread at a time. With counters open,
+ * the phases that own the pool while they run also sum the counters of all
+ * workers. Background augmentation runs its tasks on the same workers, so
+ * its work lands in the counters of whichever phase was running meanwhile,
+ * mostly the training steps; print_profile says so.
+ */
+
+typedef enum
 {
-    int ndim = network.ndim;
-    int *dims = network.dims;
+    PHASE_STEP,     // training steps
+    PHASE_WAIT,     // training loop waiting for the next batch
+    PHASE_AUGMENT,  // preparing augmented batches, in the background
+    PHASE_VALIDATE, // scoring the validation split
+    N_PHASES,
+} Phase;
 
-    // allocate arrays to accumulate gradients
-    double **weights_grad = malloc(ndim * sizeof(double *));
-    double **biases_grad = malloc(ndim * sizeof(double *));
+const char *phase_names[] = {"training steps", "waiting for batches", "augmentation", "validation"};
 
-    for (int l = 1; l < ndim; l++)
+// background augmentation and the wait for it overlap the other phases
+const int phase_counted[] = {1, 0, 0, 1};
+
+typedef struct
+{
+    double seconds[N_PHASES];
+    long count[N_PHASES];
+    Counters counters; // n_threads is 0 unless profile_open_counters was called
+    double counts[N_PHASES][N_COUNTERS];
+    double marks[N_PHASES][N_COUNTERS];
+} Profile;
+
+Profile profile;
+
+// start time of a phase, for profile_add
+double profile_start(Phase phase)
+{
+    if (profile.counters.n_threads > 0 && phase_counted[phase])
     {
-        weights_grad[l] = calloc(sizeof(double), dims[l] * dims[l - 1]);
-        biases_grad[l] = calloc(sizeof(double), dims[l]);
+        counters_read(profile.counters, profile.marks[phase]);
     }
+    return timestamp();
+}
 
-    // accumulate intermediate gradients from backpropagation
-    double loss = 0;
-    for (int b = 0; b < batch_size; b++)
+void profile_add(Phase phase, double start)
+{
+    profile.seconds[phase] += timestamp() - start;
+    profile.count[phase]++;
+    if (profile.counters.n_threads > 0 && phase_counted[phase])
     {
-        forward(network, images[b].data);
-        loss += compute_loss(network, images[b].label);
-
-        backward(network, images[b].label);
-
-        for (int l = 1; l < ndim; l++)
+        double values[N_COUNTERS];
+        counters_read(profile.counters, values);
+        for (int c = 0; c < N_COUNTERS; c++)
         {
-            for (int i = 0; i < dims[l]; i++)
-            {
-                biases_grad[l][i] += network.biases_grad[l][i];
-                for (int j = 0; j < dims[l - 1]; j++)
-                {
-                    int idx = i * dims[l - 1] + j;
-                    weights_grad[l][idx] += network.weights_grad[l][idx];
-                }
-            }
+            profile.counts[phase][c] += values[c] - profile.marks[phase][c];
         }
     }
+}
 
-    // update weights and biases
-    double factor = learning_rate / batch_size;
-    for (int l = 1; l < ndim; l++)
+void print_profile()
+{
+    printf("%s%-22s %10s %8s%s\n", BOLD, "phase", "seconds", "count", RESET);
+    for (int phase = 0; phase < N_PHASES; phase++)
     {
-        for (int i = 0; i < dims[l]; i++)
+        printf("%-22s %10.3f %8ld\n", phase_names[phase], profile.seconds[phase], profile.count[phase]);
+    }
+    if (profile.count[PHASE_AUGMENT] > 0)
+    {
+        // time the training loop would have waited if batches were augmented in line
+        double hidden = profile.seconds[PHASE_AUGMENT] - profile.seconds[PHASE_WAIT];
+        printf("augmentation overlapped with training: %.1f%%\n", 100 * fmax(hidden, 0) / profile.seconds[PHASE_AUGMENT]);
+    }
+    if (profile.counters.n_threads > 0)
+    {
+        print_counters_note(profile.counters);
+        print_counters_header("counters of all workers");
+        for (int phase = 0; phase < N_PHASES; phase++)
         {
-            network.biases[l][i] -= factor * biases_grad[l][i];
-            for (int j = 0; j < dims[l - 1]; j++)
+            if (phase_counted[phase] && profile.count[phase] > 0)
             {
-                int idx = i * dims[l - 1] + j;
-                network.weights[l][idx] -= factor * weights_grad[l][idx];
+                print_counters_row(phase_names[phase], profile.seconds[phase], profile.counts[phase]);
             }
         }
+        if (profile.count[PHASE_AUGMENT] > 0)
+        {
+            printf("the workers also augment the next batches during the steps, so these counters include that work\n");
+        }
     }
+}
 
-    // free gradient arrays
-    for (int i = 1; i < network.ndim; i++)
-    {
-        free(weights_grad[i]);
-        free(biases_grad[i]);
-    }
-    free(weights_grad);
-    free(biases_grad);
+// MEMORY
 
-    return loss;
-}
+/*
+ * Large arrays (the decoded dataset and the parameters and gradients of big
+ * layers) are mapped with mmap, so their pages can be backed by huge pages
+ * and placed on NUMA nodes. The policy is read from the environment:
+ *
+ *   NEURAL_HUGEPAGES      'transparent' (default) asks for transparent huge
+ *                         pages, 'explicit' maps pages reserved in
+ *                         /proc/sys/vm/nr_hugepages and falls back to
+ *                         transparent ones, 'off' keeps 4 KiB pages.
+ *   NEURAL_NUMA_DATA      'first-touch' (default) leaves the images on the
+ *                         node of the worker that decodes them, 'interleave'
+ *                         spreads their pages over all nodes and 'shard'
+ *                         binds contiguous shards of the images to the nodes.
+ *   NEURAL_NUMA_REPLICAS  1 (default) copies the weights used by read-only
+ *                         inference to every node, 0 shares one copy.
+ *
+ * Buffers written by a single worker (gradients, activations) are first
+ * touched by that worker, so they land on its node without any policy. On a
+ * single node only the huge page setting has an effect.
+ */
+
+#define LARGE_ARRAY (2 << 20) // arrays of at least this many bytes are mapped
+#define HUGE_PAGE (2 << 20)
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
 
-void epoch(Network network, Dataset dataset, int batch_size, double learning_rate)
+typedef enum
 {
-    double start = timestamp();
-    int batches = dataset.size / batch_size;
-    printf("Start epoch with %d batches (batch_size: %d)\n", batches, batch_size);
-    double loss = 0;
-    for (int i = 0; i < batches; i++)
-    {
-        printf("%sloss: %.4lf ", CLEAR, loss / (i + 1));
-        print_progress(i, batches, (int)timestamp() - start);
+    HUGEPAGES_OFF,
+    HUGEPAGES_TRANSPARENT,
+    HUGEPAGES_EXPLICIT,
+} HugePages;
 
-        loss += update_mini_batch(network, dataset.images + i * batch_size, batch_size, learning_rate) / batch_size;
-    }
+typedef enum
+{
+    PLACEMENT_FIRST_TOUCH,
+    PLACEMENT_INTERLEAVE,
+    PLACEMENT_SHARD,
+} Placement;
 
-    printf("%sloss: %.4lf ", CLEAR, loss / batches);
-    print_progress(batches, batches, (int)timestamp() - start);
-}
+typedef struct
+{
+    HugePages huge_pages;
+    Placement data;
+    int replicas;
+    int n_nodes;
+} MemoryPolicy;
 
-// IO
+const char *huge_pages_names[] = {"off", "transparent", "explicit"};
+const char *placement_names[] = {"first-touch", "interleave", "shard"};
 
-double *load_pgm_image(char *path)
+MemoryPolicy memory;
+int placement_failures; // mbind calls that failed, so a placement that was asked for is not reported as applied
+pthread_once_t memory_once = PTHREAD_ONCE_INIT;
+
+// index of the first of n names equal to the variable, default when it is unset
+int read_memory_setting(char *variable, const char **names, int n, int default_value)
 {
-    FILE *file = fopen(path, "rb");
-    if (file == NULL)
+    char *value = getenv(variable);
+    if (value == NULL)
     {
-        printf("%serror:%s cannot open file\n", RED, RESET);
-        exit(1);
+        return default_value;
     }
-
-    // check magic number
-    char magic[3];
-    if (fread(magic, 1, 3, file) != 3)
+    for (int i = 0; i < n; i++)
     {
-        printf("%serror:%s failed to read PGM header\n", RED, RESET);
-        exit(1);
+        if (strcmp(value, names[i]) == 0)
+        {
+            return i;
+        }
     }
-    else if (!(magic[0] == 0x50 && magic[1] == 0x35 && magic[2] == 0x0a))
-    {
-        printf("%serror:%s file '%s' is not in PGM P5 format\n", RED, RESET, path);
-        exit(1);
-    };
+    printf("%serror:%s invalid %s '%s'\n", RED, RESET, variable, value);
+    exit(1);
+}
 
-    // skip optional comments
-    int c;
-    while ((c = fgetc(file)) == '#')
+// highest online node plus one, from a list like '0-3' or '0,2'
+int read_node_count()
+{
+    FILE *file = fopen("/sys/devices/system/node/online", "r");
+    if (file == NULL)
+    {
+        return 1;
+    }
+    int n_nodes = 1;
+    int node;
+    while (fscanf(file, "%d", &node) == 1)
     {
-        while (fgetc(file) != '\n')
+        n_nodes = node + 1 > n_nodes ? node + 1 : n_nodes;
+        if (fgetc(file) == EOF)
         {
+            break;
         }
     }
-    ungetc(c, file);
+    fclose(file);
+    return n_nodes;
+}
+
+void memory_load()
+{
+    const char *replicas_names[] = {"0", "1"};
+    memory.huge_pages = read_memory_setting("NEURAL_HUGEPAGES", huge_pages_names, 3, HUGEPAGES_TRANSPARENT);
+    memory.data = read_memory_setting("NEURAL_NUMA_DATA", placement_names, 3, PLACEMENT_FIRST_TOUCH);
+    memory.replicas = read_memory_setting("NEURAL_NUMA_REPLICAS", replicas_names, 2, 1);
+    memory.n_nodes = read_node_count();
+}
+
+MemoryPolicy memory_policy()
+{
+    pthread_once(&memory_once, memory_load);
+    return memory;
+}
 
-    // check image dimensions and maxval
-    int width, height, maxval;
-    if (fscanf(file, "%d %d\n%d\n", &width, &height, &maxval) != 3)
+// NUMA node of the core the calling thread runs on
+int current_node()
+{
+    unsigned cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
     {
-        printf("%serror:%s failed to parse PGM header\n", RED, RESET);
-        exit(1);
+        return 0;
     }
+    return (int)node;
+}
+
+// bytes mapped for an array of n doubles, whole huge pages
+size_t large_array_length(size_t n)
+{
+    return (n * sizeof(double) + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+}
 
-    if (width != 28 || height != 28)
+/*
+ * Uninitialized array of n doubles, freed with large_array_free, or NULL like
+ * malloc when the memory cannot be had. Large arrays are mapped at huge page
+ * boundaries and none of their pages is touched, so a placement set right
+ * after the allocation applies to all of them.
+ */
+double *large_array(size_t n)
+{
+    if (n * sizeof(double) < LARGE_ARRAY)
     {
-        printf("%serror:%s image dimensions must be 28x28\n", RED, RESET);
-        exit(1);
+        return malloc(n * sizeof(double));
     }
 
-    if (maxval != 255)
+    MemoryPolicy policy = memory_policy();
+    size_t length = large_array_length(n);
+    char *array = MAP_FAILED;
+    if (policy.huge_pages == HUGEPAGES_EXPLICIT)
     {
-        printf("%serror:%s expected maxval of 255\n", RED, RESET);
-        exit(1);
+        array = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (array == MAP_FAILED)
+    {
+        // over-allocate by a huge page to cut out an aligned range
+        char *mapping = mmap(NULL, length + HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED)
+        {
+            return NULL;
+        }
+        array = (char *)(((uintptr_t)mapping + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+        if (array > mapping)
+        {
+            munmap(mapping, array - mapping);
+        }
+        munmap(array + length, mapping + HUGE_PAGE - array);
+        madvise(array, length, policy.huge_pages == HUGEPAGES_OFF ? MADV_NOHUGEPAGE : MADV_HUGEPAGE);
     }
+    return (double *)array;
+}
 
-    // read pixel data
-    uint8_t image_data[28 * 28];
-    if (fread(image_data, sizeof(uint8_t), 28 * 28, file) != 28 * 28)
+void large_array_free(double *array, size_t n)
+{
+    if (n * sizeof(double) < LARGE_ARRAY)
     {
-        printf("%serror:%s failed to read pixel data\n", RED, RESET);
-        exit(1);
+        free(array);
     }
-    fclose(file);
+    else if (array != NULL)
+    {
+        munmap(array, large_array_length(n));
+    }
+}
 
-    double *pixel = malloc(width * height * sizeof(double));
-    for (int i = 0; i < 28 * 28; i++)
+// sets the NUMA policy of the untouched pages of a large array, small arrays are left alone, returns 0 if mbind failed
+int large_array_policy(double *array, size_t n, int mode, unsigned long nodes)
+{
+    if (n * sizeof(double) < LARGE_ARRAY || memory_policy().n_nodes < 2)
+    {
+        return 1;
+    }
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)array + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)(array + n)) & ~(page - 1);
+    if (end > start && syscall(SYS_mbind, start, end - start, mode, &nodes, 8 * sizeof(nodes), 0) != 0)
     {
-        pixel[i] = ((double)image_data[i]) / 255.0;
+        __atomic_add_fetch(&placement_failures, 1, __ATOMIC_RELAXED);
+        return 0;
     }
+    return 1;
+}
 
-    return pixel;
+int large_array_interleave(double *array, size_t n)
+{
+    int n_nodes = memory_policy().n_nodes;
+    return large_array_policy(array, n, MPOL_INTERLEAVE, n_nodes < 64 ? (1ul << n_nodes) - 1 : ~0ul);
 }
 
-Dataset load_mnist_dataset(char *path_to_labels, char *path_to_images)
+int large_array_bind(double *array, size_t n, int node)
+{
+    return array != NULL && node < 64 && large_array_policy(array, n, MPOL_BIND, 1ul << node);
+}
+
+// NETWORK
+
+typedef struct Network
+{
+    double **neurons;
+    double **weights;
+    double **biases;
+    double **weights_grad;
+    double **biases_grad;
+    int *ranks;       // rank of the factorization of every layer, 0 for dense layers
+    double **left;    // dims[l] x ranks[l] factor of the factored layers
+    double **right;   // ranks[l] x dims[l - 1] factor, weights[l] holds left[l] * right[l]
+    int *levels;      // levels of the weights and inputs of every layer, 0 for layers of doubles
+    uint64_t **signs; // bit-packed rows of the quantized layers, a set bit for a negative weight
+    uint64_t **masks; // same layout, a set bit for a nonzero weight of ternary layers
+    double **scales;  // dims[l] magnitudes of the quantized weights, one per row
+    int *dims;
+    int ndim;
+    double *scratch; // as wide as the widest layer, private to the network and its forks like the activations
+    int inference;   // no gradients, activations in planned buffers, factored and quantized layers without dense weights
+} Network;
+
+#define PLAN_BUFFERS 2
+
+/*
+ * Assigns the activations of every layer to a buffer by their lifetimes: the
+ * activations of layer l are written by step l and last read by step l + 1,
+ * so a buffer is free again two steps after it was written. A chain of layers
+ * needs two buffers, each as wide as the widest layer it holds. Returns the
+ * number of buffers.
+ */
+int plan_activations(int ndim, int *dims, int *plan, int *widths)
+{
+    int n_buffers = 0;
+    int last_read[PLAN_BUFFERS];
+    for (int l = 1; l < ndim; l++)
+    {
+        int b = 0;
+        while (b < n_buffers && last_read[b] >= l)
+        {
+            b++;
+        }
+        if (b == n_buffers)
+        {
+            widths[n_buffers++] = 0;
+        }
+        plan[l] = b;
+        last_read[b] = l + 1;
+        widths[b] = dims[l] > widths[b] ? dims[l] : widths[b];
+    }
+    return n_buffers;
+}
+
+// whether the activations of layer l share the buffer of an earlier layer
+int network_shares_buffer(Network network, int l)
+{
+    for (int k = 1; k < l; k++)
+    {
+        if (network.neurons[k] == network.neurons[l])
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void network_destroy(Network network)
+{
+    for (int i = 1; i < network.ndim; i++)
+    {
+        size_t size = (size_t)network.dims[i] * network.dims[i - 1];
+        if (!network_shares_buffer(network, i))
+        {
+            free(network.neurons[i]);
+        }
+        large_array_free(network.weights[i], size);
+        large_array_free(network.biases[i], network.dims[i]);
+        large_array_free(network.weights_grad[i], size);
+        free(network.biases_grad[i]);
+        free(network.left[i]);
+        free(network.right[i]);
+        free(network.signs[i]);
+        free(network.masks[i]);
+        free(network.scales[i]);
+    }
+    free(network.neurons);
+    free(network.weights);
+    free(network.biases);
+    free(network.weights_grad);
+    free(network.biases_grad);
+    free(network.ranks);
+    free(network.left);
+    free(network.right);
+    free(network.levels);
+    free(network.signs);
+    free(network.masks);
+    free(network.scales);
+    free(network.dims);
+    free(network.scratch);
+}
+
+/*
+ * The arrays of a network with uninitialized parameters. A training network
+ * owns its activations and gradients, the activations of an inference
+ * network share the buffers of plan_activations and it owns no gradients.
+ * Returns a network without layers when memory runs out.
+ */
+Network network_allocate(int ndim, int *dims, int inference)
+{
+    Network network = {
+        .neurons = calloc(ndim, sizeof(double *)),
+        .weights = calloc(ndim, sizeof(double *)),
+        .biases = calloc(ndim, sizeof(double *)),
+        .weights_grad = calloc(ndim, sizeof(double *)),
+        .biases_grad = calloc(ndim, sizeof(double *)),
+        .ranks = calloc(ndim, sizeof(int)),
+        .left = calloc(ndim, sizeof(double *)),
+        .right = calloc(ndim, sizeof(double *)),
+        .levels = calloc(ndim, sizeof(int)),
+        .signs = calloc(ndim, sizeof(uint64_t *)),
+        .masks = calloc(ndim, sizeof(uint64_t *)),
+        .scales = calloc(ndim, sizeof(double *)),
+        .dims = malloc(ndim * sizeof(int)),
+        .ndim = ndim,
+        .inference = inference,
+    };
+    int width = 0;
+    for (int l = 0; l < ndim; l++)
+    {
+        width = dims[l] > width ? dims[l] : width;
+    }
+    network.scratch = malloc(width * sizeof(double));
+
+    int failed = network.neurons == NULL || network.weights == NULL || network.biases == NULL ||
+                 network.weights_grad == NULL || network.biases_grad == NULL || network.ranks == NULL ||
+                 network.left == NULL || network.right == NULL || network.levels == NULL ||
+                 network.signs == NULL || network.masks == NULL || network.scales == NULL ||
+                 network.dims == NULL || network.scratch == NULL;
+    if (failed)
+    {
+        network.ndim = 0;
+        network_destroy(network);
+        return (Network){.ndim = 0};
+    }
+    memcpy(network.dims, dims, ndim * sizeof(int));
+
+    if (inference)
+    {
+        int plan[ndim];
+        int widths[PLAN_BUFFERS];
+        double *buffers[PLAN_BUFFERS];
+        int n_buffers = plan_activations(ndim, dims, plan, widths);
+        for (int b = 0; b < n_buffers; b++)
+        {
+            buffers[b] = calloc(widths[b], sizeof(double));
+            failed |= buffers[b] == NULL;
+        }
+        for (int l = 1; l < ndim; l++)
+        {
+            network.neurons[l] = buffers[plan[l]];
+        }
+    }
+    for (int l = 1; l < ndim; l++)
+    {
+        size_t size = (size_t)dims[l] * dims[l - 1];
+        network.weights[l] = large_array(size);
+        network.biases[l] = large_array(dims[l]);
+        failed |= network.weights[l] == NULL || network.biases[l] == NULL;
+        if (!inference)
+        {
+            network.neurons[l] = calloc(dims[l], sizeof(double));
+            network.weights_grad[l] = large_array(size);
+            network.biases_grad[l] = malloc(dims[l] * sizeof(double));
+            failed |= network.neurons[l] == NULL || network.weights_grad[l] == NULL || network.biases_grad[l] == NULL;
+        }
+    }
+    if (failed)
+    {
+        network_destroy(network);
+        return (Network){.ndim = 0};
+    }
+    return network;
+}
+
+// a network of the given shape for training, with random parameters
+Network network_create(int ndim, int *dims)
+{
+    Network network = network_allocate(ndim, dims, 0);
+    if (network.ndim == 0)
+    {
+        printf("%serror:%s out of memory for a network with %d layers\n", RED, RESET, ndim);
+        exit(1);
+    }
+    for (int i = 1; i < ndim; i++)
+    {
+        for (size_t j = 0; j < (size_t)dims[i] * dims[i - 1]; j++)
+        {
+            network.weights[i][j] = rng_uniform(STREAM_WEIGHTS + i, j) - 0.5;
+        }
+        for (int j = 0; j < dims[i]; j++)
+        {
+            network.biases[i][j] = rng_uniform(STREAM_BIASES + i, j) - 0.5;
+        }
+    }
+    return network;
+}
+
+/*
+ * A network that is only used for inference: it owns no gradients, the
+ * activations of its layers share the buffers of plan_activations, and its
+ * parameters are left for the caller to fill.
+ */
+Network network_create_inference(int ndim, int *dims)
+{
+    Network network = network_allocate(ndim, dims, 1);
+    if (network.ndim == 0)
+    {
+        printf("%serror:%s out of memory for a network with %d layers\n", RED, RESET, ndim);
+        exit(1);
+    }
+    return network;
+}
+
+// turns layer l into a factored layer of the given rank with uninitialized factors, 0 makes it dense
+void network_set_rank(Network network, int l, int rank)
+{
+    free(network.left[l]);
+    free(network.right[l]);
+    network.ranks[l] = rank;
+    network.left[l] = rank > 0 ? malloc((size_t)network.dims[l] * rank * sizeof(double)) : NULL;
+    network.right[l] = rank > 0 ? malloc((size_t)rank * network.dims[l - 1] * sizeof(double)) : NULL;
+}
+
+// recomputes the weights of factored layer l from its factors
+void network_expand_layer(Network network, int l)
+{
+    int rank = network.ranks[l];
+    int n_in = network.dims[l - 1];
+    for (int i = 0; i < network.dims[l]; i++)
+    {
+        double *row = network.weights[l] + (size_t)i * n_in;
+        memset(row, 0, n_in * sizeof(double));
+        for (int k = 0; k < rank; k++)
+        {
+            double factor = network.left[l][(size_t)i * rank + k];
+            double *right = network.right[l] + (size_t)k * n_in;
+            for (int j = 0; j < n_in; j++)
+            {
+                row[j] += factor * right[j];
+            }
+        }
+    }
+}
+
+/*
+ * QUANTIZED LAYERS
+ *
+ * The hidden layers between two hidden layers can be binarized, with weights
+ * and inputs in {-1, 1}, or ternarized, in {-1, 0, 1}. Every row keeps one
+ * double scale, so output i is sigmoid(scale[i] * q(w[i]) . q(x) + b[i]). The
+ * weights come from the latent double weights of the layer:
+ *
+ *   binary:  q(w) = sign(w), scale = mean |w|
+ *   ternary: q(w) = sign(w) where |w| > 0.7 mean |w|, else 0,
+ *            scale = mean |w| over the nonzero q(w)
+ *
+ * and the inputs from the activations a in [0, 1] of the layer below, through
+ * c = 2a - 1: sign(c), or 0 where |c| <= TERNARY_THRESHOLD for ternary layers.
+ *
+ * Both are packed into 64-bit words, a sign bit set for every -1 and, for
+ * ternary layers, a mask bit set for every nonzero. Padding bits are zero.
+ * The dot products are then popcounts:
+ *
+ *   binary:  n - 2 * popcount(w ^ x)
+ *   ternary: popcount(m & ~d) - popcount(m & d), m = w_mask & x_mask, d = w_sign ^ x_sign
+ *
+ * Training uses the straight-through estimator: the gradient of q(w) is the
+ * gradient of the latent weight, which is clipped to [-1, 1] after every
+ * update, and the gradient of q(2a - 1) is 2.
+ */
+
+#define LEVELS_BINARY 2
+#define LEVELS_TERNARY 3
+#define TERNARY_THRESHOLD 0.5
+
+// 64-bit words of a packed row of n values
+int packed_words(int n)
+{
+    return (n + 63) / 64;
+}
+
+typedef struct
+{
+    const char *name;
+    int (*binary)(const uint64_t *w, const uint64_t *x, int words); // number of bits that differ
+    int (*ternary)(const uint64_t *w_signs, const uint64_t *w_masks, const uint64_t *x_signs, const uint64_t *x_masks,
+                   int words); // dot product
+} PopcountKernels;
+
+static inline __attribute__((always_inline)) int binary_differences(const uint64_t *w, const uint64_t *x, int words)
+{
+    int count = 0;
+    for (int k = 0; k < words; k++)
+    {
+        count += __builtin_popcountll(w[k] ^ x[k]);
+    }
+    return count;
+}
+
+static inline __attribute__((always_inline)) int ternary_dot(const uint64_t *w_signs, const uint64_t *w_masks,
+                                                              const uint64_t *x_signs, const uint64_t *x_masks, int words)
+{
+    int dot = 0;
+    for (int k = 0; k < words; k++)
+    {
+        uint64_t m = w_masks[k] & x_masks[k];
+        uint64_t d = w_signs[k] ^ x_signs[k];
+        dot += __builtin_popcountll(m & ~d) - __builtin_popcountll(m & d);
+    }
+    return dot;
+}
+
+int binary_differences_portable(const uint64_t *w, const uint64_t *x, int words)
+{
+    return binary_differences(w, x, words);
+}
+
+int ternary_dot_portable(const uint64_t *w_signs, const uint64_t *w_masks, const uint64_t *x_signs,
+                         const uint64_t *x_masks, int words)
+{
+    return ternary_dot(w_signs, w_masks, x_signs, x_masks, words);
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("popcnt"))) int binary_differences_popcnt(const uint64_t *w, const uint64_t *x, int words)
+{
+    return binary_differences(w, x, words);
+}
+
+__attribute__((target("popcnt"))) int ternary_dot_popcnt(const uint64_t *w_signs, const uint64_t *w_masks,
+                                                         const uint64_t *x_signs, const uint64_t *x_masks, int words)
+{
+    return ternary_dot(w_signs, w_masks, x_signs, x_masks, words);
+}
+
+// eight words per instruction, the last ones with a masked load
+__attribute__((target("avx512f,avx512vpopcntdq"))) int binary_differences_vpopcntdq(const uint64_t *w, const uint64_t *x,
+                                                                                    int words)
+{
+    __m512i count = _mm512_setzero_si512();
+    int k = 0;
+    for (; k + 8 <= words; k += 8)
+    {
+        __m512i d = _mm512_xor_si512(_mm512_loadu_si512(w + k), _mm512_loadu_si512(x + k));
+        count = _mm512_add_epi64(count, _mm512_popcnt_epi64(d));
+    }
+    __mmask8 tail = (1u << (words - k)) - 1;
+    __m512i d = _mm512_xor_si512(_mm512_maskz_loadu_epi64(tail, w + k), _mm512_maskz_loadu_epi64(tail, x + k));
+    count = _mm512_add_epi64(count, _mm512_popcnt_epi64(d));
+    return (int)_mm512_reduce_add_epi64(count);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq"))) int ternary_dot_vpopcntdq(const uint64_t *w_signs, const uint64_t *w_masks,
+                                                                             const uint64_t *x_signs, const uint64_t *x_masks,
+                                                                             int words)
+{
+    __m512i dot = _mm512_setzero_si512();
+    for (int k = 0; k < words; k += 8)
+    {
+        __mmask8 lanes = words - k >= 8 ? 0xff : (1u << (words - k)) - 1;
+        __m512i m = _mm512_and_si512(_mm512_maskz_loadu_epi64(lanes, w_masks + k),
+                                     _mm512_maskz_loadu_epi64(lanes, x_masks + k));
+        __m512i d = _mm512_xor_si512(_mm512_maskz_loadu_epi64(lanes, w_signs + k),
+                                     _mm512_maskz_loadu_epi64(lanes, x_signs + k));
+        dot = _mm512_add_epi64(dot, _mm512_popcnt_epi64(_mm512_andnot_si512(d, m)));
+        dot = _mm512_sub_epi64(dot, _mm512_popcnt_epi64(_mm512_and_si512(m, d)));
+    }
+    return (int)_mm512_reduce_add_epi64(dot);
+}
+
+#endif
+
+PopcountKernels popcount_kernels = {"portable", binary_differences_portable, ternary_dot_portable};
+pthread_once_t popcount_once = PTHREAD_ONCE_INIT;
+
+// picks the fastest popcount the CPU supports, without POPCNT the compiler emulates it with shifts and masks
+void popcount_select()
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("popcnt"))
+    {
+        popcount_kernels = (PopcountKernels){"popcnt", binary_differences_popcnt, ternary_dot_popcnt};
+    }
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"))
+    {
+        popcount_kernels = (PopcountKernels){"avx512-vpopcntdq", binary_differences_vpopcntdq, ternary_dot_vpopcntdq};
+    }
+#endif
+}
+
+// turns layer l into a quantized layer with uninitialized packed weights, 0 makes it a layer of doubles
+void network_set_levels(Network network, int l, int levels)
+{
+    pthread_once(&popcount_once, popcount_select);
+    size_t words = (size_t)network.dims[l] * packed_words(network.dims[l - 1]);
+    free(network.signs[l]);
+    free(network.masks[l]);
+    free(network.scales[l]);
+    network.levels[l] = levels;
+    network.signs[l] = levels > 0 ? malloc(words * sizeof(uint64_t)) : NULL;
+    network.masks[l] = levels == LEVELS_TERNARY ? malloc(words * sizeof(uint64_t)) : NULL;
+    network.scales[l] = levels > 0 ? malloc(network.dims[l] * sizeof(double)) : NULL;
+}
+
+// packs row i of the latent weights of quantized layer l
+void quantize_row(Network network, int l, int i)
+{
+    int n_in = network.dims[l - 1];
+    int words = packed_words(n_in);
+    double *w = network.weights[l] + (size_t)i * n_in;
+    uint64_t *signs = network.signs[l] + (size_t)i * words;
+    uint64_t *masks = network.masks[l] != NULL ? network.masks[l] + (size_t)i * words : NULL;
+
+    double mean = 0;
+    for (int j = 0; j < n_in; j++)
+    {
+        mean += fabs(w[j]);
+    }
+    mean /= n_in;
+
+    double threshold = masks != NULL ? 0.7 * mean : -1;
+    double sum = 0;
+    int nonzero = 0;
+    memset(signs, 0, words * sizeof(uint64_t));
+    if (masks != NULL)
+    {
+        memset(masks, 0, words * sizeof(uint64_t));
+    }
+    for (int j = 0; j < n_in; j++)
+    {
+        if (fabs(w[j]) > threshold)
+        {
+            signs[j / 64] |= (uint64_t)(w[j] < 0) << (j % 64);
+            if (masks != NULL)
+            {
+                masks[j / 64] |= 1ull << (j % 64);
+            }
+            sum += fabs(w[j]);
+            nonzero++;
+        }
+    }
+    network.scales[l][i] = nonzero > 0 ? sum / nonzero : 0;
+}
+
+// packs the latent weights of quantized layer l
+void network_quantize_layer(Network network, int l)
+{
+    for (int i = 0; i < network.dims[l]; i++)
+    {
+        quantize_row(network, l, i);
+    }
+}
+
+// row i of quantized layer l as doubles, scale * q(w)
+void dequantize_row(Network network, int l, int i, double *row)
+{
+    int n_in = network.dims[l - 1];
+    int words = packed_words(n_in);
+    uint64_t *signs = network.signs[l] + (size_t)i * words;
+    uint64_t *masks = network.masks[l] != NULL ? network.masks[l] + (size_t)i * words : NULL;
+    double scale = network.scales[l][i];
+    for (int k = 0; k < words; k++)
+    {
+        // without branches, the signs of trained weights are random
+        uint64_t sign_bits = signs[k];
+        uint64_t mask_bits = masks != NULL ? masks[k] : ~0ull;
+        int n = n_in - 64 * k < 64 ? n_in - 64 * k : 64;
+        for (int b = 0; b < n; b++)
+        {
+            row[64 * k + b] = (double)(mask_bits >> b & 1) * (scale - 2 * scale * (double)(sign_bits >> b & 1));
+        }
+    }
+}
+
+// input j of a quantized layer from the activation a of the layer below
+static inline double quantize_input(int levels, double a)
+{
+    double c = 2 * a - 1;
+    if (levels == LEVELS_TERNARY && fabs(c) <= TERNARY_THRESHOLD)
+    {
+        return 0;
+    }
+    return c < 0 ? -1 : 1;
+}
+
+// the inputs of layer l, quantized into scratch for quantized layers
+double *layer_inputs(Network network, int l, double *a, double *scratch)
+{
+    if (network.levels[l] == 0)
+    {
+        return a;
+    }
+    for (int j = 0; j < network.dims[l - 1]; j++)
+    {
+        scratch[j] = quantize_input(network.levels[l], a[j]);
+    }
+    return scratch;
+}
+
+// packs the n activations a of the layer below a quantized layer
+void pack_inputs(int levels, int n, double *a, uint64_t *signs, uint64_t *masks)
+{
+    memset(signs, 0, packed_words(n) * sizeof(uint64_t));
+    memset(masks, 0, packed_words(n) * sizeof(uint64_t));
+    for (int j = 0; j < n; j++)
+    {
+        double q = quantize_input(levels, a[j]);
+        signs[j / 64] |= (uint64_t)(q < 0) << (j % 64);
+        masks[j / 64] |= (uint64_t)(q != 0) << (j % 64);
+    }
+}
+
+// outputs y of quantized layer l for the activations x of the layer below, x may alias y
+void forward_quantized(Network network, int l, double *x, double *y)
+{
+    int n_in = network.dims[l - 1];
+    int words = packed_words(n_in);
+    uint64_t signs[words];
+    uint64_t masks[words];
+    pack_inputs(network.levels[l], n_in, x, signs, masks);
+
+    PopcountKernels kernels = popcount_kernels;
+    for (int i = 0; i < network.dims[l]; i++)
+    {
+        uint64_t *w_signs = network.signs[l] + (size_t)i * words;
+        int dot = network.levels[l] == LEVELS_TERNARY
+                      ? kernels.ternary(w_signs, network.masks[l] + (size_t)i * words, signs, masks, words)
+                      : n_in - 2 * kernels.binary(w_signs, signs, words);
+        double sum = network.scales[l][i] * dot + network.biases[l][i];
+        y[i] = 1.0 / (1.0 + exp(-sum));
+    }
+}
+
+// quantizes every layer between two hidden layers, with levels of LEVELS_BINARY or LEVELS_TERNARY, returns how many
+int network_quantize(Network network, int levels)
+{
+    int n_quantized = 0;
+    for (int l = 2; l < network.ndim - 1; l++)
+    {
+        if (network.ranks[l] > 0)
+        {
+            continue;
+        }
+        for (size_t i = 0; i < (size_t)network.dims[l] * network.dims[l - 1]; i++)
+        {
+            network.weights[l][i] = fmax(-1, fmin(1, network.weights[l][i]));
+        }
+        network_set_levels(network, l, levels);
+        network_quantize_layer(network, l);
+        n_quantized++;
+    }
+    return n_quantized;
+}
+
+// whether any layer of the network is quantized
+int network_quantized(Network network)
+{
+    for (int l = 1; l < network.ndim; l++)
+    {
+        if (network.levels[l] > 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// bytes of the weights, biases, factors and packed weights
+size_t network_parameter_bytes(Network network)
+{
+    size_t n = 0;
+    size_t words = 0;
+    for (int l = 1; l < network.ndim; l++)
+    {
+        n += network.weights[l] != NULL ? (size_t)network.dims[l] * network.dims[l - 1] : 0;
+        n += network.dims[l] + (size_t)network.ranks[l] * (network.dims[l] + network.dims[l - 1]);
+        if (network.levels[l] > 0)
+        {
+            n += network.dims[l];
+            words += (size_t)network.dims[l] * packed_words(network.dims[l - 1]) * (network.masks[l] != NULL ? 2 : 1);
+        }
+    }
+    return n * sizeof(double) + words * sizeof(uint64_t);
+}
+
+// bytes of the parameters, activation buffers and gradients, the working set of a network
+size_t network_bytes(Network network)
+{
+    size_t n = 0;
+    for (int l = 1; l < network.ndim; l++)
+    {
+        // a shared buffer is as wide as the widest layer it holds
+        int width = 0;
+        for (int k = l; k < network.ndim && !network_shares_buffer(network, l); k++)
+        {
+            width = network.neurons[k] == network.neurons[l] && network.dims[k] > width ? network.dims[k] : width;
+        }
+        n += width;
+        n += network.weights_grad[l] != NULL ? (size_t)network.dims[l] * network.dims[l - 1] + network.dims[l] : 0;
+    }
+    return n * sizeof(double) + network_parameter_bytes(network);
+}
+
+// multiply-adds of one forward pass, quantized layers count one popcount per packed word and ternary ones two
+long network_flops(Network network)
+{
+    long flops = 0;
+    for (int l = 1; l < network.ndim; l++)
+    {
+        int rank = network.ranks[l];
+        if (network.levels[l] > 0)
+        {
+            flops += (long)network.dims[l] * packed_words(network.dims[l - 1]) * (network.levels[l] == LEVELS_TERNARY ? 2 : 1);
+            continue;
+        }
+        flops += rank > 0 ? (long)rank * (network.dims[l] + network.dims[l - 1]) : (long)network.dims[l] * network.dims[l - 1];
+    }
+    return flops;
+}
+
+/*
+ * A fork shares weights, biases and dims with its parent but owns the scratch
+ * buffers written by forward and backward, so several threads can run passes
+ * over the same parameters at once.
+ */
+Network network_fork(Network network)
+{
+    Network fork = network;
+    fork.neurons = malloc(network.ndim * sizeof(double *));
+    fork.weights_grad = malloc(network.ndim * sizeof(double *));
+    fork.biases_grad = malloc(network.ndim * sizeof(double *));
+    int width = network.dims[0];
+    for (int l = 1; l < network.ndim; l++)
+    {
+        width = network.dims[l] > width ? network.dims[l] : width;
+        fork.neurons[l] = calloc(network.dims[l], sizeof(double));
+        fork.weights_grad[l] = large_array((size_t)network.dims[l] * network.dims[l - 1]);
+        fork.biases_grad[l] = malloc(network.dims[l] * sizeof(double));
+    }
+    fork.scratch = malloc(width * sizeof(double));
+    return fork;
+}
+
+// copies the weights, biases and factors of src into dst, both of the same shape
+void network_copy(Network dst, Network src)
+{
+    for (int l = 1; l < src.ndim; l++)
+    {
+        if (src.weights[l] != NULL && dst.weights[l] != NULL)
+        {
+            memcpy(dst.weights[l], src.weights[l], src.dims[l] * src.dims[l - 1] * sizeof(double));
+        }
+        memcpy(dst.biases[l], src.biases[l], src.dims[l] * sizeof(double));
+        if (dst.ranks[l] != src.ranks[l])
+        {
+            network_set_rank(dst, l, src.ranks[l]);
+        }
+        if (src.ranks[l] > 0)
+        {
+            memcpy(dst.left[l], src.left[l], (size_t)src.dims[l] * src.ranks[l] * sizeof(double));
+            memcpy(dst.right[l], src.right[l], (size_t)src.ranks[l] * src.dims[l - 1] * sizeof(double));
+        }
+        if (dst.levels[l] != src.levels[l])
+        {
+            network_set_levels(dst, l, src.levels[l]);
+        }
+        // replicas share the packed weights
+        if (src.levels[l] > 0 && dst.signs[l] != src.signs[l])
+        {
+            size_t words = (size_t)src.dims[l] * packed_words(src.dims[l - 1]);
+            memcpy(dst.signs[l], src.signs[l], words * sizeof(uint64_t));
+            if (src.masks[l] != NULL)
+            {
+                memcpy(dst.masks[l], src.masks[l], words * sizeof(uint64_t));
+            }
+            memcpy(dst.scales[l], src.scales[l], src.dims[l] * sizeof(double));
+        }
+        // inference networks keep no dense weights of factored and quantized layers
+        if (src.weights[l] == NULL && dst.weights[l] != NULL)
+        {
+            if (src.levels[l] > 0)
+            {
+                // the packed weights as latent weights, which quantize to the same packed weights
+                for (int i = 0; i < src.dims[l]; i++)
+                {
+                    dequantize_row(dst, l, i, dst.weights[l] + (size_t)i * src.dims[l - 1]);
+                }
+            }
+            else
+            {
+                network_expand_layer(dst, l);
+            }
+        }
+    }
+}
+
+// a network of doubles with the shapes of a quantized network, its quantized weights as doubles
+Network network_dequantize(Network network)
+{
+    Network dense = network_create_inference(network.ndim, network.dims);
+    network_copy(dense, network);
+    for (int l = 1; l < network.ndim; l++)
+    {
+        if (dense.levels[l] > 0)
+        {
+            for (int i = 0; i < dense.dims[l]; i++)
+            {
+                dequantize_row(dense, l, i, dense.weights[l] + (size_t)i * dense.dims[l - 1]);
+            }
+            network_set_levels(dense, l, 0);
+        }
+    }
+    return dense;
+}
+
+void network_fork_destroy(Network fork)
+{
+    for (int l = 1; l < fork.ndim; l++)
+    {
+        free(fork.neurons[l]);
+        large_array_free(fork.weights_grad[l], (size_t)fork.dims[l] * fork.dims[l - 1]);
+        free(fork.biases_grad[l]);
+    }
+    free(fork.neurons);
+    free(fork.weights_grad);
+    free(fork.biases_grad);
+    free(fork.scratch);
+}
+
+/*
+ * Copies of the weights and biases of a network that is only read, one bound
+ * to every NUMA node, so inference on any node reads local memory. Empty on a
+ * single node or with NEURAL_NUMA_REPLICAS=0.
+ */
+typedef struct
+{
+    int n_nodes;
+    Network *networks;
+    int refused; // node the weights could not be bound to, so they are shared instead, -1 if none
+} Replicas;
+
+void replicas_destroy(Replicas replicas)
+{
+    for (int node = 0; node < replicas.n_nodes; node++)
+    {
+        Network replica = replicas.networks[node];
+        for (int l = 1; l < replica.ndim; l++)
+        {
+            large_array_free(replica.weights[l], (size_t)replica.dims[l] * replica.dims[l - 1]);
+            large_array_free(replica.biases[l], replica.dims[l]);
+            large_array_free(replica.left[l], (size_t)replica.dims[l] * replica.ranks[l]);
+            large_array_free(replica.right[l], (size_t)replica.ranks[l] * replica.dims[l - 1]);
+        }
+        free(replica.weights);
+        free(replica.biases);
+        free(replica.left);
+        free(replica.right);
+    }
+    free(replicas.networks);
+}
+
+Replicas replicas_create(Network network)
+{
+    MemoryPolicy policy = memory_policy();
+    Replicas replicas = {.n_nodes = policy.replicas && policy.n_nodes > 1 ? policy.n_nodes : 0, .refused = -1};
+    replicas.networks = malloc(replicas.n_nodes * sizeof(Network));
+    for (int node = 0; node < replicas.n_nodes; node++)
+    {
+        Network replica = network;
+        replica.weights = malloc(network.ndim * sizeof(double *));
+        replica.biases = malloc(network.ndim * sizeof(double *));
+        replica.left = calloc(network.ndim, sizeof(double *));
+        replica.right = calloc(network.ndim, sizeof(double *));
+        int bound = 1;
+        for (int l = 1; l < network.ndim; l++)
+        {
+            size_t size = (size_t)network.dims[l] * network.dims[l - 1];
+            replica.weights[l] = network.weights[l] != NULL ? large_array(size) : NULL;
+            replica.biases[l] = large_array(network.dims[l]);
+            if (network.weights[l] != NULL)
+            {
+                bound &= large_array_bind(replica.weights[l], size, node);
+            }
+            bound &= large_array_bind(replica.biases[l], network.dims[l], node);
+            if (network.ranks[l] > 0)
+            {
+                size_t left = (size_t)network.dims[l] * network.ranks[l];
+                size_t right = (size_t)network.ranks[l] * network.dims[l - 1];
+                replica.left[l] = large_array(left);
+                replica.right[l] = large_array(right);
+                bound &= large_array_bind(replica.left[l], left, node);
+                bound &= large_array_bind(replica.right[l], right, node);
+            }
+        }
+        replicas.networks[node] = replica;
+        if (!bound)
+        {
+            // a copy that is not on its node only costs memory, every node reads the network instead
+            replicas.n_nodes = node + 1;
+            replicas_destroy(replicas);
+            return (Replicas){.n_nodes = 0, .networks = NULL, .refused = node};
+        }
+        network_copy(replica, network);
+    }
+    return replicas;
+}
+
+// the network with the weights local to node, or network itself without replicas
+Network replica_network(Replicas replicas, Network network, int node)
+{
+    return replicas.n_nodes > 0 ? replicas.networks[node % replicas.n_nodes] : network;
+}
+
+// THREAD POOL
+
+/*
+ * A work-stealing pool shared by training, inference, evaluation and data
+ * loading. Every worker owns a deque: it pushes and pops tasks at the bottom,
+ * while idle workers steal from the top of the others' deques. Threads that
+ * wait for a fork/join group to finish keep executing tasks in the meantime,
+ * so nested parallel calls never oversubscribe the machine.
+ *
+ * The number of workers is read from NEURAL_THREADS (default: all available
+ * cores). Workers are pinned to cores unless NEURAL_PIN=0.
+ *
+ * Threads outside the pool that make parallel calls while the main thread
+ * does too, like the producer of the prefetcher, attach to one of
+ * POOL_EXTERNAL extra slots with their own deque and worker id, so they never
+ * share the per-worker scratch of worker 0. Per-worker scratch therefore
+ * holds pool_slots() entries.
+ */
+
+#define POOL_EXTERNAL 1
+
+typedef void (*Task)(void *context, int index);
+typedef void (*RangeTask)(void *context, int start, int end);
+
+typedef struct
+{
+    Task task;
+    void *context;
+    int index;
+    int *pending;
+} PoolTask;
+
+typedef struct
+{
+    PoolTask *tasks;
+    long top;
+    long bottom;
+    long capacity;
+    pthread_mutex_t lock;
+} Deque;
+
+typedef struct
+{
+    Deque *deques;
+    pthread_t *threads;
+    int *nodes; // NUMA node of every worker
+    pid_t *tids; // kernel thread id of every worker, 0 until it started
+    int size;
+    int attached; // external slots in use
+    int queued;
+    int shutdown;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} Pool;
+
+Pool pool = {.size = 0};
+_Thread_local int pool_worker = 0;
+
+int pool_pop(int id, PoolTask *task)
+{
+    Deque *deque = pool.deques + id;
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top)
+    {
+        *task = deque->tasks[--deque->bottom % deque->capacity];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+int pool_steal(int id, PoolTask *task)
+{
+    Deque *deque = pool.deques + id;
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top)
+    {
+        *task = deque->tasks[deque->top++ % deque->capacity];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// looks for work in the own deque first, then steals round-robin
+int pool_find_task(PoolTask *task)
+{
+    if (__atomic_load_n(&pool.queued, __ATOMIC_ACQUIRE) <= 0)
+    {
+        return 0;
+    }
+
+    int slots = pool.size + POOL_EXTERNAL;
+    int found = pool_pop(pool_worker, task);
+    for (int i = 1; !found && i < slots; i++)
+    {
+        found = pool_steal((pool_worker + i) % slots, task);
+    }
+
+    if (found)
+    {
+        __atomic_sub_fetch(&pool.queued, 1, __ATOMIC_ACQ_REL);
+    }
+    return found;
+}
+
+void pool_execute(PoolTask task)
+{
+    task.task(task.context, task.index);
+    __atomic_sub_fetch(task.pending, 1, __ATOMIC_ACQ_REL);
+}
+
+void pool_pin(int id)
+{
+    if (getenv("NEURAL_PIN") != NULL && strcmp(getenv("NEURAL_PIN"), "0") == 0)
+    {
+        return;
+    }
+
+    cpu_set_t available;
+    if (sched_getaffinity(0, sizeof(available), &available) != 0)
+    {
+        return;
+    }
+
+    // map worker ids onto the cores this process may run on
+    int n_cpus = CPU_COUNT(&available);
+    int target = id % n_cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &available) && target-- == 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            return;
+        }
+    }
+}
+
+void *pool_work(void *arg)
+{
+    pool_worker = (int)(intptr_t)arg;
+    __atomic_store_n(pool.tids + pool_worker, (pid_t)syscall(SYS_gettid), __ATOMIC_RELEASE);
+    pool_pin(pool_worker);
+    pool.nodes[pool_worker] = current_node();
+
+    while (1)
+    {
+        PoolTask task;
+        if (pool_find_task(&task))
+        {
+            pool_execute(task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        while (__atomic_load_n(&pool.queued, __ATOMIC_ACQUIRE) <= 0 && !pool.shutdown)
+        {
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        }
+        int shutdown = pool.shutdown;
+        pthread_mutex_unlock(&pool.lock);
+
+        if (shutdown)
+        {
+            return NULL;
+        }
+    }
+}
+
+// starts the pool with the given number of workers, the calling thread being worker 0
+void pool_init(int size)
+{
+    if (pool.size != 0)
+    {
+        return;
+    }
+
+    pool.size = size;
+    pool.queued = 0;
+    pool.shutdown = 0;
+    pool.attached = 0;
+    pool.deques = calloc(size + POOL_EXTERNAL, sizeof(Deque));
+    pool.threads = malloc(size * sizeof(pthread_t));
+    pool.nodes = calloc(size + POOL_EXTERNAL, sizeof(int));
+    pool.tids = calloc(size + POOL_EXTERNAL, sizeof(pid_t));
+    pool.tids[0] = (pid_t)syscall(SYS_gettid);
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+
+    for (int i = 0; i < size + POOL_EXTERNAL; i++)
+    {
+        pool.deques[i].capacity = 64;
+        pool.deques[i].tasks = malloc(pool.deques[i].capacity * sizeof(PoolTask));
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+    }
+
+    if (size > 1)
+    {
+        pool_pin(0);
+    }
+    pool.nodes[0] = current_node();
+    for (int i = 1; i < size; i++)
+    {
+        if (pthread_create(pool.threads + i, NULL, pool_work, (void *)(intptr_t)i) != 0)
+        {
+            printf("%serror:%s failed to spawn thread\n", RED, RESET);
+            exit(1);
+        }
+    }
+}
+
+// cores the process may run on
+int available_cores()
+{
+    cpu_set_t available;
+    if (sched_getaffinity(0, sizeof(available), &available) == 0)
+    {
+        return CPU_COUNT(&available);
+    }
+    return 1;
+}
+
+int pool_default_size()
+{
+    char *value = getenv("NEURAL_THREADS");
+    if (value != NULL)
+    {
+        char c;
+        int size;
+        if (sscanf(value, "%d%c", &size, &c) != 1 || size < 1)
+        {
+            printf("%serror:%s invalid NEURAL_THREADS '%s'\n", RED, RESET, value);
+            exit(1);
+        }
+        return size;
+    }
+    return available_cores();
+}
+
+int pool_size()
+{
+    if (pool.size == 0)
+    {
+        pool_init(pool_default_size());
+    }
+    return pool.size;
+}
+
+// entries of per-worker scratch, the workers and the external slots
+int pool_slots()
+{
+    return pool_size() + POOL_EXTERNAL;
+}
+
+// gives the calling thread, which is not a worker, an external slot of its own until pool_detach
+void pool_attach()
+{
+    pool_size();
+    int slot = __atomic_fetch_add(&pool.attached, 1, __ATOMIC_ACQ_REL);
+    if (slot >= POOL_EXTERNAL)
+    {
+        printf("%serror:%s more than %d threads outside the pool make parallel calls\n", RED, RESET, POOL_EXTERNAL);
+        exit(1);
+    }
+    pool_worker = pool.size + slot;
+    pool.tids[pool_worker] = (pid_t)syscall(SYS_gettid);
+    pool.nodes[pool_worker] = current_node();
+}
+
+void pool_detach()
+{
+    pool_worker = 0;
+    __atomic_sub_fetch(&pool.attached, 1, __ATOMIC_ACQ_REL);
+}
+
+void pool_shutdown()
+{
+    if (pool.size == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = 1;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int i = 1; i < pool.size; i++)
+    {
+        pthread_join(pool.threads[i], NULL);
+    }
+    for (int i = 0; i < pool.size + POOL_EXTERNAL; i++)
+    {
+        free(pool.deques[i].tasks);
+        pthread_mutex_destroy(&pool.deques[i].lock);
+    }
+    free(pool.deques);
+    free(pool.threads);
+    free(pool.nodes);
+    free(pool.tids);
+    pool.size = 0;
+}
+
+void pool_push(int id, PoolTask task)
+{
+    Deque *deque = pool.deques + id;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom - deque->top == deque->capacity)
+    {
+        PoolTask *tasks = malloc(2 * deque->capacity * sizeof(PoolTask));
+        for (long i = deque->top; i < deque->bottom; i++)
+        {
+            tasks[i % (2 * deque->capacity)] = deque->tasks[i % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity *= 2;
+    }
+    deque->tasks[deque->bottom++ % deque->capacity] = task;
+    pthread_mutex_unlock(&deque->lock);
+    __atomic_add_fetch(&pool.queued, 1, __ATOMIC_ACQ_REL);
+}
+
+// fork/join: runs task(context, i) for i in [0, n) on the pool and waits for all of them
+void parallel_run(int n, Task task, void *context)
+{
+    if (n <= 0)
+    {
+        return;
+    }
+    if (pool_size() == 1 || n == 1)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            task(context, i);
+        }
+        return;
+    }
+
+    int pending = n;
+
+    /*
+     * Task i is queued at worker (caller + i), pushed in reverse so every owner
+     * pops its tasks in ascending order. Runs of the same size thus keep task i
+     * on the same worker unless it gets stolen, and buffers first touched by
+     * task i stay local to the node that uses them.
+     */
+    for (int i = n - 1; i > 0; i--)
+    {
+        pool_push((pool_worker + i) % pool.size, (PoolTask){.task = task, .context = context, .index = i, .pending = &pending});
+    }
+    pthread_mutex_lock(&pool.lock);
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    pool_execute((PoolTask){.task = task, .context = context, .index = 0, .pending = &pending});
+
+    // help out until the whole group is done
+    while (__atomic_load_n(&pending, __ATOMIC_ACQUIRE) > 0)
+    {
+        PoolTask other;
+        if (pool_find_task(&other))
+        {
+            pool_execute(other);
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+}
+
+typedef struct
+{
+    RangeTask task;
+    void *context;
+    int n;
+    int grain;
+} RangeJob;
+
+void run_range(void *context, int chunk)
+{
+    RangeJob *job = context;
+    int start = chunk * job->grain;
+    int end = start + job->grain < job->n ? start + job->grain : job->n;
+    job->task(job->context, start, end);
+}
+
+// parallel-for: splits [0, n) into chunks of at most grain items
+void parallel_for(int n, int grain, RangeTask task, void *context)
+{
+    RangeJob job = {.task = task, .context = context, .n = n, .grain = grain < 1 ? 1 : grain};
+    parallel_run((n + job.grain - 1) / job.grain, run_range, &job);
+}
+
+// counters of every worker of the pool, waiting for the workers to start
+Counters counters_open_pool()
+{
+    int size = pool_size();
+    for (int t = 0; t < size; t++)
+    {
+        while (__atomic_load_n(pool.tids + t, __ATOMIC_ACQUIRE) == 0)
+        {
+            sched_yield();
+        }
+    }
+    return counters_open(size, pool.tids);
+}
+
+// the profile also sums the counters of the pool from now on
+void profile_open_counters()
+{
+    profile.counters = counters_open_pool();
+}
+
+// grain that splits n items into a few chunks per worker, for load balancing
+int parallel_grain(int n)
+{
+    int chunks = 4 * pool_size();
+    return n / chunks > 0 ? n / chunks : 1;
+}
+
+// DISTRIBUTED
+
+/*
+ * Processes of a distributed job form a ring: every rank listens on its own
+ * address, connects to the next rank and accepts a connection from the
+ * previous one. Addresses are either 'host:port' (TCP) or 'unix:<path>'.
+ *
+ * The ring all-reduce splits the buffer into one chunk per rank. During the
+ * reduce-scatter phase every chunk travels once around the ring and
+ * accumulates the contributions of all ranks, during the all-gather phase the
+ * finished chunks are copied around. Every chunk is summed in the same order
+ * on all ranks, so parameters stay bit-identical across processes.
+ */
+
+typedef struct
+{
+    int rank;
+    int world_size;
+    int next;
+    int prev;
+    double time;
+    long bytes;
+} Communicator;
+
+int socket_listen(char *address)
+{
+    int fd;
+    if (strncmp(address, "unix:", 5) == 0)
+    {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        strncpy(addr.sun_path, address + 5, sizeof(addr.sun_path) - 1);
+        unlink(addr.sun_path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+            printf("%serror:%s cannot bind to '%s'\n", RED, RESET, address);
+            exit(1);
+        }
+    }
+    else
+    {
+        char *colon = strrchr(address, ':');
+        if (colon == NULL)
+        {
+            printf("%serror:%s expected address 'host:port' or 'unix:path', got '%s'\n", RED, RESET, address);
+            exit(1);
+        }
+
+        struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE};
+        struct addrinfo *info;
+        if (getaddrinfo(NULL, colon + 1, &hints, &info) != 0)
+        {
+            printf("%serror:%s cannot resolve '%s'\n", RED, RESET, address);
+            exit(1);
+        }
+
+        int reuse = 1;
+        fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (fd < 0 || bind(fd, info->ai_addr, info->ai_addrlen) != 0)
+        {
+            printf("%serror:%s cannot bind to '%s'\n", RED, RESET, address);
+            exit(1);
+        }
+        freeaddrinfo(info);
+    }
+
+    if (listen(fd, 1) != 0)
+    {
+        printf("%serror:%s cannot listen on '%s'\n", RED, RESET, address);
+        exit(1);
+    }
+    return fd;
+}
+
+// returns -1 while the peer is not listening yet
+int socket_connect(char *address)
+{
+    int fd;
+    if (strncmp(address, "unix:", 5) == 0)
+    {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        strncpy(addr.sun_path, address + 5, sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    char host[256];
+    char *colon = strrchr(address, ':');
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *info;
+    if (getaddrinfo(host, colon + 1, &hints, &info) != 0)
+    {
+        return -1;
+    }
+    fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    int status = connect(fd, info->ai_addr, info->ai_addrlen);
+    freeaddrinfo(info);
+    if (status != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return fd;
+}
+
+Communicator communicator_connect(int rank, int world_size, char **peers)
+{
+    Communicator comm = {.rank = rank, .world_size = world_size, .next = -1, .prev = -1};
+    if (world_size == 1)
+    {
+        return comm;
+    }
+
+    int listener = socket_listen(peers[rank]);
+
+    // peers start at different times, so retry for up to a minute
+    char *next_address = peers[(rank + 1) % world_size];
+    for (int attempt = 0; comm.next < 0 && attempt < 600; attempt++)
+    {
+        comm.next = socket_connect(next_address);
+        if (comm.next < 0)
+        {
+            usleep(100000);
+        }
+    }
+    if (comm.next < 0)
+    {
+        printf("%serror:%s cannot connect to '%s'\n", RED, RESET, next_address);
+        exit(1);
+    }
+    int32_t id = rank;
+    if (write(comm.next, &id, sizeof(id)) != sizeof(id))
+    {
+        printf("%serror:%s failed to greet '%s'\n", RED, RESET, next_address);
+        exit(1);
+    }
+
+    comm.prev = accept(listener, NULL, NULL);
+    if (comm.prev < 0 || read(comm.prev, &id, sizeof(id)) != sizeof(id) || id != (rank + world_size - 1) % world_size)
+    {
+        printf("%serror:%s unexpected peer connected to '%s'\n", RED, RESET, peers[rank]);
+        exit(1);
+    }
+    close(listener);
+    if (strncmp(peers[rank], "unix:", 5) == 0)
+    {
+        unlink(peers[rank] + 5);
+    }
+
+    return comm;
+}
+
+void communicator_close(Communicator comm)
+{
+    if (comm.next >= 0)
+    {
+        close(comm.next);
+        close(comm.prev);
+    }
+}
+
+// sends to the next rank while receiving from the previous one, without deadlocking on full buffers
+void ring_exchange(Communicator *comm, double *outgoing, int n_send, double *incoming, int n_recv)
+{
+    char *out = (char *)outgoing;
+    char *in = (char *)incoming;
+    size_t to_send = n_send * sizeof(double);
+    size_t to_recv = n_recv * sizeof(double);
+    comm->bytes += to_send;
+
+    while (to_send > 0 || to_recv > 0)
+    {
+        struct pollfd fds[] = {
+            {.fd = to_send > 0 ? comm->next : -1, .events = POLLOUT},
+            {.fd = to_recv > 0 ? comm->prev : -1, .events = POLLIN},
+        };
+        poll(fds, 2, -1);
+
+        if (fds[0].revents & POLLOUT)
+        {
+            ssize_t n = send(comm->next, out, to_send, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n > 0)
+            {
+                out += n;
+                to_send -= n;
+            }
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP))
+        {
+            ssize_t n = recv(comm->prev, in, to_recv, MSG_DONTWAIT);
+            if (n == 0)
+            {
+                printf("%serror:%s rank %d lost connection to its peer\n", RED, RESET, comm->rank);
+                exit(1);
+            }
+            if (n > 0)
+            {
+                in += n;
+                to_recv -= n;
+            }
+        }
+        if (fds[0].revents & (POLLERR | POLLHUP))
+        {
+            printf("%serror:%s rank %d lost connection to its peer\n", RED, RESET, comm->rank);
+            exit(1);
+        }
+    }
+}
+
+// bounds of chunk c (taken modulo n) when splitting size elements into n chunks
+int chunk_start(int c, int n, int size)
+{
+    return (long)((c % n + n) % n) * size / n;
+}
+
+int chunk_size(int c, int n, int size)
+{
+    c = (c % n + n) % n;
+    return (long)(c + 1) * size / n - (long)c * size / n;
+}
+
+// sums data element-wise over all ranks, the result is identical on every rank
+void allreduce(Communicator *comm, double *data, int size)
+{
+    int n = comm->world_size;
+    if (n == 1)
+    {
+        return;
+    }
+
+    double start = timestamp();
+    double *buffer = malloc((size / n + 1) * sizeof(double));
+
+    // reduce-scatter: afterwards chunk rank + 1 holds the sum over all ranks
+    for (int step = 0; step < n - 1; step++)
+    {
+        int send_chunk = comm->rank - step;
+        int recv_chunk = comm->rank - step - 1;
+        ring_exchange(comm, data + chunk_start(send_chunk, n, size), chunk_size(send_chunk, n, size),
+                      buffer, chunk_size(recv_chunk, n, size));
+
+        double *chunk = data + chunk_start(recv_chunk, n, size);
+        for (int i = 0; i < chunk_size(recv_chunk, n, size); i++)
+        {
+            chunk[i] += buffer[i];
+        }
+    }
+
+    // all-gather: pass the finished chunks around the ring
+    for (int step = 0; step < n - 1; step++)
+    {
+        int send_chunk = comm->rank + 1 - step;
+        int recv_chunk = comm->rank - step;
+        ring_exchange(comm, data + chunk_start(send_chunk, n, size), chunk_size(send_chunk, n, size),
+                      data + chunk_start(recv_chunk, n, size), chunk_size(recv_chunk, n, size));
+    }
+
+    free(buffer);
+    comm->time += timestamp() - start;
+}
+
+// MACHINE LEARNING
+
+double compute_loss(Network network, double *label)
+{
+    double loss = 0;
+    for (int i = 0; i < network.dims[network.ndim - 1]; i++)
+    {
+        double tmp = network.neurons[network.ndim - 1][i] - label[i];
+        loss += tmp * tmp;
+    }
+    return loss;
+}
+
+// forward pass of a factored layer as two skinny products, through the rank-sized hidden vector
+void forward_factored(Network network, int l)
+{
+    int rank = network.ranks[l];
+    int n_in = network.dims[l - 1];
+    double *a = network.neurons[l - 1];
+    double *hidden = network.scratch;
+    for (int k = 0; k < rank; k++)
+    {
+        double *right = network.right[l] + (size_t)k * n_in;
+        hidden[k] = 0;
+        for (int j = 0; j < n_in; j++)
+        {
+            hidden[k] += right[j] * a[j];
+        }
+    }
+    for (int i = 0; i < network.dims[l]; i++)
+    {
+        double *left = network.left[l] + (size_t)i * rank;
+        double sum = network.biases[l][i];
+        for (int k = 0; k < rank; k++)
+        {
+            sum += left[k] * hidden[k];
+        }
+        network.neurons[l][i] = 1.0 / (1.0 + exp(-sum));
+    }
+}
+
+// activations of layer l from the ones of layer l - 1
+void forward_layer(Network network, int l)
+{
+    if (network.ranks[l] > 0)
+    {
+        forward_factored(network, l);
+        return;
+    }
+    if (network.levels[l] > 0)
+    {
+        forward_quantized(network, l, network.neurons[l - 1], network.neurons[l]);
+        return;
+    }
+
+    int *dims = network.dims;
+    double **a = network.neurons;
+    double **w = network.weights;
+    double **b = network.biases;
+    for (int i = 0; i < dims[l]; i++)
+    {
+        a[l][i] = 0;
+        for (int j = 0; j < dims[l - 1]; j++)
+        {
+            a[l][i] += w[l][i * dims[l - 1] + j] * a[l - 1][j];
+        }
+        a[l][i] += b[l][i];
+        a[l][i] = 1.0 / (1.0 + exp(-a[l][i]));
+    }
+}
+
+void forward(Network network, double *inputs)
+{
+    network.neurons[0] = inputs;
+    for (int l = 1; l < network.ndim; l++)
+    {
+        forward_layer(network, l);
+    }
+}
+
+/*
+ * SPECIALIZED KERNELS
+ *
+ * Forward passes for fixed network shapes, with constant trip counts and
+ * register-blocked tiles. The shapes are listed in 'generate_kernels.py'.
+ */
+
+// four doubles, loaded from arbitrarily aligned addresses
+typedef double v4d __attribute__((vector_size(32)));
+typedef double v4d_unaligned __attribute__((vector_size(32), aligned(8), may_alias));
+
+#define LOAD_V4D(p) (*(const v4d_unaligned *)(p))
+#define SUM_V4D(v) (((v)[0] + (v)[1]) + ((v)[2] + (v)[3]))
+
+/* automatically generated by 'generate_kernels.py' */
+#include "kernels.c"
+
+// returns the specialized forward pass for the network's shape, or the generic one
+ForwardKernel find_forward_kernel(Network network)
+{
+    for (int l = 1; l < network.ndim; l++)
+    {
+        if (network.ranks[l] > 0 || network.levels[l] > 0)
+        {
+            return forward;
+        }
+    }
+    for (size_t k = 0; k < sizeof(specialized_kernels) / sizeof(SpecializedKernel); k++)
+    {
+        SpecializedKernel kernel = specialized_kernels[k];
+        int matches = kernel.ndim == network.ndim;
+        for (int l = 0; matches && l < network.ndim; l++)
+        {
+            matches = kernel.dims[l] == network.dims[l];
+        }
+        if (matches)
+        {
+            return kernel.forward;
+        }
+    }
+    return forward;
+}
+
+/*
+ * AUTOTUNING
+ *
+ * The fastest tile and batch split of the batched forward pass, the number of
+ * inference threads and whether the specialized kernel and the layer-wise
+ * pipeline pay off depend on the cache sizes and cores of the machine.
+ * 'neural tune' times candidates for the shape of a model and stores the
+ * fastest in a tuning cache, one line per CPU model, core count and shape:
+ *
+ *   cpu,cores,shape,tile,grain,threads,specialized,pipeline
+ *
+ * The cache is read from NEURAL_TUNING (default: ~/.cache/neural/tuning.csv,
+ * an empty value disables it) the first time a shape is looked up. Shapes
+ * without an entry for this machine use tuning_default. None of the settings
+ * change the results, only how fast they are computed.
+ */
+
+#define TUNING_FIELD 256
+#define TUNING_TILES 4
+
+const int tuning_tiles[TUNING_TILES] = {1, 2, 4, 8};
+
+typedef struct
+{
+    int tile;        // samples sharing every weight row in forward_layer_batch: 1, 2, 4 or 8
+    int grain;       // samples per task of batched prediction, 0 for a few tasks per worker
+    int threads;     // workers for inference, 0 for NEURAL_THREADS or all cores
+    int specialized; // single samples use the generated kernel of the shape, if there is one
+    int pipeline;    // training steps update a layer while the layers below back-propagate
+} Tuning;
+
+typedef struct
+{
+    char cpu[TUNING_FIELD];
+    int cores;
+    char shape[TUNING_FIELD];
+    Tuning tuning;
+} TuningEntry;
+
+typedef struct
+{
+    char cpu[TUNING_FIELD];
+    int cores;
+    TuningEntry *entries;
+    int n_entries;
+} TuningCache;
+
+TuningCache tuning_cache;
+pthread_once_t tuning_once = PTHREAD_ONCE_INIT;
+
+// the heuristics used without an entry
+Tuning tuning_default()
+{
+    return (Tuning){.tile = 4, .grain = 0, .threads = 0, .specialized = 1, .pipeline = 1};
+}
+
+// model name of the first core, commas replaced so it fits in a CSV field
+void cpu_model(char *model)
+{
+    strcpy(model, "unknown");
+    FILE *file = fopen("/proc/cpuinfo", "r");
+    if (file == NULL)
+    {
+        return;
+    }
+    char line[TUNING_FIELD];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char *colon = strchr(line, ':');
+        if (strncmp(line, "model name", 10) == 0 && colon != NULL)
+        {
+            char *value = colon + 1 + strspn(colon + 1, " \t");
+            value[strcspn(value, "\n")] = '\0';
+            strcpy(model, value);
+            for (char *c = model; *c != '\0'; c++)
+            {
+                *c = *c == ',' || *c == '"' ? ' ' : *c;
+            }
+            break;
+        }
+    }
+    fclose(file);
+}
+
+// sizes of the layers like '784x64r16x32bx10', factored layers with their rank, quantized ones with b or t
+void network_shape(Network network, char *shape, int size)
+{
+    int length = snprintf(shape, size, "%d", network.dims[0]);
+    for (int l = 1; l < network.ndim && length < size; l++)
+    {
+        length += snprintf(shape + length, size - length, network.ranks[l] > 0 ? "x%dr%d" : "x%d", network.dims[l],
+                           network.ranks[l]);
+        if (network.levels[l] > 0 && length < size)
+        {
+            length += snprintf(shape + length, size - length, network.levels[l] == LEVELS_TERNARY ? "t" : "b");
+        }
+    }
+}
+
+// path of the tuning cache, NULL when it is disabled
+char *tuning_path()
+{
+    static char path[PATH_MAX];
+    char *value = getenv("NEURAL_TUNING");
+    if (value != NULL)
+    {
+        return value[0] != '\0' ? value : NULL;
+    }
+    char *home = getenv("HOME");
+    if (home == NULL)
+    {
+        return NULL;
+    }
+    snprintf(path, sizeof(path), "%s/.cache/neural/tuning.csv", home);
+    return path;
+}
+
+// whether the settings of an entry are ones that 'neural tune' could have chosen on its machine
+int tuning_valid(TuningEntry entry)
+{
+    Tuning t = entry.tuning;
+    int tile = 0;
+    for (int k = 0; k < TUNING_TILES; k++)
+    {
+        tile |= t.tile == tuning_tiles[k];
+    }
+    return tile && entry.cores > 0 && t.grain >= 0 && t.threads >= 0 && t.threads <= entry.cores &&
+           (t.specialized == 0 || t.specialized == 1) && (t.pipeline == 0 || t.pipeline == 1);
+}
+
+// all entries of a tuning cache, for any machine; a missing file has none
+int tuning_read(char *path, TuningEntry **entries)
+{
+    *entries = NULL;
+    FILE *file = path != NULL ? fopen(path, "r") : NULL;
+    if (file == NULL)
+    {
+        return 0;
+    }
+    int n = 0;
+    int capacity = 0;
+    char line[3 * TUNING_FIELD];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        TuningEntry entry;
+        Tuning *t = &entry.tuning;
+        // the header and broken lines do not parse, edited lines may hold settings that would not run
+        if (sscanf(line, "%255[^,],%d,%255[^,],%d,%d,%d,%d,%d", entry.cpu, &entry.cores, entry.shape, &t->tile,
+                   &t->grain, &t->threads, &t->specialized, &t->pipeline) != 8 ||
+            !tuning_valid(entry))
+        {
+            continue;
+        }
+        if (n == capacity)
+        {
+            capacity = capacity > 0 ? 2 * capacity : 16;
+            *entries = realloc(*entries, capacity * sizeof(TuningEntry));
+        }
+        (*entries)[n++] = entry;
+    }
+    fclose(file);
+    return n;
+}
+
+// replaces the file atomically, creating its directories
+void tuning_write(char *path, TuningEntry *entries, int n)
+{
+    char directory[PATH_MAX];
+    snprintf(directory, sizeof(directory), "%s", path);
+    for (char *slash = strchr(directory + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        mkdir(directory, 0755);
+        *slash = '/';
+    }
+
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    FILE *file = fopen(temporary, "w");
+    if (file == NULL)
+    {
+        printf("%serror:%s cannot write tuning cache '%s'\n", RED, RESET, temporary);
+        exit(1);
+    }
+    fprintf(file, "cpu,cores,shape,tile,grain,threads,specialized,pipeline\n");
+    for (int i = 0; i < n; i++)
+    {
+        Tuning t = entries[i].tuning;
+        fprintf(file, "%s,%d,%s,%d,%d,%d,%d,%d\n", entries[i].cpu, entries[i].cores, entries[i].shape, t.tile, t.grain,
+                t.threads, t.specialized, t.pipeline);
+    }
+    if (fclose(file) != 0 || rename(temporary, path) != 0)
+    {
+        printf("%serror:%s cannot write tuning cache '%s'\n", RED, RESET, path);
+        exit(1);
+    }
+}
+
+// index of the entry for a machine and shape, or -1
+int tuning_find(TuningEntry *entries, int n, char *cpu, int cores, char *shape)
+{
+    for (int i = 0; i < n; i++)
+    {
+        if (entries[i].cores == cores && strcmp(entries[i].cpu, cpu) == 0 && strcmp(entries[i].shape, shape) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// adds or replaces the entry of this machine for a shape
+void tuning_store(char *path, char *shape, Tuning tuning)
+{
+    TuningEntry entry = {.cores = available_cores(), .tuning = tuning};
+    cpu_model(entry.cpu);
+    snprintf(entry.shape, sizeof(entry.shape), "%s", shape);
+
+    TuningEntry *entries;
+    int n = tuning_read(path, &entries);
+    int i = tuning_find(entries, n, entry.cpu, entry.cores, entry.shape);
+    if (i < 0)
+    {
+        entries = realloc(entries, (n + 1) * sizeof(TuningEntry));
+        i = n++;
+    }
+    entries[i] = entry;
+    tuning_write(path, entries, n);
+    free(entries);
+}
+
+void tuning_load()
+{
+    cpu_model(tuning_cache.cpu);
+    tuning_cache.cores = available_cores();
+    tuning_cache.n_entries = tuning_read(tuning_path(), &tuning_cache.entries);
+}
+
+// settings for the network's shape on this machine, returns whether the cache had an entry
+int tuning_lookup(Network network, Tuning *tuning)
+{
+    pthread_once(&tuning_once, tuning_load);
+    char shape[TUNING_FIELD];
+    network_shape(network, shape, sizeof(shape));
+    int i = tuning_find(tuning_cache.entries, tuning_cache.n_entries, tuning_cache.cpu, tuning_cache.cores, shape);
+    *tuning = i >= 0 ? tuning_cache.entries[i].tuning : tuning_default();
+    return i >= 0;
+}
+
+// notes that the model's shape has an entry in the tuning cache, returns the settings either way
+Tuning report_tuning(Network network, FILE *log)
+{
+    Tuning tuning;
+    if (tuning_lookup(network, &tuning))
+    {
+        fprintf(log, "info: using tuned settings for this model shape from '%s'\n", tuning_path());
+    }
+    return tuning;
+}
+
+// the specialized kernel of the shape, unless tuning found the generic one faster
+ForwardKernel tuned_forward_kernel(Network network)
+{
+    Tuning tuning;
+    tuning_lookup(network, &tuning);
+    return tuning.specialized ? find_forward_kernel(network) : forward;
+}
+
+// starts the pool with the tuned number of threads, unless NEURAL_THREADS or an earlier call sized it
+void tuning_start_pool(Tuning tuning)
+{
+    if (tuning.threads > 0 && getenv("NEURAL_THREADS") == NULL)
+    {
+        pool_init(tuning.threads);
+    }
+}
+
+/*
+ * BATCHED INFERENCE
+ *
+ * Runs the forward pass of many samples at once. Tiles of a few samples share
+ * every weight row while it is in registers, and the activations of the whole
+ * batch alternate between two buffers of an InferenceContext. Contexts are
+ * not shared between threads.
+ */
+
+typedef struct
+{
+    int capacity;
+    int tile;  // samples per register tile
+    int grain; // samples per task of predict, 0 for a few tasks per worker
+    int *plan; // buffer of the activations of every layer
+    double *buffers[PLAN_BUFFERS];
+    double *hidden; // rank-sized outputs of the first product of factored layers
+    double **rows;
+} InferenceContext;
+
+void inference_context_destroy(InferenceContext context)
+{
+    free(context.plan);
+    free(context.buffers[0]);
+    free(context.buffers[1]);
+    free(context.hidden);
+    free(context.rows);
+}
+
+// a context for batches of up to capacity samples, one with capacity 0 when out of memory
+InferenceContext inference_context_create(Network network, int capacity)
+{
+    int rank = 0;
+    for (int l = 1; l < network.ndim; l++)
+    {
+        rank = network.ranks[l] > rank ? network.ranks[l] : rank;
+    }
+
+    Tuning tuning;
+    tuning_lookup(network, &tuning);
+    InferenceContext context = {
+        .capacity = capacity,
+        .tile = tuning.tile,
+        .grain = tuning.grain,
+        .plan = malloc(network.ndim * sizeof(int)),
+    };
+    if (context.plan == NULL)
+    {
+        return (InferenceContext){.capacity = 0};
+    }
+    int widths[PLAN_BUFFERS];
+    int n_buffers = plan_activations(network.ndim, network.dims, context.plan, widths);
+    for (int b = 0; b < PLAN_BUFFERS; b++)
+    {
+        context.buffers[b] = b < n_buffers ? malloc((size_t)capacity * widths[b] * sizeof(double)) : NULL;
+    }
+    context.hidden = rank > 0 ? malloc((size_t)capacity * rank * sizeof(double)) : NULL;
+    context.rows = malloc(capacity * sizeof(double *));
+
+    int failed = context.rows == NULL || (rank > 0 && context.hidden == NULL);
+    for (int b = 0; b < n_buffers; b++)
+    {
+        failed |= context.buffers[b] == NULL;
+    }
+    if (failed)
+    {
+        inference_context_destroy(context);
+        return (InferenceContext){.capacity = 0};
+    }
+    return context;
+}
+
+double sigmoid(double x)
+{
+    return 1.0 / (1.0 + exp(-x));
+}
+
+// output i of a layer with pre-activation sum, without a bias the layer is linear
+static inline double layer_output(double sum, double *bias, int i)
+{
+    return bias != NULL ? sigmoid(sum + bias[i]) : sum;
+}
+
+/*
+ * y[b][i] = sigmoid(w[i] . x[b] + bias[i]) for a tile of samples, just
+ * w[i] . x[b] without a bias. The tile size is a constant after inlining, so
+ * the accumulators stay in registers. Every sample sums its products in the
+ * same order whatever the tile, so all tiles give identical outputs.
+ */
+static inline __attribute__((always_inline)) void forward_tile(int tile, int n_in, int n_out, double *w, double *bias,
+                                                                double **x, double *y)
+{
+    for (int i = 0; i < n_out; i++)
+    {
+        double *row = w + (size_t)i * n_in;
+        v4d acc[8];
+#pragma GCC unroll 8
+        for (int k = 0; k < tile; k++)
+        {
+            acc[k] = (v4d){0, 0, 0, 0};
+        }
+        int j = 0;
+        for (; j + 4 <= n_in; j += 4)
+        {
+            v4d wj = LOAD_V4D(row + j);
+#pragma GCC unroll 8
+            for (int k = 0; k < tile; k++)
+            {
+                acc[k] += wj * LOAD_V4D(x[k] + j);
+            }
+        }
+#pragma GCC unroll 8
+        for (int k = 0; k < tile; k++)
+        {
+            double sum = SUM_V4D(acc[k]);
+            for (int r = j; r < n_in; r++)
+            {
+                sum += row[r] * x[k][r];
+            }
+            y[(size_t)k * n_out + i] = layer_output(sum, bias, i);
+        }
+    }
+}
+
+// forward_tile over the n rows of x, in tiles of up to tile samples
+void forward_layer_batch(int tile, int n, int n_in, int n_out, double *w, double *bias, double **x, double *y)
+{
+    int b = 0;
+    if (tile >= 8)
+    {
+        for (; b + 8 <= n; b += 8)
+        {
+            forward_tile(8, n_in, n_out, w, bias, x + b, y + (size_t)b * n_out);
+        }
+    }
+    if (tile >= 4)
+    {
+        for (; b + 4 <= n; b += 4)
+        {
+            forward_tile(4, n_in, n_out, w, bias, x + b, y + (size_t)b * n_out);
+        }
+    }
+    if (tile >= 2)
+    {
+        for (; b + 2 <= n; b += 2)
+        {
+            forward_tile(2, n_in, n_out, w, bias, x + b, y + (size_t)b * n_out);
+        }
+    }
+    for (; b < n; b++)
+    {
+        forward_tile(1, n_in, n_out, w, bias, x + b, y + (size_t)b * n_out);
+    }
+}
+
+// forward pass of n <= capacity samples, returns their outputs as n rows inside the context
+double *forward_batch(Network network, InferenceContext *context, int n, double **inputs)
+{
+    double **rows = context->rows;
+    double **x = inputs;
+    double *y = NULL;
+
+    for (int l = 1; l < network.ndim; l++)
+    {
+        y = context->buffers[context->plan[l]];
+        if (network.ranks[l] > 0)
+        {
+            // two skinny products through the hidden vectors, x is read before rows is reused
+            int rank = network.ranks[l];
+            forward_layer_batch(context->tile, n, network.dims[l - 1], rank, network.right[l], NULL, x, context->hidden);
+            for (int b = 0; b < n; b++)
+            {
+                rows[b] = context->hidden + (size_t)b * rank;
+            }
+            forward_layer_batch(context->tile, n, rank, network.dims[l], network.left[l], network.biases[l], rows, y);
+        }
+        else if (network.levels[l] > 0)
+        {
+            for (int b = 0; b < n; b++)
+            {
+                forward_quantized(network, l, x[b], y + (size_t)b * network.dims[l]);
+            }
+        }
+        else
+        {
+            forward_layer_batch(context->tile, n, network.dims[l - 1], network.dims[l], network.weights[l],
+                                network.biases[l], x, y);
+        }
+
+        for (int b = 0; b < n; b++)
+        {
+            rows[b] = y + (size_t)b * network.dims[l];
+        }
+        x = rows;
+    }
+
+    return y;
+}
+
+typedef struct
+{
+    Network network;
+    Replicas replicas;
+    InferenceContext *contexts;
+    double **inputs;
+    double *outputs;
+} PredictJob;
+
+void predict_range(void *context, int start, int end)
+{
+    PredictJob *job = context;
+    int n_outputs = job->network.dims[job->network.ndim - 1];
+    Network network = replica_network(job->replicas, job->network, pool.nodes[pool_worker]);
+    double *outputs = forward_batch(network, job->contexts + pool_worker, end - start, job->inputs + start);
+    memcpy(job->outputs + (size_t)start * n_outputs, outputs, (size_t)(end - start) * n_outputs * sizeof(double));
+}
+
+// one context per pool worker, for predict
+InferenceContext *inference_contexts_create(Network network, int capacity)
+{
+    InferenceContext *contexts = malloc(pool_slots() * sizeof(InferenceContext));
+    for (int t = 0; t < pool_slots(); t++)
+    {
+        contexts[t] = inference_context_create(network, capacity);
+        if (contexts[t].capacity == 0)
+        {
+            printf("%serror:%s out of memory for batches of %d samples\n", RED, RESET, capacity);
+            exit(1);
+        }
+    }
+    return contexts;
+}
+
+void inference_contexts_destroy(InferenceContext *contexts)
+{
+    for (int t = 0; t < pool_slots(); t++)
+    {
+        inference_context_destroy(contexts[t]);
+    }
+    free(contexts);
+}
+
+// like predict, every worker reading the replica of the weights on its node
+void predict_replicated(Network network, Replicas replicas, InferenceContext *contexts, int n, double **inputs, double *outputs)
+{
+    PredictJob job = {.network = network, .replicas = replicas, .contexts = contexts, .inputs = inputs, .outputs = outputs};
+    int grain = contexts[0].grain > 0 ? contexts[0].grain : parallel_grain(n);
+    grain = grain < contexts[0].capacity ? grain : contexts[0].capacity;
+    parallel_for(n, grain, predict_range, &job);
+}
+
+// batched forward pass of n samples on the pool, writes n rows of outputs
+void predict(Network network, InferenceContext *contexts, int n, double **inputs, double *outputs)
+{
+    predict_replicated(network, (Replicas){.n_nodes = 0}, contexts, n, inputs, outputs);
+}
+
+// computes the error term of layer l and stores it in biases_grad[l]
+void backward_delta(Network network, int l, double *label)
+{
+    int *dims = network.dims;
+    double **a = network.neurons;
+    double **w = network.weights;
+    double **b_grad = network.biases_grad;
+
+    if (l == network.ndim - 1)
+    {
+        for (int i = 0; i < dims[l]; i++)
+        {
+            b_grad[l][i] = 2 * (a[l][i] - label[i]) * a[l][i] * (1 - a[l][i]);
+        }
+        return;
+    }
+
+    // accumulate w^T * delta row by row, so the weights are read contiguously
+    // instead of walking down their columns with a stride of dims[l]
+    for (int i = 0; i < dims[l]; i++)
+    {
+        b_grad[l][i] = 0;
+    }
+    int quantized = network.levels[l + 1] > 0;
+    double *dequantized = network.scratch;
+    for (int j = 0; j < dims[l + 1]; j++)
+    {
+        double delta = b_grad[l + 1][j];
+        double *row = w[l + 1] + j * dims[l];
+        if (quantized)
+        {
+            // the forward pass used the quantized weights
+            dequantize_row(network, l + 1, j, dequantized);
+            row = dequantized;
+        }
+        for (int i = 0; i < dims[l]; i++)
+        {
+            b_grad[l][i] += row[i] * delta;
+        }
+    }
+    // the straight-through gradient of the quantized inputs q(2a - 1) is 2
+    double input_gradient = quantized ? 2 : 1;
+    for (int i = 0; i < dims[l]; i++)
+    {
+        b_grad[l][i] *= input_gradient * a[l][i] * (1 - a[l][i]);
+    }
+}
+
+// computes the error term of every layer and stores it in biases_grad
+void backward_deltas(Network network, double *label)
+{
+    for (int l = network.ndim - 1; l > 0; l--)
+    {
+        backward_delta(network, l, label);
+    }
+}
+
+// gradient of the weights of layer l, from its error term and the activations below it
+void weight_gradient(Network network, int l)
+{
+    int *dims = network.dims;
+    double **w_grad = network.weights_grad;
+    double **b_grad = network.biases_grad;
+    double *a = layer_inputs(network, l, network.neurons[l - 1], network.scratch);
+    for (int i = 0; i < dims[l]; i++)
+    {
+        for (int j = 0; j < dims[l - 1]; j++)
+        {
+            w_grad[l][i * dims[l - 1] + j] = a[j] * b_grad[l][i];
+        }
+    }
+}
+
+void backward(Network network, double *label)
+{
+    backward_deltas(network, label);
+    for (int l = 1; l < network.ndim; l++)
+    {
+        weight_gradient(network, l);
+    }
+}
+
+double update_mini_batch(Network network, Image *images, int batch_size, double learning_rate)
+{
+    int ndim = network.ndim;
+    int *dims = network.dims;
+
+    // allocate arrays to accumulate gradients
+    double **weights_grad = malloc(ndim * sizeof(double *));
+    double **biases_grad = malloc(ndim * sizeof(double *));
+
+    for (int l = 1; l < ndim; l++)
+    {
+        weights_grad[l] = calloc(sizeof(double), dims[l] * dims[l - 1]);
+        biases_grad[l] = calloc(sizeof(double), dims[l]);
+    }
+
+    // accumulate intermediate gradients from backpropagation
+    double loss = 0;
+    for (int b = 0; b < batch_size; b++)
+    {
+        forward(network, images[b].data);
+        loss += compute_loss(network, images[b].label);
+
+        backward(network, images[b].label);
+
+        for (int l = 1; l < ndim; l++)
+        {
+            for (int i = 0; i < dims[l]; i++)
+            {
+                biases_grad[l][i] += network.biases_grad[l][i];
+                for (int j = 0; j < dims[l - 1]; j++)
+                {
+                    int idx = i * dims[l - 1] + j;
+                    weights_grad[l][idx] += network.weights_grad[l][idx];
+                }
+            }
+        }
+    }
+
+    // update weights and biases
+    double factor = learning_rate / batch_size;
+    for (int l = 1; l < ndim; l++)
+    {
+        for (int i = 0; i < dims[l]; i++)
+        {
+            network.biases[l][i] -= factor * biases_grad[l][i];
+            for (int j = 0; j < dims[l - 1]; j++)
+            {
+                int idx = i * dims[l - 1] + j;
+                network.weights[l][idx] -= factor * weights_grad[l][idx];
+            }
+        }
+    }
+
+    // free gradient arrays
+    for (int i = 1; i < network.ndim; i++)
+    {
+        free(weights_grad[i]);
+        free(biases_grad[i]);
+    }
+    free(weights_grad);
+    free(biases_grad);
+
+    return loss;
+}
+
+/*
+ * PACKED MODELS
+ *
+ * Trains up to four networks of the same shape side by side, one per lane of
+ * a vector: parameter [l][i] of all networks is stored as one v4d, so a
+ * single pass over each sample updates all of them with the same
+ * instructions. Every lane has its own learning rate and otherwise follows
+ * update_mini_batch. Unused lanes train a copy of the first network with a
+ * learning rate of 0. Most pixels are blank, so the first layer only visits
+ * the nonzero inputs of each sample, which all lanes and neurons share.
+ */
+
+#define PACK_LANES 4
+
+typedef struct
+{
+    int ndim;
+    int *dims;
+    int n_networks;
+    int batch_size;
+    double learning_rates[PACK_LANES];
+    v4d **weights; // [l][i * dims[l - 1] + j], lane k belongs to network k
+    v4d **biases;
+    v4d **neurons;
+    v4d **deltas;
+    v4d **weights_grad; // summed over a batch
+    v4d **biases_grad;
+    int *active; // indices of the nonzero inputs of the current sample
+} Pack;
+
+v4d *pack_array(int size)
+{
+    return aligned_alloc(sizeof(v4d), size * sizeof(v4d));
+}
+
+Pack pack_create(Network *networks, int n_networks, double *learning_rates, int batch_size)
+{
+    int ndim = networks[0].ndim;
+    Pack pack = {
+        .ndim = ndim,
+        .dims = malloc(ndim * sizeof(int)),
+        .n_networks = n_networks,
+        .batch_size = batch_size,
+        .weights = malloc(ndim * sizeof(v4d *)),
+        .biases = malloc(ndim * sizeof(v4d *)),
+        .neurons = malloc(ndim * sizeof(v4d *)),
+        .deltas = malloc(ndim * sizeof(v4d *)),
+        .weights_grad = malloc(ndim * sizeof(v4d *)),
+        .biases_grad = malloc(ndim * sizeof(v4d *)),
+        .active = malloc(networks[0].dims[0] * sizeof(int)),
+    };
+    memcpy(pack.dims, networks[0].dims, ndim * sizeof(int));
+
+    for (int l = 1; l < ndim; l++)
+    {
+        int size = pack.dims[l] * pack.dims[l - 1];
+        pack.weights[l] = pack_array(size);
+        pack.biases[l] = pack_array(pack.dims[l]);
+        pack.neurons[l] = pack_array(pack.dims[l]);
+        pack.deltas[l] = pack_array(pack.dims[l]);
+        pack.weights_grad[l] = pack_array(size);
+        pack.biases_grad[l] = pack_array(pack.dims[l]);
+        for (int k = 0; k < PACK_LANES; k++)
+        {
+            Network network = networks[k < n_networks ? k : 0];
+            for (int i = 0; i < size; i++)
+            {
+                pack.weights[l][i][k] = network.weights[l][i];
+            }
+            for (int i = 0; i < pack.dims[l]; i++)
+            {
+                pack.biases[l][i][k] = network.biases[l][i];
+            }
+        }
+    }
+    for (int k = 0; k < PACK_LANES; k++)
+    {
+        pack.learning_rates[k] = k < n_networks ? learning_rates[k] : 0;
+    }
+    return pack;
+}
+
+// copies the parameters of every lane back to its network
+void pack_extract(Pack pack, Network *networks)
+{
+    for (int k = 0; k < pack.n_networks; k++)
+    {
+        for (int l = 1; l < pack.ndim; l++)
+        {
+            for (int i = 0; i < pack.dims[l] * pack.dims[l - 1]; i++)
+            {
+                networks[k].weights[l][i] = pack.weights[l][i][k];
+            }
+            for (int i = 0; i < pack.dims[l]; i++)
+            {
+                networks[k].biases[l][i] = pack.biases[l][i][k];
+            }
+        }
+    }
+}
+
+void pack_destroy(Pack pack)
+{
+    for (int l = 1; l < pack.ndim; l++)
+    {
+        free(pack.weights[l]);
+        free(pack.biases[l]);
+        free(pack.neurons[l]);
+        free(pack.deltas[l]);
+        free(pack.weights_grad[l]);
+        free(pack.biases_grad[l]);
+    }
+    free(pack.weights);
+    free(pack.biases);
+    free(pack.neurons);
+    free(pack.deltas);
+    free(pack.weights_grad);
+    free(pack.biases_grad);
+    free(pack.active);
+    free(pack.dims);
+}
+
+// sum of row[j] * x[j] over the n indices j in active, or over 0..n-1 if active is NULL
+static inline void pack_dot(int n, int *active, v4d *row, v4d *x, double *shared, v4d *result)
+{
+    v4d sum0 = {0, 0, 0, 0}, sum1 = {0, 0, 0, 0}, sum2 = {0, 0, 0, 0}, sum3 = {0, 0, 0, 0};
+    int t = 0;
+    if (active != NULL)
+    {
+        for (; t + 4 <= n; t += 4)
+        {
+            sum0 += row[active[t]] * shared[active[t]];
+            sum1 += row[active[t + 1]] * shared[active[t + 1]];
+            sum2 += row[active[t + 2]] * shared[active[t + 2]];
+            sum3 += row[active[t + 3]] * shared[active[t + 3]];
+        }
+        for (; t < n; t++)
+        {
+            sum0 += row[active[t]] * shared[active[t]];
+        }
+    }
+    else
+    {
+        for (; t + 4 <= n; t += 4)
+        {
+            sum0 += row[t] * x[t];
+            sum1 += row[t + 1] * x[t + 1];
+            sum2 += row[t + 2] * x[t + 2];
+            sum3 += row[t + 3] * x[t + 3];
+        }
+        for (; t < n; t++)
+        {
+            sum0 += row[t] * x[t];
+        }
+    }
+    *result = (sum0 + sum1) + (sum2 + sum3);
+}
+
+// one mini-batch step of every network in the pack, adds the loss of each lane to losses
+void pack_step(Pack pack, Image *images, int batch_size, double *losses)
+{
+    int L = pack.ndim - 1;
+    int *dims = pack.dims;
+    v4d **a = pack.neurons;
+    v4d **w = pack.weights;
+    v4d **delta = pack.deltas;
+
+    for (int l = 1; l <= L; l++)
+    {
+        memset(pack.weights_grad[l], 0, dims[l] * dims[l - 1] * sizeof(v4d));
+        memset(pack.biases_grad[l], 0, dims[l] * sizeof(v4d));
+    }
+
+    v4d loss = {0, 0, 0, 0};
+    for (int b = 0; b < batch_size; b++)
+    {
+        double *x = images[b].data;
+        double *y = images[b].label;
+        int n_active = 0;
+        for (int j = 0; j < dims[0]; j++)
+        {
+            if (x[j] != 0)
+            {
+                pack.active[n_active++] = j;
+            }
+        }
+
+        // the inputs are shared by all lanes
+        for (int l = 1; l <= L; l++)
+        {
+            for (int i = 0; i < dims[l]; i++)
+            {
+                v4d *row = w[l] + i * dims[l - 1];
+                v4d sum;
+                if (l == 1)
+                {
+                    pack_dot(n_active, pack.active, row, NULL, x, &sum);
+                }
+                else
+                {
+                    pack_dot(dims[l - 1], NULL, row, a[l - 1], NULL, &sum);
+                }
+                sum += pack.biases[l][i];
+                for (int k = 0; k < PACK_LANES; k++)
+                {
+                    a[l][i][k] = 1.0 / (1.0 + exp(-sum[k]));
+                }
+            }
+        }
+
+        for (int i = 0; i < dims[L]; i++)
+        {
+            v4d error = a[L][i] - y[i];
+            loss += error * error;
+            delta[L][i] = 2 * error * a[L][i] * (1 - a[L][i]);
+        }
+        for (int l = L - 1; l > 0; l--)
+        {
+            memset(delta[l], 0, dims[l] * sizeof(v4d));
+            for (int j = 0; j < dims[l + 1]; j++)
+            {
+                v4d *row = w[l + 1] + j * dims[l];
+                for (int i = 0; i < dims[l]; i++)
+                {
+                    delta[l][i] += row[i] * delta[l + 1][j];
+                }
+            }
+            for (int i = 0; i < dims[l]; i++)
+            {
+                delta[l][i] *= a[l][i] * (1 - a[l][i]);
+            }
+        }
+
+        for (int l = 1; l <= L; l++)
+        {
+            for (int i = 0; i < dims[l]; i++)
+            {
+                v4d *row = pack.weights_grad[l] + i * dims[l - 1];
+                pack.biases_grad[l][i] += delta[l][i];
+                if (l == 1)
+                {
+                    for (int t = 0; t < n_active; t++)
+                    {
+                        row[pack.active[t]] += x[pack.active[t]] * delta[l][i];
+                    }
+                }
+                else
+                {
+                    for (int j = 0; j < dims[l - 1]; j++)
+                    {
+                        row[j] += a[l - 1][j] * delta[l][i];
+                    }
+                }
+            }
+        }
+    }
+
+    v4d factor = LOAD_V4D(pack.learning_rates) / batch_size;
+    for (int l = 1; l <= L; l++)
+    {
+        for (int i = 0; i < dims[l]; i++)
+        {
+            pack.biases[l][i] -= factor * pack.biases_grad[l][i];
+        }
+        for (int i = 0; i < dims[l] * dims[l - 1]; i++)
+        {
+            w[l][i] -= factor * pack.weights_grad[l][i];
+        }
+    }
+    for (int k = 0; k < PACK_LANES; k++)
+    {
+        losses[k] += loss[k];
+    }
+}
+
+typedef struct
+{
+    Pack *packs;
+    Dataset dataset;
+    double *losses; // [pack * PACK_LANES + lane] mean loss per sample
+} PackEpochJob;
+
+void pack_epoch_task(void *context, int p)
+{
+    PackEpochJob *job = context;
+    Pack pack = job->packs[p];
+    int batches = job->dataset.size / pack.batch_size;
+    double *losses = job->losses + p * PACK_LANES;
+    memset(losses, 0, PACK_LANES * sizeof(double));
+    for (int i = 0; i < batches; i++)
+    {
+        pack_step(pack, job->dataset.images + i * pack.batch_size, pack.batch_size, losses);
+    }
+    for (int k = 0; k < PACK_LANES; k++)
+    {
+        losses[k] /= batches * pack.batch_size;
+    }
+}
+
+// one epoch of every pack over the same order of samples, the packs run in parallel
+void packs_epoch(Pack *packs, int n_packs, Dataset dataset, double *losses)
+{
+    PackEpochJob job = {.packs = packs, .dataset = dataset, .losses = losses};
+    parallel_run(n_packs, pack_epoch_task, &job);
+}
+
+/*
+ * MIXED PRECISION
+ *
+ * Weights, activations and error terms are stored as 16-bit floats, either
+ * bf16 (the upper half of an fp32, same range) or fp16 (5 bit exponent, more
+ * precise but narrow). Every sweep over the weights then moves 2 instead of 8
+ * bytes per parameter. Dot products and gradient sums accumulate in fp32 and
+ * the network's double arrays remain the master weights: updates are applied
+ * to them and the 16-bit copy is refreshed after every step.
+ *
+ * Small fp16 error terms would underflow to zero, so they are multiplied by a
+ * loss scale that is halved whenever the gradients overflow (the step is then
+ * skipped) and doubled after a long run of finite ones.
+ */
+
+typedef enum
+{
+    PRECISION_DOUBLE,
+    PRECISION_BF16,
+    PRECISION_FP16,
+} Precision;
+
+uint32_t float_bits(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+float bits_float(uint32_t bits)
+{
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+uint16_t float_to_bf16(float f)
+{
+    uint32_t bits = float_bits(f);
+    if ((bits & 0x7fffffff) > 0x7f800000)
+    {
+        return (bits >> 16) | 0x40; // keep NaN a quiet NaN
+    }
+    // round to nearest even, overflows carry into the exponent up to infinity
+    return (bits + 0x7fff + ((bits >> 16) & 1)) >> 16;
+}
+
+float bf16_to_float(uint16_t h)
+{
+    return bits_float((uint32_t)h << 16);
+}
+
+uint16_t float_to_fp16(float f)
+{
+    uint32_t bits = float_bits(f);
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t abs = bits & 0x7fffffff;
+    if (abs > 0x7f800000)
+    {
+        return sign | 0x7e00;
+    }
+    if (abs >= 0x477ff000)
+    {
+        return sign | 0x7c00; // 65520 and above round to infinity
+    }
+    if (abs >= 0x38800000)
+    {
+        // rebias the exponent and round the 13 dropped bits to nearest even
+        uint32_t rebiased = abs - (112u << 23);
+        return sign | ((rebiased + 0xfff + ((rebiased >> 13) & 1)) >> 13);
+    }
+    // subnormal: the mantissa counts multiples of 2^-24
+    return sign | (uint16_t)nearbyintf(bits_float(abs) * 0x1p24f);
+}
+
+float fp16_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    if (exponent == 0)
+    {
+        float value = mantissa * 0x1p-24f;
+        return sign ? -value : value;
+    }
+    if (exponent == 31)
+    {
+        return bits_float(sign | 0x7f800000 | (mantissa << 13));
+    }
+    return bits_float(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
+
+uint16_t to_half(Precision precision, float f)
+{
+    return precision == PRECISION_BF16 ? float_to_bf16(f) : float_to_fp16(f);
+}
+
+float from_half(Precision precision, uint16_t h)
+{
+    return precision == PRECISION_BF16 ? bf16_to_float(h) : fp16_to_float(h);
+}
+
+// eight 16-bit values loaded from arbitrarily aligned addresses, widened to fp32
+typedef uint16_t v8h_unaligned __attribute__((vector_size(16), aligned(2), may_alias));
+typedef uint32_t v8u __attribute__((vector_size(32)));
+typedef float v8f __attribute__((vector_size(32)));
+
+#define BF16_TO_V8F(p) ((v8f)(__builtin_convertvector(*(const v8h_unaligned *)(p), v8u) << 16))
+#define SUM_V8F(v) ((((v)[0] + (v)[1]) + ((v)[2] + (v)[3])) + (((v)[4] + (v)[5]) + ((v)[6] + (v)[7])))
+
+// dot product of n 16-bit weights and activations with fp32 accumulation
+typedef float (*HalfDot)(const uint16_t *w, const uint16_t *x, int n);
+
+// y += a * x for n 16-bit values x
+typedef void (*HalfAxpy)(float a, const uint16_t *x, float *y, int n);
+
+float dot_bf16(const uint16_t *w, const uint16_t *x, int n)
+{
+    v8f acc = {0};
+    int j = 0;
+    for (; j + 8 <= n; j += 8)
+    {
+        acc += BF16_TO_V8F(w + j) * BF16_TO_V8F(x + j);
+    }
+    float sum = SUM_V8F(acc);
+    for (; j < n; j++)
+    {
+        sum += bf16_to_float(w[j]) * bf16_to_float(x[j]);
+    }
+    return sum;
+}
+
+void axpy_bf16(float a, const uint16_t *x, float *y, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        v8f sum = BF16_TO_V8F(x + i) * a;
+        for (int k = 0; k < 8; k++)
+        {
+            y[i + k] += sum[k];
+        }
+    }
+    for (; i < n; i++)
+    {
+        y[i] += a * bf16_to_float(x[i]);
+    }
+}
+
+float dot_fp16(const uint16_t *w, const uint16_t *x, int n)
+{
+    float sum = 0;
+    for (int j = 0; j < n; j++)
+    {
+        sum += fp16_to_float(w[j]) * fp16_to_float(x[j]);
+    }
+    return sum;
+}
+
+void axpy_fp16(float a, const uint16_t *x, float *y, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        y[i] += a * fp16_to_float(x[i]);
+    }
+}
+
+#if defined(__x86_64__)
+
+// pairs of bf16 products accumulated by the VDPBF16PS instruction
+__attribute__((target("avx512f,avx512bf16"))) float dot_bf16_avx512(const uint16_t *w, const uint16_t *x, int n)
+{
+    __m512 acc = _mm512_setzero_ps();
+    int j = 0;
+    for (; j + 32 <= n; j += 32)
+    {
+        __m512i w_bits = _mm512_loadu_si512(w + j);
+        __m512i x_bits = _mm512_loadu_si512(x + j);
+        acc = _mm512_dpbf16_ps(acc, (__m512bh)w_bits, (__m512bh)x_bits);
+    }
+    float sum = _mm512_reduce_add_ps(acc);
+    for (; j < n; j++)
+    {
+        sum += bf16_to_float(w[j]) * bf16_to_float(x[j]);
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma,f16c"))) float dot_fp16_f16c(const uint16_t *w, const uint16_t *x, int n)
+{
+    __m256 acc = _mm256_setzero_ps();
+    int j = 0;
+    for (; j + 8 <= n; j += 8)
+    {
+        __m256 w_values = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(w + j)));
+        __m256 x_values = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(x + j)));
+        acc = _mm256_fmadd_ps(w_values, x_values, acc);
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, acc);
+    float sum = SUM_V8F(lanes);
+    for (; j < n; j++)
+    {
+        sum += fp16_to_float(w[j]) * fp16_to_float(x[j]);
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma,f16c"))) void axpy_fp16_f16c(float a, const uint16_t *x, float *y, int n)
+{
+    __m256 factor = _mm256_set1_ps(a);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 x_values = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(x + i)));
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(factor, x_values, _mm256_loadu_ps(y + i)));
+    }
+    for (; i < n; i++)
+    {
+        y[i] += a * fp16_to_float(x[i]);
+    }
+}
+
+#endif
+
+typedef struct
+{
+    Precision precision;
+    HalfDot dot;
+    HalfAxpy axpy;
+    uint16_t **weights;       // [l] 16-bit copy of the master weights
+    uint16_t ***neurons;      // [t][l] activations of the current sample of slice t
+    uint16_t ***deltas;       // [t][l] error terms, multiplied by the loss scale
+    float ***weights_grad;    // [t][l] scaled gradient sums of slice t
+    float ***biases_grad;     // [t][l]
+    float **rows;             // [t] scratch row of fp32 values
+    int n_threads;
+    double loss_scale;
+    int stable_steps;         // steps since the loss scale changed
+} MixedPrecision;
+
+// picks the fastest kernels the CPU supports
+void mixed_select_kernels(MixedPrecision *mixed)
+{
+    mixed->dot = mixed->precision == PRECISION_BF16 ? dot_bf16 : dot_fp16;
+    mixed->axpy = mixed->precision == PRECISION_BF16 ? axpy_bf16 : axpy_fp16;
+#if defined(__x86_64__)
+    if (mixed->precision == PRECISION_BF16 && __builtin_cpu_supports("avx512bf16"))
+    {
+        mixed->dot = dot_bf16_avx512;
+    }
+    if (mixed->precision == PRECISION_FP16 && __builtin_cpu_supports("f16c") &&
+        __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        mixed->dot = dot_fp16_f16c;
+        mixed->axpy = axpy_fp16_f16c;
+    }
+#endif
+}
+
+// rounds the master weights to the 16-bit copy
+void mixed_refresh(MixedPrecision *mixed, Network network)
+{
+    for (int l = 1; l < network.ndim; l++)
+    {
+        for (int i = 0; i < network.dims[l] * network.dims[l - 1]; i++)
+        {
+            mixed->weights[l][i] = to_half(mixed->precision, network.weights[l][i]);
+        }
+    }
+}
+
+MixedPrecision *mixed_create(Network network, int n_threads, Precision precision)
+{
+    int ndim = network.ndim;
+    int *dims = network.dims;
+    int max_dim = 0;
+    for (int l = 0; l < ndim; l++)
+    {
+        max_dim = dims[l] > max_dim ? dims[l] : max_dim;
+    }
+
+    MixedPrecision *mixed = malloc(sizeof(MixedPrecision));
+    *mixed = (MixedPrecision){
+        .precision = precision,
+        .weights = malloc(ndim * sizeof(uint16_t *)),
+        .neurons = malloc(n_threads * sizeof(uint16_t **)),
+        .deltas = malloc(n_threads * sizeof(uint16_t **)),
+        .weights_grad = malloc(n_threads * sizeof(float **)),
+        .biases_grad = malloc(n_threads * sizeof(float **)),
+        .rows = malloc(n_threads * sizeof(float *)),
+        .n_threads = n_threads,
+        .loss_scale = precision == PRECISION_FP16 ? 1024 : 1,
+    };
+    mixed_select_kernels(mixed);
+
+    for (int l = 1; l < ndim; l++)
+    {
+        mixed->weights[l] = malloc(dims[l] * dims[l - 1] * sizeof(uint16_t));
+    }
+    for (int t = 0; t < n_threads; t++)
+    {
+        mixed->neurons[t] = malloc(ndim * sizeof(uint16_t *));
+        mixed->deltas[t] = malloc(ndim * sizeof(uint16_t *));
+        mixed->weights_grad[t] = malloc(ndim * sizeof(float *));
+        mixed->biases_grad[t] = malloc(ndim * sizeof(float *));
+        mixed->rows[t] = malloc(max_dim * sizeof(float));
+        mixed->neurons[t][0] = malloc(dims[0] * sizeof(uint16_t));
+        for (int l = 1; l < ndim; l++)
+        {
+            mixed->neurons[t][l] = malloc(dims[l] * sizeof(uint16_t));
+            mixed->deltas[t][l] = malloc(dims[l] * sizeof(uint16_t));
+            mixed->weights_grad[t][l] = malloc(dims[l] * dims[l - 1] * sizeof(float));
+            mixed->biases_grad[t][l] = malloc(dims[l] * sizeof(float));
+        }
+    }
+
+    mixed_refresh(mixed, network);
+    return mixed;
+}
+
+void mixed_destroy(MixedPrecision *mixed, Network network)
+{
+    for (int t = 0; t < mixed->n_threads; t++)
+    {
+        free(mixed->neurons[t][0]);
+        for (int l = 1; l < network.ndim; l++)
+        {
+            free(mixed->neurons[t][l]);
+            free(mixed->deltas[t][l]);
+            free(mixed->weights_grad[t][l]);
+            free(mixed->biases_grad[t][l]);
+        }
+        free(mixed->neurons[t]);
+        free(mixed->deltas[t]);
+        free(mixed->weights_grad[t]);
+        free(mixed->biases_grad[t]);
+        free(mixed->rows[t]);
+    }
+    for (int l = 1; l < network.ndim; l++)
+    {
+        free(mixed->weights[l]);
+    }
+    free(mixed->weights);
+    free(mixed->neurons);
+    free(mixed->deltas);
+    free(mixed->weights_grad);
+    free(mixed->biases_grad);
+    free(mixed->rows);
+    free(mixed);
+}
+
+void mixed_zero_gradients(MixedPrecision *mixed, int t, Network network)
+{
+    for (int l = 1; l < network.ndim; l++)
+    {
+        memset(mixed->weights_grad[t][l], 0, network.dims[l] * network.dims[l - 1] * sizeof(float));
+        memset(mixed->biases_grad[t][l], 0, network.dims[l] * sizeof(float));
+    }
+}
+
+/*
+ * Also stores the derivative a * (1 - a) of every activation in the error
+ * terms. Computed from the fp32 activation it keeps its relative precision,
+ * while the difference of a saturated 16-bit activation and one would not.
+ */
+void forward_mixed(MixedPrecision *mixed, int t, Network network, double *inputs)
+{
+    Precision precision = mixed->precision;
+    int *dims = network.dims;
+    uint16_t **a = mixed->neurons[t];
+    uint16_t **d = mixed->deltas[t];
+
+    for (int j = 0; j < dims[0]; j++)
+    {
+        a[0][j] = to_half(precision, inputs[j]);
+    }
+    for (int l = 1; l < network.ndim; l++)
+    {
+        for (int i = 0; i < dims[l]; i++)
+        {
+            float sum = mixed->dot(mixed->weights[l] + i * dims[l - 1], a[l - 1], dims[l - 1]) + (float)network.biases[l][i];
+            float activation = 1.0f / (1.0f + expf(-sum));
+            a[l][i] = to_half(precision, activation);
+            d[l][i] = to_half(precision, activation * (1 - activation));
+        }
+    }
+}
+
+/*
+ * Forward and backward pass of one sample on slice t, adds its gradients
+ * (multiplied by the loss scale) to the slice's sums and returns its loss.
+ */
+double mixed_sample(MixedPrecision *mixed, int t, Network network, double *inputs, double *label)
+{
+    Precision precision = mixed->precision;
+    int ndim = network.ndim;
+    int *dims = network.dims;
+    uint16_t **a = mixed->neurons[t];
+    uint16_t **d = mixed->deltas[t];
+    float *row = mixed->rows[t];
+    float scale = mixed->loss_scale;
+
+    forward_mixed(mixed, t, network, inputs);
+
+    double loss = 0;
+    for (int i = 0; i < dims[ndim - 1]; i++)
+    {
+        float output = from_half(precision, a[ndim - 1][i]);
+        loss += (output - label[i]) * (output - label[i]);
+        float derivative = from_half(precision, d[ndim - 1][i]);
+        d[ndim - 1][i] = to_half(precision, scale * 2 * (output - (float)label[i]) * derivative);
+    }
+
+    for (int l = ndim - 1; l > 0; l--)
+    {
+        // error term of the layer below, accumulated row by row as in backward_delta
+        if (l > 1)
+        {
+            memset(row, 0, dims[l - 1] * sizeof(float));
+            for (int i = 0; i < dims[l]; i++)
+            {
+                mixed->axpy(from_half(precision, d[l][i]), mixed->weights[l] + i * dims[l - 1], row, dims[l - 1]);
+            }
+            for (int j = 0; j < dims[l - 1]; j++)
+            {
+                d[l - 1][j] = to_half(precision, row[j] * from_half(precision, d[l - 1][j]));
+            }
+        }
+
+        for (int j = 0; j < dims[l - 1]; j++)
+        {
+            row[j] = from_half(precision, a[l - 1][j]);
+        }
+        for (int i = 0; i < dims[l]; i++)
+        {
+            float delta = from_half(precision, d[l][i]);
+            float *grad = mixed->weights_grad[t][l] + i * dims[l - 1];
+            mixed->biases_grad[t][l][i] += delta;
+            for (int j = 0; j < dims[l - 1]; j++)
+            {
+                grad[j] += delta * row[j];
+            }
+        }
+    }
+
+    return loss;
+}
+
+/*
+ * Called with the summed gradients of a step before the update. Returns 0 if
+ * they overflowed, in which case the step has to be skipped, and adapts the
+ * loss scale.
+ */
+int mixed_check_gradients(MixedPrecision *mixed, Network network, double **weights_grad, double **biases_grad)
+{
+    if (mixed->precision != PRECISION_FP16)
+    {
+        return 1;
+    }
+
+    int finite = 1;
+    for (int l = 1; finite && l < network.ndim; l++)
+    {
+        for (int i = 0; i < network.dims[l] * network.dims[l - 1]; i++)
+        {
+            finite &= isfinite(weights_grad[l][i]);
+        }
+        for (int i = 0; i < network.dims[l]; i++)
+        {
+            finite &= isfinite(biases_grad[l][i]);
+        }
+    }
+
+    if (!finite)
+    {
+        mixed->loss_scale /= 2;
+        mixed->stable_steps = 0;
+        return 0;
+    }
+    if (++mixed->stable_steps == 1000)
+    {
+        mixed->loss_scale *= 2;
+        mixed->stable_steps = 0;
+    }
+    return 1;
+}
+
+/*
+ * ACTIVATION CHECKPOINTING
+ *
+ * A batched slice runs every layer over all of its samples at once, in tiles
+ * of samples that share each weight row like forward_batch, and so has
+ * to keep the activations of the whole slice for the backward pass. Only
+ * every k-th layer is stored during the forward pass. The backward pass walks
+ * the segments between these checkpoints from the top and recomputes the
+ * activations inside a segment from the checkpoint below it, so k slots hold
+ * the layers of whichever segment is being differentiated.
+ */
+
+typedef struct
+{
+    int every;         // layers between checkpoints
+    int tile;          // samples per register tile of the forward pass
+    int capacity;      // samples the buffers hold
+    double **stored;   // [l] activations of checkpoint l for the whole slice, NULL for other layers
+    double **slots;    // [(l - 1) % every] activations of the layers between checkpoints
+    double *deltas[2]; // error terms of a layer and of the one below it
+    double **inputs;   // rows of the images of the slice
+    double **rows;     // rows of the activations of one layer
+} Checkpoints;
+
+int is_checkpoint(Network network, int l, int every)
+{
+    return l < network.ndim - 1 && l % every == 0;
+}
+
+// widths of the layers in slot s, and of the widest layer
+int checkpoint_slot_width(Network network, int every, int s)
+{
+    int width = 0;
+    for (int l = 1; l < network.ndim; l++)
+    {
+        if ((s < 0 || (!is_checkpoint(network, l, every) && (l - 1) % every == s)) && network.dims[l] > width)
+        {
+            width = network.dims[l];
+        }
+    }
+    return width;
+}
+
+// bytes of activations and error terms a slice of n samples keeps
+size_t checkpoint_bytes(Network network, int every, int n)
+{
+    size_t size = 2 * (size_t)checkpoint_slot_width(network, every, -1);
+    for (int l = 1; l < network.ndim; l++)
+    {
+        size += is_checkpoint(network, l, every) ? network.dims[l] : 0;
+    }
+    for (int s = 0; s < every; s++)
+    {
+        size += checkpoint_slot_width(network, every, s);
+    }
+    return size * n * sizeof(double);
+}
+
+// multiply-adds per sample the backward pass spends recomputing activations
+long checkpoint_recompute_flops(Network network, int every)
+{
+    // the layers of the top segment are still in their slots after the forward pass
+    int last = (network.ndim - 2) / every * every;
+    long flops = 0;
+    for (int l = 1; l < last; l++)
+    {
+        flops += is_checkpoint(network, l, every) ? 0 : (long)network.dims[l] * network.dims[l - 1];
+    }
+    return flops;
+}
+
+void checkpoints_free(Checkpoints checkpoints, Network network)
+{
+    for (int l = 1; checkpoints.stored != NULL && l < network.ndim; l++)
+    {
+        free(checkpoints.stored[l]);
+    }
+    for (int s = 0; s < checkpoints.every; s++)
+    {
+        free(checkpoints.slots[s]);
+    }
+    free(checkpoints.stored);
+    free(checkpoints.slots);
+    free(checkpoints.deltas[0]);
+    free(checkpoints.deltas[1]);
+    free(checkpoints.inputs);
+    free(checkpoints.rows);
+}
+
+// grows the buffers to n samples, on the thread that uses them
+void checkpoints_reserve(Checkpoints *checkpoints, Network network, int every, int n)
+{
+    if (n <= checkpoints->capacity && every == checkpoints->every)
+    {
+        return;
+    }
+    checkpoints_free(*checkpoints, network);
+
+    Checkpoints c = {
+        .every = every,
+        .tile = checkpoints->tile,
+        .capacity = n,
+        .stored = calloc(network.ndim, sizeof(double *)),
+        .slots = malloc(every * sizeof(double *)),
+        .inputs = malloc(n * sizeof(double *)),
+        .rows = malloc(n * sizeof(double *)),
+    };
+    for (int l = 1; l < network.ndim; l++)
+    {
+        c.stored[l] = is_checkpoint(network, l, every) ? malloc((size_t)n * network.dims[l] * sizeof(double)) : NULL;
+    }
+    for (int s = 0; s < every; s++)
+    {
+        c.slots[s] = malloc((size_t)n * checkpoint_slot_width(network, every, s) * sizeof(double));
+    }
+    int widest = checkpoint_slot_width(network, every, -1);
+    c.deltas[0] = malloc((size_t)n * widest * sizeof(double));
+    c.deltas[1] = malloc((size_t)n * widest * sizeof(double));
+    *checkpoints = c;
+}
+
+// rows of the activations of layer l, the inputs for layer 0
+double **checkpoint_rows(Checkpoints *c, Network network, int l, int n)
+{
+    if (l == 0)
+    {
+        return c->inputs;
+    }
+    double *activations = is_checkpoint(network, l, c->every) ? c->stored[l] : c->slots[(l - 1) % c->every];
+    for (int b = 0; b < n; b++)
+    {
+        c->rows[b] = activations + (size_t)b * network.dims[l];
+    }
+    return c->rows;
+}
+
+// forward pass of layers first to last over the slice, from the activations of layer first - 1
+void checkpoint_forward(Checkpoints *c, Network network, int first, int last, int n)
+{
+    for (int l = first; l <= last; l++)
+    {
+        double **x = checkpoint_rows(c, network, l - 1, n);
+        double *y = is_checkpoint(network, l, c->every) ? c->stored[l] : c->slots[(l - 1) % c->every];
+        forward_layer_batch(c->tile, n, network.dims[l - 1], network.dims[l], network.weights[l], network.biases[l], x,
+                            y);
+    }
+}
+
+// w_grad[i] += sum of delta[b][i] * x[b] and b_grad[i] += sum of delta[b][i], four samples at a time
+void accumulate_layer_batch(int n, int n_in, int n_out, double *delta, double **x, double *w_grad, double *b_grad)
+{
+    for (int i = 0; i < n_out; i++)
+    {
+        double *grad = w_grad + (size_t)i * n_in;
+        int b = 0;
+        for (; b + 4 <= n; b += 4)
+        {
+            double d0 = delta[(size_t)b * n_out + i], d1 = delta[(size_t)(b + 1) * n_out + i];
+            double d2 = delta[(size_t)(b + 2) * n_out + i], d3 = delta[(size_t)(b + 3) * n_out + i];
+            double *x0 = x[b], *x1 = x[b + 1], *x2 = x[b + 2], *x3 = x[b + 3];
+            for (int j = 0; j < n_in; j++)
+            {
+                grad[j] += (d0 * x0[j] + d1 * x1[j]) + (d2 * x2[j] + d3 * x3[j]);
+            }
+            b_grad[i] += (d0 + d1) + (d2 + d3);
+        }
+        for (; b < n; b++)
+        {
+            double d = delta[(size_t)b * n_out + i];
+            for (int j = 0; j < n_in; j++)
+            {
+                grad[j] += d * x[b][j];
+            }
+            b_grad[i] += d;
+        }
+    }
+}
+
+// below[b][j] = (sum of w[i][j] * delta[b][i]) * a[b][j] * (1 - a[b][j]), the error terms of the layer below
+void backward_layer_batch(int n, int n_in, int n_out, double *w, double *delta, double **a, double *below)
+{
+    memset(below, 0, (size_t)n * n_in * sizeof(double));
+    int b = 0;
+    for (; b + 4 <= n; b += 4)
+    {
+        double *y0 = below + (size_t)b * n_in, *y1 = y0 + n_in, *y2 = y1 + n_in, *y3 = y2 + n_in;
+        for (int i = 0; i < n_out; i++)
+        {
+            double *row = w + (size_t)i * n_in;
+            double d0 = delta[(size_t)b * n_out + i], d1 = delta[(size_t)(b + 1) * n_out + i];
+            double d2 = delta[(size_t)(b + 2) * n_out + i], d3 = delta[(size_t)(b + 3) * n_out + i];
+            for (int j = 0; j < n_in; j++)
+            {
+                y0[j] += row[j] * d0;
+                y1[j] += row[j] * d1;
+                y2[j] += row[j] * d2;
+                y3[j] += row[j] * d3;
+            }
+        }
+    }
+    for (; b < n; b++)
+    {
+        double *y = below + (size_t)b * n_in;
+        for (int i = 0; i < n_out; i++)
+        {
+            double *row = w + (size_t)i * n_in;
+            double d = delta[(size_t)b * n_out + i];
+            for (int j = 0; j < n_in; j++)
+            {
+                y[j] += row[j] * d;
+            }
+        }
+    }
+    for (b = 0; b < n; b++)
+    {
+        double *y = below + (size_t)b * n_in;
+        for (int j = 0; j < n_in; j++)
+        {
+            y[j] *= a[b][j] * (1 - a[b][j]);
+        }
+    }
+}
+
+void print_checkpointing(Network network, int every, int n)
+{
+    long forward_flops = 0;
+    for (int l = 1; l < network.ndim; l++)
+    {
+        forward_flops += (long)network.dims[l] * network.dims[l - 1];
+    }
+    printf("activations of %d samples per thread: %.1f MB with a checkpoint every %d layers, %.1f MB keeping all\n", n,
+           checkpoint_bytes(network, every, n) / 1e6, every, checkpoint_bytes(network, 1, n) / 1e6);
+    printf("recomputed in the backward pass: %.1f%% of the forward pass\n",
+           100.0 * checkpoint_recompute_flops(network, every) / forward_flops);
+}
+
+/*
+ * DATA-PARALLEL TRAINING
+ *
+ * The batch is split into one contiguous slice per thread. Every slice
+ * accumulates its gradients into its own buffers, which are then summed with
+ * a pairwise tree whose shape only depends on the number of slices. Together
+ * with the counter-based RNG this makes training bit-identical for a given
+ * seed and thread count, regardless of thread scheduling.
+ */
+
+typedef struct
+{
+    Network network;
+    Network *forks;
+    double ***weights_grad;
+    double ***biases_grad;
+    double **factors_grad; // [layer] gradients of the two factors of factored layers, see update_factors
+    double *losses;
+    int *pending;
+    int n_threads;
+    int pipeline;
+    Communicator *comm;
+    double *packed;
+    MixedPrecision *mixed;
+    int checkpoint_every; // batched slices with a checkpoint every this many layers, 0 for one sample at a time
+    Checkpoints *checkpoints;
+} Trainer;
+
+typedef struct
+{
+    Trainer *trainer;
+    Image *images;
+    double factor;
+    int batch_size;
+    int n_slices;
+    int stride;
+} TrainerJob;
+
+// zeroes the gradient buffers of slice t on the worker that runs slice t, placing them on its node
+void trainer_touch(void *context, int t)
+{
+    Trainer *trainer = context;
+    Network network = trainer->network;
+    for (int l = 1; l < network.ndim; l++)
+    {
+        size_t size = (size_t)network.dims[l] * network.dims[l - 1];
+        memset(trainer->weights_grad[t][l], 0, size * sizeof(double));
+        memset(trainer->forks[t].weights_grad[l], 0, size * sizeof(double));
+    }
+}
+
+Trainer trainer_create(Network network, int n_threads)
+{
+    Tuning tuning;
+    tuning_lookup(network, &tuning);
+    Trainer trainer = {
+        .network = network,
+        .forks = malloc(n_threads * sizeof(Network)),
+        .weights_grad = malloc(n_threads * sizeof(double **)),
+        .biases_grad = malloc(n_threads * sizeof(double **)),
+        .factors_grad = calloc(network.ndim, sizeof(double *)),
+        .losses = malloc(n_threads * sizeof(double)),
+        .pending = malloc(network.ndim * sizeof(int)),
+        .n_threads = n_threads,
+        .pipeline = tuning.pipeline,
+        .comm = NULL,
+        .packed = NULL,
+        .mixed = NULL,
+        .checkpoint_every = 0,
+        .checkpoints = calloc(n_threads, sizeof(Checkpoints)),
+    };
+    for (int t = 0; t < n_threads; t++)
+    {
+        trainer.checkpoints[t].tile = tuning.tile;
+        trainer.forks[t] = network_fork(network);
+        trainer.weights_grad[t] = malloc(network.ndim * sizeof(double *));
+        trainer.biases_grad[t] = malloc(network.ndim * sizeof(double *));
+        for (int l = 1; l < network.ndim; l++)
+        {
+            trainer.weights_grad[t][l] = large_array((size_t)network.dims[l] * network.dims[l - 1]);
+            trainer.biases_grad[t][l] = malloc(network.dims[l] * sizeof(double));
+        }
+    }
+    for (int l = 1; l < network.ndim; l++)
+    {
+        if (network.ranks[l] > 0)
+        {
+            trainer.factors_grad[l] = malloc((size_t)(network.dims[l] + network.dims[l - 1]) * network.ranks[l] * sizeof(double));
+        }
+    }
+    parallel_run(n_threads, trainer_touch, &trainer);
+    return trainer;
+}
+
+void trainer_destroy(Trainer trainer)
+{
+    for (int t = 0; t < trainer.n_threads; t++)
+    {
+        for (int l = 1; l < trainer.network.ndim; l++)
+        {
+            large_array_free(trainer.weights_grad[t][l], (size_t)trainer.network.dims[l] * trainer.network.dims[l - 1]);
+            free(trainer.biases_grad[t][l]);
+        }
+        free(trainer.weights_grad[t]);
+        free(trainer.biases_grad[t]);
+        network_fork_destroy(trainer.forks[t]);
+        checkpoints_free(trainer.checkpoints[t], trainer.network);
+    }
+    for (int l = 1; l < trainer.network.ndim; l++)
+    {
+        free(trainer.factors_grad[l]);
+    }
+    free(trainer.factors_grad);
+    free(trainer.checkpoints);
+    free(trainer.forks);
+    free(trainer.weights_grad);
+    free(trainer.biases_grad);
+    free(trainer.losses);
+    free(trainer.pending);
+    free(trainer.packed);
+    if (trainer.mixed != NULL)
+    {
+        mixed_destroy(trainer.mixed, trainer.network);
+    }
+}
+
+void accumulate_slice(void *context, int t)
+{
+    TrainerJob *job = context;
+    Trainer *trainer = job->trainer;
+    Network fork = trainer->forks[t];
+    int ndim = fork.ndim;
+    int *dims = fork.dims;
+    double **weights_grad = trainer->weights_grad[t];
+    double **biases_grad = trainer->biases_grad[t];
+
+    for (int l = 1; l < ndim; l++)
+    {
+        memset(weights_grad[l], 0, dims[l] * dims[l - 1] * sizeof(double));
+        memset(biases_grad[l], 0, dims[l] * sizeof(double));
+    }
+
+    int start = t * job->batch_size / job->n_slices;
+    int end = (t + 1) * job->batch_size / job->n_slices;
+
+    double loss = 0;
+    for (int b = start; b < end; b++)
+    {
+        forward(fork, job->images[b].data);
+        loss += compute_loss(fork, job->images[b].label);
+
+        backward(fork, job->images[b].label);
+
+        for (int l = 1; l < ndim; l++)
+        {
+            for (int i = 0; i < dims[l]; i++)
+            {
+                biases_grad[l][i] += fork.biases_grad[l][i];
+                for (int j = 0; j < dims[l - 1]; j++)
+                {
+                    int idx = i * dims[l - 1] + j;
+                    weights_grad[l][idx] += fork.weights_grad[l][idx];
+                }
+            }
+        }
+    }
+    trainer->losses[t] = loss;
+}
+
+// accumulate_slice with 16-bit weights and activations, see MIXED PRECISION
+void accumulate_slice_mixed(void *context, int t)
+{
+    TrainerJob *job = context;
+    Trainer *trainer = job->trainer;
+    MixedPrecision *mixed = trainer->mixed;
+    Network network = trainer->network;
+    int *dims = network.dims;
+
+    mixed_zero_gradients(mixed, t, network);
+
+    int start = t * job->batch_size / job->n_slices;
+    int end = (t + 1) * job->batch_size / job->n_slices;
+
+    double loss = 0;
+    for (int b = start; b < end; b++)
+    {
+        loss += mixed_sample(mixed, t, network, job->images[b].data, job->images[b].label);
+    }
+
+    // the reduction and the update run on the double sums
+    for (int l = 1; l < network.ndim; l++)
+    {
+        for (int i = 0; i < dims[l] * dims[l - 1]; i++)
+        {
+            trainer->weights_grad[t][l][i] = mixed->weights_grad[t][l][i];
+        }
+        for (int i = 0; i < dims[l]; i++)
+        {
+            trainer->biases_grad[t][l][i] = mixed->biases_grad[t][l][i];
+        }
+    }
+    trainer->losses[t] = loss;
+}
+
+// the slice as one batch through every layer, see ACTIVATION CHECKPOINTING
+void accumulate_slice_checkpointed(void *context, int t)
+{
+    TrainerJob *job = context;
+    Trainer *trainer = job->trainer;
+    Network network = trainer->network;
+    int top = network.ndim - 1;
+    int *dims = network.dims;
+    double **weights_grad = trainer->weights_grad[t];
+    double **biases_grad = trainer->biases_grad[t];
+    Checkpoints *c = trainer->checkpoints + t;
+
+    int start = t * job->batch_size / job->n_slices;
+    int n = (t + 1) * job->batch_size / job->n_slices - start;
+    checkpoints_reserve(c, network, trainer->checkpoint_every, n);
+    for (int b = 0; b < n; b++)
+    {
+        c->inputs[b] = job->images[start + b].data;
+    }
+    for (int l = 1; l <= top; l++)
+    {
+        memset(weights_grad[l], 0, dims[l] * dims[l - 1] * sizeof(double));
+        memset(biases_grad[l], 0, dims[l] * sizeof(double));
+    }
+
+    checkpoint_forward(c, network, 1, top, n);
+
+    double loss = 0;
+    double **outputs = checkpoint_rows(c, network, top, n);
+    for (int b = 0; b < n; b++)
+    {
+        double *label = job->images[start + b].label;
+        for (int i = 0; i < dims[top]; i++)
+        {
+            double a = outputs[b][i];
+            loss += (a - label[i]) * (a - label[i]);
+            c->deltas[0][(size_t)b * dims[top] + i] = 2 * (a - label[i]) * a * (1 - a);
+        }
+    }
+
+    // segments from the top, each from the checkpoint below it
+    int current = 0;
+    for (int high = top; high > 0;)
+    {
+        int low = (high - 1) / c->every * c->every;
+        if (high < top)
+        {
+            checkpoint_forward(c, network, low + 1, high - 1, n);
+        }
+        for (int l = high; l > low; l--)
+        {
+            double **below = checkpoint_rows(c, network, l - 1, n);
+            accumulate_layer_batch(n, dims[l - 1], dims[l], c->deltas[current], below, weights_grad[l], biases_grad[l]);
+            if (l > 1)
+            {
+                backward_layer_batch(n, dims[l - 1], dims[l], network.weights[l], c->deltas[current], below, c->deltas[1 - current]);
+                current = 1 - current;
+            }
+        }
+        high = low;
+    }
+    trainer->losses[t] = loss;
+}
+
+// adds slice (2 * pair + 1) * stride into slice 2 * pair * stride
+void reduce_pair(void *context, int pair)
+{
+    TrainerJob *job = context;
+    Trainer *trainer = job->trainer;
+    int *dims = trainer->network.dims;
+    int dst = 2 * pair * job->stride;
+    int src = dst + job->stride;
+
+    for (int l = 1; l < trainer->network.ndim; l++)
+    {
+        for (int i = 0; i < dims[l]; i++)
+        {
+            trainer->biases_grad[dst][l][i] += trainer->biases_grad[src][l][i];
+        }
+        for (int i = 0; i < dims[l] * dims[l - 1]; i++)
+        {
+            trainer->weights_grad[dst][l][i] += trainer->weights_grad[src][l][i];
+        }
+    }
+    trainer->losses[dst] += trainer->losses[src];
+}
+
+/*
+ * Gradient step on the factors of layer l, given the gradient of its weights:
+ * for weights = left * right, left moves along grad * right^T and right along
+ * left^T * grad. The weights are then recomputed from the factors. The
+ * gradients of the factors go to factors_grad, (n_out + n_in) * rank doubles.
+ */
+void update_factors(Network network, int l, double *weights_grad, double *factors_grad, double factor)
+{
+    int rank = network.ranks[l];
+    int n_in = network.dims[l - 1];
+    int n_out = network.dims[l];
+    double *left_grad = factors_grad;
+    double *right_grad = factors_grad + (size_t)n_out * rank;
+    memset(right_grad, 0, (size_t)rank * n_in * sizeof(double));
+    for (int i = 0; i < n_out; i++)
+    {
+        double *grad = weights_grad + (size_t)i * n_in;
+        for (int k = 0; k < rank; k++)
+        {
+            double *right = network.right[l] + (size_t)k * n_in;
+            double *right_row = right_grad + (size_t)k * n_in;
+            double left = network.left[l][(size_t)i * rank + k];
+            double sum = 0;
+            for (int j = 0; j < n_in; j++)
+            {
+                sum += grad[j] * right[j];
+                right_row[j] += left * grad[j];
+            }
+            left_grad[(size_t)i * rank + k] = sum;
+        }
+    }
+    for (size_t i = 0; i < (size_t)n_out * rank; i++)
+    {
+        network.left[l][i] -= factor * left_grad[i];
+    }
+    for (size_t i = 0; i < (size_t)rank * n_in; i++)
+    {
+        network.right[l][i] -= factor * right_grad[i];
+    }
+    network_expand_layer(network, l);
+}
+
+void update_layer(Network network, int l, double **weights_grad, double **biases_grad, double **factors_grad, double factor)
+{
+    int *dims = network.dims;
+    if (network.ranks[l] > 0)
+    {
+        for (int i = 0; i < dims[l]; i++)
+        {
+            network.biases[l][i] -= factor * biases_grad[l][i];
+        }
+        update_factors(network, l, weights_grad[l], factors_grad[l], factor);
+        return;
+    }
+    for (int i = 0; i < dims[l]; i++)
+    {
+        network.biases[l][i] -= factor * biases_grad[l][i];
+        for (int j = 0; j < dims[l - 1]; j++)
+        {
+            int idx = i * dims[l - 1] + j;
+            network.weights[l][idx] -= factor * weights_grad[l][idx];
+        }
+    }
+    if (network.levels[l] > 0)
+    {
+        // latent weights beyond [-1, 1] would no longer flip their sign, see QUANTIZED LAYERS
+        for (int i = 0; i < dims[l] * dims[l - 1]; i++)
+        {
+            network.weights[l][i] = fmax(-1, fmin(1, network.weights[l][i]));
+        }
+        network_quantize_layer(network, l);
+    }
+}
+
+/*
+ * LAYER-WISE PIPELINE
+ *
+ * During the last sample of its slice, a thread reports a layer as finished
+ * once it has accumulated the layer's gradients and no longer needs its
+ * weights, i.e. after computing the error term of the layer below. The last
+ * thread to report a layer reduces that layer's gradients and updates its
+ * parameters right away, while the other threads are still back-propagating
+ * through the lower layers. The reduction uses the same tree as the
+ * non-pipelined path, so both produce identical models.
+ */
+
+void reduce_and_update_layer(TrainerJob *job, int l)
+{
+    Trainer *trainer = job->trainer;
+    int *dims = trainer->network.dims;
+
+    for (int stride = 1; stride < job->n_slices; stride *= 2)
+    {
+        for (int dst = 0; dst + stride < job->n_slices; dst += 2 * stride)
+        {
+            double *weights_dst = trainer->weights_grad[dst][l];
+            double *weights_src = trainer->weights_grad[dst + stride][l];
+            for (int i = 0; i < dims[l]; i++)
+            {
+                trainer->biases_grad[dst][l][i] += trainer->biases_grad[dst + stride][l][i];
+            }
+            for (int i = 0; i < dims[l] * dims[l - 1]; i++)
+            {
+                weights_dst[i] += weights_src[i];
+            }
+        }
+    }
+
+    update_layer(trainer->network, l, trainer->weights_grad[0], trainer->biases_grad[0], trainer->factors_grad, job->factor);
+}
+
+void finish_layer(TrainerJob *job, int l)
+{
+    if (__atomic_sub_fetch(job->trainer->pending + l, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        reduce_and_update_layer(job, l);
+    }
+}
+
+void accumulate_slice_pipelined(void *context, int t)
+{
+    TrainerJob *job = context;
+    Trainer *trainer = job->trainer;
+    Network fork = trainer->forks[t];
+    int ndim = fork.ndim;
+    int *dims = fork.dims;
+    double **weights_grad = trainer->weights_grad[t];
+    double **biases_grad = trainer->biases_grad[t];
+
+    for (int l = 1; l < ndim; l++)
+    {
+        memset(weights_grad[l], 0, dims[l] * dims[l - 1] * sizeof(double));
+        memset(biases_grad[l], 0, dims[l] * sizeof(double));
+    }
+
+    int start = t * job->batch_size / job->n_slices;
+    int end = (t + 1) * job->batch_size / job->n_slices;
+
+    double loss = 0;
+    for (int b = start; b < end; b++)
+    {
+        int is_last = b == end - 1;
+        double *label = job->images[b].label;
+        forward(fork, job->images[b].data);
+        loss += compute_loss(fork, label);
+
+        for (int l = ndim - 1; l > 0; l--)
+        {
+            backward_delta(fork, l, label);
+            if (is_last && l < ndim - 1)
+            {
+                finish_layer(job, l + 1);
+            }
+
+            double *a = layer_inputs(fork, l, fork.neurons[l - 1], fork.scratch);
+            for (int i = 0; i < dims[l]; i++)
+            {
+                double delta = fork.biases_grad[l][i];
+                double *grad = weights_grad[l] + i * dims[l - 1];
+                biases_grad[l][i] += delta;
+                for (int j = 0; j < dims[l - 1]; j++)
+                {
+                    grad[j] += a[j] * delta;
+                }
+            }
+        }
+        if (is_last)
+        {
+            finish_layer(job, 1);
+        }
+    }
+    trainer->losses[t] = loss;
+}
+
+// sums the reduced gradients and the loss of all processes of a distributed job
+void trainer_allreduce(Trainer *trainer)
+{
+    Network network = trainer->network;
+    int size = 1;
+    for (int l = 1; l < network.ndim; l++)
+    {
+        size += network.dims[l] * (network.dims[l - 1] + 1);
+    }
+    if (trainer->packed == NULL)
+    {
+        trainer->packed = malloc(size * sizeof(double));
+    }
+
+    double *p = trainer->packed;
+    for (int l = 1; l < network.ndim; l++)
+    {
+        memcpy(p, trainer->weights_grad[0][l], network.dims[l] * network.dims[l - 1] * sizeof(double));
+        p += network.dims[l] * network.dims[l - 1];
+        memcpy(p, trainer->biases_grad[0][l], network.dims[l] * sizeof(double));
+        p += network.dims[l];
+    }
+    *p = trainer->losses[0];
+
+    allreduce(trainer->comm, trainer->packed, size);
+
+    p = trainer->packed;
+    for (int l = 1; l < network.ndim; l++)
+    {
+        memcpy(trainer->weights_grad[0][l], p, network.dims[l] * network.dims[l - 1] * sizeof(double));
+        p += network.dims[l] * network.dims[l - 1];
+        memcpy(trainer->biases_grad[0][l], p, network.dims[l] * sizeof(double));
+        p += network.dims[l];
+    }
+    trainer->losses[0] = *p;
+}
+
+// exits when the trainer is set up for a pass that cannot train its network
+void trainer_check(Trainer *trainer)
+{
+    // the mixed precision and checkpointed passes train every layer as doubles
+    if (network_quantized(trainer->network) && (trainer->mixed != NULL || trainer->checkpoint_every > 0))
+    {
+        printf("%serror:%s quantized networks only train in double precision without checkpoints\n", RED, RESET);
+        exit(1);
+    }
+    // the checkpointed pass recomputes activations of doubles, the mixed pass has no checkpoints
+    if (trainer->mixed != NULL && trainer->checkpoint_every > 0)
+    {
+        printf("%serror:%s checkpoints only train in double precision\n", RED, RESET);
+        exit(1);
+    }
+}
+
+/*
+ * Same update as update_mini_batch, but spread over the trainer's threads.
+ * In a distributed job every process only computes the gradients of its
+ * shard of the batch and the sums are all-reduced before the update.
+ */
+double trainer_step(Trainer *trainer, Image *images, int batch_size, double learning_rate)
+{
+    trainer_check(trainer);
+    Network network = trainer->network;
+    int ndim = network.ndim;
+    double factor = learning_rate / batch_size;
+
+    if (trainer->comm != NULL)
+    {
+        int rank = trainer->comm->rank;
+        int world_size = trainer->comm->world_size;
+        images += rank * batch_size / world_size;
+        batch_size = (rank + 1) * batch_size / world_size - rank * batch_size / world_size;
+    }
+
+    int n_slices = trainer->n_threads < batch_size ? trainer->n_threads : batch_size;
+
+    TrainerJob job = {
+        .trainer = trainer,
+        .images = images,
+        .factor = factor,
+        .batch_size = batch_size,
+        .n_slices = n_slices,
+    };
+
+    if (trainer->pipeline && trainer->comm == NULL && trainer->mixed == NULL && trainer->checkpoint_every == 0)
+    {
+        for (int l = 1; l < ndim; l++)
+        {
+            trainer->pending[l] = n_slices;
+        }
+        parallel_run(n_slices, accumulate_slice_pipelined, &job);
+
+        for (int stride = 1; stride < n_slices; stride *= 2)
+        {
+            for (int dst = 0; dst + stride < n_slices; dst += 2 * stride)
+            {
+                trainer->losses[dst] += trainer->losses[dst + stride];
+            }
+        }
+        return trainer->losses[0];
+    }
+
+    Task accumulate = trainer->mixed != NULL ? accumulate_slice_mixed : accumulate_slice;
+    parallel_run(n_slices, trainer->checkpoint_every > 0 ? accumulate_slice_checkpointed : accumulate, &job);
+
+    for (job.stride = 1; job.stride < n_slices; job.stride *= 2)
+    {
+        int n_pairs = (n_slices - job.stride + 2 * job.stride - 1) / (2 * job.stride);
+        parallel_run(n_pairs, reduce_pair, &job);
+    }
+
+    if (trainer->comm != NULL)
+    {
+        trainer_allreduce(trainer);
+    }
+
+    if (trainer->mixed != NULL)
+    {
+        // undo the loss scale of the gradients, skip the update if they overflowed
+        job.factor /= trainer->mixed->loss_scale;
+        if (!mixed_check_gradients(trainer->mixed, network, trainer->weights_grad[0], trainer->biases_grad[0]))
+        {
+            return trainer->losses[0];
+        }
+    }
+
+    for (int l = 1; l < ndim; l++)
+    {
+        update_layer(network, l, trainer->weights_grad[0], trainer->biases_grad[0], trainer->factors_grad, job.factor);
+    }
+
+    if (trainer->mixed != NULL)
+    {
+        mixed_refresh(trainer->mixed, network);
+    }
+
+    return trainer->losses[0];
+}
+
+// deterministic Fisher-Yates shuffle, one permutation per epoch
+void shuffle_dataset(Dataset dataset, int epoch)
+{
+    for (int i = dataset.size - 1; i > 0; i--)
+    {
+        int j = rng_next(STREAM_SHUFFLE + epoch, i) % (i + 1);
+        Image tmp = dataset.images[i];
+        dataset.images[i] = dataset.images[j];
+        dataset.images[j] = tmp;
+    }
+}
+
+/*
+ * Shuffles the images of the whole batches of a distributed job, keeping every
+ * image in the share of its batch that one process trains on, so each process
+ * only ever reads the images of shard_dataset. With one process it is
+ * shuffle_dataset.
+ */
+void shuffle_shards(Dataset dataset, int epoch, int batch_size, int world_size)
+{
+    if (world_size == 1)
+    {
+        shuffle_dataset(dataset, epoch);
+        return;
+    }
+    int batches = dataset.size / batch_size;
+    for (int r = 0; r < world_size; r++)
+    {
+        // the k-th image of share r is in batch k / share at offset k % share
+        int low = r * batch_size / world_size;
+        int share = (r + 1) * batch_size / world_size - low;
+        for (int k = batches * share - 1; k > 0; k--)
+        {
+            int j = rng_next(STREAM_SHUFFLE + epoch, (uint64_t)r * dataset.size + k) % (k + 1);
+            Image *a = dataset.images + k / share * batch_size + low + k % share;
+            Image *b = dataset.images + j / share * batch_size + low + j % share;
+            Image tmp = *a;
+            *a = *b;
+            *b = tmp;
+        }
+    }
+}
+
+/*
+ * HOGWILD
+ *
+ * Lock-free asynchronous SGD: every thread walks its own interleaved stream
+ * of samples and applies each sample's update straight to the shared
+ * weights, without barriers or locks. Concurrent updates may overwrite each
+ * other, which is tolerable since each one is small and most of them touch
+ * different inputs. Results are not reproducible across runs.
+ */
+
+typedef struct
+{
+    Trainer *trainer;
+    Dataset dataset;
+    double factor;
+} HogwildJob;
+
+void hogwild_stream(void *context, int t)
+{
+    HogwildJob *job = context;
+    Trainer *trainer = job->trainer;
+    Network fork = trainer->forks[t];
+    Network network = trainer->network;
+    int ndim = network.ndim;
+    int *dims = network.dims;
+    int *nonzero = malloc(dims[0] * sizeof(int));
+
+    double loss = 0;
+    for (int b = t; b < job->dataset.size; b += trainer->n_threads)
+    {
+        Image image = job->dataset.images[b];
+        forward(fork, image.data);
+        loss += compute_loss(fork, image.label);
+        backward_deltas(fork, image.label);
+
+        // inputs are mostly blank pixels, so the first layer's update is sparse
+        int n_nonzero = 0;
+        for (int j = 0; j < dims[0]; j++)
+        {
+            if (image.data[j] != 0)
+            {
+                nonzero[n_nonzero++] = j;
+            }
+        }
+
+        for (int l = 1; l < ndim; l++)
+        {
+            double *a = fork.neurons[l - 1];
+            for (int i = 0; i < dims[l]; i++)
+            {
+                double delta = job->factor * fork.biases_grad[l][i];
+                double *w = network.weights[l] + i * dims[l - 1];
+                network.biases[l][i] -= delta;
+                if (l == 1)
+                {
+                    for (int k = 0; k < n_nonzero; k++)
+                    {
+                        w[nonzero[k]] -= delta * a[nonzero[k]];
+                    }
+                }
+                else
+                {
+                    for (int j = 0; j < dims[l - 1]; j++)
+                    {
+                        w[j] -= delta * a[j];
+                    }
+                }
+            }
+        }
+    }
+
+    trainer->losses[t] = loss;
+    free(nonzero);
+}
+
+// one asynchronous pass over the dataset, returns the summed loss
+double hogwild(Trainer *trainer, Dataset dataset, int batch_size, double learning_rate)
+{
+    if (network_quantized(trainer->network))
+    {
+        printf("%serror:%s quantized networks only train synchronously\n", RED, RESET);
+        exit(1);
+    }
+    if (trainer->checkpoint_every > 0)
+    {
+        printf("%serror:%s checkpoints only train synchronously\n", RED, RESET);
+        exit(1);
+    }
+    // every sample moves the weights as far as it would within a synchronous batch
+    HogwildJob job = {.trainer = trainer, .dataset = dataset, .factor = learning_rate / batch_size};
+    parallel_run(trainer->n_threads, hogwild_stream, &job);
+
+    double loss = 0;
+    for (int t = 0; t < trainer->n_threads; t++)
+    {
+        loss += trainer->losses[t];
+    }
+    return loss;
+}
+
+void hogwild_epoch(Trainer *trainer, Dataset dataset, int batch_size, double learning_rate)
+{
+    double start = profile_start(PHASE_STEP);
+    printf("Start asynchronous epoch with %d samples on %d threads\n", dataset.size, trainer->n_threads);
+    double loss = hogwild(trainer, dataset, batch_size, learning_rate);
+    profile_add(PHASE_STEP, start);
+    printf("%sloss: %.4lf ", CLEAR, loss / dataset.size);
+    print_progress(1, 1, (int)timestamp() - start);
+}
+
+typedef struct
+{
+    Network *forks;
+    Dataset dataset;
+    int predicted_correctly;
+} EvaluationJob;
+
+void evaluate_range(void *context, int start, int end)
+{
+    EvaluationJob *job = context;
+    Network fork = job->forks[pool_worker];
+    int predicted_correctly = 0;
+    for (int i = start; i < end; i++)
+    {
+        forward(fork, job->dataset.images[i].data);
+        int n_outputs = fork.dims[fork.ndim - 1];
+        predicted_correctly += arg_max(n_outputs, fork.neurons[fork.ndim - 1]) == arg_max(n_outputs, job->dataset.images[i].label);
+    }
+    __atomic_add_fetch(&job->predicted_correctly, predicted_correctly, __ATOMIC_RELAXED);
+}
+
+int evaluate(Network network, Dataset dataset)
+{
+    EvaluationJob job = {.forks = malloc(pool_slots() * sizeof(Network)), .dataset = dataset};
+    for (int t = 0; t < pool_slots(); t++)
+    {
+        job.forks[t] = network_fork(network);
+    }
+
+    parallel_for(dataset.size, parallel_grain(dataset.size), evaluate_range, &job);
+
+    for (int t = 0; t < pool_slots(); t++)
+    {
+        network_fork_destroy(job.forks[t]);
+    }
+    free(job.forks);
+    return job.predicted_correctly;
+}
+
+/*
+ * METRICS
+ *
+ * Counts the predictions of a classifier with any number of outputs: the
+ * confusion matrix, from which accuracy, precision and recall follow, and the
+ * samples whose label is among the k largest outputs. Workers count into
+ * their own Metrics, which are merged at the end.
+ */
+
+typedef struct
+{
+    int n_classes;
+    int top_k;
+    int size;
+    int *confusion; // [label * n_classes + prediction]
+    int top_k_correctly;
+    double loss;    // summed over all samples
+    double seconds; // spent in forward passes, summed over all workers
+} Metrics;
+
+Metrics metrics_create(int n_classes, int top_k)
+{
+    Metrics metrics = {
+        .n_classes = n_classes,
+        .top_k = top_k,
+        .confusion = calloc((size_t)n_classes * n_classes, sizeof(int)),
+    };
+    return metrics;
+}
+
+void metrics_destroy(Metrics metrics)
+{
+    free(metrics.confusion);
+}
+
+// counts the prediction of one sample and returns its loss
+double metrics_add(Metrics *metrics, double *output, double *label)
+{
+    int n = metrics->n_classes;
+    int actual = arg_max(n, label);
+    int rank = 0;
+    double loss = 0;
+    for (int i = 0; i < n; i++)
+    {
+        rank += output[i] > output[actual] || (output[i] == output[actual] && i < actual);
+        loss += (output[i] - label[i]) * (output[i] - label[i]);
+    }
+
+    metrics->size += 1;
+    metrics->confusion[actual * n + arg_max(n, output)] += 1;
+    metrics->top_k_correctly += rank < metrics->top_k;
+    return loss;
+}
+
+void metrics_merge(Metrics *metrics, Metrics other)
+{
+    metrics->size += other.size;
+    metrics->top_k_correctly += other.top_k_correctly;
+    metrics->loss += other.loss;
+    metrics->seconds += other.seconds;
+    for (int i = 0; i < metrics->n_classes * metrics->n_classes; i++)
+    {
+        metrics->confusion[i] += other.confusion[i];
+    }
+}
+
+int metrics_correctly(Metrics metrics)
+{
+    int predicted_correctly = 0;
+    for (int c = 0; c < metrics.n_classes; c++)
+    {
+        predicted_correctly += metrics.confusion[c * metrics.n_classes + c];
+    }
+    return predicted_correctly;
+}
+
+// fraction of the predictions of class c that were right, 0 if it was never predicted
+double metrics_precision(Metrics metrics, int c)
+{
+    int predicted = 0;
+    for (int i = 0; i < metrics.n_classes; i++)
+    {
+        predicted += metrics.confusion[i * metrics.n_classes + c];
+    }
+    return predicted == 0 ? 0 : (double)metrics.confusion[c * metrics.n_classes + c] / predicted;
+}
+
+// fraction of the samples of class c that were recognized, 0 if there were none
+double metrics_recall(Metrics metrics, int c)
+{
+    int actual = 0;
+    for (int i = 0; i < metrics.n_classes; i++)
+    {
+        actual += metrics.confusion[c * metrics.n_classes + i];
+    }
+    return actual == 0 ? 0 : (double)metrics.confusion[c * metrics.n_classes + c] / actual;
+}
+
+/*
+ * DISTILLATION
+ *
+ * A small student network learns from a trained teacher: its targets are the
+ * teacher's outputs softened by a temperature T and mixed with the true
+ * labels. The networks end in sigmoids, so the teacher's logits are the
+ * inputs of its output sigmoids, z = log(a / (1 - a)), and the soft target
+ * of an output is sigmoid(z / T). Higher temperatures move the targets
+ * towards 0.5 and keep more of the teacher's ranking of the wrong classes.
+ */
+
+// logits of the teacher's outputs for every image of the dataset, from one batched pass
+double *teacher_logits(Network teacher, Dataset dataset)
+{
+    int n_outputs = teacher.dims[teacher.ndim - 1];
+    double **inputs = malloc(dataset.size * sizeof(double *));
+    for (int i = 0; i < dataset.size; i++)
+    {
+        inputs[i] = dataset.images[i].data;
+    }
+    double *logits = malloc((size_t)dataset.size * n_outputs * sizeof(double));
+    InferenceContext *contexts = inference_contexts_create(teacher, 64);
+    predict(teacher, contexts, dataset.size, inputs, logits);
+    inference_contexts_destroy(contexts);
+    free(inputs);
+
+    // saturated outputs are clamped, so their logits stay finite
+    for (size_t i = 0; i < (size_t)dataset.size * n_outputs; i++)
+    {
+        double a = fmin(fmax(logits[i], 1e-12), 1 - 1e-12);
+        logits[i] = log(a) - log1p(-a);
+    }
+    return logits;
+}
+
+// replaces every label by alpha times the soft target of the teacher's logits plus 1 - alpha times the label
+void distill_labels(Dataset dataset, double *logits, int n_outputs, double temperature, double alpha)
+{
+    for (int i = 0; i < dataset.size; i++)
+    {
+        double *label = dataset.images[i].label;
+        for (int j = 0; j < n_outputs; j++)
+        {
+            double soft = sigmoid(logits[(size_t)i * n_outputs + j] / temperature);
+            label[j] = alpha * soft + (1 - alpha) * label[j];
+        }
+    }
+}
+
+/*
+ * LOW-RANK FACTORIZATION
+ *
+ * Replaces the weights of a layer by the product of two thin factors from a
+ * truncated SVD, computed with a randomized range finder: a few products of
+ * the weights with random vectors span (almost) the dominant singular
+ * subspace, which power iterations sharpen. Projecting the weights onto that
+ * subspace leaves a small matrix, whose SVD follows from the Jacobi
+ * eigendecomposition of its Gram matrix. The singular values are split evenly
+ * between the factors, which keeps their gradients balanced when fine-tuning.
+ */
+
+#define FACTORIZE_OVERSAMPLING 10
+#define FACTORIZE_POWER_ITERATIONS 2
+
+// orthonormalizes k vectors of length n in place, twice for stability, dependent vectors become zero
+void orthonormalize(int k, int n, double *vectors)
+{
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int c = 0; c < k; c++)
+        {
+            double *v = vectors + (size_t)c * n;
+            for (int p = 0; p < c; p++)
+            {
+                double *u = vectors + (size_t)p * n;
+                double dot = 0;
+                for (int i = 0; i < n; i++)
+                {
+                    dot += u[i] * v[i];
+                }
+                for (int i = 0; i < n; i++)
+                {
+                    v[i] -= dot * u[i];
+                }
+            }
+            double norm = 0;
+            for (int i = 0; i < n; i++)
+            {
+                norm += v[i] * v[i];
+            }
+            norm = sqrt(norm);
+            for (int i = 0; i < n; i++)
+            {
+                v[i] = norm > 1e-12 ? v[i] / norm : 0;
+            }
+        }
+    }
+}
+
+/*
+ * Cyclic Jacobi eigendecomposition of the symmetric k x k matrix a, which is
+ * destroyed. Eigenvector c is row c of vectors, values are sorted descending.
+ */
+void jacobi_eigen(int k, double *a, double *vectors, double *values)
+{
+    for (int i = 0; i < k * k; i++)
+    {
+        vectors[i] = i % (k + 1) == 0;
+    }
+    for (int sweep = 0; sweep < 64; sweep++)
+    {
+        double off = 0, total = 0;
+        for (int i = 0; i < k * k; i++)
+        {
+            total += a[i] * a[i];
+            off += i % (k + 1) == 0 ? 0 : a[i] * a[i];
+        }
+        if (off <= 1e-30 * total)
+        {
+            break;
+        }
+        for (int p = 0; p < k; p++)
+        {
+            for (int q = p + 1; q < k; q++)
+            {
+                double apq = a[p * k + q];
+                if (fabs(apq) < 1e-300)
+                {
+                    continue;
+                }
+                // rotation that zeroes a[p][q]
+                double theta = (a[q * k + q] - a[p * k + p]) / (2 * apq);
+                double t = (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta * theta + 1));
+                double c = 1 / sqrt(t * t + 1);
+                double s = t * c;
+                for (int r = 0; r < k; r++)
+                {
+                    double arp = a[r * k + p], arq = a[r * k + q];
+                    a[r * k + p] = c * arp - s * arq;
+                    a[r * k + q] = s * arp + c * arq;
+                }
+                for (int r = 0; r < k; r++)
+                {
+                    double apr = a[p * k + r], aqr = a[q * k + r];
+                    a[p * k + r] = c * apr - s * aqr;
+                    a[q * k + r] = s * apr + c * aqr;
+                }
+                for (int r = 0; r < k; r++)
+                {
+                    double vp = vectors[p * k + r], vq = vectors[q * k + r];
+                    vectors[p * k + r] = c * vp - s * vq;
+                    vectors[q * k + r] = s * vp + c * vq;
+                }
+            }
+        }
+    }
+
+    // selection sort, k is small
+    for (int i = 0; i < k; i++)
+    {
+        values[i] = a[i * k + i];
+    }
+    for (int i = 0; i < k; i++)
+    {
+        int best = i;
+        for (int j = i + 1; j < k; j++)
+        {
+            best = values[j] > values[best] ? j : best;
+        }
+        double value = values[i];
+        values[i] = values[best];
+        values[best] = value;
+        for (int r = 0; r < k; r++)
+        {
+            double v = vectors[i * k + r];
+            vectors[i * k + r] = vectors[best * k + r];
+            vectors[best * k + r] = v;
+        }
+    }
+}
+
+/*
+ * Truncated SVD of the m x n matrix a (row-major): writes left (m x rank) and
+ * right (rank x n) with left * right the best rank-rank approximation of a.
+ */
+void truncated_svd(int m, int n, double *a, int rank, double *left, double *right)
+{
+    int k = rank + FACTORIZE_OVERSAMPLING;
+    k = k < m ? k : m;
+    k = k < n ? k : n;
+    double *q = calloc((size_t)k * m, sizeof(double)); // k vectors of length m
+    double *z = calloc((size_t)k * n, sizeof(double)); // k vectors of length n
+
+    for (size_t i = 0; i < (size_t)k * n; i++)
+    {
+        z[i] = rng_uniform(STREAM_FACTORIZE, i) - 0.5;
+    }
+    for (int iteration = 0; iteration <= FACTORIZE_POWER_ITERATIONS; iteration++)
+    {
+        // q = orth(a z)
+        for (int i = 0; i < m; i++)
+        {
+            double *row = a + (size_t)i * n;
+            for (int c = 0; c < k; c++)
+            {
+                double sum = 0;
+                for (int j = 0; j < n; j++)
+                {
+                    sum += row[j] * z[(size_t)c * n + j];
+                }
+                q[(size_t)c * m + i] = sum;
+            }
+        }
+        orthonormalize(k, m, q);
+
+        // z = a^T q, its vectors are the rows of the projection b = q^T a in the last iteration
+        memset(z, 0, (size_t)k * n * sizeof(double));
+        for (int i = 0; i < m; i++)
+        {
+            double *row = a + (size_t)i * n;
+            for (int c = 0; c < k; c++)
+            {
+                double factor = q[(size_t)c * m + i];
+                double *zc = z + (size_t)c * n;
+                for (int j = 0; j < n; j++)
+                {
+                    zc[j] += factor * row[j];
+                }
+            }
+        }
+        if (iteration < FACTORIZE_POWER_ITERATIONS)
+        {
+            orthonormalize(k, n, z);
+        }
+    }
+
+    // b b^T = e diag(s^2) e^T, so b = e diag(s) v^T and a ~ (q e) diag(s) v^T
+    double *gram = malloc((size_t)k * k * sizeof(double));
+    double *e = malloc((size_t)k * k * sizeof(double));
+    double *values = malloc(k * sizeof(double));
+    for (int c = 0; c < k; c++)
+    {
+        for (int d = 0; d < k; d++)
+        {
+            double sum = 0;
+            for (int j = 0; j < n; j++)
+            {
+                sum += z[(size_t)c * n + j] * z[(size_t)d * n + j];
+            }
+            gram[c * k + d] = sum;
+        }
+    }
+    jacobi_eigen(k, gram, e, values);
+
+    for (int r = 0; r < rank; r++)
+    {
+        double sigma = r < k && values[r] > 0 ? sqrt(values[r]) : 0;
+        double scale = sqrt(sigma);
+        for (int i = 0; i < m; i++)
+        {
+            double sum = 0;
+            for (int c = 0; r < k && c < k; c++)
+            {
+                sum += q[(size_t)c * m + i] * e[r * k + c];
+            }
+            left[(size_t)i * rank + r] = sum * scale;
+        }
+        for (int j = 0; j < n; j++)
+        {
+            double sum = 0;
+            for (int c = 0; r < k && c < k; c++)
+            {
+                sum += e[r * k + c] * z[(size_t)c * n + j];
+            }
+            right[(size_t)r * n + j] = sigma > 1e-12 ? sum / scale : 0;
+        }
+    }
+
+    free(q);
+    free(z);
+    free(gram);
+    free(e);
+    free(values);
+}
+
+// factorizes layer l of network at the given rank, its weights become the low-rank product
+void factorize_layer(Network network, int l, int rank)
+{
+    network_set_rank(network, l, rank);
+    truncated_svd(network.dims[l], network.dims[l - 1], network.weights[l], rank, network.left[l], network.right[l]);
+    network_expand_layer(network, l);
+}
+
+/*
+ * MULTI-MODEL EVALUATION
+ *
+ * Evaluates several models with the same inputs and outputs in one pass over
+ * a dataset. Each worker takes a tile of images and runs the batched forward
+ * pass of every model on it, so the tile is read from memory once and stays
+ * in cache for all models. The ensemble prediction averages the outputs of
+ * all models. The losses are summed per tile and then in tile order, so the
+ * result does not depend on the scheduling of the workers.
+ */
+
+#define EVALUATION_TILE 32
+
+typedef struct
+{
+    Network *models;
+    Replicas *replicas; // [model]
+    int n_models;
+    int n_ensemble; // the first models, whose outputs are averaged
+    Dataset dataset;
+    int grain;
+    InferenceContext *contexts; // [worker * n_models + model]
+    double *averages;           // [worker] tile of averaged outputs
+    Metrics *partials;          // [worker * (n_models + 1) + model], the ensemble last
+    double *losses;             // [tile * (n_models + 1) + model]
+} MultiEvaluationJob;
+
+void evaluate_models_range(void *context, int start, int end)
+{
+    MultiEvaluationJob *job = context;
+    int n_outputs = job->models[0].dims[job->models[0].ndim - 1];
+    int n = end - start;
+    double *inputs[EVALUATION_TILE];
+    for (int b = 0; b < n; b++)
+    {
+        inputs[b] = job->dataset.images[start + b].data;
+    }
+
+    Metrics *partials = job->partials + pool_worker * (job->n_models + 1);
+    double *losses = job->losses + start / job->grain * (job->n_models + 1);
+    double *averages = job->averages + (size_t)pool_worker * EVALUATION_TILE * n_outputs;
+    memset(averages, 0, (size_t)n * n_outputs * sizeof(double));
+    for (int m = 0; m < job->n_models; m++)
+    {
+        InferenceContext *inference = job->contexts + pool_worker * job->n_models + m;
+        Network model = replica_network(job->replicas[m], job->models[m], pool.nodes[pool_worker]);
+        double forward_start = timestamp();
+        double *outputs = forward_batch(model, inference, n, inputs);
+        partials[m].seconds += timestamp() - forward_start;
+        for (int b = 0; b < n; b++)
+        {
+            losses[m] += metrics_add(&partials[m], outputs + b * n_outputs, job->dataset.images[start + b].label);
+            for (int i = 0; i < n_outputs && m < job->n_ensemble; i++)
+            {
+                averages[b * n_outputs + i] += outputs[b * n_outputs + i] / job->n_ensemble;
+            }
+        }
+    }
+
+    for (int b = 0; b < n; b++)
+    {
+        double *label = job->dataset.images[start + b].label;
+        losses[job->n_models] += metrics_add(&partials[job->n_models], averages + b * n_outputs, label);
+    }
+}
+
+// adds the predictions of every model and of the average of the first n_ensemble (the last of n_models + 1 metrics) on the dataset,
+// reading the weights from the replicas of each model, or from the models themselves when replicas is NULL
+void evaluate_models(Network *models, Replicas *replicas, int n_models, int n_ensemble, Dataset dataset, Metrics *metrics)
+{
+    int n_outputs = models[0].dims[models[0].ndim - 1];
+    int grain = parallel_grain(dataset.size) < EVALUATION_TILE ? parallel_grain(dataset.size) : EVALUATION_TILE;
+    int n_tiles = (dataset.size + grain - 1) / grain;
+    MultiEvaluationJob job = {
+        .models = models,
+        .replicas = malloc(n_models * sizeof(Replicas)),
+        .n_models = n_models,
+        .n_ensemble = n_ensemble,
+        .dataset = dataset,
+        .grain = grain,
+        .contexts = malloc((size_t)pool_slots() * n_models * sizeof(InferenceContext)),
+        .averages = malloc((size_t)pool_slots() * EVALUATION_TILE * n_outputs * sizeof(double)),
+        .partials = malloc((size_t)pool_slots() * (n_models + 1) * sizeof(Metrics)),
+        .losses = calloc((size_t)n_tiles * (n_models + 1), sizeof(double)),
+    };
+    for (int m = 0; m < n_models; m++)
+    {
+        job.replicas[m] = replicas != NULL ? replicas[m] : (Replicas){.n_nodes = 0, .networks = NULL, .refused = -1};
+    }
+    for (int t = 0; t < pool_slots(); t++)
+    {
+        for (int m = 0; m < n_models; m++)
+        {
+            job.contexts[t * n_models + m] = inference_context_create(models[m], EVALUATION_TILE);
+            if (job.contexts[t * n_models + m].capacity == 0)
+            {
+                printf("%serror:%s out of memory for the evaluation of %d models\n", RED, RESET, n_models);
+                exit(1);
+            }
+        }
+        for (int m = 0; m <= n_models; m++)
+        {
+            job.partials[t * (n_models + 1) + m] = metrics_create(n_outputs, metrics[m].top_k);
+        }
+    }
+
+    parallel_for(dataset.size, grain, evaluate_models_range, &job);
+
+    for (int t = 0; t < pool_slots(); t++)
+    {
+        for (int m = 0; m < n_models; m++)
+        {
+            inference_context_destroy(job.contexts[t * n_models + m]);
+        }
+        for (int m = 0; m <= n_models; m++)
+        {
+            metrics_merge(&metrics[m], job.partials[t * (n_models + 1) + m]);
+            metrics_destroy(job.partials[t * (n_models + 1) + m]);
+        }
+    }
+    for (int i = 0; i < n_tiles; i++)
+    {
+        for (int m = 0; m <= n_models; m++)
+        {
+            metrics[m].loss += job.losses[i * (n_models + 1) + m];
+        }
+    }
+    free(job.replicas);
+    free(job.contexts);
+    free(job.averages);
+    free(job.partials);
+    free(job.losses);
+}
+
+void epoch(Trainer *trainer, Dataset dataset, int batch_size, double learning_rate)
+{
+    double start = timestamp();
+    int batches = dataset.size / batch_size;
+    printf("Start epoch with %d batches (batch_size: %d)\n", batches, batch_size);
+    double loss = 0;
+    for (int i = 0; i < batches; i++)
+    {
+        printf("%sloss: %.4lf ", CLEAR, loss / (i + 1));
+        print_progress(i, batches, (int)timestamp() - start);
+
+        double step_start = profile_start(PHASE_STEP);
+        loss += trainer_step(trainer, dataset.images + i * batch_size, batch_size, learning_rate) / batch_size;
+        profile_add(PHASE_STEP, step_start);
+    }
+
+    printf("%sloss: %.4lf ", CLEAR, loss / batches);
+    print_progress(batches, batches, (int)timestamp() - start);
+}
+
+/*
+ * AUGMENTATION
+ *
+ * Random distortions of the training images, generated on the fly: a shift,
+ * a rotation about the centre, an elastic distortion (a random displacement
+ * field smoothed by a Gaussian, as proposed by Simard et al.) and additive
+ * noise. Every sample draws its parameters from its own stream, derived from
+ * the epoch and its position in the epoch, so augmented training stays
+ * reproducible for a given seed and thread count.
+ */
+
+typedef struct
+{
+    double shift;    // largest translation in pixels
+    double rotation; // largest rotation in degrees
+    double elastic;  // scale of the displacement field in pixels, 0 disables it
+    double sigma;    // standard deviation of the field's smoothing in pixels
+    double noise;    // standard deviation of the additive noise
+} Augmentation;
+
+// separable Gaussian blur of a rows x cols field, tmp has the same size
+void blur_field(double *field, double *tmp, int rows, int cols, double sigma)
+{
+    int radius = (int)ceil(3 * sigma);
+    double kernel[2 * radius + 1];
+    double sum = 0;
+    for (int k = -radius; k <= radius; k++)
+    {
+        kernel[k + radius] = exp(-k * k / (2 * sigma * sigma));
+        sum += kernel[k + radius];
+    }
+    for (int k = 0; k < 2 * radius + 1; k++)
+    {
+        kernel[k] /= sum;
+    }
+
+    // rows, then columns, with zero padding; both add shifted copies of contiguous rows
+    memset(tmp, 0, rows * cols * sizeof(double));
+    for (int y = 0; y < rows; y++)
+    {
+        for (int k = -radius; k <= radius; k++)
+        {
+            int start = k < 0 ? -k : 0;
+            int end = k > 0 ? cols - k : cols;
+            double *src = field + y * cols + k;
+            double *dst = tmp + y * cols;
+            int x = start;
+            for (; x + 4 <= end; x += 4)
+            {
+                *(v4d_unaligned *)(dst + x) += kernel[k + radius] * LOAD_V4D(src + x);
+            }
+            for (; x < end; x++)
+            {
+                dst[x] += kernel[k + radius] * src[x];
+            }
+        }
+    }
+    memset(field, 0, rows * cols * sizeof(double));
+    for (int k = -radius; k <= radius; k++)
+    {
+        int start = k < 0 ? -k : 0;
+        int end = k > 0 ? rows - k : rows;
+        for (int y = start; y < end; y++)
+        {
+            double *src = tmp + (y + k) * cols;
+            double *dst = field + y * cols;
+            int x = 0;
+            for (; x + 4 <= cols; x += 4)
+            {
+                *(v4d_unaligned *)(dst + x) += kernel[k + radius] * LOAD_V4D(src + x);
+            }
+            for (; x < cols; x++)
+            {
+                dst[x] += kernel[k + radius] * src[x];
+            }
+        }
+    }
+}
+
+/*
+ * Writes a distorted copy of the rows x cols image in to out. scratch holds
+ * 3 * rows * cols doubles.
+ */
+void augment_image(Augmentation augmentation, uint64_t stream, int rows, int cols, double *in, double *out, double *scratch)
+{
+    int size = rows * cols;
+    double *dx = scratch;
+    double *dy = scratch + size;
+    double *tmp = scratch + 2 * size;
+    uint64_t counter = 0;
+
+    double angle = (2 * rng_uniform(stream, counter++) - 1) * augmentation.rotation * M_PI / 180;
+    double shift_x = (2 * rng_uniform(stream, counter++) - 1) * augmentation.shift;
+    double shift_y = (2 * rng_uniform(stream, counter++) - 1) * augmentation.shift;
+    double c = cos(angle);
+    double s = sin(angle);
+
+    if (augmentation.elastic > 0)
+    {
+        // both displacements from the halves of one random number
+        for (int i = 0; i < size; i++)
+        {
+            uint64_t bits = rng_next(stream, counter++);
+            dx[i] = (bits & 0xffffffff) * 0x1p-31 - 1;
+            dy[i] = (bits >> 32) * 0x1p-31 - 1;
+        }
+        blur_field(dx, tmp, rows, cols, augmentation.sigma);
+        blur_field(dy, tmp, rows, cols, augmentation.sigma);
+    }
+    else
+    {
+        memset(dx, 0, 2 * size * sizeof(double));
+    }
+
+    // source coordinates of every output pixel: inverse rotation and shift plus displacement
+    double cx = (cols - 1) / 2.0;
+    double cy = (rows - 1) / 2.0;
+    for (int y = 0; y < rows; y++)
+    {
+        for (int x = 0; x < cols; x++)
+        {
+            double u = x - cx - shift_x;
+            double v = y - cy - shift_y;
+            dx[y * cols + x] = c * u + s * v + cx + augmentation.elastic * dx[y * cols + x];
+            dy[y * cols + x] = -s * u + c * v + cy + augmentation.elastic * dy[y * cols + x];
+        }
+    }
+
+    // bilinear sampling, pixels outside the image are blank
+    for (int i = 0; i < size; i++)
+    {
+        double fx = floor(dx[i]);
+        double fy = floor(dy[i]);
+        int x0 = (int)fx;
+        int y0 = (int)fy;
+        double wx = dx[i] - fx;
+        double wy = dy[i] - fy;
+        double value = 0;
+        for (int k = 0; k < 4; k++)
+        {
+            int x = x0 + (k & 1);
+            int y = y0 + (k >> 1);
+            if (x >= 0 && x < cols && y >= 0 && y < rows)
+            {
+                value += ((k & 1) ? wx : 1 - wx) * ((k >> 1) ? wy : 1 - wy) * in[y * cols + x];
+            }
+        }
+        out[i] = value;
+    }
+
+    if (augmentation.noise > 0)
+    {
+        // the sum of four uniform numbers (mean 2, variance 1/3) is close to normally distributed
+        for (int i = 0; i < size; i++)
+        {
+            uint64_t bits = rng_next(stream, counter++);
+            double sum = (bits & 0xffff) + ((bits >> 16) & 0xffff) + ((bits >> 32) & 0xffff) + (bits >> 48);
+            double value = out[i] + augmentation.noise * (sum * 0x1p-16 - 2) * sqrt(3);
+            out[i] = value < 0 ? 0 : value > 1 ? 1 : value;
+        }
+    }
+}
+
+/*
+ * PREFETCHING
+ *
+ * A producer thread prepares the batches of all epochs ahead of the training
+ * loop: it shuffles its own copy of the dataset exactly like shuffle_dataset,
+ * and augments every batch into a free slot of a small ring, spreading the
+ * images over the pool's workers. The training loop only waits if the ring
+ * runs empty, which the profile reports.
+ */
+
+typedef struct
+{
+    Augmentation augmentation;
+    Image *images;   // the producer's copy of the dataset, in epoch order
+    int size;
+    int rows;
+    int cols;
+    int batch_size;
+    int world_size;  // processes sharing every batch, see shuffle_shards
+    int epochs;
+    int depth;       // number of batches in the ring
+    Image *slots;    // depth * batch_size augmented images
+    double *pixels;  // their data
+    double *scratch; // 3 * rows * cols doubles per image of a batch
+    int produced;
+    int consumed;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+} Prefetcher;
+
+typedef struct
+{
+    Prefetcher *prefetcher;
+    Image *source;
+    Image *target;
+    int epoch;
+    int position;
+} AugmentJob;
+
+void augment_range(void *context, int start, int end)
+{
+    AugmentJob *job = context;
+    Prefetcher *prefetcher = job->prefetcher;
+    int size = prefetcher->rows * prefetcher->cols;
+    for (int b = start; b < end; b++)
+    {
+        // the shares of the other processes of a distributed job
+        if (job->source[b].data == NULL)
+        {
+            job->target[b].label = NULL;
+            continue;
+        }
+        uint64_t stream = STREAM_AUGMENT + ((uint64_t)job->epoch << 20) + job->position + b;
+        augment_image(prefetcher->augmentation, stream, prefetcher->rows, prefetcher->cols,
+                      job->source[b].data, job->target[b].data, prefetcher->scratch + (size_t)b * 3 * size);
+        job->target[b].label = job->source[b].label;
+    }
+}
+
+void *prefetch(void *arg)
+{
+    Prefetcher *prefetcher = arg;
+    // validation runs on the pool at the same time, from worker 0
+    pool_attach();
+    int batches = prefetcher->size / prefetcher->batch_size;
+    Dataset dataset = {.images = prefetcher->images, .size = prefetcher->size};
+
+    for (int epoch = 0; epoch < prefetcher->epochs; epoch++)
+    {
+        shuffle_shards(dataset, epoch, prefetcher->batch_size, prefetcher->world_size);
+        for (int i = 0; i < batches; i++)
+        {
+            pthread_mutex_lock(&prefetcher->lock);
+            while (prefetcher->produced - prefetcher->consumed == prefetcher->depth && !prefetcher->stop)
+            {
+                pthread_cond_wait(&prefetcher->changed, &prefetcher->lock);
+            }
+            int stop = prefetcher->stop;
+            pthread_mutex_unlock(&prefetcher->lock);
+            if (stop)
+            {
+                pool_detach();
+                return NULL;
+            }
+
+            double start = profile_start(PHASE_AUGMENT);
+            AugmentJob job = {
+                .prefetcher = prefetcher,
+                .source = prefetcher->images + i * prefetcher->batch_size,
+                .target = prefetcher->slots + (prefetcher->produced % prefetcher->depth) * prefetcher->batch_size,
+                .epoch = epoch,
+                .position = i * prefetcher->batch_size,
+            };
+            parallel_for(prefetcher->batch_size, 8, augment_range, &job);
+            profile_add(PHASE_AUGMENT, start);
+
+            pthread_mutex_lock(&prefetcher->lock);
+            prefetcher->produced++;
+            pthread_cond_broadcast(&prefetcher->changed);
+            pthread_mutex_unlock(&prefetcher->lock);
+        }
+    }
+    pool_detach();
+    return NULL;
+}
+
+// starts producing the augmented batches of the given number of epochs
+Prefetcher *prefetcher_start(Dataset dataset, int batch_size, int world_size, int epochs, Augmentation augmentation)
+{
+    int size = dataset.rows * dataset.cols;
+    Prefetcher *prefetcher = malloc(sizeof(Prefetcher));
+    *prefetcher = (Prefetcher){
+        .augmentation = augmentation,
+        .images = malloc(dataset.size * sizeof(Image)),
+        .size = dataset.size,
+        .rows = dataset.rows,
+        .cols = dataset.cols,
+        .batch_size = batch_size,
+        .world_size = world_size,
+        .epochs = epochs,
+        .depth = 3,
+    };
+    memcpy(prefetcher->images, dataset.images, dataset.size * sizeof(Image));
+    prefetcher->slots = malloc(prefetcher->depth * batch_size * sizeof(Image));
+    prefetcher->pixels = malloc((size_t)prefetcher->depth * batch_size * size * sizeof(double));
+    prefetcher->scratch = malloc((size_t)batch_size * 3 * size * sizeof(double));
+    pthread_mutex_init(&prefetcher->lock, NULL);
+    pthread_cond_init(&prefetcher->changed, NULL);
+
+    for (int slot = 0; slot < prefetcher->depth; slot++)
+    {
+        for (int b = 0; b < batch_size; b++)
+        {
+            prefetcher->slots[slot * batch_size + b].data = prefetcher->pixels + (size_t)(slot * batch_size + b) * size;
+        }
+    }
+
+    if (pthread_create(&prefetcher->thread, NULL, prefetch, prefetcher) != 0)
+    {
+        printf("%serror:%s failed to spawn thread\n", RED, RESET);
+        exit(1);
+    }
+    return prefetcher;
+}
+
+// waits for the next batch, which stays valid until prefetcher_release
+Image *prefetcher_next(Prefetcher *prefetcher)
+{
+    double start = profile_start(PHASE_WAIT);
+    pthread_mutex_lock(&prefetcher->lock);
+    while (prefetcher->produced == prefetcher->consumed)
+    {
+        pthread_cond_wait(&prefetcher->changed, &prefetcher->lock);
+    }
+    pthread_mutex_unlock(&prefetcher->lock);
+    profile_add(PHASE_WAIT, start);
+
+    return prefetcher->slots + (prefetcher->consumed % prefetcher->depth) * prefetcher->batch_size;
+}
+
+void prefetcher_release(Prefetcher *prefetcher)
+{
+    pthread_mutex_lock(&prefetcher->lock);
+    prefetcher->consumed++;
+    pthread_cond_broadcast(&prefetcher->changed);
+    pthread_mutex_unlock(&prefetcher->lock);
+}
+
+// stops the producer, also before it finished all epochs
+void prefetcher_stop(Prefetcher *prefetcher)
+{
+    pthread_mutex_lock(&prefetcher->lock);
+    prefetcher->stop = 1;
+    pthread_cond_broadcast(&prefetcher->changed);
+    pthread_mutex_unlock(&prefetcher->lock);
+    pthread_join(prefetcher->thread, NULL);
+
+    pthread_mutex_destroy(&prefetcher->lock);
+    pthread_cond_destroy(&prefetcher->changed);
+    free(prefetcher->images);
+    free(prefetcher->slots);
+    free(prefetcher->pixels);
+    free(prefetcher->scratch);
+    free(prefetcher);
+}
+
+// like epoch, but trains on the next batches of the prefetcher
+void epoch_prefetched(Trainer *trainer, Prefetcher *prefetcher, int batches, double learning_rate)
+{
+    double start = timestamp();
+    int batch_size = prefetcher->batch_size;
+    printf("Start epoch with %d augmented batches (batch_size: %d)\n", batches, batch_size);
+    double loss = 0;
+    for (int i = 0; i < batches; i++)
+    {
+        printf("%sloss: %.4lf ", CLEAR, loss / (i + 1));
+        print_progress(i, batches, (int)timestamp() - start);
+
+        Image *batch = prefetcher_next(prefetcher);
+        double step_start = profile_start(PHASE_STEP);
+        loss += trainer_step(trainer, batch, batch_size, learning_rate) / batch_size;
+        profile_add(PHASE_STEP, step_start);
+        prefetcher_release(prefetcher);
+    }
+
+    printf("%sloss: %.4lf ", CLEAR, loss / batches);
+    print_progress(batches, batches, (int)timestamp() - start);
+}
+
+/*
+ * VALIDATION
+ *
+ * A held-out split of the training data stays in memory and is scored with
+ * batched inference while training runs. Its loss drives early stopping and
+ * the learning rate schedules.
+ */
+
+typedef struct
+{
+    Dataset dataset;
+    InferenceContext *contexts;
+    double **inputs;
+    double *outputs;
+} Validator;
+
+typedef struct
+{
+    double loss;
+    double accuracy;
+} Validation;
+
+/*
+ * The images one process of a distributed job reads: its share of every batch
+ * of the first n_train images, see trainer_step, and all images after them,
+ * which every process validates. The images of the other processes keep
+ * their place without data, and shuffle_shards keeps them out of the share of
+ * this process, so it holds about 1 / world_size of the training images.
+ */
+Dataset shard_dataset(Dataset dataset, int n_train, int batch_size, int rank, int world_size)
+{
+    int pixel = dataset.rows * dataset.cols;
+    int batches = n_train / batch_size;
+    int low = rank * batch_size / world_size;
+    int high = (rank + 1) * batch_size / world_size;
+    Dataset shard = dataset;
+    shard.view = 0;
+    shard.capacity = batches * (high - low) + dataset.size - n_train;
+    shard.images = calloc(dataset.size, sizeof(Image));
+    shard.pixels = large_array((size_t)shard.capacity * pixel);
+    shard.labels = large_array((size_t)shard.capacity * 10);
+    if (shard.images == NULL || shard.pixels == NULL || shard.labels == NULL)
+    {
+        printf("%serror:%s out of memory for %d images\n", RED, RESET, shard.capacity);
+        exit(1);
+    }
+
+    int k = 0;
+    for (int i = 0; i < dataset.size; i++)
+    {
+        int slot = i % batch_size;
+        if (i >= n_train || (i < batches * batch_size && slot >= low && slot < high))
+        {
+            shard.images[i].data = shard.pixels + (size_t)k * pixel;
+            shard.images[i].label = shard.labels + (size_t)k * 10;
+            memcpy(shard.images[i].data, dataset.images[i].data, pixel * sizeof(double));
+            memcpy(shard.images[i].label, dataset.images[i].label, 10 * sizeof(double));
+            k++;
+        }
+    }
+    return shard;
+}
+
+// moves the last fraction of the images of dataset into a new validation dataset
+Dataset split_dataset(Dataset *dataset, double fraction)
+{
+    Dataset validation = *dataset;
+    validation.size = (int)(dataset->size * fraction);
+    validation.images = malloc(validation.size * sizeof(Image));
+    validation.view = 1;
+    dataset->size -= validation.size;
+    memcpy(validation.images, dataset->images + dataset->size, validation.size * sizeof(Image));
+    return validation;
+}
+
+Validator validator_create(Network network, Dataset dataset)
+{
+    Validator validator = {
+        .dataset = dataset,
+        .contexts = inference_contexts_create(network, 64),
+        .inputs = malloc(dataset.size * sizeof(double *)),
+        .outputs = malloc((size_t)dataset.size * network.dims[network.ndim - 1] * sizeof(double)),
+    };
+    for (int i = 0; i < dataset.size; i++)
+    {
+        validator.inputs[i] = dataset.images[i].data;
+    }
+    return validator;
+}
+
+void validator_destroy(Validator validator)
+{
+    inference_contexts_destroy(validator.contexts);
+    free(validator.inputs);
+    free(validator.outputs);
+}
+
+// mean loss and accuracy of network on the validation dataset
+Validation validate(Network network, Validator *validator)
+{
+    Dataset dataset = validator->dataset;
+    int n_outputs = network.dims[network.ndim - 1];
+    predict(network, validator->contexts, dataset.size, validator->inputs, validator->outputs);
+
+    double loss = 0;
+    int predicted_correctly = 0;
+    for (int i = 0; i < dataset.size; i++)
+    {
+        double *output = validator->outputs + (size_t)i * n_outputs;
+        double *label = dataset.images[i].label;
+        for (int j = 0; j < n_outputs; j++)
+        {
+            loss += (output[j] - label[j]) * (output[j] - label[j]);
+        }
+        predicted_correctly += arg_max(n_outputs, output) == arg_max(n_outputs, label);
+    }
+
+    Validation validation = {
+        .loss = loss / dataset.size,
+        .accuracy = (double)predicted_correctly / dataset.size,
+    };
+    return validation;
+}
+
+typedef enum
+{
+    SCHEDULE_CONSTANT,
+    SCHEDULE_STEP,    // multiply by factor every step epochs
+    SCHEDULE_COSINE,  // cosine decay to zero over the whole run
+    SCHEDULE_PLATEAU, // multiply by factor after step evaluations without improvement
+} Schedule;
+
+typedef struct
+{
+    Schedule schedule;
+    double base;
+    double factor;
+    int step;
+    double rate;
+} LearningRate;
+
+/*
+ * Updates the learning rate before training on from progress, the fraction of
+ * training done so far, in epoch. stale counts the validations in a row that
+ * did not improve the loss.
+ */
+double learning_rate_update(LearningRate *lr, int epoch, double progress, int stale)
+{
+    switch (lr->schedule)
+    {
+    case SCHEDULE_CONSTANT:
+        lr->rate = lr->base;
+        break;
+    case SCHEDULE_STEP:
+        lr->rate = lr->base * pow(lr->factor, epoch / lr->step);
+        break;
+    case SCHEDULE_COSINE:
+        lr->rate = lr->base * 0.5 * (1 + cos(M_PI * progress));
+        break;
+    case SCHEDULE_PLATEAU:
+        if (stale > 0 && stale % lr->step == 0)
+        {
+            lr->rate *= lr->factor;
+        }
+        break;
+    }
+    return lr->rate;
+}
+
+typedef struct
+{
+    int patience;     // validations without improvement before stopping, 0 never stops
+    double min_delta; // decrease of the loss that counts as an improvement
+    double best;
+    int stale;
+} EarlyStopping;
+
+// records a validation loss, returns 1 if it is the best one so far
+int early_stopping_update(EarlyStopping *stopping, double loss)
+{
+    if (loss < stopping->best - stopping->min_delta)
+    {
+        stopping->best = loss;
+        stopping->stale = 0;
+        return 1;
+    }
+    stopping->stale++;
+    return 0;
+}
+
+int early_stopping_done(EarlyStopping stopping)
+{
+    return stopping.patience > 0 && stopping.stale >= stopping.patience;
+}
+
+// IO
+
+// reads the next header token of a PGM file, skipping whitespace and comments
+int pgm_token(uint8_t *data, size_t size, size_t *pos)
+{
+    while (*pos < size && (isspace(data[*pos]) || data[*pos] == '#'))
+    {
+        if (data[*pos] == '#')
+        {
+            while (*pos < size && data[*pos] != '\n')
+            {
+                (*pos)++;
+            }
+        }
+        else
+        {
+            (*pos)++;
+        }
+    }
+
+    int value = 0;
+    int digits = 0;
+    while (*pos < size && isdigit(data[*pos]) && digits < 9)
+    {
+        value = 10 * value + data[(*pos)++] - '0';
+        digits++;
+    }
+    return digits ? value : -1;
+}
+
+// resamples n_in values with the given stride to n_out values: area average when shrinking, linear when growing
+void resample_line(double *in, int n_in, int stride_in, double *out, int n_out, int stride_out)
+{
+    double scale = (double)n_in / n_out;
+    for (int o = 0; o < n_out; o++)
+    {
+        if (scale >= 1)
+        {
+            double lo = o * scale;
+            double hi = lo + scale;
+            double sum = 0;
+            for (int i = (int)lo; i < n_in && i < hi; i++)
+            {
+                double overlap = (i + 1 < hi ? i + 1 : hi) - (i > lo ? i : lo);
+                sum += overlap * in[i * stride_in];
+            }
+            out[o * stride_out] = sum / scale;
+        }
+        else
+        {
+            double position = (o + 0.5) * scale - 0.5;
+            position = position < 0 ? 0 : position > n_in - 1 ? n_in - 1 : position;
+            int i = (int)position;
+            int next = i + 1 < n_in ? i + 1 : i;
+            double t = position - i;
+            out[o * stride_out] = (1 - t) * in[i * stride_in] + t * in[next * stride_in];
+        }
+    }
+}
+
+/*
+ * Scratch of decode_pgm: the bytes of the file, then the decoded image and
+ * its resampled rows. It grows to the largest image decoded so far, so a
+ * decoder that keeps one per thread allocates nothing in steady state.
+ */
+typedef struct
+{
+    uint8_t *bytes;
+    size_t n_bytes;
+    double *values;
+    size_t n_values;
+} DecodeBuffer;
+
+// grows the buffer to at least n_bytes bytes and n_values doubles, returns 0 when out of memory
+int decode_buffer_reserve(DecodeBuffer *buffer, size_t n_bytes, size_t n_values)
+{
+    if (n_bytes > buffer->n_bytes)
+    {
+        uint8_t *bytes = realloc(buffer->bytes, n_bytes);
+        if (bytes == NULL)
+        {
+            return 0;
+        }
+        buffer->bytes = bytes;
+        buffer->n_bytes = n_bytes;
+    }
+    if (n_values > buffer->n_values)
+    {
+        double *values = realloc(buffer->values, n_values * sizeof(double));
+        if (values == NULL)
+        {
+            return 0;
+        }
+        buffer->values = values;
+        buffer->n_values = n_values;
+    }
+    return 1;
+}
+
+void decode_buffer_destroy(DecodeBuffer buffer)
+{
+    free(buffer.bytes);
+    free(buffer.values);
+}
+
+/*
+ * Decodes a PGM image (P2 or P5, 8 or 16 bit) into width x height pixels in
+ * [0, 1], resampling it if its size differs. Returns NULL on success and an
+ * error message otherwise.
+ */
+const char *decode_pgm(char *path, int width, int height, double *pixel, DecodeBuffer *buffer)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return "cannot open file";
+    }
+    fseek(file, 0, SEEK_END);
+    size_t size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (!decode_buffer_reserve(buffer, size + 1, 0))
+    {
+        fclose(file);
+        return "out of memory";
+    }
+    uint8_t *data = buffer->bytes;
+    size_t read = fread(data, 1, size, file);
+    fclose(file);
+    if (read != size || size < 3 || data[0] != 'P' || (data[1] != '2' && data[1] != '5'))
+    {
+        return "not in PGM P2 or P5 format";
+    }
+
+    size_t pos = 2;
+    int image_width = pgm_token(data, size, &pos);
+    int image_height = pgm_token(data, size, &pos);
+    int maxval = pgm_token(data, size, &pos);
+    if (image_width <= 0 || image_height <= 0 || maxval <= 0 || maxval > 65535)
+    {
+        return "failed to parse PGM header";
+    }
+
+    size_t n_pixel = (size_t)image_width * image_height;
+    int bytes = maxval < 256 ? 1 : 2;
+    if (!decode_buffer_reserve(buffer, 0, n_pixel + (size_t)width * image_height))
+    {
+        return "out of memory";
+    }
+    double *image = buffer->values;
+    if (data[1] == '5')
+    {
+        pos++; // single whitespace after maxval
+        if (size - pos < n_pixel * bytes)
+        {
+            return "failed to read pixel data";
+        }
+        for (size_t i = 0; i < n_pixel; i++)
+        {
+            int value = bytes == 1 ? data[pos + i] : (data[pos + 2 * i] << 8) | data[pos + 2 * i + 1];
+            image[i] = (double)value / maxval;
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < n_pixel; i++)
+        {
+            int value = pgm_token(data, size, &pos);
+            if (value < 0)
+            {
+                return "failed to read pixel data";
+            }
+            image[i] = (double)value / maxval;
+        }
+    }
+
+    if (image_width == width && image_height == height)
+    {
+        memcpy(pixel, image, n_pixel * sizeof(double));
+    }
+    else
+    {
+        // separable resampling, first the rows then the columns
+        double *rows = image + n_pixel;
+        for (int y = 0; y < image_height; y++)
+        {
+            resample_line(image + (size_t)y * image_width, image_width, 1, rows + (size_t)y * width, width, 1);
+        }
+        for (int x = 0; x < width; x++)
+        {
+            resample_line(rows + x, image_height, width, pixel + x, height, width);
+        }
+    }
+    return NULL;
+}
+
+double *load_pgm_image(char *path, int width, int height)
+{
+    double *pixel = malloc(width * height * sizeof(double));
+    DecodeBuffer buffer = {0};
+    const char *error = decode_pgm(path, width, height, pixel, &buffer);
+    decode_buffer_destroy(buffer);
+    if (error != NULL)
+    {
+        printf("%serror:%s '%s': %s\n", RED, RESET, path, error);
+        exit(1);
+    }
+    return pixel;
+}
+
+typedef struct
 {
     Dataset dataset;
+    uint8_t *buffer;
+} DecodeJob;
+
+void decode_images(void *context, int start, int end)
+{
+    DecodeJob *job = context;
+    int pixel = job->dataset.rows * job->dataset.cols;
+    for (int i = start; i < end; i++)
+    {
+        double *data = job->dataset.pixels + (size_t)i * pixel;
+        for (int j = 0; j < pixel; j++)
+        {
+            data[j] = ((double)job->buffer[(size_t)i * pixel + j]) / 255.0;
+        }
+        job->dataset.images[i].data = data;
+    }
+}
+
+// places the pixels of a dataset according to NEURAL_NUMA_DATA, before they are first written
+void place_pixels(Dataset dataset)
+{
+    MemoryPolicy policy = memory_policy();
+    size_t size = (size_t)dataset.size * dataset.rows * dataset.cols;
+    int placed = 1;
+    if (policy.data == PLACEMENT_INTERLEAVE)
+    {
+        placed = large_array_interleave(dataset.pixels, size);
+    }
+    else if (policy.data == PLACEMENT_SHARD)
+    {
+        // contiguous shards of whole images
+        for (int node = 0; node < policy.n_nodes; node++)
+        {
+            size_t start = (size_t)(dataset.size * node / policy.n_nodes) * dataset.rows * dataset.cols;
+            size_t end = (size_t)(dataset.size * (node + 1) / policy.n_nodes) * dataset.rows * dataset.cols;
+            placed &= large_array_bind(dataset.pixels + start, end - start, node);
+        }
+    }
+    if (!placed)
+    {
+        fprintf(stderr, "warning: cannot %s the images across NUMA nodes, they stay where they are first touched\n",
+                placement_names[policy.data]);
+    }
+}
+
+Dataset load_mnist_dataset(char *path_to_labels, char *path_to_images)
+{
+    Dataset dataset = {.view = 0};
 
     {
         FILE *file = fopen(path_to_labels, "rb");
@@ -429,7 +6225,15 @@ Dataset load_mnist_dataset(char *path_to_labels, char *path_to_images)
 
         fseek(file, 4, SEEK_SET); // skip magic number
         dataset.size = read_network_order(file);
+        dataset.capacity = dataset.size;
         dataset.images = malloc(sizeof(Image) * dataset.size);
+        dataset.labels = large_array((size_t)dataset.size * 10);
+        if (dataset.images == NULL || dataset.labels == NULL)
+        {
+            printf("%serror:%s out of memory for %d labels\n", RED, RESET, dataset.size);
+            exit(1);
+        }
+        memset(dataset.labels, 0, (size_t)dataset.size * 10 * sizeof(double));
 
         uint8_t number;
         for (int i = 0; i < dataset.size; i++)
@@ -439,7 +6243,7 @@ Dataset load_mnist_dataset(char *path_to_labels, char *path_to_images)
                 printf("%serror:%s failed to read label from file\n", RED, RESET);
                 exit(1);
             };
-            dataset.images[i].label = calloc(sizeof(double), 10);
+            dataset.images[i].label = dataset.labels + (size_t)i * 10;
             dataset.images[i].label[number] = 1.0;
         }
 
@@ -454,25 +6258,33 @@ Dataset load_mnist_dataset(char *path_to_labels, char *path_to_images)
         }
 
         fseek(file, 4, SEEK_SET); // skip magic number
-        dataset.size = read_network_order(file);
+        if (read_network_order(file) != dataset.capacity)
+        {
+            printf("%serror:%s '%s' and '%s' hold different numbers of images\n", RED, RESET, path_to_labels, path_to_images);
+            exit(1);
+        }
         dataset.rows = read_network_order(file);
         dataset.cols = read_network_order(file);
 
         int pixel = dataset.rows * dataset.cols;
-        uint8_t buffer[pixel];
-        for (int i = 0; i < dataset.size; i++)
+        uint8_t *buffer = malloc((size_t)dataset.size * pixel);
+        if (fread(buffer, pixel, dataset.size, file) != (unsigned)dataset.size)
         {
-            dataset.images[i].data = malloc(sizeof(double) * pixel);
-            if (fread(buffer, 1, pixel, file) != (unsigned)pixel)
-            {
-                printf("%serror:%s failed to read images from file\n", RED, RESET);
-                exit(1);
-            };
-            for (int j = 0; j < pixel; j++)
-            {
-                dataset.images[i].data[j] = ((double)buffer[j]) / 255.0;
-            }
+            printf("%serror:%s failed to read images from file\n", RED, RESET);
+            exit(1);
+        };
+
+        dataset.pixels = large_array((size_t)dataset.size * pixel);
+        if (dataset.pixels == NULL)
+        {
+            printf("%serror:%s out of memory for %d images\n", RED, RESET, dataset.size);
+            exit(1);
         }
+        place_pixels(dataset);
+
+        DecodeJob job = {.dataset = dataset, .buffer = buffer};
+        parallel_for(dataset.size, parallel_grain(dataset.size), decode_images, &job);
+        free(buffer);
 
         fclose(file);
     }
@@ -482,10 +6294,18 @@ Dataset load_mnist_dataset(char *path_to_labels, char *path_to_images)
 
 void destroy_dataset(Dataset dataset)
 {
-    for (int i = 0; i < dataset.size; i++)
+    if (!dataset.view && dataset.pixels != NULL)
+    {
+        large_array_free(dataset.pixels, (size_t)dataset.capacity * dataset.rows * dataset.cols);
+        large_array_free(dataset.labels, (size_t)dataset.capacity * 10);
+    }
+    else if (!dataset.view)
     {
-        free(dataset.images[i].label);
-        free(dataset.images[i].data);
+        for (int i = 0; i < dataset.size; i++)
+        {
+            free(dataset.images[i].label);
+            free(dataset.images[i].data);
+        }
     }
     free(dataset.images);
 }
@@ -496,13 +6316,47 @@ void destroy_dataset(Dataset dataset)
  * SERIALIZATION FORMAT
  * SECTION | ndim |   dims   |          w[1]         |     b[1]    | ... |
  * SIZE    |   4  | 4 * ndim | 8 * dims[1] * dims[0] | 8 * dims[1] | ... |
+ *
+ * Networks with factored layers start with a negative format version, so
+ * older readers reject them. Version 2 stores the rank of every layer and
+ * either its weights or its two factors:
+ * SECTION | -2 | ndim |   dims   | rank[1] | w[1] or left[1], right[1] |     b[1]    | ... |
+ * SIZE    |  4 |   4  | 4 * ndim |    4    |  8 * dims[1] * dims[0] or  | 8 * dims[1] | ... |
+ *         |    |      |          |         |  8 * rank[1] * (dims[1] +  |             |     |
+ *         |    |      |          |         |  dims[0])                  |             |     |
+ *
+ * Version 3 also stores the levels of every layer, with the bit-packed rows
+ * and the scales of the quantized layers instead of their weights, see
+ * QUANTIZED LAYERS. Ternary layers store their masks after their signs:
+ * SECTION | -3 | ndim |   dims   | rank[1] | levels[1] | w[1], left[1], right[1] or |     b[1]    | ... |
+ *         |    |      |          |         |           | signs[1], masks[1], scale[1] |           |     |
+ * SIZE    |  4 |   4  | 4 * ndim |    4    |     4     | 8 * dims[1] * words(dims[0]) | 8 * dims[1] | ... |
+ *         |    |      |          |         |           | per packed matrix, 8 * dims[1] |           |     |
+ *         |    |      |          |         |           | for the scales               |           |     |
+ * where words(n) = (n + 63) / 64 and bit j % 64 of word j / 64 holds column j.
  */
 
+#define FORMAT_FACTORED 2
+#define FORMAT_QUANTIZED 3
+#define MAX_PARAMETERS (1 << 28) // weights and biases of a model that read_network accepts, 2 GB of doubles
+
 void serialize_network(Network network, FILE *file)
 {
     int ndim = network.ndim;
     int *dims = network.dims;
 
+    int factored = 0;
+    for (int l = 1; l < ndim; l++)
+    {
+        factored |= network.ranks[l] > 0;
+    }
+    int quantized = network_quantized(network);
+    if (factored || quantized)
+    {
+        int32_t version = quantized ? -FORMAT_QUANTIZED : -FORMAT_FACTORED;
+        fwrite(&version, sizeof(int32_t), 1, file);
+    }
+
     fwrite(&ndim, sizeof(int32_t), 1, file);
     for (int l = 0; l < ndim; l++)
     {
@@ -511,44 +6365,180 @@ void serialize_network(Network network, FILE *file)
 
     for (int l = 1; l < ndim; l++)
     {
-        fwrite(network.weights[l], sizeof(double), dims[l] * dims[l - 1], file);
+        int rank = network.ranks[l];
+        if (factored || quantized)
+        {
+            fwrite(&rank, sizeof(int32_t), 1, file);
+        }
+        if (quantized)
+        {
+            fwrite(network.levels + l, sizeof(int32_t), 1, file);
+        }
+        if (network.levels[l] > 0)
+        {
+            size_t words = (size_t)dims[l] * packed_words(dims[l - 1]);
+            fwrite(network.signs[l], sizeof(uint64_t), words, file);
+            if (network.masks[l] != NULL)
+            {
+                fwrite(network.masks[l], sizeof(uint64_t), words, file);
+            }
+            fwrite(network.scales[l], sizeof(double), dims[l], file);
+        }
+        else if (rank > 0)
+        {
+            fwrite(network.left[l], sizeof(double), (size_t)dims[l] * rank, file);
+            fwrite(network.right[l], sizeof(double), (size_t)rank * dims[l - 1], file);
+        }
+        else
+        {
+            fwrite(network.weights[l], sizeof(double), dims[l] * dims[l - 1], file);
+        }
         fwrite(network.biases[l], sizeof(double), dims[l], file);
     }
 }
 
+/*
+ * Reads a network without exiting on malformed input, returns the number of
+ * failures. Implausible sizes are rejected before anything is allocated.
+ */
 // todo: make this platform independent
-Network deserialize_network(FILE *file)
+// reads a network for training, or only for inference
+int read_network(FILE *file, Network *network, int inference)
 {
-    int ndim;
-    int failures = fread(&ndim, sizeof(int32_t), 1, file) != 1;
-
-    int *dims = malloc(ndim * sizeof(int32_t));
+    int32_t ndim;
+    if (fread(&ndim, sizeof(int32_t), 1, file) != 1)
+    {
+        return 1;
+    }
+    int quantized = ndim == -FORMAT_QUANTIZED;
+    int factored = ndim == -FORMAT_FACTORED || quantized;
+    if ((factored && fread(&ndim, sizeof(int32_t), 1, file) != 1) || ndim < 2 || ndim > 64)
+    {
+        return 1;
+    }
 
+    int dims[ndim];
+    size_t parameters = 0;
     for (int l = 0; l < ndim; l++)
     {
-        failures += fread(dims + l, sizeof(int32_t), 1, file) != 1;
+        if (fread(dims + l, sizeof(int32_t), 1, file) != 1 || dims[l] < 1 || dims[l] > (1 << 20))
+        {
+            return 1;
+        }
+        parameters += l > 0 ? (size_t)dims[l] * dims[l - 1] + dims[l] : 0;
+    }
+    // sizes stay far from overflowing int, and a crafted header cannot request unbounded memory
+    if (parameters > MAX_PARAMETERS)
+    {
+        return 1;
     }
 
-    Network network = network_create(ndim, dims);
+    *network = network_allocate(ndim, dims, inference);
+    if (network->ndim == 0)
+    {
+        return 1;
+    }
 
-    for (int l = 1; l < ndim; l++)
+    int failures = 0;
+    for (int l = 1; l < ndim && !failures; l++)
+    {
+        int32_t rank = 0;
+        if (factored && (fread(&rank, sizeof(int32_t), 1, file) != 1 || rank < 0 || rank > dims[l] || rank > dims[l - 1]))
+        {
+            failures++;
+            break;
+        }
+        int32_t levels = 0;
+        if (quantized && (fread(&levels, sizeof(int32_t), 1, file) != 1 ||
+                          (levels != 0 && levels != LEVELS_BINARY && levels != LEVELS_TERNARY) ||
+                          (levels > 0 && rank > 0)))
+        {
+            failures++;
+            break;
+        }
+        if (levels > 0)
+        {
+            size_t words = (size_t)dims[l] * packed_words(dims[l - 1]);
+            network_set_levels(*network, l, levels);
+            if (network->signs[l] == NULL || (levels == LEVELS_TERNARY && network->masks[l] == NULL) || network->scales[l] == NULL)
+            {
+                failures++;
+                break;
+            }
+            failures += fread(network->signs[l], sizeof(uint64_t), words, file) != words;
+            if (network->masks[l] != NULL)
+            {
+                failures += fread(network->masks[l], sizeof(uint64_t), words, file) != words;
+            }
+            failures += fread(network->scales[l], sizeof(double), dims[l], file) != (unsigned)dims[l];
+            if (inference)
+            {
+                // inference only reads the packed weights
+                large_array_free(network->weights[l], (size_t)dims[l] * dims[l - 1]);
+                network->weights[l] = NULL;
+            }
+            else
+            {
+                // latent weights that quantize to the packed ones again
+                for (int i = 0; i < dims[l] && !failures; i++)
+                {
+                    dequantize_row(*network, l, i, network->weights[l] + (size_t)i * dims[l - 1]);
+                }
+            }
+        }
+        else if (rank > 0)
+        {
+            size_t n_left = (size_t)dims[l] * rank;
+            size_t n_right = (size_t)rank * dims[l - 1];
+            network_set_rank(*network, l, rank);
+            if (network->left[l] == NULL || network->right[l] == NULL)
+            {
+                failures++;
+                break;
+            }
+            failures += fread(network->left[l], sizeof(double), n_left, file) != n_left;
+            failures += fread(network->right[l], sizeof(double), n_right, file) != n_right;
+            if (inference)
+            {
+                // inference only reads the factors
+                large_array_free(network->weights[l], (size_t)dims[l] * dims[l - 1]);
+                network->weights[l] = NULL;
+            }
+            else
+            {
+                network_expand_layer(*network, l);
+            }
+        }
+        else
+        {
+            size_t size = (size_t)dims[l] * dims[l - 1];
+            failures += fread(network->weights[l], sizeof(double), size, file) != size;
+        }
+        failures += fread(network->biases[l], sizeof(double), dims[l], file) != (unsigned)dims[l];
+    }
+
+    if (failures)
     {
-        failures += fread(network.weights[l], sizeof(double), dims[l] * dims[l - 1], file) != (unsigned)dims[l] * dims[l - 1];
-        failures += fread(network.biases[l], sizeof(double), dims[l], file) != (unsigned)dims[l];
+        network_destroy(*network);
     }
+    return failures;
+}
 
+Network deserialize_network(FILE *file, int inference)
+{
+    Network network;
+    int failures = read_network(file, &network, inference);
     if (failures)
     {
         printf("%serror:%s failed to load read network from file %d\n", RED, RESET, failures);
         exit(1);
     }
 
-    free(dims);
-
     return network;
 }
 
-Network load_network(char *path)
+// loads a network for training, or only for inference
+Network load_network(char *path, int inference)
 {
 
     FILE *file = fopen(path, "rb");
@@ -558,15 +6548,404 @@ Network load_network(char *path)
         exit(1);
     }
 
-    Network network = deserialize_network(file);
+    Network network = deserialize_network(file, inference);
     fclose(file);
 
-    printf("info: loaded model '%s' with size %d", path, network.dims[0]);
+    // diagnostics go to stderr, so results written to stdout stay machine-readable
+    fprintf(stderr, "info: loaded model '%s' with size %d", path, network.dims[0]);
     for (int i = 1; i < network.ndim; i++)
     {
-        printf("x%d", network.dims[i]);
+        fprintf(stderr, network.ranks[i] > 0 ? "x%d(rank %d)" : "x%d", network.dims[i], network.ranks[i]);
+        if (network.levels[i] > 0)
+        {
+            fprintf(stderr, network.levels[i] == LEVELS_TERNARY ? "(ternary)" : "(binary)");
+        }
     }
-    printf("\n");
+    fprintf(stderr, "%s, working set %.2f MB\n", inference ? " for inference" : "", network_bytes(network) / 1e6);
 
     return network;
 }
+
+/*
+ * ONLINE LEARNING
+ *
+ * New samples arrive as lines '<path>,<label>' naming a PGM image and its
+ * digit, e.g. the CSV of 'neural run' with corrected predictions. They are
+ * read from a file that is followed like 'tail -f', from standard input or
+ * from the clients of a Unix socket. Every step mixes the new samples with
+ * samples replayed from the original dataset and from the new samples seen
+ * before, so the model learns the new data without forgetting the old.
+ */
+
+#define SOURCE_LINE 4352 // a path of PATH_MAX, the label and more columns
+
+typedef struct
+{
+    int fd;
+    int length;
+    char line[SOURCE_LINE];
+} SourceReader;
+
+typedef struct
+{
+    int listener; // listening socket, -1 when reading a file
+    int follow;   // wait for more data at the end of the file
+    SourceReader *readers;
+    int n_readers;
+} SampleSource;
+
+// reads '-' (standard input, until it ends), 'unix:<path>' (clients of a socket) or a file that is followed
+SampleSource sample_source_open(char *address)
+{
+    SampleSource source = {.listener = -1, .follow = 0, .readers = malloc(sizeof(SourceReader)), .n_readers = 0};
+    if (strncmp(address, "unix:", 5) == 0)
+    {
+        source.listener = socket_listen(address);
+        return source;
+    }
+
+    int fd = strcmp(address, "-") == 0 ? STDIN_FILENO : open(address, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("%serror:%s cannot open '%s'\n", RED, RESET, address);
+        exit(1);
+    }
+    source.follow = fd != STDIN_FILENO;
+    source.readers[0] = (SourceReader){.fd = fd, .length = 0};
+    source.n_readers = 1;
+    return source;
+}
+
+void sample_source_close(SampleSource source)
+{
+    for (int r = 0; r < source.n_readers; r++)
+    {
+        if (source.readers[r].fd != STDIN_FILENO)
+        {
+            close(source.readers[r].fd);
+        }
+    }
+    if (source.listener >= 0)
+    {
+        close(source.listener);
+    }
+    free(source.readers);
+}
+
+/*
+ * Reads what arrives within timeout_ms and calls handler for every complete
+ * line. Returns the number of lines, or -1 once standard input has ended.
+ */
+int sample_source_poll(SampleSource *source, int timeout_ms, void (*handler)(void *, char *), void *context)
+{
+    int n_fds = source->n_readers + (source->listener >= 0);
+    struct pollfd *fds = malloc(n_fds * sizeof(struct pollfd));
+    for (int r = 0; r < source->n_readers; r++)
+    {
+        fds[r] = (struct pollfd){.fd = source->readers[r].fd, .events = POLLIN};
+    }
+    if (source->listener >= 0)
+    {
+        fds[n_fds - 1] = (struct pollfd){.fd = source->listener, .events = POLLIN};
+    }
+
+    int n_lines = 0;
+    int ended = 0;
+    int idle = poll(fds, n_fds, timeout_ms) <= 0;
+    // backwards, so closed clients can be replaced by the last one
+    for (int r = source->n_readers - 1; !idle && r >= 0; r--)
+    {
+        if (fds[r].revents == 0)
+        {
+            continue;
+        }
+
+        SourceReader *reader = source->readers + r;
+        ssize_t count = read(reader->fd, reader->line + reader->length, SOURCE_LINE - 1 - reader->length);
+        if (count > 0)
+        {
+            reader->length += count;
+            char *start = reader->line;
+            char *newline;
+            while ((newline = memchr(start, '\n', reader->line + reader->length - start)) != NULL)
+            {
+                *newline = '\0';
+                handler(context, start);
+                n_lines++;
+                start = newline + 1;
+            }
+            reader->length -= start - reader->line;
+            memmove(reader->line, start, reader->length);
+            if (reader->length == SOURCE_LINE - 1)
+            {
+                fprintf(stderr, "warning: skipping a line longer than %d bytes\n", SOURCE_LINE - 1);
+                reader->length = 0;
+            }
+            continue;
+        }
+
+        // the end of the data, a last line may lack its newline
+        if (reader->length > 0 && !source->follow)
+        {
+            reader->line[reader->length] = '\0';
+            handler(context, reader->line);
+            n_lines++;
+            reader->length = 0;
+        }
+        if (source->listener >= 0)
+        {
+            close(reader->fd);
+            source->readers[r] = source->readers[--source->n_readers];
+        }
+        else if (source->follow)
+        {
+            // start over when the file was truncated, otherwise wait for it to grow
+            struct stat status;
+            if (fstat(reader->fd, &status) == 0 && status.st_size < lseek(reader->fd, 0, SEEK_CUR))
+            {
+                lseek(reader->fd, 0, SEEK_SET);
+                reader->length = 0;
+            }
+            else if (n_lines == 0)
+            {
+                struct timespec wait = {.tv_sec = timeout_ms / 1000, .tv_nsec = timeout_ms % 1000 * 1000000L};
+                nanosleep(&wait, NULL);
+            }
+        }
+        else
+        {
+            ended = 1;
+        }
+    }
+
+    if (source->listener >= 0 && !idle && fds[n_fds - 1].revents != 0)
+    {
+        int fd = accept(source->listener, NULL, NULL);
+        if (fd >= 0)
+        {
+            source->readers = realloc(source->readers, (source->n_readers + 1) * sizeof(SourceReader));
+            source->readers[source->n_readers++] = (SourceReader){.fd = fd, .length = 0};
+        }
+    }
+    free(fds);
+    return ended ? -1 : n_lines;
+}
+
+typedef struct
+{
+    Dataset replay;  // the original dataset
+    Dataset fresh;   // the new samples not replayed yet in order of arrival, each owning its data
+    int capacity;    // images allocated in fresh
+    int taken;       // samples at the start of fresh that went into the last batch
+    Image *kept;     // ring of the last new samples trained on, replayed with the original dataset
+    int kept_capacity;
+    int trained;     // new samples that went into a step, the rest are pending
+    double ratio;    // share of replayed samples in a batch
+    int batch_size;
+    int n_outputs;
+    long step;
+    Image *batch;
+    int rejected;    // lines that were not a readable image and a label
+    DecodeBuffer decode;
+} Online;
+
+Online online_create(Dataset replay, int n_outputs, int batch_size, double ratio, int kept_capacity)
+{
+    Online online = {
+        .replay = replay,
+        .fresh = {.images = malloc(16 * sizeof(Image)), .rows = replay.rows, .cols = replay.cols},
+        .capacity = 16,
+        .kept = malloc(kept_capacity * sizeof(Image)),
+        .kept_capacity = kept_capacity,
+        .ratio = ratio,
+        .batch_size = batch_size,
+        .n_outputs = n_outputs,
+        .batch = malloc(batch_size * sizeof(Image)),
+    };
+    return online;
+}
+
+// new samples in the ring, the ones of the last batch join it when the next one is drawn
+int online_kept(Online *online)
+{
+    int retired = online->trained - online->taken;
+    return retired < online->kept_capacity ? retired : online->kept_capacity;
+}
+
+void online_destroy(Online online)
+{
+    for (int i = 0; i < online_kept(&online); i++)
+    {
+        free(online.kept[i].label);
+        free(online.kept[i].data);
+    }
+    free(online.kept);
+    destroy_dataset(online.fresh);
+    free(online.batch);
+    decode_buffer_destroy(online.decode);
+}
+
+// splits a line '<path>,<label>' or '"<path>",<label>,..', returns the path or NULL
+char *online_parse(char *line, int *label)
+{
+    char *path = line;
+    char *end;
+    if (*line == '"')
+    {
+        // quotes inside a quoted path are doubled, unescape it in place
+        char *c = line + 1;
+        path = end = line + 1;
+        while (*c != '\0' && !(*c == '"' && c[1] != '"'))
+        {
+            c += *c == '"';
+            *end++ = *c++;
+        }
+        if (*c != '"' || c[1] != ',')
+        {
+            return NULL;
+        }
+        *end = '\0';
+        end = c + 1;
+    }
+    else
+    {
+        end = strchr(line, ',');
+        if (end == NULL)
+        {
+            return NULL;
+        }
+        *end = '\0';
+    }
+
+    char *rest;
+    long value = strtol(end + 1, &rest, 10);
+    if (rest == end + 1 || (*rest != '\0' && *rest != ',' && *rest != '\r') || value < 0 || value > INT32_MAX)
+    {
+        return NULL;
+    }
+    *label = (int)value;
+    return path;
+}
+
+// decodes the image of a line and appends it to the new samples
+void online_add(void *context, char *line)
+{
+    Online *online = context;
+    int label;
+    char *path = online_parse(line, &label);
+    if (path == NULL || label >= online->n_outputs)
+    {
+        fprintf(stderr, "warning: skipping '%s', expected '<path>,<label>' with a label below %d\n", line, online->n_outputs);
+        online->rejected++;
+        return;
+    }
+
+    double *data = malloc((size_t)online->fresh.rows * online->fresh.cols * sizeof(double));
+    const char *error = decode_pgm(path, online->fresh.cols, online->fresh.rows, data, &online->decode);
+    if (error != NULL)
+    {
+        fprintf(stderr, "warning: skipping '%s': %s\n", path, error);
+        free(data);
+        online->rejected++;
+        return;
+    }
+
+    if (online->fresh.size == online->capacity)
+    {
+        online->capacity *= 2;
+        online->fresh.images = realloc(online->fresh.images, online->capacity * sizeof(Image));
+    }
+    double *one_hot = calloc(online->n_outputs, sizeof(double));
+    one_hot[label] = 1.0;
+    online->fresh.images[online->fresh.size++] = (Image){.label = one_hot, .data = data};
+}
+
+/*
+ * Fills the next batch with pending new samples and replayed ones, drawn from
+ * the original dataset and the last kept_capacity new samples trained before.
+ * Returns its size, 0 until enough new samples are pending, unless flushing
+ * the last of them.
+ */
+int online_batch(Online *online, int flush)
+{
+    // the last step is done, so its new samples move into the ring and the oldest ones there are freed
+    int first = online->trained - online->taken;
+    for (int b = 0; b < online->taken; b++)
+    {
+        Image image = online->fresh.images[b];
+        if (online->kept_capacity == 0)
+        {
+            free(image.label);
+            free(image.data);
+            continue;
+        }
+        int slot = (first + b) % online->kept_capacity;
+        if (first + b >= online->kept_capacity)
+        {
+            free(online->kept[slot].label);
+            free(online->kept[slot].data);
+        }
+        online->kept[slot] = image;
+    }
+    online->fresh.size -= online->taken;
+    memmove(online->fresh.images, online->fresh.images + online->taken, online->fresh.size * sizeof(Image));
+    online->taken = 0;
+
+    int pending = online->fresh.size;
+    int n_fresh = online->batch_size - (int)lround(online->batch_size * online->ratio);
+    n_fresh = n_fresh < 1 ? 1 : n_fresh;
+    if (pending == 0 || (pending < n_fresh && !flush))
+    {
+        return 0;
+    }
+
+    // a partial batch keeps the share of replayed samples
+    int n_replay = online->batch_size - n_fresh;
+    if (pending < n_fresh)
+    {
+        n_fresh = pending;
+        n_replay = (int)lround(n_fresh * online->ratio / (1 - online->ratio));
+        n_replay = n_replay < online->batch_size - n_fresh ? n_replay : online->batch_size - n_fresh;
+    }
+
+    int n_seen = online->replay.size + online_kept(online);
+    n_replay = n_seen > 0 ? n_replay : 0;
+    for (int b = 0; b < n_fresh; b++)
+    {
+        online->batch[b] = online->fresh.images[b];
+    }
+    for (int b = 0; b < n_replay; b++)
+    {
+        int r = rng_next(STREAM_REPLAY, (uint64_t)online->step * online->batch_size + b) % n_seen;
+        online->batch[n_fresh + b] = r < online->replay.size ? online->replay.images[r] : online->kept[r - online->replay.size];
+    }
+
+    online->taken = n_fresh;
+    online->trained += n_fresh;
+    online->step++;
+    return n_fresh + n_replay;
+}
+
+// writes the network next to path and renames it over path, so readers see either the old or the new snapshot
+void publish_network(Network network, char *path)
+{
+    char *temporary = malloc(strlen(path) + 8);
+    sprintf(temporary, "%s.XXXXXX", path);
+    int fd = mkstemp(temporary);
+    FILE *file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (file == NULL)
+    {
+        printf("%serror:%s cannot create '%s'\n", RED, RESET, temporary);
+        exit(1);
+    }
+
+    fchmod(fd, 0644);
+    serialize_network(network, file);
+    if (fflush(file) != 0 || fsync(fd) != 0 || fclose(file) != 0 || rename(temporary, path) != 0)
+    {
+        unlink(temporary);
+        printf("%serror:%s cannot write '%s'\n", RED, RESET, path);
+        exit(1);
+    }
+    free(temporary);
+}
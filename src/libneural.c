@@ -0,0 +1,443 @@
+#define NEURAL_BUILD
+#include "neural.h"
+#include "lib.c"
+
+// LIBRARY
+
+struct neural_model
+{
+    Network network;
+    Replicas replicas;
+};
+
+struct neural_context
+{
+    Network network;
+    InferenceContext inference;
+    double **inputs;
+    neural_live *live;     // NULL for contexts of a fixed model
+    int node;
+    unsigned long reading; // epoch of the live model while predicting, 0 otherwise
+};
+
+/*
+ * LIVE MODELS
+ *
+ * A live model follows a file that 'neural online' keeps replacing with new
+ * snapshots. A new snapshot is swapped in with an atomic pointer exchange,
+ * read-copy-update style: predictions never wait, they only announce the
+ * epoch they started in, and the replaced model is freed once no prediction
+ * that may still read it is running.
+ */
+
+struct neural_live
+{
+    neural_model *current;
+    unsigned long epoch;   // advanced by every swap, starts at 1 so 0 means not reading
+    unsigned long version; // snapshots loaded
+    char *path;
+    struct stat loaded;    // the file of the last snapshot tried
+    int interval_ms;
+    int stop;
+    pthread_t watcher;
+    pthread_mutex_t lock; // serializes swaps with creating and freeing contexts
+    pthread_cond_t wake;
+    neural_context **contexts;
+    int n_contexts;
+};
+
+const char *neural_status_string(neural_status status)
+{
+    switch (status)
+    {
+    case NEURAL_OK:
+        return "ok";
+    case NEURAL_ERROR_IO:
+        return "cannot open model";
+    case NEURAL_ERROR_FORMAT:
+        return "malformed model";
+    case NEURAL_ERROR_ARGUMENT:
+        return "invalid argument";
+    case NEURAL_ERROR_SHAPE:
+        return "snapshot has another shape";
+    case NEURAL_ERROR_MEMORY:
+        return "out of memory";
+    }
+    return "unknown status";
+}
+
+neural_status model_from_file(FILE *file, neural_model **model)
+{
+    Network network;
+    if (read_network(file, &network, 1) != 0)
+    {
+        return NEURAL_ERROR_FORMAT;
+    }
+
+    *model = malloc(sizeof(neural_model));
+    if (*model == NULL)
+    {
+        network_destroy(network);
+        return NEURAL_ERROR_MEMORY;
+    }
+    (*model)->network = network;
+    (*model)->replicas = replicas_create(network);
+    return NEURAL_OK;
+}
+
+neural_status neural_model_load(const char *path, neural_model **model)
+{
+    if (path == NULL || model == NULL)
+    {
+        return NEURAL_ERROR_ARGUMENT;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return NEURAL_ERROR_IO;
+    }
+    neural_status status = model_from_file(file, model);
+    fclose(file);
+    return status;
+}
+
+neural_status neural_model_load_memory(const void *data, size_t size, neural_model **model)
+{
+    if (data == NULL || size == 0 || model == NULL)
+    {
+        return NEURAL_ERROR_ARGUMENT;
+    }
+
+    FILE *file = fmemopen((void *)data, size, "rb");
+    if (file == NULL)
+    {
+        return NEURAL_ERROR_IO;
+    }
+    neural_status status = model_from_file(file, model);
+    fclose(file);
+    return status;
+}
+
+void neural_model_free(neural_model *model)
+{
+    if (model != NULL)
+    {
+        replicas_destroy(model->replicas);
+        network_destroy(model->network);
+        free(model);
+    }
+}
+
+size_t neural_model_bytes(const neural_model *model)
+{
+    return network_bytes(model->network) + model->replicas.n_nodes * network_parameter_bytes(model->network);
+}
+
+int neural_model_input_size(const neural_model *model)
+{
+    return model->network.dims[0];
+}
+
+int neural_model_output_size(const neural_model *model)
+{
+    return model->network.dims[model->network.ndim - 1];
+}
+
+neural_status neural_context_create(const neural_model *model, int max_batch, neural_context **context)
+{
+    if (model == NULL || max_batch < 1 || context == NULL)
+    {
+        return NEURAL_ERROR_ARGUMENT;
+    }
+
+    neural_context *created = malloc(sizeof(neural_context));
+    if (created == NULL)
+    {
+        return NEURAL_ERROR_MEMORY;
+    }
+    created->inference = inference_context_create(model->network, max_batch);
+    created->inputs = malloc(max_batch * sizeof(double *));
+    if (created->inference.capacity == 0 || created->inputs == NULL)
+    {
+        inference_context_destroy(created->inference);
+        free(created->inputs);
+        free(created);
+        return NEURAL_ERROR_MEMORY;
+    }
+
+    *context = created;
+    // contexts are used by the thread that creates them, read the weights local to it
+    (*context)->network = replica_network(model->replicas, model->network, current_node());
+    (*context)->live = NULL;
+    (*context)->node = current_node();
+    (*context)->reading = 0;
+    return NEURAL_OK;
+}
+
+void neural_context_free(neural_context *context)
+{
+    if (context != NULL)
+    {
+        neural_live *live = context->live;
+        if (live != NULL)
+        {
+            pthread_mutex_lock(&live->lock);
+            for (int c = 0; c < live->n_contexts; c++)
+            {
+                if (live->contexts[c] == context)
+                {
+                    live->contexts[c] = live->contexts[--live->n_contexts];
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&live->lock);
+        }
+        inference_context_destroy(context->inference);
+        free(context->inputs);
+        free(context);
+    }
+}
+
+neural_status neural_predict(neural_context *context, const double *inputs, int n, double *outputs)
+{
+    if (context == NULL || inputs == NULL || outputs == NULL || n < 0 || n > context->inference.capacity)
+    {
+        return NEURAL_ERROR_ARGUMENT;
+    }
+
+    Network network = context->network;
+    neural_live *live = context->live;
+    if (live != NULL)
+    {
+        // announce the epoch before reading the pointer, a swap then waits for this prediction
+        __atomic_store_n(&context->reading, __atomic_load_n(&live->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+        neural_model *model = __atomic_load_n(&live->current, __ATOMIC_SEQ_CST);
+        network = replica_network(model->replicas, model->network, context->node);
+    }
+    int n_inputs = network.dims[0];
+    int n_outputs = network.dims[network.ndim - 1];
+
+    // the inputs are only read, rows point straight into the caller's buffer
+    for (int b = 0; b < n; b++)
+    {
+        context->inputs[b] = (double *)inputs + (size_t)b * n_inputs;
+    }
+
+    double *result = forward_batch(network, &context->inference, n, context->inputs);
+    memcpy(outputs, result, (size_t)n * n_outputs * sizeof(double));
+    if (live != NULL)
+    {
+        __atomic_store_n(&context->reading, 0, __ATOMIC_RELEASE);
+    }
+    return NEURAL_OK;
+}
+
+int same_shape(Network a, Network b)
+{
+    if (a.ndim != b.ndim)
+    {
+        return 0;
+    }
+    for (int l = 0; l < a.ndim; l++)
+    {
+        // contexts size their buffers by the widths and ranks
+        if (a.dims[l] != b.dims[l] || a.ranks[l] != b.ranks[l])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// loads the file if it was replaced since the last snapshot and swaps it in, with the lock held
+neural_status live_refresh(neural_live *live)
+{
+    FILE *file = fopen(live->path, "rb");
+    if (file == NULL)
+    {
+        return NEURAL_ERROR_IO;
+    }
+
+    // renaming a snapshot over the path gives it a new inode
+    struct stat status;
+    fstat(fileno(file), &status);
+    if (status.st_ino == live->loaded.st_ino && status.st_dev == live->loaded.st_dev &&
+        status.st_size == live->loaded.st_size && status.st_mtim.tv_sec == live->loaded.st_mtim.tv_sec &&
+        status.st_mtim.tv_nsec == live->loaded.st_mtim.tv_nsec)
+    {
+        fclose(file);
+        return NEURAL_OK;
+    }
+
+    // a snapshot that fails to load is not tried again until the file changes
+    live->loaded = status;
+    neural_model *model;
+    neural_status result = model_from_file(file, &model);
+    fclose(file);
+    if (result != NEURAL_OK)
+    {
+        return result;
+    }
+    if (!same_shape(model->network, live->current->network))
+    {
+        neural_model_free(model);
+        return NEURAL_ERROR_SHAPE;
+    }
+
+    neural_model *old = __atomic_exchange_n(&live->current, model, __ATOMIC_SEQ_CST);
+    unsigned long epoch = __atomic_add_fetch(&live->epoch, 1, __ATOMIC_SEQ_CST);
+
+    // grace period: predictions that announced an older epoch may still read the old model
+    for (int c = 0; c < live->n_contexts; c++)
+    {
+        unsigned long reading;
+        while ((reading = __atomic_load_n(&live->contexts[c]->reading, __ATOMIC_SEQ_CST)) != 0 && reading < epoch)
+        {
+            sched_yield();
+        }
+    }
+    neural_model_free(old);
+    __atomic_add_fetch(&live->version, 1, __ATOMIC_RELEASE);
+    return NEURAL_OK;
+}
+
+void *live_watch(void *arg)
+{
+    neural_live *live = arg;
+    pthread_mutex_lock(&live->lock);
+    while (!live->stop)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += live->interval_ms / 1000;
+        deadline.tv_nsec += live->interval_ms % 1000 * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&live->wake, &live->lock, &deadline);
+        if (!live->stop)
+        {
+            live_refresh(live);
+        }
+    }
+    pthread_mutex_unlock(&live->lock);
+    return NULL;
+}
+
+neural_status neural_live_open(const char *path, int interval_ms, neural_live **live)
+{
+    if (path == NULL || interval_ms < 0 || live == NULL)
+    {
+        return NEURAL_ERROR_ARGUMENT;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return NEURAL_ERROR_IO;
+    }
+    struct stat status;
+    fstat(fileno(file), &status);
+    neural_model *model;
+    neural_status result = model_from_file(file, &model);
+    fclose(file);
+    if (result != NEURAL_OK)
+    {
+        return result;
+    }
+
+    neural_live *opened = calloc(1, sizeof(neural_live));
+    char *copy = strdup(path);
+    if (opened == NULL || copy == NULL)
+    {
+        free(opened);
+        free(copy);
+        neural_model_free(model);
+        return NEURAL_ERROR_MEMORY;
+    }
+    *live = opened;
+    (*live)->current = model;
+    (*live)->epoch = 1;
+    (*live)->version = 1;
+    (*live)->path = copy;
+    (*live)->loaded = status;
+    (*live)->interval_ms = interval_ms;
+    pthread_mutex_init(&(*live)->lock, NULL);
+    pthread_cond_init(&(*live)->wake, NULL);
+    if (interval_ms > 0)
+    {
+        pthread_create(&(*live)->watcher, NULL, live_watch, *live);
+    }
+    return NEURAL_OK;
+}
+
+neural_status neural_live_refresh(neural_live *live)
+{
+    if (live == NULL)
+    {
+        return NEURAL_ERROR_ARGUMENT;
+    }
+
+    pthread_mutex_lock(&live->lock);
+    neural_status status = live_refresh(live);
+    pthread_mutex_unlock(&live->lock);
+    return status;
+}
+
+unsigned long neural_live_version(const neural_live *live)
+{
+    return __atomic_load_n(&live->version, __ATOMIC_ACQUIRE);
+}
+
+neural_status neural_live_context_create(neural_live *live, int max_batch, neural_context **context)
+{
+    if (live == NULL)
+    {
+        return NEURAL_ERROR_ARGUMENT;
+    }
+
+    pthread_mutex_lock(&live->lock);
+    neural_status status = neural_context_create(live->current, max_batch, context);
+    neural_context **contexts = NULL;
+    if (status == NEURAL_OK)
+    {
+        contexts = realloc(live->contexts, (live->n_contexts + 1) * sizeof(neural_context *));
+    }
+    if (contexts != NULL)
+    {
+        (*context)->live = live;
+        live->contexts = contexts;
+        live->contexts[live->n_contexts++] = *context;
+    }
+    else if (status == NEURAL_OK)
+    {
+        neural_context_free(*context);
+        status = NEURAL_ERROR_MEMORY;
+    }
+    pthread_mutex_unlock(&live->lock);
+    return status;
+}
+
+void neural_live_close(neural_live *live)
+{
+    if (live != NULL)
+    {
+        if (live->interval_ms > 0)
+        {
+            pthread_mutex_lock(&live->lock);
+            live->stop = 1;
+            pthread_cond_signal(&live->wake);
+            pthread_mutex_unlock(&live->lock);
+            pthread_join(live->watcher, NULL);
+        }
+        pthread_cond_destroy(&live->wake);
+        pthread_mutex_destroy(&live->lock);
+        neural_model_free(live->current);
+        free(live->contexts);
+        free(live->path);
+        free(live);
+    }
+}
@@ -1,34 +1,226 @@
 #include <ctype.h>
+#include <dirent.h>
+#include <glob.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "lib.c"
 
 // SUBCOMMANDS
 
-int train(Network network, Dataset dataset, int batch_size, int epochs, double learning_rate, char *model_path)
+typedef struct
+{
+    int batch_size;
+    int epochs;
+    double learning_rate;
+    int threads;
+    int hogwild;
+    char *output_path;
+    Communicator comm;
+    double validation;  // fraction of the training images held out for validation
+    int validate_every; // batches between validations, 0 validates after every epoch
+    int patience;
+    double min_delta;
+    Schedule schedule;
+    double lr_factor;
+    int lr_step;
+    Precision precision;
+    int checkpoint_every; // layers between stored activations, 0 trains sample by sample
+    int quantize;         // levels of the quantized hidden layers, 0 trains doubles only
+    int augment;
+    Augmentation augmentation;
+    int profile;
+} TrainOptions;
+
+int train(Network network, Dataset dataset, TrainOptions options)
 {
     // training
     {
-        printf("start training with learning rate of %s%.4lf%s and %s%d%s epochs\n",
-               BOLD, learning_rate, RESET, BOLD, epochs, RESET);
-        for (int i = 0; i < epochs; i++)
+        Dataset validation = split_dataset(&dataset, options.validation);
+        if (validation.size > 0)
+        {
+            printf("holding out %d images for validation\n", validation.size);
+        }
+        if (options.batch_size > dataset.size)
+        {
+            printf("%serror:%s batch size %d is larger than the %d training images\n", RED, RESET, options.batch_size, dataset.size);
+            exit(1);
+        }
+
+        printf("start training with learning rate of %s%.4lf%s and %s%d%s epochs on %s%d%s threads (seed: %llu)\n",
+               BOLD, options.learning_rate, RESET, BOLD, options.epochs, RESET,
+               BOLD, options.threads, RESET, (unsigned long long)rng_seed);
+        if (options.hogwild && options.threads > 1)
+        {
+            printf("warning: asynchronous updates make training non-deterministic\n");
+        }
+
+        if (options.quantize > 0)
+        {
+            int n_quantized = network_quantize(network, options.quantize);
+            if (n_quantized == 0)
+            {
+                printf("%serror:%s --quantize needs at least two hidden layers, the first and last layers keep doubles\n", RED, RESET);
+                exit(1);
+            }
+            printf("quantizing %d hidden layers to %s weights and activations\n", n_quantized,
+                   options.quantize == LEVELS_TERNARY ? "ternary" : "binary");
+        }
+
+        report_tuning(network, stdout);
+        if (options.profile)
+        {
+            profile_open_counters();
+        }
+        Trainer trainer = trainer_create(network, options.threads);
+        if (options.precision != PRECISION_DOUBLE)
+        {
+            trainer.mixed = mixed_create(network, options.threads, options.precision);
+            printf("storing weights and activations as %s\n", options.precision == PRECISION_BF16 ? "bf16" : "fp16");
+        }
+        trainer.checkpoint_every = options.checkpoint_every;
+        if (options.comm.world_size > 1)
+        {
+            trainer.comm = &options.comm;
+            printf("rank %d of %d processes, %d samples per process and batch\n",
+                   options.comm.rank, options.comm.world_size, options.batch_size / options.comm.world_size);
+        }
+
+        // every process validates the same split, so all of them stop at the same step
+        Validator validator = {0};
+        Network best = {0};
+        if (validation.size > 0)
+        {
+            validator = validator_create(network, validation);
+            best = network_create(network.ndim, network.dims);
+            network_copy(best, network);
+        }
+        LearningRate lr = {
+            .schedule = options.schedule,
+            .base = options.learning_rate,
+            .factor = options.lr_factor,
+            .step = options.lr_step,
+            .rate = options.learning_rate,
+        };
+        EarlyStopping stopping = {.patience = options.patience, .min_delta = options.min_delta, .best = INFINITY};
+
+        Prefetcher *prefetcher = NULL;
+        if (options.augment)
+        {
+            prefetcher = prefetcher_start(dataset, options.batch_size, options.comm.world_size, options.epochs, options.augmentation);
+        }
+
+        int batches = dataset.size / options.batch_size;
+        int segment = options.validate_every > 0 && options.validate_every < batches ? options.validate_every : batches;
+        int total = options.epochs * batches;
+        int done = 0;
+
+        double start = timestamp();
+        for (int i = 0; i < options.epochs && !early_stopping_done(stopping); i++)
         {
             printf("%sEpoch %d%s\n", BOLD, i, RESET);
-            epoch(network, dataset, batch_size, learning_rate);
+            if (prefetcher == NULL)
+            {
+                shuffle_shards(dataset, i, options.batch_size, options.comm.world_size);
+            }
+            for (int first = 0; first < batches && !early_stopping_done(stopping); first += segment)
+            {
+                double learning_rate = learning_rate_update(&lr, i, (double)done / total, stopping.stale);
+
+                // the last segment keeps the images left over by the batches
+                int n = batches - first < segment ? batches - first : segment;
+                Dataset part = dataset;
+                part.images += first * options.batch_size;
+                part.size = first + n < batches ? n * options.batch_size : dataset.size - first * options.batch_size;
+                if (prefetcher != NULL)
+                {
+                    epoch_prefetched(&trainer, prefetcher, n, learning_rate);
+                }
+                else if (options.hogwild)
+                {
+                    hogwild_epoch(&trainer, part, options.batch_size, learning_rate);
+                }
+                else
+                {
+                    epoch(&trainer, part, options.batch_size, learning_rate);
+                }
+                done += n;
+
+                if (validation.size > 0)
+                {
+                    double validation_start = profile_start(PHASE_VALIDATE);
+                    Validation result = validate(network, &validator);
+                    profile_add(PHASE_VALIDATE, validation_start);
+                    int improved = early_stopping_update(&stopping, result.loss);
+                    if (improved)
+                    {
+                        network_copy(best, network);
+                    }
+                    printf("validation loss: %.4lf, accuracy: %.4lf, learning rate: %.4g%s\n",
+                           result.loss, result.accuracy, learning_rate, improved ? " (best)" : "");
+                }
+            }
+        }
+        double duration = timestamp() - start;
+        trainer_destroy(trainer);
+        if (prefetcher != NULL)
+        {
+            prefetcher_stop(prefetcher);
         }
+        if (options.profile)
+        {
+            print_profile();
+            if (options.checkpoint_every > 0)
+            {
+                int per_thread = (options.batch_size / options.comm.world_size + options.threads - 1) / options.threads;
+                print_checkpointing(network, options.checkpoint_every, per_thread);
+            }
+        }
+
+        if (early_stopping_done(stopping))
+        {
+            // the remaining steps would have taken as long as the average one so far
+            double saved = duration / done * (total - done);
+            printf("stopped early after %d of %d batches, saved about %.1f s (%.1f CPU seconds)\n",
+                   done, total, saved, saved * options.threads * options.comm.world_size);
+        }
+        if (validation.size > 0)
+        {
+            if (options.patience > 0)
+            {
+                network_copy(network, best);
+                printf("restored the weights with the best validation loss: %.4lf\n", stopping.best);
+            }
+            validator_destroy(validator);
+            network_destroy(best);
+        }
+
+        if (options.comm.world_size > 1)
+        {
+            // share of the time not spent waiting for gradients of the other processes
+            printf("trained on %.0f samples/s, communication: %.2f s (%.1f MB sent), computing: %.1f%% of the time\n",
+                   (double)done * options.batch_size / duration,
+                   options.comm.time, options.comm.bytes / 1e6, 100 * (1 - options.comm.time / duration));
+        }
+        communicator_close(options.comm);
 
         destroy_dataset(dataset);
+        destroy_dataset(validation);
+    }
+
+    // only the first process of a distributed job validates and saves the model
+    if (options.comm.rank != 0)
+    {
+        network_destroy(network);
+        return 0;
     }
 
-    // validation
+    // test
     {
         Dataset dataset = load_mnist_dataset("mnist/t10k-labels-idx1-ubyte", "mnist/t10k-images-idx3-ubyte");
-        printf("loaded validation dataset with %d images\n", dataset.size);
+        printf("loaded test dataset with %d images\n", dataset.size);
 
-        int predicted_correctly = 0;
-        for (int i = 0; i < dataset.size; i++)
-        {
-            forward(network, dataset.images[i].data);
-            predicted_correctly += arg_max(network.neurons[network.ndim - 1]) == arg_max(dataset.images[i].label);
-        }
+        int predicted_correctly = evaluate(network, dataset);
         printf("predicted: %d, accurarcy: %f\n", predicted_correctly, ((double)predicted_correctly) / dataset.size);
 
         destroy_dataset(dataset);
@@ -36,9 +228,9 @@ int train(Network network, Dataset dataset, int batch_size, int epochs, double l
 
     // persistence
     {
-        FILE *file = fopen(model_path, "wb");
+        FILE *file = fopen(options.output_path, "wb");
         serialize_network(network, file);
-        printf("saved model to: '%s'\n", model_path);
+        printf("saved model to: '%s'\n", options.output_path);
         fclose(file);
     }
 
@@ -47,7 +239,338 @@ int train(Network network, Dataset dataset, int batch_size, int epochs, double l
     return 0;
 }
 
-int bench()
+// dimensions of a network for MNIST with the hidden layers of '--dims', 16,16 if dims_string is NULL
+int *parse_dims(char *dims_string, int *ndim)
+{
+    if (dims_string == NULL)
+    {
+        *ndim = 4;
+    }
+    else
+    {
+        *ndim = 3;
+        for (char *c = dims_string; *c != '\0'; c++)
+        {
+            *ndim += *c == ',';
+            if (!isdigit(*c) && *c != ',')
+            {
+                printf("%serror:%s invalid character '%c' in '%s'\n",
+                       RED, RESET, *c, dims_string);
+                exit(1);
+            }
+        }
+    }
+
+    int *dims = malloc(*ndim * sizeof(int));
+
+    char *c = dims_string;
+    dims[0] = 784;
+    for (int l = 1; l < *ndim - 1; l++)
+    {
+        if (dims_string == NULL)
+        {
+            dims[l] = 16;
+        }
+        else
+        {
+            dims[l] = atoi(c);
+            if (!dims[l])
+            {
+                printf("%serror:%s invalid value '%s' for --dims flag\n", RED, RESET, dims_string);
+                exit(1);
+            }
+            c = strchr(c, ',') + 1;
+        }
+    }
+    dims[*ndim - 1] = 10;
+    return dims;
+}
+
+// parses a comma separated list of real numbers, returns NULL if one of them is invalid
+double *parse_reals(char *string, int *count)
+{
+    *count = 1;
+    for (char *c = string; *c != '\0'; c++)
+    {
+        *count += *c == ',';
+    }
+
+    double *values = malloc(*count * sizeof(double));
+    char *c = string;
+    for (int i = 0; i < *count; i++)
+    {
+        char *end;
+        values[i] = strtod(c, &end);
+        if (end == c || (*end != ',' && *end != '\0'))
+        {
+            free(values);
+            return NULL;
+        }
+        c = end + 1;
+    }
+    return values;
+}
+
+typedef struct
+{
+    char **dims_strings; // hidden layers of every candidate shape, NULL for the default
+    int n_dims;
+    double *learning_rates;
+    int n_learning_rates;
+    int learning_rate_range; // sample learning rates log-uniformly between the two values
+    double *batch_sizes;
+    int n_batch_sizes;
+    int epochs;
+    double validation;
+    int random; // number of random configurations, 0 for the full grid
+    char *output_path;
+} SweepOptions;
+
+typedef struct
+{
+    char *dims_string;
+    int ndim;
+    int *dims;
+    double learning_rate;
+    int batch_size;
+    double training_loss;
+    Metrics metrics;
+} SweepConfig;
+
+// networks of the same shape and batch size share a pack, so they come next to each other
+int compare_sweep_configs(const void *a, const void *b)
+{
+    const SweepConfig *x = a;
+    const SweepConfig *y = b;
+    int order = strcmp(x->dims_string, y->dims_string);
+    if (order == 0)
+    {
+        order = x->batch_size - y->batch_size;
+    }
+    return order != 0 ? order : (x->learning_rate > y->learning_rate) - (x->learning_rate < y->learning_rate);
+}
+
+int compare_sweep_results(const void *a, const void *b)
+{
+    const SweepConfig *x = a;
+    const SweepConfig *y = b;
+    return (x->metrics.loss > y->metrics.loss) - (x->metrics.loss < y->metrics.loss);
+}
+
+// trains every configuration of a grid or random search on one copy of the dataset and ranks them by validation loss
+int sweep(Dataset dataset, SweepOptions options)
+{
+    int n_configs = options.random > 0 ? options.random
+                                       : options.n_dims * options.n_learning_rates * options.n_batch_sizes;
+    SweepConfig *configs = malloc(n_configs * sizeof(SweepConfig));
+    for (int c = 0; c < n_configs; c++)
+    {
+        int d, l, b;
+        if (options.random > 0)
+        {
+            d = rng_next(STREAM_SWEEP, 3 * c) % options.n_dims;
+            l = rng_next(STREAM_SWEEP, 3 * c + 1) % options.n_learning_rates;
+            b = rng_next(STREAM_SWEEP, 3 * c + 2) % options.n_batch_sizes;
+        }
+        else
+        {
+            d = c / (options.n_learning_rates * options.n_batch_sizes);
+            l = c / options.n_batch_sizes % options.n_learning_rates;
+            b = c % options.n_batch_sizes;
+        }
+
+        SweepConfig config = {
+            .dims_string = options.dims_strings[d] == NULL ? "16,16" : options.dims_strings[d],
+            .learning_rate = options.learning_rates[l],
+            .batch_size = (int)options.batch_sizes[b],
+        };
+        if (options.learning_rate_range)
+        {
+            double low = log(options.learning_rates[0]);
+            double high = log(options.learning_rates[1]);
+            config.learning_rate = exp(low + (high - low) * rng_uniform(STREAM_SWEEP, 3 * c + 1));
+        }
+        config.dims = parse_dims(config.dims_string, &config.ndim);
+        configs[c] = config;
+    }
+    qsort(configs, n_configs, sizeof(SweepConfig), compare_sweep_configs);
+
+    Dataset validation = split_dataset(&dataset, options.validation);
+    printf("holding out %d images for validation\n", validation.size);
+    for (int c = 0; c < n_configs; c++)
+    {
+        if (configs[c].batch_size > dataset.size)
+        {
+            printf("%serror:%s batch size %d is larger than the %d training images\n", RED, RESET, configs[c].batch_size, dataset.size);
+            exit(1);
+        }
+    }
+
+    // every network starts from the weights 'neural train' would initialize for its shape and seed
+    Network *networks = malloc(n_configs * sizeof(Network));
+    Pack *packs = malloc(n_configs * sizeof(Pack));
+    int n_packs = 0;
+    for (int start = 0; start < n_configs;)
+    {
+        double learning_rates[PACK_LANES];
+        int n = 0;
+        while (n < PACK_LANES && start + n < n_configs &&
+               strcmp(configs[start].dims_string, configs[start + n].dims_string) == 0 &&
+               configs[start].batch_size == configs[start + n].batch_size)
+        {
+            networks[start + n] = network_create(configs[start + n].ndim, configs[start + n].dims);
+            learning_rates[n] = configs[start + n].learning_rate;
+            n++;
+        }
+        packs[n_packs++] = pack_create(networks + start, n, learning_rates, configs[start].batch_size);
+        start += n;
+    }
+    printf("training %s%d%s configurations in %s%d%s packs for %s%d%s epochs on %s%d%s threads (seed: %llu)\n",
+           BOLD, n_configs, RESET, BOLD, n_packs, RESET, BOLD, options.epochs, RESET, BOLD, pool_size(), RESET,
+           (unsigned long long)rng_seed);
+
+    double *losses = malloc(n_packs * PACK_LANES * sizeof(double));
+    double start = timestamp();
+    for (int e = 0; e < options.epochs; e++)
+    {
+        shuffle_dataset(dataset, e);
+        packs_epoch(packs, n_packs, dataset, losses);
+        printf("%sepoch %d of %d ", CLEAR, e + 1, options.epochs);
+        print_progress(e + 1, options.epochs, (int)(timestamp() - start));
+    }
+    double seconds = timestamp() - start;
+    printf("trained %d models in %.2f s (%.0f samples per second)\n", n_configs, seconds,
+           (double)n_configs * options.epochs * dataset.size / seconds);
+
+    for (int p = 0, c = 0; p < n_packs; c += packs[p].n_networks, p++)
+    {
+        pack_extract(packs[p], networks + c);
+        for (int k = 0; k < packs[p].n_networks; k++)
+        {
+            configs[c + k].training_loss = losses[p * PACK_LANES + k];
+        }
+        pack_destroy(packs[p]);
+    }
+
+    // all networks share their inputs and outputs, so one pass validates them all
+    Metrics *metrics = malloc((n_configs + 1) * sizeof(Metrics));
+    for (int c = 0; c <= n_configs; c++)
+    {
+        metrics[c] = metrics_create(10, 1);
+    }
+    evaluate_models(networks, NULL, n_configs, n_configs, validation, metrics);
+    for (int c = 0; c < n_configs; c++)
+    {
+        configs[c].metrics = metrics[c];
+        network_destroy(networks[c]);
+    }
+    metrics_destroy(metrics[n_configs]);
+    qsort(configs, n_configs, sizeof(SweepConfig), compare_sweep_results);
+
+    FILE *output = fopen(options.output_path, "w");
+    if (output == NULL)
+    {
+        printf("%serror:%s cannot open '%s'\n", RED, RESET, options.output_path);
+        exit(1);
+    }
+    fprintf(output, "rank,dims,learning_rate,batch_size,training_loss,validation_loss,validation_accuracy\n");
+    printf("\n%srank  dims             learning rate  batch size  validation loss  accuracy%s\n", BOLD, RESET);
+    for (int c = 0; c < n_configs; c++)
+    {
+        SweepConfig config = configs[c];
+        double loss = config.metrics.loss / validation.size;
+        double accuracy = (double)metrics_correctly(config.metrics) / validation.size;
+        fprintf(output, "%d,\"%s\",%g,%d,%.6f,%.6f,%.6f\n", c + 1, config.dims_string, config.learning_rate,
+                config.batch_size, config.training_loss, loss, accuracy);
+        if (c < 10)
+        {
+            printf("%4d  %-15s  %13g  %10d  %15.4f  %8.4f\n", c + 1, config.dims_string, config.learning_rate,
+                   config.batch_size, loss, accuracy);
+        }
+    }
+    fclose(output);
+    printf("wrote %d ranked results to '%s'\n", n_configs, options.output_path);
+    printf("train the best configuration with: neural train -d %s -l %g -b %d -e %d -s %llu --validation %g\n",
+           configs[0].dims_string, configs[0].learning_rate, configs[0].batch_size, options.epochs,
+           (unsigned long long)rng_seed, options.validation);
+
+    for (int c = 0; c < n_configs; c++)
+    {
+        metrics_destroy(configs[c].metrics);
+        free(configs[c].dims);
+    }
+    free(configs);
+    free(networks);
+    free(packs);
+    free(losses);
+    free(metrics);
+    free(validation.images);
+
+    return 0;
+}
+
+// per-layer forward and backward passes of the calling thread, with its counters
+void bench_layers(Network network, Dataset dataset, int n_passes)
+{
+    pid_t self = 0;
+    Counters counters = counters_open(1, &self);
+    print_counters_note(counters);
+    double before[N_COUNTERS], after[N_COUNTERS], delta[N_COUNTERS];
+    char label[64];
+
+    // every layer reads the activations a full pass left behind
+    forward(network, dataset.images[0].data);
+    backward(network, dataset.images[0].label);
+    for (int pass = 0; pass < 2; pass++)
+    {
+        print_counters_header(pass == 0 ? "forward, per pass" : "backward, per pass");
+        for (int k = 0; k <= network.ndim - 1; k++)
+        {
+            // layers bottom up forward and top down backward, then the whole pass
+            int l = pass == 0 ? k + 1 : network.ndim - 1 - k;
+            counters_read(counters, before);
+            double start = timestamp();
+            for (int i = 0; i < n_passes; i++)
+            {
+                if (k == network.ndim - 1 && pass == 0)
+                {
+                    forward(network, dataset.images[0].data);
+                }
+                else if (k == network.ndim - 1)
+                {
+                    backward(network, dataset.images[0].label);
+                }
+                else if (pass == 0)
+                {
+                    forward_layer(network, l);
+                }
+                else
+                {
+                    backward_delta(network, l, dataset.images[0].label);
+                    weight_gradient(network, l);
+                }
+            }
+            double seconds = (timestamp() - start) / n_passes;
+            counters_read(counters, after);
+            for (int c = 0; c < N_COUNTERS; c++)
+            {
+                delta[c] = (after[c] - before[c]) / n_passes;
+            }
+            if (k == network.ndim - 1)
+            {
+                snprintf(label, sizeof(label), "all layers");
+            }
+            else
+            {
+                snprintf(label, sizeof(label), "layer %d (%dx%d)", l, network.dims[l], network.dims[l - 1]);
+            }
+            print_counters_row(label, seconds, delta);
+        }
+    }
+    counters_close(counters);
+}
+
+int bench_passes(int counters)
 {
     Dataset dataset = load_mnist_dataset("mnist/train-labels-idx1-ubyte", "mnist/train-images-idx3-ubyte");
     printf("loaded training dataset with %d images\n", dataset.size);
@@ -70,6 +593,14 @@ int bench()
 
     int n_passes = 100;
 
+    if (counters)
+    {
+        bench_layers(network, dataset, n_passes);
+        network_destroy(network);
+        destroy_dataset(dataset);
+        return 0;
+    }
+
     {
         printf("%sForward Pass%s \U0001f51c\n", BOLD, RESET);
         double start = timestamp();
@@ -92,103 +623,1516 @@ int bench()
         printf("took: %.3f seconds (%d passes)\n", end - start, n_passes);
     }
 
+    network_destroy(network);
     destroy_dataset(dataset);
 
     return 0;
 }
 
-int run(char *model_path, char *image_path)
+// compares synchronous and asynchronous SGD on the default model
+int bench_sgd()
 {
-    Network network = load_network(model_path);
-    double *data = load_pgm_image(image_path);
-
-    forward(network, data);
-    int prediction = arg_max(network.neurons[network.ndim - 1]);
+    Dataset dataset = load_mnist_dataset("mnist/train-labels-idx1-ubyte", "mnist/train-images-idx3-ubyte");
+    Dataset validation = load_mnist_dataset("mnist/t10k-labels-idx1-ubyte", "mnist/t10k-images-idx3-ubyte");
+    printf("loaded %d training and %d validation images\n", dataset.size, validation.size);
 
-    double probabilities[network.dims[network.ndim - 1]];
+    int dims[] = {dataset.rows * dataset.cols, 16, 16, 10};
+    int batch_size = 20;
+    double learning_rate = 1.0;
+    int max_threads = pool_size();
+    printf("one epoch of a 784x16x16x10 network (batch_size: %d, learning rate: %.2f)\n", batch_size, learning_rate);
 
-    double sum = 0;
-    for (int i = 0; i < network.dims[network.ndim - 1]; i++)
+    printf("%s%8s %8s %12s %10s%s\n", BOLD, "mode", "threads", "samples/s", "accuracy", RESET);
+    for (int threads = 1; threads <= max_threads; threads *= 2)
     {
-        probabilities[i] = network.neurons[network.ndim - 1][i];
-        sum += probabilities[i];
-    }
+        for (int hogwild_mode = 0; hogwild_mode < 2; hogwild_mode++)
+        {
+            Network network = network_create(4, dims);
+            Trainer trainer = trainer_create(network, threads);
+            shuffle_dataset(dataset, 0);
 
-    for (int i = 0; i < network.dims[network.ndim - 1]; i++)
-    {
-        probabilities[i] /= sum;
-    }
+            double start = timestamp();
+            if (hogwild_mode)
+            {
+                hogwild(&trainer, dataset, batch_size, learning_rate);
+            }
+            else
+            {
+                for (int i = 0; i < dataset.size / batch_size; i++)
+                {
+                    trainer_step(&trainer, dataset.images + i * batch_size, batch_size, learning_rate);
+                }
+            }
+            double end = timestamp();
 
-    printf("%smodel prediction: %d%s\n", BOLD, prediction, RESET);
+            double accuracy = (double)evaluate(network, validation) / validation.size;
+            printf("%8s %8d %12.0f %10.4f\n", hogwild_mode ? "hogwild" : "sync", threads, dataset.size / (end - start), accuracy);
 
-    int n_rows = 10;
-    for (int row = 0; row < n_rows; row++)
-    {
-        for (int i = 0; i < network.dims[network.ndim - 1]; i++)
-        {
-            char *symbol = probabilities[i] > 1.0 - ((double)row + 0.5) / n_rows ? "\U00002588" : " ";
-            printf(" %s%s%s%s%s ", symbol, symbol, symbol, symbol, symbol);
+            trainer_destroy(trainer);
+            network_destroy(network);
         }
-        printf("\n");
-    }
-    for (int i = 0; i < network.dims[network.ndim - 1]; i++)
-    {
-        printf(" %.3lf ", probabilities[i]);
-    }
-    printf("\n");
-    for (int i = 0; i < network.dims[network.ndim - 1]; i++)
-    {
-        printf("\U00002500\U00002500\U00002500\U00002500\U00002500\U00002500\U00002500");
-    }
-    printf("\n");
-    for (int i = 0; i < network.dims[network.ndim - 1]; i++)
-    {
-        printf("   %d   ", i);
     }
-    printf("\n");
 
-    network_destroy(network);
-    free(data);
+    destroy_dataset(dataset);
+    destroy_dataset(validation);
 
     return 0;
 }
 
-int test(char *model_path)
+// step time of the 3x1024 network with and without the layer-wise pipeline
+int bench_pipeline()
 {
-    Network network = load_network(model_path);
-    Dataset dataset = load_mnist_dataset("mnist/t10k-labels-idx1-ubyte", "mnist/t10k-images-idx3-ubyte");
-    printf("loaded dataset with %d images\n", dataset.size);
+    Dataset dataset = load_mnist_dataset("mnist/train-labels-idx1-ubyte", "mnist/train-images-idx3-ubyte");
+    printf("loaded training dataset with %d images\n", dataset.size);
+
+    int dims[] = {dataset.rows * dataset.cols, 1024, 1024, 1024, 10};
+    int batch_size = 64;
+    int n_steps = 5;
+    int max_threads = pool_size();
+    printf("%d steps of a 784x1024x1024x1024x10 network (batch_size: %d)\n", n_steps, batch_size);
 
-    int predicted_correctly = 0;
-    for (int i = 0; i < dataset.size; i++)
+    printf("%s%8s %14s %14s %8s%s\n", BOLD, "threads", "sequential", "pipelined", "speedup", RESET);
+    for (int threads = 1; threads <= max_threads; threads *= 2)
     {
-        forward(network, dataset.images[i].data);
-        predicted_correctly += arg_max(network.neurons[network.ndim - 1]) == arg_max(dataset.images[i].label);
+        double step_time[2];
+        for (int pipeline = 0; pipeline < 2; pipeline++)
+        {
+            Network network = network_create(5, dims);
+            Trainer trainer = trainer_create(network, threads);
+            trainer.pipeline = pipeline;
+
+            double start = timestamp();
+            for (int i = 0; i < n_steps; i++)
+            {
+                trainer_step(&trainer, dataset.images + i * batch_size, batch_size, 0.01);
+            }
+            step_time[pipeline] = (timestamp() - start) / n_steps;
+
+            trainer_destroy(trainer);
+            network_destroy(network);
+        }
+        printf("%8d %11.1f ms %11.1f ms %7.2fx\n", threads, 1000 * step_time[0], 1000 * step_time[1], step_time[0] / step_time[1]);
     }
-    printf("predicted: %d, accurarcy: %f\n", predicted_correctly, ((double)predicted_correctly) / dataset.size);
 
-    network_destroy(network);
     destroy_dataset(dataset);
 
     return 0;
 }
 
-// USAGE
-
-int print_usage_main()
+// step time of the 3x1024 network with double and 16-bit weights and activations
+int bench_precision()
 {
-    printf("Usage:\n");
-    printf("\n");
+    Dataset dataset = load_mnist_dataset("mnist/train-labels-idx1-ubyte", "mnist/train-images-idx3-ubyte");
+    printf("loaded training dataset with %d images\n", dataset.size);
+
+    int dims[] = {dataset.rows * dataset.cols, 1024, 1024, 1024, 10};
+    int batch_size = 64;
+    int n_steps = 5;
+    int threads = pool_size();
+    printf("%d steps of a 784x1024x1024x1024x10 network (batch_size: %d, threads: %d)\n", n_steps, batch_size, threads);
+
+    char *names[] = {"double", "bf16", "fp16"};
+    int bytes[] = {sizeof(double), sizeof(uint16_t), sizeof(uint16_t)};
+    double n_weights = 0;
+    for (int l = 1; l < 5; l++)
+    {
+        n_weights += dims[l] * dims[l - 1];
+    }
+
+    printf("%s%10s %14s %14s %8s%s\n", BOLD, "precision", "weights", "step", "speedup", RESET);
+    double reference = 0;
+    for (int precision = PRECISION_DOUBLE; precision <= PRECISION_FP16; precision++)
+    {
+        Network network = network_create(5, dims);
+        Trainer trainer = trainer_create(network, threads);
+        if (precision != PRECISION_DOUBLE)
+        {
+            trainer.mixed = mixed_create(network, threads, precision);
+        }
+
+        double start = timestamp();
+        for (int i = 0; i < n_steps; i++)
+        {
+            trainer_step(&trainer, dataset.images + i * batch_size, batch_size, 0.01);
+        }
+        double step_time = (timestamp() - start) / n_steps;
+        reference = precision == PRECISION_DOUBLE ? step_time : reference;
+
+        printf("%10s %11.1f MB %11.1f ms %7.2fx\n", names[precision], n_weights * bytes[precision] / 1e6,
+               1000 * step_time, reference / step_time);
+
+        trainer_destroy(trainer);
+        network_destroy(network);
+    }
+
+    destroy_dataset(dataset);
+
+    return 0;
+}
+
+// activation memory of a deep network against the compute spent recomputing it
+int bench_checkpoint()
+{
+    Dataset dataset = load_mnist_dataset("mnist/train-labels-idx1-ubyte", "mnist/train-images-idx3-ubyte");
+    printf("loaded training dataset with %d images\n", dataset.size);
+
+    int dims[] = {dataset.rows * dataset.cols, 512, 512, 512, 512, 512, 512, 10};
+    int ndim = sizeof(dims) / sizeof(int);
+    int batch_size = 256;
+    int n_steps = 4;
+    int threads = pool_size();
+    int per_thread = (batch_size + threads - 1) / threads;
+    printf("%d steps of a 784x512x512x512x512x512x512x10 network (batch_size: %d, threads: %d)\n", n_steps, batch_size,
+           threads);
+
+    long forward_flops = 0;
+    for (int l = 1; l < ndim; l++)
+    {
+        forward_flops += (long)dims[l] * dims[l - 1];
+    }
+
+    printf("%s%12s %18s %12s %12s %16s%s\n", BOLD, "checkpoint", "activations", "recomputed", "step", "samples/s",
+           RESET);
+    for (int every = 0; every <= 3; every++)
+    {
+        Network network = network_create(ndim, dims);
+        Trainer trainer = trainer_create(network, threads);
+        trainer.checkpoint_every = every;
+
+        double start = timestamp();
+        for (int i = 0; i < n_steps; i++)
+        {
+            trainer_step(&trainer, dataset.images + i * batch_size, batch_size, 0.01);
+        }
+        double step_time = (timestamp() - start) / n_steps;
+
+        // sample by sample, a thread only keeps the activations of the current sample
+        size_t bytes = every == 0 ? checkpoint_bytes(network, 1, 1) : checkpoint_bytes(network, every, per_thread);
+        double recomputed = every == 0 ? 0 : 100.0 * checkpoint_recompute_flops(network, every) / forward_flops;
+        char label[16];
+        snprintf(label, sizeof(label), every == 0 ? "per sample" : "every %d", every);
+        printf("%12s %10.2f MB/thr %11.1f%% %9.1f ms %16.0f\n", label, bytes / 1e6, recomputed, 1000 * step_time,
+               batch_size / step_time);
+
+        trainer_destroy(trainer);
+        network_destroy(network);
+    }
+
+    destroy_dataset(dataset);
+
+    return 0;
+}
+
+// latency of the specialized forward passes against the generic one
+int bench_kernels(int counters)
+{
+    int n_passes = 100000;
+    int n_kernels = sizeof(specialized_kernels) / sizeof(SpecializedKernel);
+    pid_t self = 0;
+    Counters kernel_counters = {0};
+    if (counters)
+    {
+        kernel_counters = counters_open(1, &self);
+        print_counters_note(kernel_counters);
+        print_counters_header("kernel, per pass");
+    }
+    else
+    {
+        printf("%s%24s %12s %12s %8s%s\n", BOLD, "shape", "generic", "specialized", "speedup", RESET);
+    }
+    for (int k = 0; k < n_kernels; k++)
+    {
+        SpecializedKernel kernel = specialized_kernels[k];
+        Network network = network_create(kernel.ndim, kernel.dims);
+        double *inputs = random_array(kernel.dims[0], 0);
+        char shape[TUNING_FIELD];
+        network_shape(network, shape, sizeof(shape));
+
+        double latency[2];
+        ForwardKernel kernels[] = {forward, kernel.forward};
+        for (int variant = 0; variant < 2; variant++)
+        {
+            double before[N_COUNTERS], after[N_COUNTERS];
+            counters_read(kernel_counters, before);
+            double start = timestamp();
+            for (int i = 0; i < n_passes; i++)
+            {
+                kernels[variant](network, inputs);
+            }
+            latency[variant] = (timestamp() - start) / n_passes;
+            counters_read(kernel_counters, after);
+            if (counters)
+            {
+                for (int c = 0; c < N_COUNTERS; c++)
+                {
+                    after[c] = (after[c] - before[c]) / n_passes;
+                }
+                char label[TUNING_FIELD + 16];
+                snprintf(label, sizeof(label), "%s %s", shape, variant ? "specialized" : "generic");
+                print_counters_row(label, latency[variant], after);
+            }
+        }
+
+        if (!counters)
+        {
+            printf("%24s %9.2f us %9.2f us %7.2fx\n", shape, 1e6 * latency[0], 1e6 * latency[1], latency[0] / latency[1]);
+        }
+
+        free(inputs);
+        network_destroy(network);
+    }
+    counters_close(kernel_counters);
+
+    return 0;
+}
+
+// warns when the kernel refused to bind the weights to a NUMA node, every node then reads the network itself
+Replicas report_replicas(Replicas replicas)
+{
+    if (replicas.refused >= 0)
+    {
+        fprintf(stderr, "warning: cannot place the weights on NUMA node %d, not replicating them\n", replicas.refused);
+    }
+    return replicas;
+}
+
+// kilobytes of this process backed by huge pages, transparent or explicit
+long huge_page_kilobytes()
+{
+    FILE *file = fopen("/proc/self/smaps_rollup", "r");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    long total = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        long kilobytes;
+        if (sscanf(line, "AnonHugePages: %ld", &kilobytes) == 1 || sscanf(line, "Private_Hugetlb: %ld", &kilobytes) == 1)
+        {
+            total += kilobytes;
+        }
+    }
+    fclose(file);
+    return total;
+}
+
+// loading, training and inference of a 784x1024x1024x10 network under different memory placements
+int bench_memory()
+{
+    MemoryPolicy defaults = memory_policy();
+    int batch_size = 64;
+    int n_steps = 10;
+    printf("%d NUMA node(s), %d threads, %d steps (batch_size: %d)\n", defaults.n_nodes, pool_size(), n_steps, batch_size);
+
+    struct
+    {
+        char *name;
+        HugePages huge_pages;
+        Placement data;
+        int replicas;
+    } settings[] = {
+        {"4 KiB pages", HUGEPAGES_OFF, PLACEMENT_FIRST_TOUCH, 1},
+        {"transparent huge pages", HUGEPAGES_TRANSPARENT, PLACEMENT_FIRST_TOUCH, 1},
+        {"explicit huge pages", HUGEPAGES_EXPLICIT, PLACEMENT_FIRST_TOUCH, 1},
+        {"interleaved data", HUGEPAGES_TRANSPARENT, PLACEMENT_INTERLEAVE, 1},
+        {"sharded data", HUGEPAGES_TRANSPARENT, PLACEMENT_SHARD, 1},
+        {"no weight replicas", HUGEPAGES_TRANSPARENT, PLACEMENT_FIRST_TOUCH, 0},
+    };
+    int n_settings = sizeof(settings) / sizeof(settings[0]);
+
+    printf("%s%24s %10s %10s %12s %10s%s\n", BOLD, "setting", "load", "step", "inference", "huge", RESET);
+    for (int i = 0; i < n_settings; i++)
+    {
+        memory.huge_pages = settings[i].huge_pages;
+        memory.data = settings[i].data;
+        memory.replicas = settings[i].replicas;
+        int failures = placement_failures;
+
+        double start = timestamp();
+        Dataset dataset = load_mnist_dataset("mnist/train-labels-idx1-ubyte", "mnist/train-images-idx3-ubyte");
+        double load_time = timestamp() - start;
+
+        int dims[] = {dataset.rows * dataset.cols, 1024, 1024, 10};
+        Network network = network_create(4, dims);
+        Trainer trainer = trainer_create(network, pool_size());
+        start = timestamp();
+        for (int s = 0; s < n_steps; s++)
+        {
+            trainer_step(&trainer, dataset.images + s * batch_size, batch_size, 0.01);
+        }
+        double step_time = (timestamp() - start) / n_steps;
+        long huge = huge_page_kilobytes();
+
+        Replicas replicas = report_replicas(replicas_create(network));
+        Metrics metrics[2] = {metrics_create(10, 1), metrics_create(10, 1)};
+        start = timestamp();
+        evaluate_models(&network, &replicas, 1, 1, dataset, metrics);
+        double throughput = dataset.size / (timestamp() - start);
+
+        // a placement that mbind refused is measured as first touch
+        printf("%24s %7.0f ms %7.1f ms %7.0f img/s %7.0f MB%s\n", settings[i].name, 1000 * load_time, 1000 * step_time,
+               throughput, huge / 1024.0, placement_failures > failures ? " (placement not applied)" : "");
+
+        metrics_destroy(metrics[0]);
+        metrics_destroy(metrics[1]);
+        replicas_destroy(replicas);
+        trainer_destroy(trainer);
+        network_destroy(network);
+        destroy_dataset(dataset);
+    }
+    memory = defaults;
+
+    return 0;
+}
+
+typedef struct
+{
+    double samples_per_second;
+    double communication; // seconds rank 0 spent in the all-reduce
+    long bytes;           // sent by rank 0
+} DistributedRun;
+
+// trains with world_size processes over loopback, forked from a process that has no threads yet, and returns what rank 0 measured
+DistributedRun distributed_run(int world_size, int threads, int port, int batch_size, int n_steps)
+{
+    char **peers = malloc(world_size * sizeof(char *));
+    for (int r = 0; r < world_size; r++)
+    {
+        peers[r] = malloc(32);
+        snprintf(peers[r], 32, "127.0.0.1:%d", port + r);
+    }
+    int channel[2];
+    if (pipe(channel) != 0)
+    {
+        printf("%serror:%s cannot create a pipe for the results\n", RED, RESET);
+        exit(1);
+    }
+
+    fflush(stdout);
+    pid_t *children = malloc(world_size * sizeof(pid_t));
+    for (int r = 0; r < world_size; r++)
+    {
+        children[r] = fork();
+        if (children[r] == 0)
+        {
+            close(channel[0]);
+            Communicator comm = communicator_connect(r, world_size, peers);
+            pool_init(threads);
+            Dataset dataset = load_mnist_dataset("mnist/train-labels-idx1-ubyte", "mnist/train-images-idx3-ubyte");
+            int dims[] = {dataset.rows * dataset.cols, 256, 256, 10};
+            Network network = network_create(4, dims);
+            Trainer trainer = trainer_create(network, threads);
+            trainer.comm = world_size > 1 ? &comm : NULL;
+
+            // the first step is not timed, it waits for the slowest process to load the dataset
+            trainer_step(&trainer, dataset.images, batch_size, 0.01);
+            comm.time = 0;
+            comm.bytes = 0;
+            double start = timestamp();
+            for (int s = 1; s <= n_steps; s++)
+            {
+                trainer_step(&trainer, dataset.images + s * batch_size, batch_size, 0.01);
+            }
+            DistributedRun run = {
+                .samples_per_second = (double)n_steps * batch_size / (timestamp() - start),
+                .communication = comm.time,
+                .bytes = comm.bytes,
+            };
+            if (r == 0 && write(channel[1], &run, sizeof(run)) != sizeof(run))
+            {
+                exit(1);
+            }
+
+            trainer_destroy(trainer);
+            network_destroy(network);
+            destroy_dataset(dataset);
+            communicator_close(comm);
+            exit(0);
+        }
+    }
+    close(channel[1]);
+
+    DistributedRun run;
+    int received = read(channel[0], &run, sizeof(run)) == sizeof(run);
+    close(channel[0]);
+    for (int r = 0; r < world_size; r++)
+    {
+        int status;
+        waitpid(children[r], &status, 0);
+        received &= WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    if (!received)
+    {
+        printf("%serror:%s a process of the distributed run with %d processes failed\n", RED, RESET, world_size);
+        exit(1);
+    }
+
+    for (int r = 0; r < world_size; r++)
+    {
+        free(peers[r]);
+    }
+    free(peers);
+    free(children);
+    return run;
+}
+
+// samples per second of 1 to 4 processes training one batch together over loopback, and their scaling efficiency
+int bench_distributed()
+{
+    int cores = pool_default_size();
+    int max_processes = cores < 4 ? 2 : 4;
+    int threads = cores / max_processes > 0 ? cores / max_processes : 1;
+    int batch_size = 64;
+    int n_steps = 40;
+    int port = 20000 + getpid() % 20000;
+    printf("%d steps of a 784x256x256x10 network (batch_size: %d), %d thread(s) per process\n", n_steps, batch_size, threads);
+
+    printf("%s%10s %12s %15s %10s %11s%s\n", BOLD, "processes", "samples/s", "communication", "sent", "efficiency", RESET);
+    double reference = 0;
+    for (int world_size = 1; world_size <= max_processes; world_size *= 2)
+    {
+        // every run listens on ports of its own, so it never waits for the sockets of the last one to close
+        DistributedRun run = distributed_run(world_size, threads, port, batch_size, n_steps);
+        port += world_size;
+        if (world_size == 1)
+        {
+            reference = run.samples_per_second;
+        }
+        // the speedup over one process as a share of the ideal one, world_size times its throughput
+        printf("%10d %12.0f %13.1f s %7.1f MB %10.1f%%\n", world_size, run.samples_per_second, run.communication,
+               run.bytes / 1e6, 100 * run.samples_per_second / (world_size * reference));
+    }
+    if (cores < max_processes * threads)
+    {
+        printf("only %d cores, the processes share them and the efficiency is bounded by %.0f%%\n", cores,
+               100.0 * cores / (max_processes * threads));
+    }
+
+    return 0;
+}
+
+int bench(char *suite, int counters)
+{
+    if (counters && strcmp(suite, "passes") != 0 && strcmp(suite, "kernels") != 0)
+    {
+        printf("%serror:%s --counters only applies to the passes and kernels suites\n", RED, RESET);
+        exit(1);
+    }
+
+    if (strcmp(suite, "passes") == 0)
+    {
+        return bench_passes(counters);
+    }
+    else if (strcmp(suite, "sgd") == 0)
+    {
+        return bench_sgd();
+    }
+    else if (strcmp(suite, "pipeline") == 0)
+    {
+        return bench_pipeline();
+    }
+    else if (strcmp(suite, "kernels") == 0)
+    {
+        return bench_kernels(counters);
+    }
+    else if (strcmp(suite, "precision") == 0)
+    {
+        return bench_precision();
+    }
+    else if (strcmp(suite, "memory") == 0)
+    {
+        return bench_memory();
+    }
+    else if (strcmp(suite, "checkpoint") == 0)
+    {
+        return bench_checkpoint();
+    }
+    else if (strcmp(suite, "distributed") == 0)
+    {
+        return bench_distributed();
+    }
+
+    printf("%serror:%s unknown benchmark '%s'\n", RED, RESET, suite);
+    return 1;
+}
+
+typedef struct
+{
+    int batch_size;
+    char *output_path; // tuning cache to update, NULL for NEURAL_TUNING or the default
+} TuneOptions;
+
+#define TUNE_REPEATS 5
+
+// best of a few runs of predict over n samples, with every context using the tile and grain
+double time_predict(Network network, int n, double **inputs, double *outputs, int tile, int grain)
+{
+    InferenceContext *contexts = inference_contexts_create(network, n);
+    for (int t = 0; t < pool_slots(); t++)
+    {
+        contexts[t].tile = tile;
+        contexts[t].grain = grain;
+    }
+    double best = INFINITY;
+    for (int r = 0; r < TUNE_REPEATS; r++)
+    {
+        double start = timestamp();
+        predict(network, contexts, n, inputs, outputs);
+        double duration = timestamp() - start;
+        best = duration < best ? duration : best;
+    }
+    inference_contexts_destroy(contexts);
+    return best;
+}
+
+// best of a few training steps on the pool, with or without the layer-wise pipeline
+double time_steps(Network network, Image *images, int n, int pipeline)
+{
+    Trainer trainer = trainer_create(network, pool_size());
+    trainer.pipeline = pipeline;
+    double best = INFINITY;
+    for (int r = 0; r < TUNE_REPEATS; r++)
+    {
+        double start = timestamp();
+        trainer_step(&trainer, images, n, 0.01);
+        double duration = timestamp() - start;
+        best = duration < best ? duration : best;
+    }
+    trainer_destroy(trainer);
+    return best;
+}
+
+/*
+ * Times the settings of a model's shape one after another on random inputs,
+ * every one with the fastest of the settings before it: the tile, the batch
+ * split and the threads of batched inference, the single-sample kernel and
+ * the training pipeline. The fastest are stored in the tuning cache.
+ */
+int tune(char *model_path, TuneOptions options)
+{
+    char *path = options.output_path != NULL ? options.output_path : tuning_path();
+    if (path == NULL)
+    {
+        printf("%serror:%s the tuning cache is disabled, set NEURAL_TUNING or pass --output\n", RED, RESET);
+        exit(1);
+    }
+
+    Network network = load_network(model_path, 1);
+    int n = options.batch_size;
+    int n_inputs = network.dims[0];
+    int n_outputs = network.dims[network.ndim - 1];
+    char shape[TUNING_FIELD];
+    char cpu[TUNING_FIELD];
+    network_shape(network, shape, sizeof(shape));
+    cpu_model(cpu);
+    printf("tuning %s%s%s on %s (%d cores) with batches of %d samples\n", BOLD, shape, RESET, cpu, available_cores(), n);
+
+    double *pixels = random_array(n * n_inputs, 0);
+    double *labels = calloc((size_t)n * n_outputs, sizeof(double));
+    double **inputs = malloc(n * sizeof(double *));
+    Image *images = malloc(n * sizeof(Image));
+    for (int b = 0; b < n; b++)
+    {
+        inputs[b] = pixels + (size_t)b * n_inputs;
+        labels[(size_t)b * n_outputs + b % n_outputs] = 1;
+        images[b] = (Image){.label = labels + (size_t)b * n_outputs, .data = inputs[b]};
+    }
+    double *outputs = malloc((size_t)n * n_outputs * sizeof(double));
+    Tuning tuning = tuning_default();
+
+    printf("%s%10s %12s%s\n", BOLD, "tile", "samples/s", RESET);
+    double best = INFINITY;
+    for (int k = 0; k < TUNING_TILES; k++)
+    {
+        double duration = time_predict(network, n, inputs, outputs, tuning_tiles[k], 0);
+        printf("%10d %12.0f\n", tuning_tiles[k], n / duration);
+        tuning.tile = duration < best ? tuning_tiles[k] : tuning.tile;
+        best = duration < best ? duration : best;
+    }
+
+    printf("%s%10s %12s%s\n", BOLD, "grain", "samples/s", RESET);
+    best = INFINITY;
+    for (int grain = 0; grain <= n; grain = grain == 0 ? 4 : 2 * grain)
+    {
+        double duration = time_predict(network, n, inputs, outputs, tuning.tile, grain);
+        if (grain == 0)
+        {
+            printf("%10s %12.0f\n", "auto", n / duration);
+        }
+        else
+        {
+            printf("%10d %12.0f\n", grain, n / duration);
+        }
+        tuning.grain = duration < best ? grain : tuning.grain;
+        best = duration < best ? duration : best;
+    }
+
+    // the pool is restarted with every thread count, and with the default one afterwards
+    printf("%s%10s %12s%s\n", BOLD, "threads", "samples/s", RESET);
+    best = INFINITY;
+    int cores = available_cores();
+    for (int threads = 1; threads <= cores; threads = threads < cores && 2 * threads > cores ? cores : 2 * threads)
+    {
+        pool_shutdown();
+        pool_init(threads);
+        double duration = time_predict(network, n, inputs, outputs, tuning.tile, tuning.grain);
+        printf("%10d %12.0f\n", threads, n / duration);
+        tuning.threads = duration < best ? threads : tuning.threads;
+        best = duration < best ? duration : best;
+    }
+    pool_shutdown();
+    // all cores is what the pool uses anyway
+    tuning.threads = tuning.threads == cores ? 0 : tuning.threads;
+
+    ForwardKernel specialized = find_forward_kernel(network);
+    if (specialized != forward)
+    {
+        printf("%s%10s %12s%s\n", BOLD, "kernel", "latency", RESET);
+        ForwardKernel kernels[] = {forward, specialized};
+        double latency[2];
+        for (int variant = 0; variant < 2; variant++)
+        {
+            latency[variant] = INFINITY;
+            for (int r = 0; r < TUNE_REPEATS; r++)
+            {
+                double start = timestamp();
+                for (int b = 0; b < n; b++)
+                {
+                    kernels[variant](network, inputs[b]);
+                }
+                double duration = (timestamp() - start) / n;
+                latency[variant] = duration < latency[variant] ? duration : latency[variant];
+            }
+            printf("%10s %9.2f us\n", variant ? "specialized" : "generic", 1e6 * latency[variant]);
+        }
+        tuning.specialized = latency[1] <= latency[0];
+    }
+
+    // a trainable copy, with the gradients an inference network does not have
+    Network trainable = network_create(network.ndim, network.dims);
+    network_copy(trainable, network);
+    printf("%s%10s %12s%s\n", BOLD, "pipeline", "step", RESET);
+    double steps[2];
+    for (int pipeline = 0; pipeline < 2; pipeline++)
+    {
+        steps[pipeline] = time_steps(trainable, images, n, pipeline);
+        printf("%10s %9.2f ms\n", pipeline ? "on" : "off", 1000 * steps[pipeline]);
+    }
+    tuning.pipeline = steps[1] <= steps[0];
+
+    tuning_store(path, shape, tuning);
+    printf("tile %s%d%s, %s%d%s samples per task (0: a few tasks per worker), %s%d%s threads (0: all), %s%s%s kernel, "
+           "pipeline %s%s%s\n",
+           BOLD, tuning.tile, RESET, BOLD, tuning.grain, RESET, BOLD, tuning.threads, RESET, BOLD,
+           tuning.specialized && specialized != forward ? "specialized" : "generic", RESET, BOLD, tuning.pipeline ? "on" : "off", RESET);
+    printf("saved the tuning of %s to '%s'\n", shape, path);
+
+    network_destroy(trainable);
+    network_destroy(network);
+    free(outputs);
+    free(images);
+    free(inputs);
+    free(labels);
+    free(pixels);
+
+    return 0;
+}
+
+// side length of the square images the network expects
+int input_side(Network network)
+{
+    int side = (int)round(sqrt(network.dims[0]));
+    if (side * side != network.dims[0])
+    {
+        printf("%serror:%s model input of size %d is not a square image\n", RED, RESET, network.dims[0]);
+        exit(1);
+    }
+    return side;
+}
+
+int run(char *model_path, char *image_path)
+{
+    Network network = load_network(model_path, 1);
+    int side = input_side(network);
+    double *data = load_pgm_image(image_path, side, side);
+
+    report_tuning(network, stdout);
+    ForwardKernel kernel = tuned_forward_kernel(network);
+    if (kernel != forward)
+    {
+        printf("info: using specialized kernel for this model shape\n");
+    }
+    kernel(network, data);
+    int prediction = arg_max(network.dims[network.ndim - 1], network.neurons[network.ndim - 1]);
+
+    double probabilities[network.dims[network.ndim - 1]];
+
+    double sum = 0;
+    for (int i = 0; i < network.dims[network.ndim - 1]; i++)
+    {
+        probabilities[i] = network.neurons[network.ndim - 1][i];
+        sum += probabilities[i];
+    }
+
+    for (int i = 0; i < network.dims[network.ndim - 1]; i++)
+    {
+        probabilities[i] /= sum;
+    }
+
+    printf("%smodel prediction: %d%s\n", BOLD, prediction, RESET);
+
+    int n_rows = 10;
+    for (int row = 0; row < n_rows; row++)
+    {
+        for (int i = 0; i < network.dims[network.ndim - 1]; i++)
+        {
+            char *symbol = probabilities[i] > 1.0 - ((double)row + 0.5) / n_rows ? "\U00002588" : " ";
+            printf(" %s%s%s%s%s ", symbol, symbol, symbol, symbol, symbol);
+        }
+        printf("\n");
+    }
+    for (int i = 0; i < network.dims[network.ndim - 1]; i++)
+    {
+        printf(" %.3lf ", probabilities[i]);
+    }
+    printf("\n");
+    for (int i = 0; i < network.dims[network.ndim - 1]; i++)
+    {
+        printf("\U00002500\U00002500\U00002500\U00002500\U00002500\U00002500\U00002500");
+    }
+    printf("\n");
+    for (int i = 0; i < network.dims[network.ndim - 1]; i++)
+    {
+        printf("   %d   ", i);
+    }
+    printf("\n");
+
+    network_destroy(network);
+    free(data);
+
+    return 0;
+}
+
+typedef struct
+{
+    char *format;
+    char *output_path;
+    int batch_size;
+} RunOptions;
+
+int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+void append_path(char ***paths, int *count, int *capacity, char *path)
+{
+    if (*count == *capacity)
+    {
+        *capacity = *capacity ? 2 * *capacity : 256;
+        *paths = realloc(*paths, *capacity * sizeof(char *));
+    }
+    (*paths)[(*count)++] = strdup(path);
+}
+
+// expands directories, glob patterns and '@<file>' lists into image paths
+char **collect_images(int n_args, char **args, int *count)
+{
+    char **paths = NULL;
+    int capacity = 0;
+    *count = 0;
+
+    for (int a = 0; a < n_args; a++)
+    {
+        struct stat info;
+        if (args[a][0] == '@')
+        {
+            FILE *file = fopen(args[a] + 1, "r");
+            if (file == NULL)
+            {
+                printf("%serror:%s cannot open list '%s'\n", RED, RESET, args[a] + 1);
+                exit(1);
+            }
+            char line[4096];
+            while (fgets(line, sizeof(line), file) != NULL)
+            {
+                line[strcspn(line, "\r\n")] = '\0';
+                if (line[0] != '\0')
+                {
+                    append_path(&paths, count, &capacity, line);
+                }
+            }
+            fclose(file);
+        }
+        else if (stat(args[a], &info) == 0 && S_ISDIR(info.st_mode))
+        {
+            DIR *dir = opendir(args[a]);
+            int first = *count;
+            struct dirent *entry;
+            while (dir != NULL && (entry = readdir(dir)) != NULL)
+            {
+                size_t length = strlen(entry->d_name);
+                if (length > 4 && strcasecmp(entry->d_name + length - 4, ".pgm") == 0)
+                {
+                    char path[4096];
+                    snprintf(path, sizeof(path), "%s/%s", args[a], entry->d_name);
+                    append_path(&paths, count, &capacity, path);
+                }
+            }
+            if (dir != NULL)
+            {
+                closedir(dir);
+            }
+            qsort(paths + first, *count - first, sizeof(char *), compare_paths);
+        }
+        else if (strpbrk(args[a], "*?[") != NULL)
+        {
+            glob_t matches;
+            if (glob(args[a], 0, NULL, &matches) == 0)
+            {
+                for (size_t i = 0; i < matches.gl_pathc; i++)
+                {
+                    append_path(&paths, count, &capacity, matches.gl_pathv[i]);
+                }
+            }
+            globfree(&matches);
+        }
+        else
+        {
+            append_path(&paths, count, &capacity, args[a]);
+        }
+    }
+
+    return paths;
+}
+
+void write_escaped(FILE *file, char *string, int json)
+{
+    for (char *c = string; *c != '\0'; c++)
+    {
+        if (json && (*c == '"' || *c == '\\'))
+        {
+            fputc('\\', file);
+        }
+        else if (!json && *c == '"')
+        {
+            fputc('"', file);
+        }
+        fputc(*c, file);
+    }
+}
+
+typedef struct
+{
+    char **paths;
+    double *pixels;
+    const char **errors;
+    DecodeBuffer *buffers; // one per pool worker, reused for every batch
+    int side;
+} DecodeBatchJob;
+
+void decode_batch(void *context, int start, int end)
+{
+    DecodeBatchJob *job = context;
+    int size = job->side * job->side;
+    for (int b = start; b < end; b++)
+    {
+        job->errors[b] = decode_pgm(job->paths[b], job->side, job->side, job->pixels + (size_t)b * size, job->buffers + pool_worker);
+    }
+}
+
+// classifies many images in batches and streams the results as CSV or JSON lines
+int run_batch(char *model_path, int n_args, char **args, RunOptions options)
+{
+    int json = strcmp(options.format, "jsonl") == 0;
+    if (!json && strcmp(options.format, "csv") != 0)
+    {
+        printf("%serror:%s unknown format '%s'\n", RED, RESET, options.format);
+        exit(1);
+    }
+
+    Network network = load_network(model_path, 1);
+    tuning_start_pool(report_tuning(network, stderr));
+    int side = input_side(network);
+    int n_inputs = network.dims[0];
+    int n_outputs = network.dims[network.ndim - 1];
+
+    int count;
+    char **paths = collect_images(n_args, args, &count);
+
+    FILE *output = stdout;
+    if (options.output_path != NULL && (output = fopen(options.output_path, "w")) == NULL)
+    {
+        printf("%serror:%s cannot open '%s'\n", RED, RESET, options.output_path);
+        exit(1);
+    }
+    if (!json)
+    {
+        fprintf(output, "path,prediction,confidence");
+        for (int i = 0; i < n_outputs; i++)
+        {
+            fprintf(output, ",p%d", i);
+        }
+        fprintf(output, "\n");
+    }
+
+    // buffers are reused for every batch
+    int batch_size = options.batch_size;
+    double *pixels = malloc((size_t)batch_size * n_inputs * sizeof(double));
+    const char **errors = malloc(batch_size * sizeof(char *));
+    double **rows = malloc(batch_size * sizeof(double *));
+    int *indices = malloc(batch_size * sizeof(int));
+    double *outputs = malloc((size_t)batch_size * n_outputs * sizeof(double));
+    DecodeBuffer *buffers = calloc(pool_slots(), sizeof(DecodeBuffer));
+    InferenceContext *contexts = inference_contexts_create(network, 64);
+    Replicas replicas = report_replicas(replicas_create(network));
+
+    double start = timestamp();
+    int n_failed = 0;
+    for (int offset = 0; offset < count; offset += batch_size)
+    {
+        int n = count - offset < batch_size ? count - offset : batch_size;
+        DecodeBatchJob job = {.paths = paths + offset, .pixels = pixels, .errors = errors, .buffers = buffers, .side = side};
+        parallel_for(n, 1, decode_batch, &job);
+
+        int n_decoded = 0;
+        for (int b = 0; b < n; b++)
+        {
+            if (errors[b] != NULL)
+            {
+                fprintf(stderr, "warning: skipping '%s': %s\n", paths[offset + b], errors[b]);
+                n_failed++;
+                continue;
+            }
+            indices[n_decoded] = b;
+            rows[n_decoded++] = pixels + (size_t)b * n_inputs;
+        }
+
+        predict_replicated(network, replicas, contexts, n_decoded, rows, outputs);
+
+        for (int k = 0; k < n_decoded; k++)
+        {
+            double *probabilities = outputs + (size_t)k * n_outputs;
+            double sum = 0;
+            for (int i = 0; i < n_outputs; i++)
+            {
+                sum += probabilities[i];
+            }
+            int prediction = arg_max(n_outputs, probabilities);
+
+            char *path = paths[offset + indices[k]];
+            fprintf(output, json ? "{\"path\": \"" : "\"");
+            write_escaped(output, path, json);
+            fprintf(output, json ? "\", \"prediction\": %d, \"confidence\": %.6f, \"probabilities\": [" : "\",%d,%.6f",
+                    prediction, probabilities[prediction] / sum);
+            for (int i = 0; i < n_outputs; i++)
+            {
+                fprintf(output, json ? (i ? ", %.6f" : "%.6f") : ",%.6f", probabilities[i] / sum);
+            }
+            fprintf(output, json ? "]}\n" : "\n");
+        }
+    }
+    double duration = timestamp() - start;
+
+    fprintf(stderr, "info: classified %d images in %.3f s (%.0f images/s), %d failed\n",
+            count - n_failed, duration, (count - n_failed) / duration, n_failed);
+
+    if (output != stdout)
+    {
+        fclose(output);
+    }
+    inference_contexts_destroy(contexts);
+    replicas_destroy(replicas);
+    for (int t = 0; t < pool_slots(); t++)
+    {
+        decode_buffer_destroy(buffers[t]);
+    }
+    free(buffers);
+    free(outputs);
+    free(indices);
+    free(rows);
+    free(errors);
+    free(pixels);
+    for (int i = 0; i < count; i++)
+    {
+        free(paths[i]);
+    }
+    free(paths);
+    network_destroy(network);
+
+    return n_failed != 0;
+}
+
+typedef struct
+{
+    int ensemble;
+    int top_k;
+    char *format;
+    char *output_path;
+    char *teacher_path; // model the others are compared with, evaluated in the same pass
+} TestOptions;
+
+// one JSON object with the counts and rates of metrics
+void write_metrics_json(FILE *output, Metrics metrics)
+{
+    // rates of an empty set, and the speed of the ensemble that is not timed, are 0 since JSON has no NaN
+    double size = metrics.size > 0 ? metrics.size : 1;
+    fprintf(output, "{\"accuracy\": %.6f, \"top_k\": %d, \"top_k_accuracy\": %.6f, \"loss\": %.6f, "
+                    "\"images_per_second\": %.0f, \"classes\": [",
+            metrics_correctly(metrics) / size, metrics.top_k, metrics.top_k_correctly / size, metrics.loss / size,
+            metrics.seconds > 0 ? metrics.size / metrics.seconds : 0);
+    for (int c = 0; c < metrics.n_classes; c++)
+    {
+        fprintf(output, "%s{\"precision\": %.6f, \"recall\": %.6f}", c == 0 ? "" : ", ",
+                metrics_precision(metrics, c), metrics_recall(metrics, c));
+    }
+    fprintf(output, "], \"confusion\": [");
+    for (int c = 0; c < metrics.n_classes; c++)
+    {
+        fprintf(output, "%s[", c == 0 ? "" : ", ");
+        for (int i = 0; i < metrics.n_classes; i++)
+        {
+            fprintf(output, "%s%d", i == 0 ? "" : ", ", metrics.confusion[c * metrics.n_classes + i]);
+        }
+        fprintf(output, "]");
+    }
+    fprintf(output, "]}");
+}
+
+// mean time of a single-sample forward pass, over the first images of the dataset
+double forward_latency(Network network, Dataset dataset)
+{
+    ForwardKernel kernel = tuned_forward_kernel(network);
+    int n = dataset.size < 1000 ? dataset.size : 1000;
+    double start = timestamp();
+    for (int i = 0; i < n; i++)
+    {
+        kernel(network, dataset.images[i].data);
+    }
+    return n == 0 ? 0 : (timestamp() - start) / n;
+}
+
+// evaluates all models in one pass over the test images, optionally with their averaged prediction
+int test(int n_models, char **model_paths, TestOptions options)
+{
+    int json = strcmp(options.format, "json") == 0;
+    if (!json && strcmp(options.format, "text") != 0)
+    {
+        printf("%serror:%s unknown format '%s'\n", RED, RESET, options.format);
+        exit(1);
+    }
+
+    // the teacher is evaluated last, after the models compared with it
+    if (options.teacher_path != NULL)
+    {
+        model_paths[n_models++] = options.teacher_path;
+    }
+
+    Network *models = malloc((n_models + 1) * sizeof(Network));
+    for (int m = 0; m < n_models; m++)
+    {
+        models[m] = load_network(model_paths[m], 1);
+        int *dims = models[m].dims;
+        int *first = models[0].dims;
+        if (dims[0] != first[0] || dims[models[m].ndim - 1] != first[models[0].ndim - 1])
+        {
+            printf("%serror:%s model '%s' has %d inputs and %d outputs, expected %d and %d\n", RED, RESET,
+                   model_paths[m], dims[0], dims[models[m].ndim - 1], first[0], first[models[0].ndim - 1]);
+            exit(1);
+        }
+    }
+    // without a teacher, a quantized model is compared with its quantized weights as doubles on the same layers
+    const char *reference = "the teacher";
+    char dequantized_path[PATH_MAX + 16];
+    if (options.teacher_path == NULL && network_quantized(models[0]))
+    {
+        snprintf(dequantized_path, sizeof(dequantized_path), "%s as doubles", model_paths[0]);
+        models[n_models] = network_dequantize(models[0]);
+        options.teacher_path = model_paths[n_models++] = dequantized_path;
+        reference = dequantized_path;
+    }
+    // the copies of the weights on every NUMA node live as long as the models
+    Replicas *replicas = malloc(n_models * sizeof(Replicas));
+    for (int m = 0; m < n_models; m++)
+    {
+        replicas[m] = report_replicas(replicas_create(models[m]));
+    }
+    // the first model decides the number of threads, every model uses its own tile
+    tuning_start_pool(report_tuning(models[0], json ? stderr : stdout));
+    Dataset dataset = load_mnist_dataset("mnist/t10k-labels-idx1-ubyte", "mnist/t10k-images-idx3-ubyte");
+    fprintf(json ? stderr : stdout, "loaded dataset with %d images\n", dataset.size);
+
+    int n_classes = models[0].dims[models[0].ndim - 1];
+    int top_k = options.top_k < n_classes ? options.top_k : n_classes;
+    Metrics *metrics = malloc((n_models + 1) * sizeof(Metrics));
+    for (int m = 0; m <= n_models; m++)
+    {
+        metrics[m] = metrics_create(n_classes, top_k);
+    }
+    // the teacher is not part of the ensemble
+    int n_ensemble = options.teacher_path != NULL ? n_models - 1 : n_models;
+    evaluate_models(models, replicas, n_models, n_ensemble, dataset, metrics);
+
+    // latency of single images, for the comparison with the teacher
+    double *latencies = calloc(n_models, sizeof(double));
+    for (int m = 0; options.teacher_path != NULL && m < n_models; m++)
+    {
+        latencies[m] = forward_latency(models[m], dataset);
+    }
+
+    FILE *output = stdout;
+    if (options.output_path != NULL && (output = fopen(options.output_path, "w")) == NULL)
+    {
+        printf("%serror:%s cannot open '%s'\n", RED, RESET, options.output_path);
+        exit(1);
+    }
+
+    if (json)
+    {
+        fprintf(output, "{\"images\": %d, \"models\": [", dataset.size);
+        for (int m = 0; m < n_models; m++)
+        {
+            fprintf(output, "%s{\"path\": \"", m == 0 ? "" : ", ");
+            write_escaped(output, model_paths[m], 1);
+            fprintf(output, "\", \"bytes\": %zu, \"flops\": %ld", network_parameter_bytes(models[m]), network_flops(models[m]));
+            if (options.teacher_path != NULL)
+            {
+                fprintf(output, ", \"latency\": %.9f", latencies[m]);
+            }
+            fprintf(output, ", \"metrics\": ");
+            write_metrics_json(output, metrics[m]);
+            fprintf(output, "}");
+        }
+        fprintf(output, "]");
+        if (options.teacher_path != NULL)
+        {
+            fprintf(output, ", \"teacher\": %d", n_models - 1);
+        }
+        if (options.ensemble)
+        {
+            fprintf(output, ", \"ensemble\": ");
+            write_metrics_json(output, metrics[n_models]);
+        }
+        fprintf(output, "}\n");
+    }
+    else
+    {
+        for (int m = 0; m <= n_models; m++)
+        {
+            if (m == n_models && !options.ensemble)
+            {
+                break;
+            }
+            // no escape codes in files
+            const char *bold = output == stdout ? BOLD : "";
+            const char *reset = output == stdout ? RESET : "";
+            if (m == n_models)
+            {
+                fprintf(output, "%sensemble of %d%s: ", bold, n_ensemble, reset);
+            }
+            else if (n_models > 1)
+            {
+                fprintf(output, "%s%s%s: ", bold, model_paths[m], reset);
+            }
+            int predicted_correctly = metrics_correctly(metrics[m]);
+            fprintf(output, "predicted: %d, accurarcy: %f, top-%d: %f, loss: %f", predicted_correctly,
+                    (double)predicted_correctly / dataset.size, top_k,
+                    (double)metrics[m].top_k_correctly / dataset.size, metrics[m].loss / dataset.size);
+            if (m < n_models)
+            {
+                fprintf(output, ", %.0f images/s", dataset.size / metrics[m].seconds);
+            }
+            fprintf(output, "\n");
+        }
+
+        Metrics teacher = metrics[n_models - 1];
+        Network teacher_model = models[n_models - 1];
+        for (int m = 0; options.teacher_path != NULL && m < n_models - 1; m++)
+        {
+            fprintf(output, "%s: %.1fx smaller, %.1fx fewer FLOPs, %.1fx the speed and %.1fx lower latency than %s, accuracy %+.2f%%\n",
+                    model_paths[m], (double)network_parameter_bytes(teacher_model) / network_parameter_bytes(models[m]),
+                    (double)network_flops(teacher_model) / network_flops(models[m]),
+                    teacher.seconds / metrics[m].seconds, latencies[n_models - 1] / latencies[m], reference,
+                    100.0 * (metrics_correctly(metrics[m]) - metrics_correctly(teacher)) / dataset.size);
+        }
+    }
+
+    if (output != stdout)
+    {
+        fclose(output);
+    }
+    for (int m = 0; m < n_models; m++)
+    {
+        replicas_destroy(replicas[m]);
+        network_destroy(models[m]);
+    }
+    for (int m = 0; m <= n_models; m++)
+    {
+        metrics_destroy(metrics[m]);
+    }
+    free(replicas);
+    free(models);
+    free(metrics);
+    free(latencies);
+    destroy_dataset(dataset);
+
+    return 0;
+}
+
+typedef struct
+{
+    double *ranks;
+    int n_ranks;
+    double *layers; // layers to factorize, NULL for every layer the rank makes smaller
+    int n_layers;
+    int epochs; // fine-tuning epochs, 0 to skip
+    double learning_rate;
+    int batch_size;
+    char *output_path;
+} CompressOptions;
+
+// path with '-r<rank>' inserted before the extension
+char *rank_path(char *path, int rank)
+{
+    char *slash = strrchr(path, '/');
+    char *dot = strrchr(path, '.');
+    int stem = dot != NULL && (slash == NULL || dot > slash) ? (int)(dot - path) : (int)strlen(path);
+    char *result = malloc(strlen(path) + 16);
+    sprintf(result, "%.*s-r%d%s", stem, path, rank, path + stem);
+    return result;
+}
+
+// factorizes the layers of a model at every rank, optionally fine-tunes, saves and tests the results
+int compress(char *model_path, CompressOptions options)
+{
+    Network original = load_network(model_path, 1);
+    for (int k = 0; k < options.n_layers; k++)
+    {
+        if (options.layers[k] < 1 || options.layers[k] >= original.ndim)
+        {
+            printf("%serror:%s the model has no layer %.0f, its layers are 1 to %d\n", RED, RESET, options.layers[k],
+                   original.ndim - 1);
+            exit(1);
+        }
+    }
+
+    Dataset dataset = {0};
+    if (options.epochs > 0)
+    {
+        dataset = load_mnist_dataset("mnist/train-labels-idx1-ubyte", "mnist/train-images-idx3-ubyte");
+        printf("loaded dataset with %d images\n", dataset.size);
+    }
+
+    // test appends the original model to the paths
+    char **paths = malloc((options.n_ranks + 1) * sizeof(char *));
+    for (int r = 0; r < options.n_ranks; r++)
+    {
+        int rank = (int)options.ranks[r];
+        Network network = network_create(original.ndim, original.dims);
+        network_copy(network, original);
+
+        int n_factored = 0;
+        for (int l = 1; l < network.ndim; l++)
+        {
+            int selected = options.layers == NULL;
+            for (int k = 0; k < options.n_layers; k++)
+            {
+                selected |= options.layers[k] == l;
+            }
+            int n_out = network.dims[l], n_in = network.dims[l - 1];
+            if (!selected || network.ranks[l] > 0 || network.levels[l] > 0)
+            {
+                continue;
+            }
+            if ((long)rank * (n_out + n_in) >= (long)n_out * n_in)
+            {
+                if (options.layers != NULL)
+                {
+                    printf("%serror:%s rank %d does not make layer %d (%dx%d) smaller\n", RED, RESET, rank, l, n_out, n_in);
+                    exit(1);
+                }
+                continue;
+            }
+
+            factorize_layer(network, l, rank);
+            n_factored++;
+            double error = 0, norm = 0;
+            for (size_t i = 0; i < (size_t)n_out * n_in; i++)
+            {
+                double difference = network.weights[l][i] - original.weights[l][i];
+                error += difference * difference;
+                norm += original.weights[l][i] * original.weights[l][i];
+            }
+            printf("rank %d: factorized layer %d (%dx%d), relative error %.4f\n", rank, l, n_out, n_in, sqrt(error / norm));
+        }
+        if (n_factored == 0)
+        {
+            printf("%serror:%s rank %d makes no layer smaller\n", RED, RESET, rank);
+            exit(1);
+        }
+
+        if (options.epochs > 0)
+        {
+            Trainer trainer = trainer_create(network, pool_size());
+            for (int e = 0; e < options.epochs; e++)
+            {
+                shuffle_dataset(dataset, e);
+                epoch(&trainer, dataset, options.batch_size, options.learning_rate);
+            }
+            trainer_destroy(trainer);
+        }
+
+        paths[r] = options.n_ranks == 1 ? options.output_path : rank_path(options.output_path, rank);
+        FILE *file = fopen(paths[r], "wb");
+        if (file == NULL)
+        {
+            printf("%serror:%s cannot open '%s'\n", RED, RESET, paths[r]);
+            exit(1);
+        }
+        serialize_network(network, file);
+        fclose(file);
+        printf("saved model to: '%s'\n", paths[r]);
+        network_destroy(network);
+    }
+    if (options.epochs > 0)
+    {
+        destroy_dataset(dataset);
+    }
+    network_destroy(original);
+
+    TestOptions test_options = {.top_k = 5, .format = "text", .teacher_path = model_path};
+    int status = test(options.n_ranks, paths, test_options);
+    for (int r = 0; options.n_ranks > 1 && r < options.n_ranks; r++)
+    {
+        free(paths[r]);
+    }
+    free(paths);
+    return status;
+}
+
+typedef struct
+{
+    char *input_path;
+    char *output_path;
+    int batch_size;
+    double learning_rate;
+    double replay;        // share of replayed samples in a batch
+    int replay_capacity;  // new samples kept for replay, the oldest ones are freed
+    double publish_every; // seconds between snapshots
+} OnlineOptions;
+
+volatile sig_atomic_t online_stopped = 0;
+
+void online_stop(int signal)
+{
+    (void)signal;
+    online_stopped = 1;
+}
+
+// trains on the batches of pending samples, returns the number of steps
+int online_steps(Trainer *trainer, Online *learner, int flush, double learning_rate, double *loss)
+{
+    int steps = 0;
+    int size;
+    while ((size = online_batch(learner, flush)) > 0)
+    {
+        *loss += trainer_step(trainer, learner->batch, size, learning_rate) / size;
+        steps++;
+    }
+    return steps;
+}
+
+// keeps training a model on new samples as they arrive and publishes snapshots of it
+int online(char *source_path, OnlineOptions options)
+{
+    Network network = load_network(options.input_path, 0);
+    Dataset dataset = load_mnist_dataset("mnist/train-labels-idx1-ubyte", "mnist/train-images-idx3-ubyte");
+    int n_outputs = network.dims[network.ndim - 1];
+    if (network.dims[0] != dataset.rows * dataset.cols || n_outputs != 10)
+    {
+        printf("%serror:%s the model has %d inputs and %d outputs, the images %d pixels and 10 classes\n", RED, RESET,
+               network.dims[0], n_outputs, dataset.rows * dataset.cols);
+        exit(1);
+    }
+    printf("loaded dataset with %d images to replay\n", dataset.size);
+
+    Online learner = online_create(dataset, n_outputs, options.batch_size, options.replay, options.replay_capacity);
+    Trainer trainer = trainer_create(network, pool_size());
+    SampleSource source = sample_source_open(source_path);
+    signal(SIGINT, online_stop);
+    signal(SIGTERM, online_stop);
+    printf("learning from '%s', publishing to '%s' every %g s\n", source_path, options.output_path,
+           options.publish_every);
+
+    double published = timestamp();
+    double loss = 0;
+    int steps = 0;
+    int snapshots = 0;
+    int ended = 0;
+    while (!online_stopped && !ended)
+    {
+        int n_lines = sample_source_poll(&source, 100, online_add, &learner);
+        ended = n_lines < 0;
+
+        // a partial batch is trained once the source goes quiet
+        steps += online_steps(&trainer, &learner, n_lines <= 0, options.learning_rate, &loss);
+        if (steps > 0 && timestamp() - published >= options.publish_every)
+        {
+            publish_network(network, options.output_path);
+            printf("published snapshot %d after %d new samples, loss: %.4f\n", ++snapshots, learner.trained, loss / steps);
+            published = timestamp();
+            loss = 0;
+            steps = 0;
+        }
+    }
+
+    // the samples that are still pending go into the last snapshot
+    steps += online_steps(&trainer, &learner, 1, options.learning_rate, &loss);
+    if (steps > 0)
+    {
+        publish_network(network, options.output_path);
+        printf("published snapshot %d after %d new samples, loss: %.4f\n", ++snapshots, learner.trained, loss / steps);
+    }
+    fprintf(stderr, "info: learned from %d new samples, skipped %d lines\n", learner.trained, learner.rejected);
+
+    sample_source_close(source);
+    trainer_destroy(trainer);
+    online_destroy(learner);
+    destroy_dataset(dataset);
+    network_destroy(network);
+    return 0;
+}
+
+// USAGE
+
+int print_usage_main()
+{
+    printf("Usage:\n");
+    printf("\n");
     printf("    %sneural <command> [<args>]%s\n", BOLD, RESET);
     printf("\n");
     printf("Commands:\n");
     printf("\n");
     printf("    %srun%s    Run inference using a trained network\n", BOLD, RESET);
     printf("      %s<path>%s                      path to model\n", BOLD, RESET);
-    printf("      %s<path>%s                      path to PGM P5 image \n", BOLD, RESET);
+    printf("      %s<path>..%s                    PGM images, directories, glob patterns or @<list file>\n", BOLD, RESET);
+    printf("      %s-f, --format <csv|jsonl>%s    output format for many images (default: csv)\n", BOLD, RESET);
+    printf("      %s-o, --output <path>%s         write results to a file instead of stdout\n", BOLD, RESET);
+    printf("      %s-b, --batch-size <int>%s      images decoded and classified at once (default: 256)\n", BOLD, RESET);
     printf("\n");
     printf("    %stest%s   Test the accurary of a trained network\n", BOLD, RESET);
-    printf("      %s<path>%s                      path to model (default: default.model)\n", BOLD, RESET);
+    printf("      %s<path>..%s                    paths to models, evaluated in one pass (default: default.model)\n", BOLD, RESET);
+    printf("      %s--ensemble%s                  also report the accuracy of the averaged prediction\n", BOLD, RESET);
+    printf("      %s-k, --top-k <int>%s           count a sample as correct when its label is among the\n", BOLD, RESET);
+    printf("                                  k largest outputs (default: 5)\n");
+    printf("      %s-f, --format <text|json>%s    output format, json adds the per-class precision, recall\n", BOLD, RESET);
+    printf("                                  and the confusion matrix (default: text)\n");
+    printf("      %s-o, --output <path>%s         write results to a file instead of stdout\n", BOLD, RESET);
+    printf("      %s--teacher <path>%s            also test this model, compare accuracy, size, FLOPs, speed\n", BOLD, RESET);
+    printf("                                  and latency with it, quantized models are compared with\n");
+    printf("                                  their layers in doubles by default\n");
     printf("\n");
     printf("    %strain%s  Train a new network and store it to disk\n", BOLD, RESET);
     printf("      %s-b, --batch-size <int>%s      samples per batch (default: 200)\n", BOLD, RESET);
@@ -197,94 +2141,1287 @@ int print_usage_main()
     printf("      %s-l, --learning-rate <real>%s  step size of parameter update (default: 0.01)\n", BOLD, RESET);
     printf("      %s-i, --input <path>%s          path to model used as starting point (optional)\n", BOLD, RESET);
     printf("      %s-o, --output <path>%s         output path of the trained model (default: default.model)\n", BOLD, RESET);
+    printf("      %s-s, --seed <int>%s            seed for initialization and shuffling (default: 0)\n", BOLD, RESET);
+    printf("      %s-t, --threads <int>%s         number of training threads (default: NEURAL_THREADS)\n", BOLD, RESET);
+    printf("      %s--hogwild%s                   lock-free asynchronous updates (non-deterministic)\n", BOLD, RESET);
+    printf("      %s--precision <name>%s          storage of weights and activations: double (default),\n", BOLD, RESET);
+    printf("                                  bf16 or fp16 (with loss scaling)\n");
+    printf("      %s--checkpoint-every <int>%s    train whole slices at once, keeping the activations of\n", BOLD, RESET);
+    printf("                                  every n-th layer and recomputing the rest (optional)\n");
+    printf("      %s--quantize <name>%s           binary or ternary weights and activations for the layers\n", BOLD, RESET);
+    printf("                                  between two hidden layers, run with popcounts (optional)\n");
+    printf("      %s--augment%s                   randomly shift, rotate, distort and add noise to the\n", BOLD, RESET);
+    printf("                                  images of every batch while training\n");
+    printf("      %s--shift <real>%s              largest shift in pixels (default: 2)\n", BOLD, RESET);
+    printf("      %s--rotate <real>%s             largest rotation in degrees (default: 10)\n", BOLD, RESET);
+    printf("      %s--elastic <real>%s            strength of the elastic distortion (default: 34)\n", BOLD, RESET);
+    printf("      %s--noise <real>%s              standard deviation of the noise (default: 0.05)\n", BOLD, RESET);
+    printf("      %s--profile%s                   report where the training time went, with the hardware\n", BOLD, RESET);
+    printf("                                  counters of the workers where available\n");
+    printf("      %s--validation <real>%s         fraction of images held out for validation (default: 0)\n", BOLD, RESET);
+    printf("      %s--validate-every <int>%s      batches between validations (default: once per epoch)\n", BOLD, RESET);
+    printf("      %s--patience <int>%s            stop after this many validations without improvement\n", BOLD, RESET);
+    printf("                                  and keep the best weights (default: 0, never stop)\n");
+    printf("      %s--min-delta <real>%s          decrease of the validation loss that counts as\n", BOLD, RESET);
+    printf("                                  an improvement (default: 0)\n");
+    printf("      %s--schedule <name>%s           learning rate schedule: constant (default), step,\n", BOLD, RESET);
+    printf("                                  cosine or plateau\n");
+    printf("      %s--lr-factor <real>%s          rate multiplier of step and plateau (default: 0.5)\n", BOLD, RESET);
+    printf("      %s--lr-step <int>%s             epochs between steps, or validations without\n", BOLD, RESET);
+    printf("                                  improvement before a plateau decay (default: 2)\n");
+    printf("      %s--workers <int>%s             train with this many local processes (default: 1)\n", BOLD, RESET);
+    printf("      %s--peers <addr,addr,..>%s      addresses of all processes of a distributed job,\n", BOLD, RESET);
+    printf("                                  'host:port' or 'unix:<path>'\n");
+    printf("      %s--rank <int>%s                index of this process in --peers\n", BOLD, RESET);
+    printf("\n");
+    printf("    %ssweep%s  Train many configurations side by side and rank them by validation loss\n", BOLD, RESET);
+    printf("      %s-d, --dims <int,int,..>%s     hidden layers of a candidate shape, repeat for more (default: 16,16)\n", BOLD, RESET);
+    printf("      %s-l, --learning-rate <list>%s  candidate learning rates 'a,b,..', or a range 'min:max'\n", BOLD, RESET);
+    printf("                                  sampled log-uniformly by --random (default: 0.01)\n");
+    printf("      %s-b, --batch-size <list>%s     candidate batch sizes 'a,b,..' (default: 200)\n", BOLD, RESET);
+    printf("      %s-e, --epochs <int>%s          number of epochs (default: 10)\n", BOLD, RESET);
+    printf("      %s-s, --seed <int>%s            seed for initialization and shuffling (default: 0)\n", BOLD, RESET);
+    printf("      %s--validation <real>%s         fraction of images held out for ranking (default: 0.1)\n", BOLD, RESET);
+    printf("      %s--random <int>%s              draw this many random configurations instead of the grid\n", BOLD, RESET);
+    printf("      %s-o, --output <path>%s         ranked results as CSV (default: sweep.csv)\n", BOLD, RESET);
+    printf("\n");
+    printf("    %sdistill%s Train a small student network on the soft outputs of a teacher\n", BOLD, RESET);
+    printf("      %s<path>%s                      path to the teacher model\n", BOLD, RESET);
+    printf("      %s--temperature <real>%s        softening of the teacher's outputs (default: 2)\n", BOLD, RESET);
+    printf("      %s--alpha <real>%s              weight of the soft targets against the labels (default: 0.7)\n", BOLD, RESET);
+    printf("                                  and all flags of train, -o defaults to student.model\n");
+    printf("\n");
+    printf("    %scompress%s Factorize the layers of a network into low-rank products\n", BOLD, RESET);
+    printf("      %s<path>%s                      path to the model\n", BOLD, RESET);
+    printf("      %s-r, --rank <int,int,..>%s     ranks to try, every one saved as a separate model\n", BOLD, RESET);
+    printf("      %s--layers <int,int,..>%s       layers to factorize (default: all that get smaller)\n", BOLD, RESET);
+    printf("      %s-e, --epochs <int>%s          epochs of fine-tuning the factors (default: 0)\n", BOLD, RESET);
+    printf("      %s-l, --learning-rate <real>%s  step size of the fine-tuning (default: 0.01)\n", BOLD, RESET);
+    printf("      %s-b, --batch-size <int>%s      samples per fine-tuning batch (default: 200)\n", BOLD, RESET);
+    printf("      %s-o, --output <path>%s         output path, '-r<rank>' is added for several ranks\n", BOLD, RESET);
+    printf("                                  (default: compressed.model)\n");
+    printf("\n");
+    printf("    %sonline%s Keep training a network on new samples and publish snapshots of it\n", BOLD, RESET);
+    printf("      %s<source>%s                    lines '<path>,<label>' from a file that is followed,\n", BOLD, RESET);
+    printf("                                  '-' for standard input or 'unix:<path>' for a socket\n");
+    printf("      %s-i, --input <path>%s          model to start from (default: default.model)\n", BOLD, RESET);
+    printf("      %s-o, --output <path>%s         path the snapshots replace (default: the input)\n", BOLD, RESET);
+    printf("      %s-b, --batch-size <int>%s      samples per step (default: 32)\n", BOLD, RESET);
+    printf("      %s-l, --learning-rate <real>%s  step size of parameter update (default: 0.01)\n", BOLD, RESET);
+    printf("      %s--replay <real>%s             share of every batch replayed from the training images\n", BOLD, RESET);
+    printf("                                  and earlier samples (default: 0.5)\n");
+    printf("      %s--replay-capacity <int>%s     earlier samples kept for replay (default: 10000)\n", BOLD, RESET);
+    printf("      %s--publish-every <real>%s      seconds between snapshots (default: 10)\n", BOLD, RESET);
+    printf("\n");
+    printf("    %stune%s   Time the kernel settings for the shape of a model and cache the fastest\n", BOLD, RESET);
+    printf("      %s<path>%s                      path to model (default: default.model)\n", BOLD, RESET);
+    printf("      %s-b, --batch-size <int>%s      samples per timed batch (default: 256)\n", BOLD, RESET);
+    printf("      %s-o, --output <path>%s         tuning cache to update (default: NEURAL_TUNING)\n", BOLD, RESET);
     printf("\n");
     printf("    %sbench%s  Benchmark forward and backward pass\n", BOLD, RESET);
+    printf("      %s<suite>%s                     passes (default), sgd (synchronous vs. hogwild)\n", BOLD, RESET);
+    printf("                                  pipeline (layer-wise overlap of the update)\n");
+    printf("                                  kernels (specialized forward passes)\n");
+    printf("                                  precision (double vs. bf16 and fp16 training)\n");
+    printf("                                  memory (huge pages and NUMA placement)\n");
+    printf("                                  checkpoint (activation memory vs. recomputation)\n");
+    printf("                                  or distributed (scaling efficiency over loopback)\n");
+    printf("      %s--counters%s                  hardware counters per layer (passes) or kernel (kernels)\n", BOLD, RESET);
     printf("\n");
     printf("    %shelp%s   Show this message and exit\n", BOLD, RESET);
     printf("\n");
+    printf("Environment:\n");
+    printf("\n");
+    printf("    %sNEURAL_THREADS%s        number of worker threads (default: all cores)\n", BOLD, RESET);
+    printf("    %sNEURAL_PIN%s            pin worker threads to cores, 0 to disable (default: 1)\n", BOLD, RESET);
+    printf("    %sNEURAL_HUGEPAGES%s      huge pages for large arrays: off, transparent (default)\n", BOLD, RESET);
+    printf("                          or explicit (reserved pages, falls back to transparent)\n");
+    printf("    %sNEURAL_NUMA_DATA%s      placement of the images: first-touch (default),\n", BOLD, RESET);
+    printf("                          interleave or shard (contiguous shards per node)\n");
+    printf("    %sNEURAL_NUMA_REPLICAS%s  copy inference weights to every NUMA node, 0 to disable\n", BOLD, RESET);
+    printf("                          (default: 1)\n");
+    printf("    %sNEURAL_TUNING%s         tuning cache of train, test and run, empty to disable\n", BOLD, RESET);
+    printf("                          (default: ~/.cache/neural/tuning.csv)\n");
+    printf("\n");
+
+    return 0;
+}
+
+// MAIN
+
+int main(int argc, char *argv[])
+{
+    if (argc == 1 || strcmp(argv[1], "help") == 0 || strcmp(argv[1], "--help") == 0)
+    {
+        print_usage_main();
+        return argc == 1;
+    }
+
+    else if (strcmp(argv[1], "run") == 0)
+    {
+        RunOptions options = {.format = NULL, .output_path = NULL, .batch_size = 256};
+        char *model_path = NULL;
+        char **inputs = malloc(argc * sizeof(char *));
+        int n_inputs = 0;
+
+        for (int i = 2; i < argc; i++)
+        {
+            if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--format") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected format after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                options.format = argv[++i];
+            }
+
+            else if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected path after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                options.output_path = argv[++i];
+            }
+
+            else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch-size") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected batch size after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if batch size is a positive integer
+                char c;
+                if (sscanf(argv[++i], "%d%c", &options.batch_size, &c) != 1 || options.batch_size < 1)
+                {
+                    printf("%serror:%s invalid batch size '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else if (model_path == NULL)
+            {
+                model_path = argv[i];
+            }
+
+            else
+            {
+                inputs[n_inputs++] = argv[i];
+            }
+        }
+
+        if (n_inputs == 0)
+        {
+            printf("%serror:%s unexpected number of arguments\n", RED, RESET);
+            exit(1);
+        }
+
+        // a single image without output options is shown in the terminal
+        struct stat info;
+        int is_single_image = n_inputs == 1 && inputs[0][0] != '@' && strpbrk(inputs[0], "*?[") == NULL &&
+                              stat(inputs[0], &info) == 0 && S_ISREG(info.st_mode);
+        int status;
+        if (is_single_image && options.format == NULL && options.output_path == NULL)
+        {
+            status = run(model_path, inputs[0]);
+        }
+        else
+        {
+            options.format = options.format == NULL ? "csv" : options.format;
+            status = run_batch(model_path, n_inputs, inputs, options);
+        }
+        free(inputs);
+        return status;
+    }
+
+    else if (strcmp(argv[1], "test") == 0)
+    {
+        TestOptions options = {.ensemble = 0, .top_k = 5, .format = "text", .output_path = NULL, .teacher_path = NULL};
+        char **model_paths = malloc((argc + 1) * sizeof(char *));
+        int n_models = 0;
+
+        for (int i = 2; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--ensemble") == 0)
+            {
+                options.ensemble = 1;
+            }
+
+            else if (strcmp(argv[i], "-k") == 0 || strcmp(argv[i], "--top-k") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected top-k after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if k is a positive integer
+                char c;
+                if (sscanf(argv[++i], "%d%c", &options.top_k, &c) != 1 || options.top_k < 1)
+                {
+                    printf("%serror:%s invalid top-k '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--format") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected format after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                options.format = argv[++i];
+            }
+
+            else if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected path after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                options.output_path = argv[++i];
+            }
+
+            else if (strcmp(argv[i], "--teacher") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected path after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                options.teacher_path = argv[++i];
+            }
+
+            else
+            {
+                model_paths[n_models++] = argv[i];
+            }
+        }
+
+        if (n_models == 0)
+        {
+            model_paths[n_models++] = "default.model";
+        }
+
+        int result = test(n_models, model_paths, options);
+        free(model_paths);
+        return result;
+    }
+
+    // 'distill' trains a student with the flags of 'train', its first argument is the teacher
+    else if (strcmp(argv[1], "train") == 0 || strcmp(argv[1], "distill") == 0)
+    {
+        int distill = strcmp(argv[1], "distill") == 0;
+        if (distill && (argc < 3 || argv[2][0] == '-'))
+        {
+            printf("%serror:%s expected path of the teacher model\n", RED, RESET);
+            exit(1);
+        }
+        char *teacher_path = distill ? argv[2] : NULL;
+        double temperature = 2;
+        double alpha = 0.7;
+
+        // default values
+        TrainOptions options = {
+            .batch_size = 200,
+            .epochs = 10,
+            .learning_rate = 0.01,
+            .threads = 0,
+            .output_path = distill ? "student.model" : "default.model",
+            .schedule = SCHEDULE_CONSTANT,
+            .lr_factor = 0.5,
+            .lr_step = 2,
+            .augmentation = {.shift = 2, .rotation = 10, .elastic = 34, .sigma = 4, .noise = 0.05},
+        };
+        char *dims_string = NULL;
+        char *input_path = NULL;
+        char *peers_string = NULL;
+        int rank = 0;
+        int workers = 1;
+
+        // parse optional flags
+        for (int i = distill ? 3 : 2; i < argc; i++)
+        {
+
+            if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch-size") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected batch size after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if batch size is an integer
+                char c;
+                if (sscanf(argv[++i], "%d%c", &options.batch_size, &c) != 1 || options.batch_size < 1)
+                {
+                    printf("%serror:%s invalid batch size '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--dims") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected dimensions after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                dims_string = argv[++i];
+            }
+
+            else if (strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--epochs") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected epochs after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if batch size is an integer
+                char c;
+                if (sscanf(argv[++i], "%d%c", &options.epochs, &c) != 1)
+                {
+                    printf("%serror:%s invalid epochs '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else if (strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--learning-rate") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected learning rate after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if learning rate is a real number
+                char c;
+                if (sscanf(argv[++i], "%lf%c", &options.learning_rate, &c) != 1)
+                {
+                    printf("%serror:%s invalid learning rate '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else if (strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--input") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected path after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                input_path = argv[++i];
+            }
+
+            else if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected path after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                options.output_path = argv[++i];
+            }
+
+            else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--seed") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected seed after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if seed is a non-negative integer
+                unsigned long long seed;
+                char c;
+                if (argv[++i][0] == '-' || sscanf(argv[i], "%llu%c", &seed, &c) != 1)
+                {
+                    printf("%serror:%s invalid seed '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+                rng_seed = seed;
+            }
+
+            else if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--threads") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected number of threads after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if number of threads is a positive integer
+                char c;
+                if (sscanf(argv[++i], "%d%c", &options.threads, &c) != 1 || options.threads < 1)
+                {
+                    printf("%serror:%s invalid number of threads '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else if (strcmp(argv[i], "--hogwild") == 0)
+            {
+                options.hogwild = 1;
+            }
+
+            else if (strcmp(argv[i], "--augment") == 0)
+            {
+                options.augment = 1;
+            }
+
+            else if (strcmp(argv[i], "--shift") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected shift after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if shift is a non-negative real number
+                char c;
+                if (sscanf(argv[++i], "%lf%c", &options.augmentation.shift, &c) != 1 || options.augmentation.shift < 0)
+                {
+                    printf("%serror:%s invalid shift '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+                options.augment = 1;
+            }
+
+            else if (strcmp(argv[i], "--rotate") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected rotation after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if rotation is a non-negative real number
+                char c;
+                if (sscanf(argv[++i], "%lf%c", &options.augmentation.rotation, &c) != 1 || options.augmentation.rotation < 0)
+                {
+                    printf("%serror:%s invalid rotation '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+                options.augment = 1;
+            }
+
+            else if (strcmp(argv[i], "--elastic") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected strength after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if strength is a non-negative real number
+                char c;
+                if (sscanf(argv[++i], "%lf%c", &options.augmentation.elastic, &c) != 1 || options.augmentation.elastic < 0)
+                {
+                    printf("%serror:%s invalid strength '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+                options.augment = 1;
+            }
+
+            else if (strcmp(argv[i], "--noise") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected noise after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if noise is a non-negative real number
+                char c;
+                if (sscanf(argv[++i], "%lf%c", &options.augmentation.noise, &c) != 1 || options.augmentation.noise < 0)
+                {
+                    printf("%serror:%s invalid noise '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+                options.augment = 1;
+            }
+
+            else if (strcmp(argv[i], "--profile") == 0)
+            {
+                options.profile = 1;
+            }
+
+            else if (strcmp(argv[i], "--precision") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected precision after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                char *name = argv[++i];
+                if (strcmp(name, "double") == 0)
+                {
+                    options.precision = PRECISION_DOUBLE;
+                }
+                else if (strcmp(name, "bf16") == 0)
+                {
+                    options.precision = PRECISION_BF16;
+                }
+                else if (strcmp(name, "fp16") == 0)
+                {
+                    options.precision = PRECISION_FP16;
+                }
+                else
+                {
+                    printf("%serror:%s unknown precision '%s'\n", RED, RESET, name);
+                    exit(1);
+                }
+            }
+
+            else if (strcmp(argv[i], "--validation") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected fraction after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if fraction is a real number in [0, 1)
+                char c;
+                if (sscanf(argv[++i], "%lf%c", &options.validation, &c) != 1 ||
+                    options.validation < 0 || options.validation >= 1)
+                {
+                    printf("%serror:%s invalid validation fraction '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else if (strcmp(argv[i], "--quantize") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected binary or ternary after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                char *name = argv[++i];
+                if (strcmp(name, "binary") == 0)
+                {
+                    options.quantize = LEVELS_BINARY;
+                }
+                else if (strcmp(name, "ternary") == 0)
+                {
+                    options.quantize = LEVELS_TERNARY;
+                }
+                else
+                {
+                    printf("%serror:%s unknown quantization '%s'\n", RED, RESET, name);
+                    exit(1);
+                }
+            }
+
+            else if (strcmp(argv[i], "--checkpoint-every") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected number of layers after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if number of layers is a positive integer
+                char c;
+                if (sscanf(argv[++i], "%d%c", &options.checkpoint_every, &c) != 1 || options.checkpoint_every < 1)
+                {
+                    printf("%serror:%s invalid number of layers '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else if (strcmp(argv[i], "--validate-every") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected number of batches after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if number of batches is a positive integer
+                char c;
+                if (sscanf(argv[++i], "%d%c", &options.validate_every, &c) != 1 || options.validate_every < 1)
+                {
+                    printf("%serror:%s invalid number of batches '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else if (strcmp(argv[i], "--patience") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected patience after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if patience is a non-negative integer
+                char c;
+                if (sscanf(argv[++i], "%d%c", &options.patience, &c) != 1 || options.patience < 0)
+                {
+                    printf("%serror:%s invalid patience '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else if (strcmp(argv[i], "--min-delta") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected minimum delta after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if minimum delta is a non-negative real number
+                char c;
+                if (sscanf(argv[++i], "%lf%c", &options.min_delta, &c) != 1 || options.min_delta < 0)
+                {
+                    printf("%serror:%s invalid minimum delta '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else if (strcmp(argv[i], "--schedule") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected schedule after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                char *name = argv[++i];
+                if (strcmp(name, "constant") == 0)
+                {
+                    options.schedule = SCHEDULE_CONSTANT;
+                }
+                else if (strcmp(name, "step") == 0)
+                {
+                    options.schedule = SCHEDULE_STEP;
+                }
+                else if (strcmp(name, "cosine") == 0)
+                {
+                    options.schedule = SCHEDULE_COSINE;
+                }
+                else if (strcmp(name, "plateau") == 0)
+                {
+                    options.schedule = SCHEDULE_PLATEAU;
+                }
+                else
+                {
+                    printf("%serror:%s unknown schedule '%s'\n", RED, RESET, name);
+                    exit(1);
+                }
+            }
+
+            else if (strcmp(argv[i], "--lr-factor") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected factor after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if factor is a positive real number
+                char c;
+                if (sscanf(argv[++i], "%lf%c", &options.lr_factor, &c) != 1 || options.lr_factor <= 0)
+                {
+                    printf("%serror:%s invalid factor '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else if (strcmp(argv[i], "--lr-step") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected step after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if step is a positive integer
+                char c;
+                if (sscanf(argv[++i], "%d%c", &options.lr_step, &c) != 1 || options.lr_step < 1)
+                {
+                    printf("%serror:%s invalid step '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else if (strcmp(argv[i], "--workers") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected number of workers after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if number of workers is a positive integer
+                char c;
+                if (sscanf(argv[++i], "%d%c", &workers, &c) != 1 || workers < 1)
+                {
+                    printf("%serror:%s invalid number of workers '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else if (strcmp(argv[i], "--peers") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected addresses after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                peers_string = argv[++i];
+            }
+
+            else if (strcmp(argv[i], "--rank") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected rank after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if rank is a non-negative integer
+                char c;
+                if (sscanf(argv[++i], "%d%c", &rank, &c) != 1 || rank < 0)
+                {
+                    printf("%serror:%s invalid rank '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else if (distill && strcmp(argv[i], "--temperature") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected temperature after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if temperature is a positive number
+                char c;
+                if (sscanf(argv[++i], "%lf%c", &temperature, &c) != 1 || temperature <= 0)
+                {
+                    printf("%serror:%s invalid temperature '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else if (distill && strcmp(argv[i], "--alpha") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected weight after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if weight is between 0 and 1
+                char c;
+                if (sscanf(argv[++i], "%lf%c", &alpha, &c) != 1 || alpha < 0 || alpha > 1)
+                {
+                    printf("%serror:%s invalid weight '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else
+            {
+                printf("%serror:%s unknown flag '%s'\n", RED, RESET, argv[i]);
+                exit(1);
+            }
+        }
+
+        // distributed setup, processes are forked before any threads exist
+        int world_size = 1;
+        char **peers = NULL;
+        pid_t *children = NULL;
+        if (peers_string != NULL && workers > 1)
+        {
+            printf("%serror:%s --peers and --workers flags are not compatible\n", RED, RESET);
+            exit(1);
+        }
+        else if (peers_string != NULL)
+        {
+            world_size = 1;
+            for (char *c = peers_string; *c != '\0'; c++)
+            {
+                world_size += *c == ',';
+            }
+            peers = malloc(world_size * sizeof(char *));
+            peers[0] = strtok(peers_string, ",");
+            for (int r = 1; r < world_size; r++)
+            {
+                peers[r] = strtok(NULL, ",");
+            }
+        }
+        else if (workers > 1)
+        {
+            world_size = workers;
+            peers = malloc(world_size * sizeof(char *));
+            for (int r = 0; r < world_size; r++)
+            {
+                peers[r] = malloc(108);
+                snprintf(peers[r], 108, "unix:/tmp/neural-%d-%d.sock", (int)getpid(), r);
+            }
+
+            fflush(stdout);
+            children = malloc(world_size * sizeof(pid_t));
+            for (int r = 1; r < world_size; r++)
+            {
+                children[r] = fork();
+                if (children[r] == 0)
+                {
+                    // only the first process reports progress
+                    rank = r;
+                    free(children);
+                    children = NULL;
+                    if (freopen("/dev/null", "w", stdout) == NULL)
+                    {
+                        exit(1);
+                    }
+                    break;
+                }
+            }
+
+            // share the cores between the local processes
+            if (options.threads == 0 && getenv("NEURAL_THREADS") == NULL)
+            {
+                int threads = pool_default_size() / world_size;
+                options.threads = threads > 0 ? threads : 1;
+            }
+        }
+
+        if (rank >= world_size)
+        {
+            printf("%serror:%s rank %d is out of range for %d peers\n", RED, RESET, rank, world_size);
+            exit(1);
+        }
+        if (options.hogwild && options.augment)
+        {
+            printf("%serror:%s --hogwild cannot be combined with augmentation\n", RED, RESET);
+            exit(1);
+        }
+        if (options.hogwild && options.precision != PRECISION_DOUBLE)
+        {
+            printf("%serror:%s --hogwild only trains in double precision\n", RED, RESET);
+            exit(1);
+        }
+        if (options.checkpoint_every > 0 && (options.hogwild || options.precision != PRECISION_DOUBLE))
+        {
+            printf("%serror:%s --checkpoint-every only trains synchronously in double precision\n", RED, RESET);
+            exit(1);
+        }
+        if (options.quantize > 0 && (options.hogwild || options.checkpoint_every > 0 || options.precision != PRECISION_DOUBLE))
+        {
+            printf("%serror:%s --quantize only trains synchronously, sample by sample, in double precision\n", RED, RESET);
+            exit(1);
+        }
+        if (world_size > 1 && options.hogwild)
+        {
+            printf("%serror:%s --hogwild cannot be used in a distributed job\n", RED, RESET);
+            exit(1);
+        }
+        if ((options.patience > 0 || options.schedule == SCHEDULE_PLATEAU) && options.validation == 0)
+        {
+            printf("%serror:%s early stopping and the plateau schedule need a --validation split\n", RED, RESET);
+            exit(1);
+        }
+        if (options.batch_size < world_size)
+        {
+            printf("%serror:%s batch size must be at least the number of processes\n", RED, RESET);
+            exit(1);
+        }
+
+        options.comm = communicator_connect(rank, world_size, peers);
+
+        // one training thread per worker unless requested otherwise
+        if (options.threads == 0)
+        {
+            options.threads = pool_size();
+        }
+        else
+        {
+            pool_init(options.threads);
+        }
+
+        // load dataset
+        Dataset dataset = load_mnist_dataset("mnist/train-labels-idx1-ubyte", "mnist/train-images-idx3-ubyte");
+        printf("loaded dataset with %d images\n", dataset.size);
+
+        // the teacher runs once, its soft targets replace the labels for all epochs
+        if (distill)
+        {
+            Network teacher = load_network(teacher_path, 1);
+            if (teacher.dims[0] != 784 || teacher.dims[teacher.ndim - 1] != 10)
+            {
+                printf("%serror:%s teacher '%s' does not have 784 inputs and 10 outputs\n", RED, RESET, teacher_path);
+                exit(1);
+            }
+            // train splits off the last images for validation, they keep their true labels
+            Dataset training = dataset;
+            training.size -= (int)(dataset.size * options.validation);
+            double start = timestamp();
+            double *logits = teacher_logits(teacher, training);
+            distill_labels(training, logits, 10, temperature, alpha);
+            printf("computed soft targets of the teacher in %.2f s (temperature: %g, weight: %g)\n",
+                   timestamp() - start, temperature, alpha);
+            free(logits);
+            network_destroy(teacher);
+        }
+
+        // every process keeps its share of the training batches and the validation split
+        if (world_size > 1)
+        {
+            int n_train = dataset.size - (int)(dataset.size * options.validation);
+            Dataset shard = shard_dataset(dataset, n_train, options.batch_size, rank, world_size);
+            destroy_dataset(dataset);
+            dataset = shard;
+            printf("keeping %d of %d images in memory\n", dataset.capacity, dataset.size);
+        }
+
+        // initialize network
+        Network network;
+        if (input_path != NULL)
+        {
+            if (dims_string != NULL)
+            {
+                printf("%serror:%s --dims and --input flags are not compatible\n", RED, RESET);
+                exit(1);
+            }
+
+            network = load_network(input_path, 0);
+            for (int l = 1; l < network.ndim && options.hogwild; l++)
+            {
+                if (network.ranks[l] > 0)
+                {
+                    printf("%serror:%s --hogwild cannot train factored layers\n", RED, RESET);
+                    exit(1);
+                }
+            }
+            if (network_quantized(network) && (options.hogwild || options.checkpoint_every > 0 || options.precision != PRECISION_DOUBLE))
+            {
+                printf("%serror:%s quantized models only train synchronously, sample by sample, in double precision\n", RED, RESET);
+                exit(1);
+            }
+        }
+        else
+        {
+            int ndim;
+            int *dims = parse_dims(dims_string, &ndim);
+            network = network_create(ndim, dims);
+            free(dims);
+
+            printf("initialized network with layers: %s%d", BOLD, network.dims[0]);
+            for (int i = 1; i < network.ndim; i++)
+                printf("x%d", network.dims[i]);
+            printf("%s\n", RESET);
+        }
+
+        int status = train(network, dataset, options);
+
+        if (distill && rank == 0 && status == 0)
+        {
+            TestOptions test_options = {.top_k = 5, .format = "text", .teacher_path = teacher_path};
+            status = test(1, (char *[]){options.output_path, NULL}, test_options);
+        }
+
+        // the launching process waits for its local workers
+        for (int r = 1; children != NULL && r < world_size; r++)
+        {
+            int child_status;
+            waitpid(children[r], &child_status, 0);
+            if (!WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0)
+            {
+                printf("%serror:%s worker %d failed\n", RED, RESET, r);
+                status = 1;
+            }
+        }
+
+        return status;
+    }
+
+    else if (strcmp(argv[1], "sweep") == 0)
+    {
+        // default values, the same as for a single training run
+        SweepOptions options = {
+            .dims_strings = malloc(argc * sizeof(char *)),
+            .n_dims = 0,
+            .learning_rates = NULL,
+            .batch_sizes = NULL,
+            .epochs = 10,
+            .validation = 0.1,
+            .output_path = "sweep.csv",
+        };
+
+        for (int i = 2; i < argc; i++)
+        {
+            if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--dims") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected dimensions after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                options.dims_strings[options.n_dims++] = argv[++i];
+            }
+
+            else if (strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--learning-rate") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected learning rates after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if learning rates are a list of positive numbers or a range 'min:max'
+                char *value = argv[++i];
+                double low, high;
+                char c;
+                free(options.learning_rates);
+                if (sscanf(value, "%lf:%lf%c", &low, &high, &c) == 2 && low > 0 && high >= low)
+                {
+                    options.learning_rates = malloc(2 * sizeof(double));
+                    options.learning_rates[0] = low;
+                    options.learning_rates[1] = high;
+                    options.n_learning_rates = 1;
+                    options.learning_rate_range = 1;
+                    continue;
+                }
+                options.learning_rate_range = 0;
+                options.learning_rates = parse_reals(value, &options.n_learning_rates);
+                for (int k = 0; options.learning_rates != NULL && k < options.n_learning_rates; k++)
+                {
+                    if (options.learning_rates[k] <= 0)
+                    {
+                        free(options.learning_rates);
+                        options.learning_rates = NULL;
+                    }
+                }
+                if (options.learning_rates == NULL)
+                {
+                    printf("%serror:%s invalid learning rates '%s'\n", RED, RESET, value);
+                    exit(1);
+                }
+            }
+
+            else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch-size") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected batch sizes after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if batch sizes are positive integers
+                free(options.batch_sizes);
+                options.batch_sizes = parse_reals(argv[++i], &options.n_batch_sizes);
+                for (int k = 0; options.batch_sizes != NULL && k < options.n_batch_sizes; k++)
+                {
+                    if (options.batch_sizes[k] < 1 || options.batch_sizes[k] != (int)options.batch_sizes[k])
+                    {
+                        free(options.batch_sizes);
+                        options.batch_sizes = NULL;
+                    }
+                }
+                if (options.batch_sizes == NULL)
+                {
+                    printf("%serror:%s invalid batch sizes '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else if (strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--epochs") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected epochs after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if epochs is a positive integer
+                char c;
+                if (sscanf(argv[++i], "%d%c", &options.epochs, &c) != 1 || options.epochs < 1)
+                {
+                    printf("%serror:%s invalid epochs '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--seed") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected seed after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if seed is a non-negative integer
+                unsigned long long seed;
+                char c;
+                if (argv[++i][0] == '-' || sscanf(argv[i], "%llu%c", &seed, &c) != 1)
+                {
+                    printf("%serror:%s invalid seed '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+                rng_seed = seed;
+            }
+
+            else if (strcmp(argv[i], "--validation") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected fraction after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
 
-    return 0;
-}
+                // Check if the fraction leaves images for both training and validation
+                char c;
+                if (sscanf(argv[++i], "%lf%c", &options.validation, &c) != 1 || options.validation <= 0 ||
+                    options.validation >= 1)
+                {
+                    printf("%serror:%s invalid fraction '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
 
-// MAIN
+            else if (strcmp(argv[i], "--random") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected number of configurations after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
 
-int main(int argc, char *argv[])
-{
-    srand(0);
+                // Check if number of configurations is a positive integer
+                char c;
+                if (sscanf(argv[++i], "%d%c", &options.random, &c) != 1 || options.random < 1)
+                {
+                    printf("%serror:%s invalid number of configurations '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
 
-    if (argc == 1 || strcmp(argv[1], "help") == 0 || strcmp(argv[1], "--help") == 0)
-    {
-        print_usage_main();
-        return argc == 1;
-    }
+            else if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected path after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
 
-    else if (strcmp(argv[1], "run") == 0)
-    {
-        if (argc != 4)
+                options.output_path = argv[++i];
+            }
+
+            else
+            {
+                printf("%serror:%s unexpected argument '%s'\n", RED, RESET, argv[i]);
+                exit(1);
+            }
+        }
+
+        if (options.n_dims == 0)
         {
-            printf("%serror:%s unexpected number of arguments\n", RED, RESET);
-            exit(1);
+            options.dims_strings[options.n_dims++] = NULL;
+        }
+        if (options.learning_rates == NULL)
+        {
+            options.learning_rates = parse_reals("0.01", &options.n_learning_rates);
+        }
+        if (options.batch_sizes == NULL)
+        {
+            options.batch_sizes = parse_reals("200", &options.n_batch_sizes);
         }
-        else if (argc > 4)
+        if (options.learning_rate_range && options.random == 0)
         {
-            printf("%serror:%s unexpected argument '%s'\n", RED, RESET, argv[4]);
+            printf("%serror:%s a range of learning rates needs --random\n", RED, RESET);
             exit(1);
         }
 
-        return run(argv[2], argv[3]);
+        Dataset dataset = load_mnist_dataset("mnist/train-labels-idx1-ubyte", "mnist/train-images-idx3-ubyte");
+        printf("loaded dataset with %d images\n", dataset.size);
+        int status = sweep(dataset, options);
+        destroy_dataset(dataset);
+        free(options.dims_strings);
+        free(options.learning_rates);
+        free(options.batch_sizes);
+        return status;
     }
 
-    else if (strcmp(argv[1], "test") == 0)
+    else if (strcmp(argv[1], "compress") == 0)
     {
-        if (argc > 3)
+        if (argc < 3 || argv[2][0] == '-')
         {
-            printf("%serror:%s unexpected argument '%s'\n", RED, RESET, argv[3]);
+            printf("%serror:%s expected path of the model to compress\n", RED, RESET);
             exit(1);
         }
 
-        return test(argc == 2 ? "default.model" : argv[2]);
-    }
-
-    else if (strcmp(argv[1], "train") == 0)
-    {
-        // default values
-        int batch_size = 200;
-        char *dims_string = NULL;
-        int epochs = 10;
-        double learning_rate = 0.01;
-        char *output_path = "default.model";
-        char *input_path = NULL;
-
-        // parse optional flags
-        for (int i = 2; i < argc; i++)
+        // default values, fine-tuning like a training run
+        CompressOptions options = {
+            .ranks = NULL,
+            .layers = NULL,
+            .epochs = 0,
+            .learning_rate = 0.01,
+            .batch_size = 200,
+            .output_path = "compressed.model",
+        };
+
+        for (int i = 3; i < argc; i++)
         {
-
-            if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch-size") == 0)
+            if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--rank") == 0 || strcmp(argv[i], "--layers") == 0)
             {
+                int layers = strcmp(argv[i], "--layers") == 0;
                 if (i + 1 >= argc)
                 {
-                    printf("%serror:%s expected batch size after '%s' flag\n", RED, RESET, argv[i]);
+                    printf("%serror:%s expected %s after '%s' flag\n", RED, RESET, layers ? "layers" : "ranks", argv[i]);
                     exit(1);
                 }
 
-                // Check if batch size is an integer
-                char c;
-                if (sscanf(argv[++i], "%d%c", &batch_size, &c) != 1)
+                // Check if ranks or layers are positive integers
+                int count;
+                double *values = parse_reals(argv[++i], &count);
+                for (int k = 0; values != NULL && k < count; k++)
                 {
-                    printf("%serror:%s invalid batch size '%s'\n", RED, RESET, argv[i]);
-                    exit(1);
+                    if (values[k] < 1 || values[k] != (int)values[k])
+                    {
+                        values = NULL;
+                    }
                 }
-            }
-
-            else if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--dims") == 0)
-            {
-                if (i + 1 >= argc)
+                if (values == NULL)
                 {
-                    printf("%serror:%s expected dimensions after '%s' flag\n", RED, RESET, argv[i]);
+                    printf("%serror:%s invalid %s '%s'\n", RED, RESET, layers ? "layers" : "ranks", argv[i]);
                     exit(1);
                 }
-
-                dims_string = argv[++i];
+                if (layers)
+                {
+                    options.layers = values;
+                    options.n_layers = count;
+                }
+                else
+                {
+                    options.ranks = values;
+                    options.n_ranks = count;
+                }
             }
 
             else if (strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--epochs") == 0)
@@ -295,9 +3432,9 @@ int main(int argc, char *argv[])
                     exit(1);
                 }
 
-                // Check if batch size is an integer
+                // Check if epochs is a non-negative integer
                 char c;
-                if (sscanf(argv[++i], "%d%c", &epochs, &c) != 1)
+                if (sscanf(argv[++i], "%d%c", &options.epochs, &c) != 1 || options.epochs < 0)
                 {
                     printf("%serror:%s invalid epochs '%s'\n", RED, RESET, argv[i]);
                     exit(1);
@@ -312,24 +3449,30 @@ int main(int argc, char *argv[])
                     exit(1);
                 }
 
-                // Check if learning rate is a real number
+                // Check if learning rate is a positive number
                 char c;
-                if (sscanf(argv[++i], "%lf%c", &learning_rate, &c) != 1)
+                if (sscanf(argv[++i], "%lf%c", &options.learning_rate, &c) != 1 || options.learning_rate <= 0)
                 {
                     printf("%serror:%s invalid learning rate '%s'\n", RED, RESET, argv[i]);
                     exit(1);
                 }
             }
 
-            else if (strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--input") == 0)
+            else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch-size") == 0)
             {
                 if (i + 1 >= argc)
                 {
-                    printf("%serror:%s expected path after '%s' flag\n", RED, RESET, argv[i]);
+                    printf("%serror:%s expected batch size after '%s' flag\n", RED, RESET, argv[i]);
                     exit(1);
                 }
 
-                input_path = argv[++i];
+                // Check if batch size is a positive integer
+                char c;
+                if (sscanf(argv[++i], "%d%c", &options.batch_size, &c) != 1 || options.batch_size < 1)
+                {
+                    printf("%serror:%s invalid batch size '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
             }
 
             else if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0)
@@ -340,99 +3483,242 @@ int main(int argc, char *argv[])
                     exit(1);
                 }
 
-                output_path = argv[++i];
+                options.output_path = argv[++i];
             }
 
             else
             {
-                printf("%serror:%s unknown flag '%s'\n", RED, RESET, argv[i]);
+                printf("%serror:%s unexpected argument '%s'\n", RED, RESET, argv[i]);
                 exit(1);
             }
         }
 
-        // load dataset
-        Dataset dataset = load_mnist_dataset("mnist/train-labels-idx1-ubyte", "mnist/train-images-idx3-ubyte");
-        printf("loaded dataset with %d images\n", dataset.size);
+        if (options.ranks == NULL)
+        {
+            printf("%serror:%s expected ranks, e.g. '--rank 16,32'\n", RED, RESET);
+            exit(1);
+        }
 
-        // initialize network
-        Network network;
-        if (input_path != NULL)
+        int status = compress(argv[2], options);
+        free(options.ranks);
+        free(options.layers);
+        return status;
+    }
+
+    else if (strcmp(argv[1], "online") == 0)
+    {
+        if (argc < 3 || (argv[2][0] == '-' && argv[2][1] != '\0'))
         {
-            if (dims_string != NULL)
+            printf("%serror:%s expected a file, '-' or 'unix:<path>' to read samples from\n", RED, RESET);
+            exit(1);
+        }
+
+        // default values, small steps on every few new samples
+        OnlineOptions options = {
+            .input_path = "default.model",
+            .output_path = NULL,
+            .batch_size = 32,
+            .learning_rate = 0.01,
+            .replay = 0.5,
+            .replay_capacity = 10000,
+            .publish_every = 10,
+        };
+
+        for (int i = 3; i < argc; i++)
+        {
+            if (strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--input") == 0 || strcmp(argv[i], "-o") == 0 ||
+                strcmp(argv[i], "--output") == 0)
             {
-                printf("%serror:%s --dims and --input flags are not compatible\n", RED, RESET);
-                exit(1);
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected path after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                if (argv[i][1] == 'i' || strcmp(argv[i], "--input") == 0)
+                {
+                    options.input_path = argv[++i];
+                }
+                else
+                {
+                    options.output_path = argv[++i];
+                }
             }
 
-            network = load_network(input_path);
-        }
-        else
-        {
-            int ndim;
-            if (dims_string == NULL)
+            else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch-size") == 0)
             {
-                ndim = 4;
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected batch size after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if batch size is a positive integer
+                char c;
+                if (sscanf(argv[++i], "%d%c", &options.batch_size, &c) != 1 || options.batch_size < 1)
+                {
+                    printf("%serror:%s invalid batch size '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
             }
-            else
+
+            else if (strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--learning-rate") == 0)
             {
-                ndim = 3;
-                for (char *c = dims_string; *c != '\0'; c++)
+                if (i + 1 >= argc)
                 {
-                    ndim += *c == ',';
-                    if (!isdigit(*c) && *c != ',')
-                    {
-                        printf("%serror:%s invalid character '%c' in '%s'\n",
-                               RED, RESET, *c, dims_string);
-                        exit(1);
-                    }
+                    printf("%serror:%s expected learning rate after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if learning rate is a positive number
+                char c;
+                if (sscanf(argv[++i], "%lf%c", &options.learning_rate, &c) != 1 || options.learning_rate <= 0)
+                {
+                    printf("%serror:%s invalid learning rate '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
                 }
             }
 
-            int *dims = malloc(ndim * sizeof(int));
+            else if (strcmp(argv[i], "--replay") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected share after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if the share is in [0, 1), some samples of every batch must be new
+                char c;
+                if (sscanf(argv[++i], "%lf%c", &options.replay, &c) != 1 || options.replay < 0 || options.replay >= 1)
+                {
+                    printf("%serror:%s invalid replay share '%s', expected a number in [0, 1)\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
 
-            char *c = dims_string;
-            dims[0] = 784;
-            for (int l = 1; l < ndim - 1; l++)
+            else if (strcmp(argv[i], "--replay-capacity") == 0)
             {
-                if (dims_string == NULL)
+                if (i + 1 >= argc)
                 {
-                    dims[l] = 16;
+                    printf("%serror:%s expected number of samples after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
                 }
-                else
+
+                // Check if the capacity is a non-negative integer
+                char c;
+                if (sscanf(argv[++i], "%d%c", &options.replay_capacity, &c) != 1 || options.replay_capacity < 0)
                 {
-                    dims[l] = atoi(c);
-                    if (!dims[l])
-                    {
-                        printf("%serror:%s invalid value '%s' for --dims flag\n", RED, RESET, dims_string);
-                        exit(1);
-                    }
-                    c = strchr(c, ',') + 1;
+                    printf("%serror:%s invalid replay capacity '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
                 }
             }
-            dims[ndim - 1] = 10;
-            network = network_create(ndim, dims);
-            free(dims);
 
-            printf("initialized network with layers: %s%d", BOLD, network.dims[0]);
-            for (int i = 1; i < network.ndim; i++)
-                printf("x%d", network.dims[i]);
-            printf("%s\n", RESET);
+            else if (strcmp(argv[i], "--publish-every") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected seconds after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if the interval is a non-negative number
+                char c;
+                if (sscanf(argv[++i], "%lf%c", &options.publish_every, &c) != 1 || options.publish_every < 0)
+                {
+                    printf("%serror:%s invalid interval '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else
+            {
+                printf("%serror:%s unexpected argument '%s'\n", RED, RESET, argv[i]);
+                exit(1);
+            }
         }
 
-        return train(network, dataset, batch_size, epochs, learning_rate, output_path);
+        if (options.output_path == NULL)
+        {
+            options.output_path = options.input_path;
+        }
+        return online(argv[2], options);
     }
 
-    else if (strcmp(argv[1], "bench") == 0)
+    else if (strcmp(argv[1], "tune") == 0)
     {
-        if (argc == 2)
+        // default values, a batch like the ones of 'neural run'
+        TuneOptions options = {.batch_size = 256, .output_path = NULL};
+        char *model_path = "default.model";
+
+        for (int i = 2; i < argc; i++)
         {
-            return bench();
+            if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch-size") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected batch size after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                // Check if batch size is a positive integer
+                char c;
+                if (sscanf(argv[++i], "%d%c", &options.batch_size, &c) != 1 || options.batch_size < 1)
+                {
+                    printf("%serror:%s invalid batch size '%s'\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+            }
+
+            else if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0)
+            {
+                if (i + 1 >= argc)
+                {
+                    printf("%serror:%s expected path after '%s' flag\n", RED, RESET, argv[i]);
+                    exit(1);
+                }
+
+                options.output_path = argv[++i];
+            }
+
+            else if (argv[i][0] != '-' && i == 2)
+            {
+                model_path = argv[i];
+            }
+
+            else
+            {
+                printf("%serror:%s unexpected argument '%s'\n", RED, RESET, argv[i]);
+                exit(1);
+            }
         }
-        else
+
+        return tune(model_path, options);
+    }
+
+    else if (strcmp(argv[1], "bench") == 0)
+    {
+        char *suite = "passes";
+        int counters = 0;
+        for (int i = 2; i < argc; i++)
         {
-            printf("%serror:%s unknown flag '%s'\n", RED, RESET, argv[argc - 1]);
-            exit(1);
+            if (strcmp(argv[i], "--counters") == 0)
+            {
+                counters = 1;
+            }
+
+            else if (argv[i][0] != '-' && i == 2)
+            {
+                suite = argv[i];
+            }
+
+            else
+            {
+                printf("%serror:%s unexpected argument '%s'\n", RED, RESET, argv[i]);
+                exit(1);
+            }
         }
+
+        return bench(suite, counters);
     }
 
     else
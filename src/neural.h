@@ -0,0 +1,94 @@
+#ifndef NEURAL_H
+#define NEURAL_H
+
+/*
+ * NEURAL INFERENCE API
+ *
+ * Load a model once, create one context per thread and classify batches
+ * in-process. Models are immutable after loading and may be shared between
+ * threads; contexts may not. neural_predict never allocates: it only touches
+ * the context and the buffers passed by the caller.
+ *
+ * A live model follows a model file that 'neural online' keeps replacing and
+ * swaps in every new snapshot while predictions continue, without locking.
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(NEURAL_BUILD) && defined(__GNUC__)
+#define NEURAL_API __attribute__((visibility("default")))
+#else
+#define NEURAL_API
+#endif
+
+typedef struct neural_model neural_model;
+typedef struct neural_context neural_context;
+typedef struct neural_live neural_live;
+
+typedef enum
+{
+    NEURAL_OK = 0,
+    NEURAL_ERROR_IO,       // the model file cannot be opened
+    NEURAL_ERROR_FORMAT,   // the model data is malformed or truncated
+    NEURAL_ERROR_ARGUMENT, // invalid argument, e.g. a batch larger than the context
+    NEURAL_ERROR_SHAPE,    // a new snapshot of a live model has other dimensions
+    NEURAL_ERROR_MEMORY,   // an allocation failed, e.g. for the buffers of a large max_batch
+} neural_status;
+
+NEURAL_API const char *neural_status_string(neural_status status);
+
+// loads a model written by 'neural train'
+NEURAL_API neural_status neural_model_load(const char *path, neural_model **model);
+
+// loads a model from size bytes of serialized data, which may be freed afterwards
+NEURAL_API neural_status neural_model_load_memory(const void *data, size_t size, neural_model **model);
+
+NEURAL_API void neural_model_free(neural_model *model);
+
+// bytes of the weights and activation buffers of a model, excluding its contexts
+NEURAL_API size_t neural_model_bytes(const neural_model *model);
+
+// number of values per input and output row
+NEURAL_API int neural_model_input_size(const neural_model *model);
+NEURAL_API int neural_model_output_size(const neural_model *model);
+
+// scratch memory for batches of up to max_batch inputs, to be used by one thread at a time;
+// NEURAL_ERROR_MEMORY when it cannot be allocated
+NEURAL_API neural_status neural_context_create(const neural_model *model, int max_batch, neural_context **context);
+
+NEURAL_API void neural_context_free(neural_context *context);
+
+/*
+ * Classifies n <= max_batch inputs. inputs holds n rows of input_size values
+ * in [0, 1], outputs receives n rows of output_size activations.
+ */
+NEURAL_API neural_status neural_predict(neural_context *context, const double *inputs, int n, double *outputs);
+
+/*
+ * Loads a model and checks its file for a new snapshot every interval_ms on
+ * a background thread, or only in neural_live_refresh when it is 0. Snapshots
+ * must be renamed over the path, as 'neural online' does, and keep the
+ * dimensions of the first one.
+ */
+NEURAL_API neural_status neural_live_open(const char *path, int interval_ms, neural_live **live);
+
+// swaps in the file if it was replaced, waiting for running predictions to finish with the old model
+NEURAL_API neural_status neural_live_refresh(neural_live *live);
+
+// number of snapshots loaded, starting at 1
+NEURAL_API unsigned long neural_live_version(const neural_live *live);
+
+// a context whose predictions use the newest snapshot, to be freed before the live model
+NEURAL_API neural_status neural_live_context_create(neural_live *live, int max_batch, neural_context **context);
+
+NEURAL_API void neural_live_close(neural_live *live);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,7 +4,7 @@
 #include <string.h>
 #include <wchar.h>
 
-#include "lib.c"
+#include "libneural.c"
 
 int n_passed = 0;
 int n_failed = 0;
@@ -51,6 +51,29 @@ void assert_scalar(char *name, double expected, double actual)
     }
 }
 
+// compares with a tolerance relative to the largest expected value
+void assert_close(char *name, int size, double *expected, double *actual, double tolerance)
+{
+    double max_expected = 0;
+    double max_error = 0;
+    for (int i = 0; i < size; i++)
+    {
+        max_expected = fmax(max_expected, fabs(expected[i]));
+        max_error = fmax(max_error, fabs(expected[i] - actual[i]));
+    }
+
+    if (!(max_error <= tolerance * max_expected))
+    {
+        assert_fails += 1;
+        printf("approximate comparison %s\"%s\"%s failed (relative error: %g)\n", BOLD, name, RESET, max_error / max_expected);
+        printf("expected: ");
+        print_array(size, expected);
+        printf("  actual: ");
+        print_array(size, actual);
+        printf("\n");
+    }
+}
+
 // TESTS
 
 /* automatically generated by 'generate_test.py' */
@@ -77,7 +100,7 @@ void test_serialization()
 
     fseek(file, 0, SEEK_SET);
 
-    Network deserialized = deserialize_network(file);
+    Network deserialized = deserialize_network(file, 0);
     for (int l = 1; l < ndim; l++)
     {
         assert_array("compare deserialized weights", dims[l] * dims[l - 1], deserialized.weights[l], network.weights[l]);
@@ -87,8 +110,1413 @@ void test_serialization()
     fclose(file);
 }
 
+void test_specialized_kernels()
+{
+    int n_kernels = sizeof(specialized_kernels) / sizeof(SpecializedKernel);
+    for (int k = 0; k < n_kernels; k++)
+    {
+        SpecializedKernel kernel = specialized_kernels[k];
+        Network network = network_create(kernel.ndim, kernel.dims);
+        Network reference = network_fork(network);
+        double *inputs = random_array(kernel.dims[0], k);
+
+        assert_scalar("kernel is found", 1, find_forward_kernel(network) == kernel.forward);
+
+        forward(reference, inputs);
+        kernel.forward(network, inputs);
+        for (int l = 1; l < kernel.ndim; l++)
+        {
+            assert_array("specialized activations", kernel.dims[l], reference.neurons[l], network.neurons[l]);
+        }
+
+        free(inputs);
+        network_fork_destroy(reference);
+        network_destroy(network);
+    }
+}
+
+void test_forward_batch()
+{
+    // odd sizes exercise the remainders of the sample tiles and vector lanes
+    int dims[] = {7, 5, 6, 3};
+    int n = 11;
+    Network network = network_create(4, dims);
+    InferenceContext context = inference_context_create(network, n);
+
+    double *inputs[n];
+    for (int b = 0; b < n; b++)
+    {
+        inputs[b] = random_array(dims[0], b);
+    }
+
+    // every tile gives the same outputs
+    for (int k = 0; k < TUNING_TILES; k++)
+    {
+        context.tile = tuning_tiles[k];
+        double *outputs = forward_batch(network, &context, n, inputs);
+        for (int b = 0; b < n; b++)
+        {
+            forward(network, inputs[b]);
+            assert_array("batched outputs", dims[3], network.neurons[3], outputs + b * dims[3]);
+        }
+    }
+    for (int b = 0; b < n; b++)
+    {
+        free(inputs[b]);
+    }
+
+    inference_context_destroy(context);
+    network_destroy(network);
+}
+
+void test_counters()
+{
+    pid_t self = 0;
+    Counters counters = counters_open(1, &self);
+    // the task clock only fails where perf_event_open is not allowed at all
+    assert_scalar("task clock or error", 1, counters.available[COUNTER_TASK_CLOCK] == (counters.error == 0));
+
+    double before[N_COUNTERS], after[N_COUNTERS];
+    counters_read(counters, before);
+    volatile double sum = 0;
+    for (int i = 0; i < 1000000; i++)
+    {
+        sum += sqrt(i);
+    }
+    counters_read(counters, after);
+    for (int c = 0; c < N_COUNTERS; c++)
+    {
+        assert_scalar("counted or unavailable", 1, counters.available[c] ? after[c] >= before[c] : isnan(after[c]));
+    }
+    if (counters.available[COUNTER_TASK_CLOCK])
+    {
+        assert_scalar("CPU time", 1, after[COUNTER_TASK_CLOCK] > before[COUNTER_TASK_CLOCK]);
+    }
+    counters_close(counters);
+
+    // every worker of the pool is counted
+    Counters workers = counters_open_pool();
+    assert_scalar("workers", pool_size(), workers.n_threads);
+    counters_close(workers);
+}
+
+void test_tuning_cache()
+{
+    char path[] = "/tmp/neural-test-XXXXXX";
+    close(mkstemp(path));
+    Tuning first = {.tile = 8, .grain = 16, .threads = 1, .specialized = 0, .pipeline = 1};
+    Tuning second = {.tile = 1, .grain = 0, .threads = 0, .specialized = 1, .pipeline = 0};
+    tuning_store(path, "784x16x16x10", first);
+    tuning_store(path, "784x64r8x10", first);
+    tuning_store(path, "784x16x16x10", second);
+
+    // the second store of a shape replaces its entry
+    TuningEntry *entries;
+    int n = tuning_read(path, &entries);
+    assert_scalar("entries", 2, n);
+    char cpu[TUNING_FIELD];
+    cpu_model(cpu);
+    int i = tuning_find(entries, n, cpu, available_cores(), "784x16x16x10");
+    assert_scalar("tile", 1, entries[i].tuning.tile);
+    assert_scalar("pipeline", 0, entries[i].tuning.pipeline);
+    i = tuning_find(entries, n, cpu, available_cores(), "784x64r8x10");
+    assert_scalar("grain", 16, entries[i].tuning.grain);
+    assert_scalar("other machine", -1, tuning_find(entries, n, cpu, available_cores() + 1, "784x64r8x10"));
+    free(entries);
+
+    // lines with settings out of range are skipped
+    FILE *file = fopen(path, "a");
+    fprintf(file, "cpu,4,784x10,3,0,0,1,1\ncpu,4,784x10,4,-1,0,1,1\ncpu,4,784x10,4,0,100000,1,1\n");
+    fprintf(file, "cpu,0,784x10,4,0,0,1,1\ncpu,4,784x10,4,0,0,2,1\ncpu,4,784x10,4,0,4,1,0\n");
+    fclose(file);
+    n = tuning_read(path, &entries);
+    assert_scalar("valid entries", 3, n);
+    assert_scalar("valid threads", 4, entries[2].tuning.threads);
+    free(entries);
+    unlink(path);
+
+    // factored layers are part of the shape
+    int dims[] = {784, 64, 10};
+    Network network = network_create(3, dims);
+    network_set_rank(network, 1, 8);
+    char shape[TUNING_FIELD];
+    network_shape(network, shape, sizeof(shape));
+    assert_scalar("shape", 0, strcmp(shape, "784x64r8x10"));
+    network_destroy(network);
+}
+
+void test_factorization()
+{
+    // a matrix of rank 4 is reproduced exactly
+    int m = 30, n = 20, rank = 4;
+    double *a = calloc(m * n, sizeof(double));
+    double *left = random_array(m * rank, 1);
+    double *right = random_array(rank * n, 2);
+    for (int i = 0; i < m; i++)
+    {
+        for (int k = 0; k < rank; k++)
+        {
+            for (int j = 0; j < n; j++)
+            {
+                a[i * n + j] += left[i * rank + k] * right[k * n + j];
+            }
+        }
+    }
+    double *product = calloc(m * n, sizeof(double));
+    truncated_svd(m, n, a, rank, left, right);
+    for (int i = 0; i < m; i++)
+    {
+        for (int k = 0; k < rank; k++)
+        {
+            for (int j = 0; j < n; j++)
+            {
+                product[i * n + j] += left[i * rank + k] * right[k * n + j];
+            }
+        }
+    }
+    assert_close("rank 4 reconstruction", m * n, a, product, 1e-9);
+
+    // factored layers run as two products and survive serialization
+    int dims[] = {9, 12, 8, 3};
+    Network network = network_create(4, dims);
+    factorize_layer(network, 1, 3);
+    factorize_layer(network, 2, 2);
+    InferenceContext context = inference_context_create(network, 5);
+    double *inputs[5];
+    for (int b = 0; b < 5; b++)
+    {
+        inputs[b] = random_array(dims[0], b);
+    }
+    double *outputs = forward_batch(network, &context, 5, inputs);
+    Network dense = network_create(4, dims);
+    for (int l = 1; l < 4; l++)
+    {
+        memcpy(dense.weights[l], network.weights[l], dims[l] * dims[l - 1] * sizeof(double));
+        memcpy(dense.biases[l], network.biases[l], dims[l] * sizeof(double));
+    }
+    for (int b = 0; b < 5; b++)
+    {
+        forward(dense, inputs[b]);
+        assert_array("batched factored outputs", dims[3], dense.neurons[3], outputs + b * dims[3]);
+        forward(network, inputs[b]);
+        assert_array("factored outputs", dims[3], dense.neurons[3], network.neurons[3]);
+    }
+    assert_scalar("factored flops", 3 * (9 + 12) + 2 * (12 + 8) + 8 * 3, network_flops(network));
+
+    FILE *file = tmpfile();
+    serialize_network(network, file);
+    fseek(file, 0, SEEK_SET);
+    Network deserialized = deserialize_network(file, 0);
+    fclose(file);
+    assert_scalar("deserialized rank", 2, deserialized.ranks[2]);
+    assert_array("deserialized factor", 3 * 9, network.right[1], deserialized.right[1]);
+    assert_array("deserialized weights", 8 * 12, network.weights[2], deserialized.weights[2]);
+
+    // gradient steps move left along grad * right^T and right along left^T * grad
+    double *weights_grad[4] = {NULL, NULL, random_array(8 * 12, 3), NULL};
+    double *biases_grad[4] = {NULL, NULL, random_array(8, 4), NULL};
+    double *factors_grad[4] = {NULL, NULL, malloc((8 + 12) * 2 * sizeof(double)), NULL};
+    double expected_left[8 * 2], expected_right[2 * 12];
+    for (int k = 0; k < 2; k++)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            double sum = 0;
+            for (int j = 0; j < 12; j++)
+            {
+                sum += weights_grad[2][i * 12 + j] * network.right[2][k * 12 + j];
+            }
+            expected_left[i * 2 + k] = network.left[2][i * 2 + k] - 0.1 * sum;
+        }
+        for (int j = 0; j < 12; j++)
+        {
+            double sum = 0;
+            for (int i = 0; i < 8; i++)
+            {
+                sum += network.left[2][i * 2 + k] * weights_grad[2][i * 12 + j];
+            }
+            expected_right[k * 12 + j] = network.right[2][k * 12 + j] - 0.1 * sum;
+        }
+    }
+    update_layer(network, 2, weights_grad, biases_grad, factors_grad, 0.1);
+    assert_array("updated left factor", 8 * 2, expected_left, network.left[2]);
+    assert_array("updated right factor", 2 * 12, expected_right, network.right[2]);
+    memcpy(dense.weights[2], network.weights[2], 8 * 12 * sizeof(double));
+    network_expand_layer(network, 2);
+    assert_array("weights are the product", 8 * 12, dense.weights[2], network.weights[2]);
+
+    for (int b = 0; b < 5; b++)
+    {
+        free(inputs[b]);
+    }
+    free(weights_grad[2]);
+    free(biases_grad[2]);
+    free(factors_grad[2]);
+    free(a);
+    free(left);
+    free(right);
+    free(product);
+    inference_context_destroy(context);
+    network_destroy(deserialized);
+    network_destroy(dense);
+    network_destroy(network);
+}
+
+void test_inference_network()
+{
+    int plan[4];
+    int widths[PLAN_BUFFERS];
+    int dims[] = {6, 4, 8, 3};
+    assert_scalar("activation buffers", 2, plan_activations(4, dims, plan, widths));
+    assert_scalar("layer 3 reuses layer 1", plan[1], plan[3]);
+    assert_scalar("layer 2 has its own", 1, plan[2] != plan[1]);
+    assert_scalar("buffer width", 4, widths[plan[1]]);
+
+    Network network = network_create(4, dims);
+    factorize_layer(network, 2, 2);
+    char *data;
+    size_t size;
+    FILE *file = open_memstream(&data, &size);
+    serialize_network(network, file);
+    fclose(file);
+    file = fmemopen(data, size, "rb");
+    Network inference = deserialize_network(file, 1);
+    fclose(file);
+
+    assert_scalar("no gradients", 1, inference.weights_grad[1] == NULL && inference.biases_grad[1] == NULL);
+    assert_scalar("no dense factored weights", 1, inference.weights[2] == NULL);
+    assert_scalar("shared activations", 1, inference.neurons[1] == inference.neurons[3]);
+    // parameters 4 * 6 + 4, 8 + 2 * (8 + 4) and 3 * 8 + 3, activation buffers 4 and 8
+    assert_scalar("working set", (28 + 32 + 27 + 12) * sizeof(double), network_bytes(inference));
+
+    InferenceContext context = inference_context_create(inference, 2);
+    double inputs[2 * 6];
+    double *rows[2] = {inputs, inputs + 6};
+    for (int i = 0; i < 2 * 6; i++)
+    {
+        inputs[i] = rng_uniform(1, i);
+    }
+    double *outputs = forward_batch(inference, &context, 2, rows);
+    for (int b = 0; b < 2; b++)
+    {
+        forward(network, rows[b]);
+        forward(inference, rows[b]);
+        assert_array("inference outputs", 3, network.neurons[3], inference.neurons[3]);
+        assert_array("batched inference outputs", 3, network.neurons[3], outputs + b * 3);
+    }
+
+    // a training network copied from it gets the dense weights back
+    Network copy = network_create(4, dims);
+    network_copy(copy, inference);
+    assert_array("expanded weights", 8 * 4, network.weights[2], copy.weights[2]);
+
+    inference_context_destroy(context);
+    network_destroy(copy);
+    network_destroy(inference);
+    network_destroy(network);
+    free(data);
+}
+
+void test_library()
+{
+    int dims[] = {6, 4, 3};
+    Network network = network_create(3, dims);
+
+    // round trip through an in-memory model file
+    char *data;
+    size_t size;
+    FILE *file = open_memstream(&data, &size);
+    serialize_network(network, file);
+    fclose(file);
+
+    neural_model *model = NULL;
+    neural_model *truncated = NULL;
+    assert_scalar("load from memory", NEURAL_OK, neural_model_load_memory(data, size, &model));
+    assert_scalar("truncated model", NEURAL_ERROR_FORMAT, neural_model_load_memory(data, size - 1, &truncated));
+    // every dimension is in range, but the 2^40 weights of a layer are not
+    int32_t oversized[] = {3, 1 << 20, 1 << 20, 1};
+    assert_scalar("oversized model", NEURAL_ERROR_FORMAT, neural_model_load_memory(oversized, sizeof(oversized), &truncated));
+    assert_scalar("input size", 6, neural_model_input_size(model));
+    assert_scalar("output size", 3, neural_model_output_size(model));
+    // parameters 4 * 6 + 4 and 3 * 4 + 3, activation buffers 4 and 3
+    assert_scalar("model bytes", (28 + 15 + 7) * sizeof(double), neural_model_bytes(model));
+
+    neural_context *context;
+    assert_scalar("create context", NEURAL_OK, neural_context_create(model, 5, &context));
+
+    double inputs[5 * 6];
+    double outputs[5 * 3];
+    for (int i = 0; i < 5 * 6; i++)
+    {
+        inputs[i] = rng_uniform(1, i);
+    }
+    assert_scalar("predict", NEURAL_OK, neural_predict(context, inputs, 5, outputs));
+    assert_scalar("batch too large", NEURAL_ERROR_ARGUMENT, neural_predict(context, inputs, 6, outputs));
+
+    for (int b = 0; b < 5; b++)
+    {
+        forward(network, inputs + b * 6);
+        assert_array("predicted outputs", 3, network.neurons[2], outputs + b * 3);
+    }
+
+    neural_context_free(context);
+
+    // the activations of a batch of 2^31 samples through 2^17 neurons do not fit in any address space
+    Network wide = network_create(3, (int[]){1, 1 << 17, 1});
+    char *wide_data;
+    size_t wide_size;
+    file = open_memstream(&wide_data, &wide_size);
+    serialize_network(wide, file);
+    fclose(file);
+    neural_model *wide_model;
+    assert_scalar("load wide model", NEURAL_OK, neural_model_load_memory(wide_data, wide_size, &wide_model));
+    assert_scalar("context out of memory", NEURAL_ERROR_MEMORY, neural_context_create(wide_model, INT_MAX, &context));
+    neural_model_free(wide_model);
+    network_destroy(wide);
+    free(wide_data);
+
+    neural_model_free(model);
+    free(data);
+    network_destroy(network);
+}
+
+// ends a prediction that test_live_model pretends to be running
+void *finish_prediction(void *context)
+{
+    usleep(50000);
+    __atomic_store_n(&((neural_context *)context)->reading, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void test_live_model()
+{
+    int dims[] = {6, 4, 3};
+    Network first = network_create(3, dims);
+    Network second = network_create(3, dims);
+    for (int i = 0; i < 4 * 6; i++)
+    {
+        second.weights[1][i] = -second.weights[1][i];
+    }
+
+    char path[] = "/tmp/neural-test-XXXXXX";
+    close(mkstemp(path));
+    publish_network(first, path);
+
+    neural_live *live;
+    neural_context *context;
+    assert_scalar("open live model", NEURAL_OK, neural_live_open(path, 0, &live));
+    assert_scalar("create live context", NEURAL_OK, neural_live_context_create(live, 2, &context));
+
+    double inputs[2 * 6];
+    double outputs[2 * 3];
+    for (int i = 0; i < 2 * 6; i++)
+    {
+        inputs[i] = rng_uniform(1, i);
+    }
+    neural_predict(context, inputs, 2, outputs);
+    forward(first, inputs + 6);
+    assert_array("first snapshot", 3, first.neurons[2], outputs + 3);
+    assert_scalar("unchanged file", NEURAL_OK, neural_live_refresh(live));
+    assert_scalar("first version", 1, neural_live_version(live));
+
+    // the swap waits for a prediction that started before it
+    publish_network(second, path);
+    context->reading = live->epoch;
+    pthread_t thread;
+    pthread_create(&thread, NULL, finish_prediction, context);
+    double start = timestamp();
+    assert_scalar("swap", NEURAL_OK, neural_live_refresh(live));
+    assert_scalar("grace period", 1, timestamp() - start >= 0.04);
+    pthread_join(thread, NULL);
+    assert_scalar("second version", 2, neural_live_version(live));
+
+    neural_predict(context, inputs, 2, outputs);
+    forward(second, inputs + 6);
+    assert_array("second snapshot", 3, second.neurons[2], outputs + 3);
+
+    int other_dims[] = {6, 5, 3};
+    Network other = network_create(3, other_dims);
+    publish_network(other, path);
+    assert_scalar("other shape", NEURAL_ERROR_SHAPE, neural_live_refresh(live));
+    assert_scalar("kept version", 2, neural_live_version(live));
+    neural_predict(context, inputs, 2, outputs);
+    assert_array("kept snapshot", 3, second.neurons[2], outputs + 3);
+
+    neural_context_free(context);
+    neural_live_close(live);
+    unlink(path);
+    network_destroy(other);
+    network_destroy(second);
+    network_destroy(first);
+}
+
+// writes n bytes to a new temporary file, whose path is stored in path
+void write_temporary(char *path, const char *bytes, int n)
+{
+    strcpy(path, "/tmp/neural-test-XXXXXX");
+    int fd = mkstemp(path);
+    assert_scalar("write temporary", n, write(fd, bytes, n));
+    close(fd);
+}
+
+void test_pgm()
+{
+    char path[32];
+    DecodeBuffer buffer = {0};
+    double pixel[8];
+
+    // ASCII pixels with comments in the header and between the pixels
+    const char ascii[] = "P2\n# scanner 1\n3 2\n# depth\n4\n0 1 2 # first row\n3 4\n4\n";
+    write_temporary(path, ascii, sizeof(ascii) - 1);
+    assert_scalar("decode P2", 1, decode_pgm(path, 3, 2, pixel, &buffer) == NULL);
+    assert_array("P2 pixels", 6, (double[]){0, 0.25, 0.5, 0.75, 1, 1}, pixel);
+    size_t n_values = buffer.n_values;
+    unlink(path);
+
+    // two bytes per pixel in big endian above a maxval of 255
+    write_temporary(path, "P5 2 1 1000 \x01\xf4\x03\xe8", 16);
+    assert_scalar("decode 16 bit", 1, decode_pgm(path, 2, 1, pixel, &buffer) == NULL);
+    assert_array("16 bit pixels", 2, (double[]){0.5, 1}, pixel);
+    unlink(path);
+
+    // shrinking averages areas, growing interpolates linearly, smaller images reuse the buffer
+    write_temporary(path, "P5 4 2 255 \x00\x40\x80\xc0\x40\x80\xc0\xff", 19);
+    assert_scalar("decode shrunk", 1, decode_pgm(path, 2, 1, pixel, &buffer) == NULL);
+    assert_array("shrunk pixels", 2, (double[]){(0x00 + 0x40 + 0x40 + 0x80) / 4 / 255.0, (0x80 + 0xc0 + 0xc0 + 0xff) / 4.0 / 255}, pixel);
+    unlink(path);
+    write_temporary(path, "P5 2 1 255 \x00\xff", 13);
+    assert_scalar("decode grown", 1, decode_pgm(path, 4, 1, pixel, &buffer) == NULL);
+    assert_array("grown pixels", 4, (double[]){0, 0.25, 0.75, 1}, pixel);
+    assert_scalar("buffer reused", n_values, buffer.n_values);
+    unlink(path);
+
+    write_temporary(path, "P5 2 2 255 \x00\xff", 13);
+    assert_scalar("truncated pixels", 0, strcmp("failed to read pixel data", decode_pgm(path, 2, 2, pixel, &buffer)));
+    unlink(path);
+    write_temporary(path, "P6 1 1 255 \x00", 12);
+    assert_scalar("other format", 0, strcmp("not in PGM P2 or P5 format", decode_pgm(path, 1, 1, pixel, &buffer)));
+    unlink(path);
+
+    decode_buffer_destroy(buffer);
+}
+
+void test_online()
+{
+    int label;
+    char quoted[] = "\"a,\"\"b\"\".pgm\",7,0.9";
+    char *path = online_parse(quoted, &label);
+    assert_scalar("quoted path", 0, strcmp("a,\"b\".pgm", path));
+    assert_scalar("quoted label", 7, label);
+    char plain[] = "c.pgm,3\r";
+    path = online_parse(plain, &label);
+    assert_scalar("plain path", 0, strcmp("c.pgm", path));
+    assert_scalar("plain label", 3, label);
+    char missing[] = "c.pgm";
+    char negative[] = "c.pgm,-1";
+    assert_scalar("missing label", 1, online_parse(missing, &label) == NULL);
+    assert_scalar("negative label", 1, online_parse(negative, &label) == NULL);
+
+    // three new 2x2 images with labels 0, 1 and 2
+    char image[] = "/tmp/neural-test-XXXXXX";
+    int fd = mkstemp(image);
+    assert_scalar("write image", 15, write(fd, "P5 2 2 255 \x10\x20\x30\x40", 15));
+    close(fd);
+    Dataset replay = {.images = calloc(6, sizeof(Image)), .size = 6, .rows = 2, .cols = 2, .view = 1};
+    Online online = online_create(replay, 10, 4, 0.5, 1);
+    for (int i = 0; i < 3; i++)
+    {
+        char line[64];
+        sprintf(line, "%s,%d", image, i);
+        online_add(&online, line);
+    }
+    assert_scalar("new samples", 3, online.fresh.size);
+    assert_scalar("decoded pixel", 0x40 / 255.0, online.fresh.images[2].data[3]);
+
+    // half of a batch is new, the rest replayed, the last sample is flushed with one replayed
+    assert_scalar("full batch", 4, online_batch(&online, 0));
+    assert_scalar("first new label", 1, online.batch[0].label[0]);
+    assert_scalar("second new label", 1, online.batch[1].label[1]);
+    assert_scalar("replayed from the dataset", 1, online.batch[2].label == NULL && online.batch[3].label == NULL);
+    assert_scalar("waits for a batch", 0, online_batch(&online, 0));
+    assert_scalar("flushed batch", 2, online_batch(&online, 1));
+    assert_scalar("flushed label", 1, online.batch[0].label[2]);
+
+    // a ring of one sample only keeps the last one trained on
+    assert_scalar("kept samples", 1, online_kept(&online));
+    assert_scalar("kept label", 1, online.kept[0].label[1]);
+    assert_scalar("nothing pending", 0, online_batch(&online, 1));
+    assert_scalar("kept last label", 1, online.kept[0].label[2]);
+
+    online_destroy(online);
+    free(replay.images);
+    unlink(image);
+}
+
+void test_quantization()
+{
+    // the kernels picked for this CPU agree with the portable ones and with a dot product of values
+    int n = 600;
+    int words = packed_words(n);
+    uint64_t signs[2][10], masks[2][10];
+    double values[2][600];
+    for (int v = 0; v < 2; v++)
+    {
+        double *a = random_array(n, 10 + v);
+        pack_inputs(LEVELS_TERNARY, n, a, signs[v], masks[v]);
+        for (int j = 0; j < n; j++)
+        {
+            values[v][j] = quantize_input(LEVELS_TERNARY, a[j]);
+        }
+        free(a);
+    }
+    pthread_once(&popcount_once, popcount_select);
+    for (int length = 1; length <= n; length += 131)
+    {
+        int expected = 0;
+        for (int j = 0; j < length; j++)
+        {
+            expected += values[0][j] * values[1][j];
+        }
+        // the full words of two packed rows, without the bits past length
+        uint64_t w_signs[10] = {0}, w_masks[10] = {0};
+        for (int j = 0; j < length; j++)
+        {
+            w_signs[j / 64] |= signs[0][j / 64] & 1ull << (j % 64);
+            w_masks[j / 64] |= masks[0][j / 64] & 1ull << (j % 64);
+        }
+        int length_words = packed_words(length);
+        assert_scalar("ternary dot", expected, ternary_dot_portable(w_signs, w_masks, signs[1], masks[1], length_words));
+        assert_scalar("selected ternary dot", expected,
+                      popcount_kernels.ternary(w_signs, w_masks, signs[1], masks[1], length_words));
+        assert_scalar("selected binary differences", binary_differences_portable(signs[0], signs[1], length_words),
+                      popcount_kernels.binary(signs[0], signs[1], length_words));
+    }
+    assert_scalar("packed words", 10, words);
+
+    for (int levels = LEVELS_BINARY; levels <= LEVELS_TERNARY; levels++)
+    {
+        // only the layers between two hidden layers are quantized, 130 inputs span three words
+        int dims[] = {9, 130, 70, 3};
+        Network network = network_create(4, dims);
+        assert_scalar("quantized layers", 1, network_quantize(network, levels));
+        assert_scalar("first layer", 0, network.levels[1]);
+        assert_scalar("last layer", 0, network.levels[3]);
+        // 70 rows of three words, ternary layers read the masks too
+        assert_scalar("quantized flops", 130 * 9 + 70 * 3 * (levels == LEVELS_TERNARY ? 2 : 1) + 3 * 70, network_flops(network));
+
+        double *inputs[5];
+        for (int b = 0; b < 5; b++)
+        {
+            inputs[b] = random_array(dims[0], 20 + b);
+        }
+        InferenceContext context = inference_context_create(network, 5);
+        double *outputs = forward_batch(network, &context, 5, inputs);
+        double row[130], q[130];
+        for (int b = 0; b < 5; b++)
+        {
+            forward(network, inputs[b]);
+            assert_array("batched quantized outputs", dims[3], network.neurons[3], outputs + b * dims[3]);
+
+            // the popcounts give the products of the quantized weights and inputs
+            double expected[70];
+            for (int i = 0; i < dims[2]; i++)
+            {
+                dequantize_row(network, 2, i, row);
+                double sum = network.biases[2][i];
+                for (int j = 0; j < dims[1]; j++)
+                {
+                    sum += row[j] * quantize_input(levels, network.neurons[1][j]);
+                }
+                expected[i] = sigmoid(sum);
+            }
+            assert_close("quantized layer", dims[2], expected, network.neurons[2], 1e-12);
+        }
+        inference_context_destroy(context);
+
+        // the straight-through gradient uses the quantized inputs
+        backward(network, inputs[0]);
+        double *a = layer_inputs(network, 2, network.neurons[1], q);
+        assert_scalar("quantized input gradient", a[7] * network.biases_grad[2][5], network.weights_grad[2][5 * 130 + 7]);
+
+        // packed rows survive serialization and the loaded latent weights quantize to the same rows
+        FILE *file = tmpfile();
+        serialize_network(network, file);
+        fseek(file, 0, SEEK_SET);
+        Network inference = deserialize_network(file, 1);
+        fseek(file, 0, SEEK_SET);
+        Network trainable = deserialize_network(file, 0);
+        fclose(file);
+        assert_scalar("deserialized levels", levels, inference.levels[2]);
+        assert_scalar("no latent weights", 1, inference.weights[2] == NULL);
+        assert_scalar("packed bytes", 70 * 3 * 8 * (levels == LEVELS_TERNARY ? 2 : 1) + 70 * 8,
+                      network_parameter_bytes(inference) - (9 * 130 + 130 + 70 + 70 * 3 + 3) * sizeof(double));
+        forward(inference, inputs[0]);
+        forward(network, inputs[0]);
+        assert_array("deserialized outputs", dims[3], network.neurons[3], inference.neurons[3]);
+        network_quantize_layer(trainable, 2);
+        assert_array("requantized scales", dims[2], network.scales[2], trainable.scales[2]);
+        assert_scalar("requantized signs", 0, memcmp(network.signs[2], trainable.signs[2], 70 * 3 * sizeof(uint64_t)));
+
+        // the same layers in doubles
+        Network dense = network_dequantize(inference);
+        dequantize_row(network, 2, 11, row);
+        assert_scalar("dequantized levels", 0, dense.levels[2]);
+        assert_array("dequantized weights", dims[1], row, dense.weights[2] + 11 * 130);
+
+        for (int b = 0; b < 5; b++)
+        {
+            free(inputs[b]);
+        }
+        network_destroy(dense);
+        network_destroy(trainable);
+        network_destroy(inference);
+        network_destroy(network);
+    }
+}
+
+void test_checkpointing()
+{
+    int dims[] = {6, 4, 8, 5, 3};
+    Network network = network_create(5, dims);
+    assert_scalar("checkpoint", 1, is_checkpoint(network, 2, 2));
+    assert_scalar("output is no checkpoint", 0, is_checkpoint(network, 4, 1));
+    // checkpoint 2, slots of layers 1 and 3 and of layer 4, two error terms of the widest layer
+    assert_scalar("activation bytes", (8 + 5 + 3 + 2 * 8) * 10 * sizeof(double), checkpoint_bytes(network, 2, 10));
+    assert_scalar("recomputed layer 1", 4 * 6, checkpoint_recompute_flops(network, 2));
+    assert_scalar("nothing recomputed", 0, checkpoint_recompute_flops(network, 1));
+    network_destroy(network);
+}
+
+void test_half_precision()
+{
+    assert_scalar("fp16 one", 0x3c00, float_to_fp16(1.0f));
+    assert_scalar("fp16 largest", 0x7bff, float_to_fp16(65504.0f));
+    assert_scalar("fp16 overflow", 0x7c00, float_to_fp16(65520.0f));
+    assert_scalar("fp16 subnormal", 0x0001, float_to_fp16(0x1p-24f));
+    assert_scalar("fp16 round trip", -0.1, fp16_to_float(float_to_fp16(-0.1f)));
+    assert_scalar("bf16 one", 0x3f80, float_to_bf16(1.0f));
+    assert_scalar("bf16 rounding", 3.140625, bf16_to_float(float_to_bf16(3.14f)));
+
+    // the kernels picked for this CPU agree with the portable ones
+    int n = 100;
+    double *values = random_array(2 * n, 7);
+    for (Precision precision = PRECISION_BF16; precision <= PRECISION_FP16; precision++)
+    {
+        uint16_t w[100];
+        uint16_t x[100];
+        float y[100] = {0};
+        float expected_y[100] = {0};
+        for (int i = 0; i < n; i++)
+        {
+            w[i] = to_half(precision, values[i]);
+            x[i] = to_half(precision, values[n + i]);
+        }
+
+        MixedPrecision mixed = {.precision = precision};
+        mixed_select_kernels(&mixed);
+        HalfDot dot = precision == PRECISION_BF16 ? dot_bf16 : dot_fp16;
+        HalfAxpy axpy = precision == PRECISION_BF16 ? axpy_bf16 : axpy_fp16;
+        assert_scalar("dot product", dot(w, x, n), mixed.dot(w, x, n));
+
+        axpy(0.5f, x, expected_y, n);
+        mixed.axpy(0.5f, x, y, n);
+        for (int i = 0; i < n; i++)
+        {
+            assert_scalar("axpy", expected_y[i], y[i]);
+        }
+    }
+    free(values);
+}
+
+void test_schedules()
+{
+    LearningRate step = {.schedule = SCHEDULE_STEP, .base = 1, .factor = 0.5, .step = 2, .rate = 1};
+    assert_scalar("step epoch 1", 1, learning_rate_update(&step, 1, 0.1, 0));
+    assert_scalar("step epoch 4", 0.25, learning_rate_update(&step, 4, 0.4, 0));
+
+    LearningRate cosine = {.schedule = SCHEDULE_COSINE, .base = 1, .rate = 1};
+    assert_scalar("cosine start", 1, learning_rate_update(&cosine, 0, 0, 0));
+    assert_scalar("cosine middle", 0.5, learning_rate_update(&cosine, 5, 0.5, 0));
+
+    // the plateau schedule and early stopping both count validations without improvement
+    LearningRate plateau = {.schedule = SCHEDULE_PLATEAU, .base = 1, .factor = 0.1, .step = 2, .rate = 1};
+    EarlyStopping stopping = {.patience = 3, .min_delta = 0.01, .best = INFINITY};
+    double losses[] = {1.0, 0.5, 0.495, 0.6};
+    double rates[] = {1, 1, 1, 1};
+    for (int i = 0; i < 4; i++)
+    {
+        assert_scalar("plateau rate", rates[i], learning_rate_update(&plateau, i, 0, stopping.stale));
+        early_stopping_update(&stopping, losses[i]);
+    }
+    assert_scalar("best loss", 0.5, stopping.best);
+    assert_scalar("plateau decay", 0.1, learning_rate_update(&plateau, 4, 0, stopping.stale));
+    assert_scalar("not stopped", 0, early_stopping_done(stopping));
+    early_stopping_update(&stopping, 0.499);
+    assert_scalar("stopped", 1, early_stopping_done(stopping));
+}
+
+void test_augmentation()
+{
+    // a bright bar away from the border, so that shifts keep it inside the image
+    double image[28 * 28] = {0};
+    for (int y = 8; y < 20; y++)
+    {
+        for (int x = 12; x < 16; x++)
+        {
+            image[y * 28 + x] = 1;
+        }
+    }
+    double a[28 * 28];
+    double b[28 * 28];
+    double scratch[3 * 28 * 28];
+
+    Augmentation none = {0};
+    augment_image(none, STREAM_AUGMENT, 28, 28, image, a, scratch);
+    assert_array("no augmentation", 28 * 28, image, a);
+
+    Augmentation all = {.shift = 2, .rotation = 10, .elastic = 34, .sigma = 4, .noise = 0.05};
+    augment_image(all, STREAM_AUGMENT + 1, 28, 28, image, a, scratch);
+    augment_image(all, STREAM_AUGMENT + 1, 28, 28, image, b, scratch);
+    assert_array("same stream", 28 * 28, a, b);
+
+    // bilinear sampling of a shifted image keeps the total brightness
+    Augmentation shift = {.shift = 2};
+    augment_image(shift, STREAM_AUGMENT + 2, 28, 28, image, a, scratch);
+    double sum = 0;
+    for (int i = 0; i < 28 * 28; i++)
+    {
+        sum += a[i];
+    }
+    assert_scalar("shifted brightness", 48, sum);
+}
+
+void test_distillation()
+{
+    int dims[] = {6, 5, 3};
+    Network teacher = network_create(3, dims);
+    Image images[4];
+    double data[4][6];
+    double labels[4][3];
+    for (int b = 0; b < 4; b++)
+    {
+        for (int j = 0; j < 6; j++)
+        {
+            data[b][j] = (b * 6 + j) % 7 / 7.0;
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            labels[b][i] = i == b % 3;
+        }
+        images[b] = (Image){.label = labels[b], .data = data[b]};
+    }
+    Dataset dataset = {.images = images, .size = 4};
+
+    // at temperature 1 the soft targets are the teacher's outputs
+    double *logits = teacher_logits(teacher, dataset);
+    distill_labels(dataset, logits, 3, 1, 1);
+    for (int b = 0; b < 4; b++)
+    {
+        forward(teacher, data[b]);
+        assert_array("soft targets", 3, teacher.neurons[2], labels[b]);
+    }
+
+    // higher temperatures move the targets towards 0.5, the hard labels keep their share
+    double expected[3];
+    for (int i = 0; i < 3; i++)
+    {
+        expected[i] = 0.5 * sigmoid(logits[3 + i] / 4) + 0.5 * labels[1][i];
+    }
+    distill_labels(dataset, logits, 3, 4, 0.5);
+    assert_array("softened targets", 3, expected, labels[1]);
+
+    free(logits);
+    network_destroy(teacher);
+}
+
+typedef struct
+{
+    Communicator comm;
+    double data[10];
+} AllreduceRank;
+
+void *allreduce_rank(void *arg)
+{
+    AllreduceRank *rank = arg;
+    allreduce(&rank->comm, rank->data, 10);
+    return NULL;
+}
+
+void test_memory()
+{
+    // large arrays are mapped at huge page boundaries, small ones come from malloc
+    size_t n = 3 * HUGE_PAGE / sizeof(double) + 5;
+    double *large = large_array(n);
+    assert_scalar("large array alignment", 0, (uintptr_t)large % HUGE_PAGE);
+    large[0] = 1;
+    large[n - 1] = 2;
+    large_array_free(large, n);
+    double *small = large_array(16);
+    small[15] = 1;
+    large_array_free(small, 16);
+
+    // with two nodes, inference reads equal copies of the weights, one per node, or the network itself when
+    // the kernel refuses to bind them, like on a machine that has one node only
+    MemoryPolicy defaults = memory_policy();
+    memory.n_nodes = 2;
+    memory.replicas = 1;
+    int dims[] = {600, 700, 10};
+    Network network = network_create(3, dims);
+    int failures = placement_failures;
+    Replicas replicas = replicas_create(network);
+    int bound = placement_failures == failures;
+    assert_scalar("replicas", bound ? 2 : 0, replicas.n_nodes);
+    assert_scalar("refused node", bound ? -1 : 1, replicas.refused);
+    for (int node = 0; node < 2; node++)
+    {
+        Network replica = replica_network(replicas, network, node);
+        assert_scalar("replica owns its weights", bound, replica.weights[1] != network.weights[1]);
+        assert_array("replica weights", dims[1] * dims[0], network.weights[1], replica.weights[1]);
+        assert_array("replica biases", dims[2], network.biases[2], replica.biases[2]);
+    }
+    replicas_destroy(replicas);
+
+    memory.replicas = 0;
+    replicas = replicas_create(network);
+    assert_scalar("replicas disabled", 1, replica_network(replicas, network, 1).weights[1] == network.weights[1]);
+    replicas_destroy(replicas);
+    memory = defaults;
+    network_destroy(network);
+}
+
+void test_allreduce()
+{
+    // ring of three ranks connected by socket pairs, each running in its own thread
+    int world_size = 3;
+    AllreduceRank ranks[3];
+    pthread_t threads[3];
+    double expected[10] = {0};
+
+    for (int r = 0; r < world_size; r++)
+    {
+        ranks[r].comm = (Communicator){.rank = r, .world_size = world_size};
+    }
+
+    for (int r = 0; r < world_size; r++)
+    {
+        int fds[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        ranks[r].comm.next = fds[0];
+        ranks[(r + 1) % world_size].comm.prev = fds[1];
+
+        for (int i = 0; i < 10; i++)
+        {
+            ranks[r].data[i] = rng_uniform(r, i);
+            expected[i] += ranks[r].data[i];
+        }
+    }
+
+    for (int r = 0; r < world_size; r++)
+    {
+        pthread_create(threads + r, NULL, allreduce_rank, ranks + r);
+    }
+    for (int r = 0; r < world_size; r++)
+    {
+        pthread_join(threads[r], NULL);
+    }
+
+    for (int r = 0; r < world_size; r++)
+    {
+        assert_array("all-reduced sum", 10, expected, ranks[r].data);
+        assert_scalar("identical on every rank", 0, memcmp(ranks[0].data, ranks[r].data, sizeof(ranks[r].data)));
+        communicator_close(ranks[r].comm);
+    }
+
+    // 23 one-pixel images, batches of 7 shared 2, 2 and 3 by three ranks, 2 images held out
+    double pixels[23], labels[230] = {0};
+    Dataset dataset = {.images = malloc(23 * sizeof(Image)), .size = 23, .rows = 1, .cols = 1, .view = 1};
+    for (int i = 0; i < 23; i++)
+    {
+        pixels[i] = i;
+        dataset.images[i] = (Image){.label = labels + 10 * i, .data = pixels + i};
+    }
+    Dataset shard = shard_dataset(dataset, 21, 7, 2, world_size);
+    assert_scalar("shard images", 3 * 3 + 2, shard.capacity);
+    for (int epoch = 0; epoch < 3; epoch++)
+    {
+        shuffle_shards(shard, epoch, 7, world_size);
+        int sum = 0;
+        for (int i = 0; i < 21; i++)
+        {
+            int own = i % 7 >= 4;
+            assert_scalar("share of the rank", own, shard.images[i].data != NULL);
+            sum += own ? *shard.images[i].data : 0;
+        }
+        // the shares of the three batches 4, 5, 6, 11, 12, 13, 18, 19 and 20 in any order
+        assert_scalar("same images", 108, sum);
+        assert_scalar("validation kept", 22, *shard.images[22].data);
+    }
+    destroy_dataset(shard);
+    free(dataset.images);
+}
+
 // CLI
 
+/*
+ * RANDOMIZED DIFFERENTIAL TESTS
+ *
+ * Every case draws a network of random shape, mostly of sizes that are not
+ * multiples of the vector widths, together with a random batch. The
+ * gradients of the scalar reference are checked against finite differences,
+ * and every optimized path is compared against the reference within the
+ * tolerance of its precision. Failures name the case and the seed to rerun it.
+ */
+
+typedef struct
+{
+    int n_cases;
+    uint64_t seed;
+    double tolerances[3]; // relative tolerance, indexed by Precision
+} HarnessOptions;
+
+HarnessOptions harness = {
+    .n_cases = 50,
+    .seed = 1,
+    .tolerances = {1e-9, 0.05, 0.01},
+};
+
+#define STREAM_HARNESS 0x7000000000000000ull
+
+typedef struct
+{
+    Network network;
+    Image *images;
+    int batch_size;
+    char name[64];
+} HarnessCase;
+
+HarnessCase harness_case_create(int c)
+{
+    uint64_t stream = STREAM_HARNESS + ((uint64_t)c << 16);
+    int counter = 0;
+    rng_seed = harness.seed + c;
+
+    int ndim = 2 + rng_next(stream, counter++) % 4;
+    int dims[5];
+    for (int l = 0; l < ndim; l++)
+    {
+        dims[l] = 1 + rng_next(stream, counter++) % (l == ndim - 1 ? 12 : 40);
+    }
+
+    HarnessCase test = {
+        .network = network_create(ndim, dims),
+        .batch_size = 1 + rng_next(stream, counter++) % 17,
+    };
+    test.images = malloc(test.batch_size * sizeof(Image));
+    for (int b = 0; b < test.batch_size; b++)
+    {
+        test.images[b].data = malloc(dims[0] * sizeof(double));
+        test.images[b].label = malloc(dims[ndim - 1] * sizeof(double));
+        for (int j = 0; j < dims[0]; j++)
+        {
+            // mostly blank inputs, like the pixels of a digit
+            double value = rng_uniform(stream, counter++);
+            test.images[b].data[j] = value < 0.5 ? 0 : value;
+        }
+        for (int i = 0; i < dims[ndim - 1]; i++)
+        {
+            test.images[b].label[i] = rng_uniform(stream, counter++);
+        }
+    }
+
+    int length = snprintf(test.name, sizeof(test.name), "seed %llu case %d: %d", (unsigned long long)harness.seed, c, dims[0]);
+    for (int l = 1; l < ndim; l++)
+    {
+        length += snprintf(test.name + length, sizeof(test.name) - length, "x%d", dims[l]);
+    }
+    snprintf(test.name + length, sizeof(test.name) - length, ", batch %d", test.batch_size);
+    return test;
+}
+
+void harness_case_destroy(HarnessCase test)
+{
+    for (int b = 0; b < test.batch_size; b++)
+    {
+        free(test.images[b].data);
+        free(test.images[b].label);
+    }
+    free(test.images);
+    network_destroy(test.network);
+}
+
+// a copy of the case's network with the same parameters
+Network harness_clone(HarnessCase test)
+{
+    Network clone = network_create(test.network.ndim, test.network.dims);
+    network_copy(clone, test.network);
+    return clone;
+}
+
+// compares all parameters of two networks, relative to the largest value of each layer
+void harness_compare(HarnessCase test, char *path, Network expected, Network actual, double tolerance)
+{
+    char name[128];
+    snprintf(name, sizeof(name), "%s (%s)", path, test.name);
+    for (int l = 1; l < expected.ndim; l++)
+    {
+        assert_close(name, expected.dims[l] * expected.dims[l - 1], expected.weights[l], actual.weights[l], tolerance);
+        assert_close(name, expected.dims[l], expected.biases[l], actual.biases[l], tolerance);
+    }
+}
+
+/*
+ * Compares the updates of a step of learning_rate from the parameters of the
+ * case. Rounding errors of a sum are bounded by the sum of the magnitudes of
+ * its terms, so the tolerance is relative to the largest sum of the absolute
+ * per-sample updates of each layer rather than to the net update.
+ */
+void harness_compare_updates(HarnessCase test, char *path, double learning_rate, Network expected, Network actual, double tolerance)
+{
+    Network before = test.network;
+    Network mass = harness_clone(test);
+    Network sample = harness_clone(test);
+    for (int l = 1; l < before.ndim; l++)
+    {
+        memset(mass.weights[l], 0, before.dims[l] * before.dims[l - 1] * sizeof(double));
+        memset(mass.biases[l], 0, before.dims[l] * sizeof(double));
+    }
+    for (int b = 0; b < test.batch_size; b++)
+    {
+        network_copy(sample, before);
+        update_mini_batch(sample, test.images + b, 1, learning_rate / test.batch_size);
+        for (int l = 1; l < before.ndim; l++)
+        {
+            for (int i = 0; i < before.dims[l] * before.dims[l - 1]; i++)
+            {
+                mass.weights[l][i] += fabs(sample.weights[l][i] - before.weights[l][i]);
+            }
+            for (int i = 0; i < before.dims[l]; i++)
+            {
+                mass.biases[l][i] += fabs(sample.biases[l][i] - before.biases[l][i]);
+            }
+        }
+    }
+
+    for (int l = 1; l < before.ndim; l++)
+    {
+        double max_mass = 0;
+        double max_error = 0;
+        for (int i = 0; i < before.dims[l] * before.dims[l - 1]; i++)
+        {
+            max_mass = fmax(max_mass, mass.weights[l][i]);
+            max_error = fmax(max_error, fabs(expected.weights[l][i] - actual.weights[l][i]));
+        }
+        for (int i = 0; i < before.dims[l]; i++)
+        {
+            max_mass = fmax(max_mass, mass.biases[l][i]);
+            max_error = fmax(max_error, fabs(expected.biases[l][i] - actual.biases[l][i]));
+        }
+
+        if (!(max_error <= tolerance * max_mass))
+        {
+            assert_fails += 1;
+            printf("update of layer %d by %s%s%s failed (%s, relative error: %g)\n",
+                   l, BOLD, path, RESET, test.name, max_error / max_mass);
+        }
+    }
+
+    network_destroy(mass);
+    network_destroy(sample);
+}
+
+// central differences of the loss of one sample, against backward
+void check_gradients(HarnessCase test)
+{
+    Network network = test.network;
+    Image image = test.images[0];
+    double epsilon = 1e-6;
+    double tolerance = 1e-5;
+
+    forward(network, image.data);
+    backward(network, image.label);
+
+    for (int l = 1; l < network.ndim; l++)
+    {
+        int n_weights = network.dims[l] * network.dims[l - 1];
+        int n_checked = n_weights < 16 ? n_weights : 16;
+        double analytic[16 + 40];
+        double numeric[16 + 40];
+
+        // a sample of the weights and all biases of the layer
+        for (int k = 0; k < n_checked + network.dims[l]; k++)
+        {
+            double *parameter = k < n_checked ? network.weights[l] + (k * 7919) % n_weights : network.biases[l] + k - n_checked;
+            double *gradient = k < n_checked ? network.weights_grad[l] + (k * 7919) % n_weights : network.biases_grad[l] + k - n_checked;
+            analytic[k] = *gradient;
+
+            double value = *parameter;
+            *parameter = value + epsilon;
+            forward(network, image.data);
+            double loss_plus = compute_loss(network, image.label);
+            *parameter = value - epsilon;
+            forward(network, image.data);
+            double loss_minus = compute_loss(network, image.label);
+            *parameter = value;
+
+            numeric[k] = (loss_plus - loss_minus) / (2 * epsilon);
+        }
+
+        // the differences themselves are only exact up to the rounding error of the losses
+        double max_expected = 0;
+        double max_error = 0;
+        for (int k = 0; k < n_checked + network.dims[l]; k++)
+        {
+            max_expected = fmax(max_expected, fabs(numeric[k]));
+            max_error = fmax(max_error, fabs(numeric[k] - analytic[k]));
+        }
+        if (!(max_error <= tolerance * max_expected + 1e-9))
+        {
+            assert_fails += 1;
+            printf("finite differences of layer %d failed (%s, relative error: %g)\n", l, test.name, max_error / max_expected);
+        }
+
+        // recompute the gradients overwritten by the perturbed passes
+        forward(network, image.data);
+        backward(network, image.label);
+    }
+}
+
+void test_gradient_check()
+{
+    for (int c = 0; c < harness.n_cases; c++)
+    {
+        HarnessCase test = harness_case_create(c);
+        check_gradients(test);
+        harness_case_destroy(test);
+    }
+    rng_seed = 0;
+}
+
+// compares metrics with the confusion matrix, top-k count and loss computed from the outputs of each sample
+void check_metrics(char *name, Metrics metrics, int size, double *outputs, Image *images)
+{
+    int n = metrics.n_classes;
+    int *confusion = calloc(n * n, sizeof(int));
+    int top_k_correctly = 0;
+    double loss = 0;
+    for (int b = 0; b < size; b++)
+    {
+        double *output = outputs + b * n;
+        int actual = arg_max(n, images[b].label);
+        confusion[actual * n + arg_max(n, output)] += 1;
+        int larger = 0;
+        for (int i = 0; i < n; i++)
+        {
+            larger += output[i] > output[actual] || (output[i] == output[actual] && i < actual);
+            loss += (output[i] - images[b].label[i]) * (output[i] - images[b].label[i]);
+        }
+        top_k_correctly += larger < metrics.top_k;
+    }
+
+    assert_scalar(name, size, metrics.size);
+    assert_scalar(name, top_k_correctly, metrics.top_k_correctly);
+    assert_close(name, 1, &loss, &metrics.loss, harness.tolerances[PRECISION_DOUBLE]);
+    for (int i = 0; i < n * n; i++)
+    {
+        assert_scalar(name, confusion[i], metrics.confusion[i]);
+    }
+    free(confusion);
+}
+
+// forward_batch, predict and evaluate against forward
+void check_inference(HarnessCase test)
+{
+    Network network = test.network;
+    int n_outputs = network.dims[network.ndim - 1];
+    double tolerance = harness.tolerances[PRECISION_DOUBLE];
+
+    double **inputs = malloc(test.batch_size * sizeof(double *));
+    double *expected = malloc(test.batch_size * n_outputs * sizeof(double));
+    double *predicted = malloc(test.batch_size * n_outputs * sizeof(double));
+    int expected_correctly = 0;
+    for (int b = 0; b < test.batch_size; b++)
+    {
+        inputs[b] = test.images[b].data;
+        forward(network, inputs[b]);
+        memcpy(expected + b * n_outputs, network.neurons[network.ndim - 1], n_outputs * sizeof(double));
+        expected_correctly += arg_max(n_outputs, network.neurons[network.ndim - 1]) == arg_max(n_outputs, test.images[b].label);
+    }
+
+    char name[128];
+    InferenceContext context = inference_context_create(network, test.batch_size);
+    double *outputs = forward_batch(network, &context, test.batch_size, inputs);
+    snprintf(name, sizeof(name), "forward_batch (%s)", test.name);
+    assert_close(name, test.batch_size * n_outputs, expected, outputs, tolerance);
+    inference_context_destroy(context);
+
+    // small contexts split the batch into many ranges
+    InferenceContext *contexts = inference_contexts_create(network, 3);
+    predict(network, contexts, test.batch_size, inputs, predicted);
+    snprintf(name, sizeof(name), "predict (%s)", test.name);
+    assert_close(name, test.batch_size * n_outputs, expected, predicted, tolerance);
+    inference_contexts_destroy(contexts);
+
+    Dataset dataset = {.images = test.images, .size = test.batch_size};
+    snprintf(name, sizeof(name), "evaluate (%s)", test.name);
+    assert_scalar(name, expected_correctly, evaluate(network, dataset));
+
+    // a second model without hidden layers, and the average of both
+    Network models[2] = {network, network_create(2, (int[]){network.dims[0], n_outputs})};
+    double *other = malloc(test.batch_size * n_outputs * sizeof(double));
+    double *average = malloc(test.batch_size * n_outputs * sizeof(double));
+    for (int b = 0; b < test.batch_size; b++)
+    {
+        forward(models[1], inputs[b]);
+        for (int i = 0; i < n_outputs; i++)
+        {
+            other[b * n_outputs + i] = models[1].neurons[1][i];
+            average[b * n_outputs + i] = expected[b * n_outputs + i] / 2 + models[1].neurons[1][i] / 2;
+        }
+    }
+    Metrics metrics[3];
+    for (int m = 0; m < 3; m++)
+    {
+        metrics[m] = metrics_create(n_outputs, 1 + test.batch_size % n_outputs);
+    }
+    evaluate_models(models, NULL, 2, 2, dataset, metrics);
+    double *expected_outputs[3] = {expected, other, average};
+    char *model_names[3] = {"model", "other model", "ensemble"};
+    for (int m = 0; m < 3; m++)
+    {
+        snprintf(name, sizeof(name), "evaluate_models %s (%s)", model_names[m], test.name);
+        check_metrics(name, metrics[m], test.batch_size, expected_outputs[m], test.images);
+        metrics_destroy(metrics[m]);
+    }
+
+    // an ensemble of only the first model, the second one is evaluated like a teacher
+    for (int m = 0; m < 3; m++)
+    {
+        metrics[m] = metrics_create(n_outputs, 1 + test.batch_size % n_outputs);
+    }
+    evaluate_models(models, NULL, 2, 1, dataset, metrics);
+    snprintf(name, sizeof(name), "evaluate_models ensemble without teacher (%s)", test.name);
+    check_metrics(name, metrics[2], test.batch_size, expected, test.images);
+    for (int m = 0; m < 3; m++)
+    {
+        metrics_destroy(metrics[m]);
+    }
+    network_destroy(models[1]);
+
+    free(inputs);
+    free(expected);
+    free(predicted);
+    free(other);
+    free(average);
+}
+
+// the trainer's paths against update_mini_batch
+void check_training(HarnessCase test)
+{
+    double learning_rate = 0.5;
+    Network reference = harness_clone(test);
+    update_mini_batch(reference, test.images, test.batch_size, learning_rate);
+
+    char name[64];
+    for (int threads = 1; threads <= 3; threads++)
+    {
+        for (int pipeline = 0; pipeline < 2; pipeline++)
+        {
+            Network network = harness_clone(test);
+            Trainer trainer = trainer_create(network, threads);
+            trainer.pipeline = pipeline;
+            trainer_step(&trainer, test.images, test.batch_size, learning_rate);
+            snprintf(name, sizeof(name), "%s step on %d threads", pipeline ? "pipelined" : "sequential", threads);
+            harness_compare(test, name, reference, network, harness.tolerances[PRECISION_DOUBLE]);
+            trainer_destroy(trainer);
+            network_destroy(network);
+        }
+    }
+
+    // batched slices, recomputing all but every first, second or third layer
+    for (int every = 1; every <= 3; every++)
+    {
+        Network network = harness_clone(test);
+        Trainer trainer = trainer_create(network, 2);
+        trainer.checkpoint_every = every;
+        trainer_step(&trainer, test.images, test.batch_size, learning_rate);
+        snprintf(name, sizeof(name), "step with a checkpoint every %d layers", every);
+        harness_compare(test, name, reference, network, harness.tolerances[PRECISION_DOUBLE]);
+        trainer_destroy(trainer);
+        network_destroy(network);
+    }
+
+    // hogwild on one thread is SGD with one sample per step
+    {
+        Network sequential = harness_clone(test);
+        for (int b = 0; b < test.batch_size; b++)
+        {
+            update_mini_batch(sequential, test.images + b, 1, learning_rate / test.batch_size);
+        }
+        Network network = harness_clone(test);
+        Trainer trainer = trainer_create(network, 1);
+        Dataset dataset = {.images = test.images, .size = test.batch_size};
+        hogwild(&trainer, dataset, test.batch_size, learning_rate);
+        harness_compare(test, "hogwild on one thread", sequential, network, harness.tolerances[PRECISION_DOUBLE]);
+        trainer_destroy(trainer);
+        network_destroy(network);
+        network_destroy(sequential);
+    }
+
+    // a pack of three lanes, two with the reference's learning rate and one with half of it
+    {
+        Network half = harness_clone(test);
+        update_mini_batch(half, test.images, test.batch_size, learning_rate / 2);
+        Network networks[3] = {harness_clone(test), harness_clone(test), harness_clone(test)};
+        double learning_rates[3] = {learning_rate, learning_rate / 2, learning_rate};
+        Pack pack = pack_create(networks, 3, learning_rates, test.batch_size);
+        double losses[PACK_LANES] = {0};
+        pack_step(pack, test.images, test.batch_size, losses);
+        pack_extract(pack, networks);
+        harness_compare(test, "packed lane", reference, networks[0], harness.tolerances[PRECISION_DOUBLE]);
+        harness_compare(test, "packed lane with half the rate", half, networks[1], harness.tolerances[PRECISION_DOUBLE]);
+        harness_compare(test, "last packed lane", reference, networks[2], harness.tolerances[PRECISION_DOUBLE]);
+        pack_destroy(pack);
+        for (int k = 0; k < 3; k++)
+        {
+            network_destroy(networks[k]);
+        }
+        network_destroy(half);
+    }
+
+    for (Precision precision = PRECISION_BF16; precision <= PRECISION_FP16; precision++)
+    {
+        Network expected = harness_clone(test);
+        update_mini_batch(expected, test.images, test.batch_size, learning_rate);
+        Network network = harness_clone(test);
+        Trainer trainer = trainer_create(network, 2);
+        trainer.mixed = mixed_create(network, 2, precision);
+        trainer_step(&trainer, test.images, test.batch_size, learning_rate);
+        harness_compare_updates(test, precision == PRECISION_BF16 ? "bf16 step" : "fp16 step",
+                                learning_rate, expected, network, harness.tolerances[precision]);
+        trainer_destroy(trainer);
+        network_destroy(network);
+        network_destroy(expected);
+    }
+
+    network_destroy(reference);
+}
+
+void test_differential()
+{
+    for (int c = 0; c < harness.n_cases; c++)
+    {
+        HarnessCase test = harness_case_create(c);
+        check_inference(test);
+        check_training(test);
+        harness_case_destroy(test);
+    }
+    rng_seed = 0;
+}
+
 void run_test(char *name, void test())
 {
     int is_selected = n_tests == 0;
@@ -121,8 +1549,56 @@ void run_test(char *name, void test())
 void print_usage()
 {
     printf("Usage:\n\n");
-    printf("    %sneural test [<names>]%s\n\n", BOLD, RESET);
+    printf("    %sneural-test [<options>] [<names>]%s\n\n", BOLD, RESET);
     printf("Run specified tests, otherwise run all.\n\n");
+    printf("Options of the randomized tests:\n\n");
+    printf("    %s--cases <int>%s                 random networks per test (default: 50)\n", BOLD, RESET);
+    printf("    %s--seed <int>%s                  seed of the shapes and values (default: 1)\n", BOLD, RESET);
+    printf("    %s--tolerance <precision=real>%s  relative tolerance of double (default: 1e-9),\n", BOLD, RESET);
+    printf("                                  bf16 (default: 0.05) or fp16 (default: 0.01)\n\n");
+}
+
+// parses the harness options in front of the test names, returns the index of the first name
+int parse_options(int argc, char *argv[])
+{
+    int i = 1;
+    for (; i + 1 < argc && strncmp(argv[i], "--", 2) == 0; i += 2)
+    {
+        char c;
+        char precision[8];
+        double tolerance;
+        unsigned long long seed;
+        if (strcmp(argv[i], "--cases") == 0 && sscanf(argv[i + 1], "%d%c", &harness.n_cases, &c) == 1 && harness.n_cases > 0)
+        {
+            continue;
+        }
+        if (strcmp(argv[i], "--seed") == 0 && argv[i + 1][0] != '-' && sscanf(argv[i + 1], "%llu%c", &seed, &c) == 1)
+        {
+            harness.seed = seed;
+            continue;
+        }
+        if (strcmp(argv[i], "--tolerance") == 0 && sscanf(argv[i + 1], "%7[^=]=%lf%c", precision, &tolerance, &c) == 2)
+        {
+            char *names[] = {"double", "bf16", "fp16"};
+            int found = 0;
+            for (int p = 0; p < 3; p++)
+            {
+                if (strcmp(precision, names[p]) == 0)
+                {
+                    harness.tolerances[p] = tolerance;
+                    found = 1;
+                }
+            }
+            if (found)
+            {
+                continue;
+            }
+        }
+
+        printf("%serror:%s invalid option '%s %s'\n", RED, RESET, argv[i], argv[i + 1]);
+        exit(1);
+    }
+    return i;
 }
 
 int main(int argc, char *argv[])
@@ -135,13 +1611,34 @@ int main(int argc, char *argv[])
 
     srand(0);
 
-    test_names = argv + 1;
-    n_tests = argc - 1;
+    int first = parse_options(argc, argv);
+    test_names = argv + first;
+    n_tests = argc - first;
 
     double start = timestamp();
 
     run_test("test_back_propagation", test_back_propagation);
     run_test("test_serialization", test_serialization);
+    run_test("test_specialized_kernels", test_specialized_kernels);
+    run_test("test_forward_batch", test_forward_batch);
+    run_test("test_tuning_cache", test_tuning_cache);
+    run_test("test_counters", test_counters);
+    run_test("test_factorization", test_factorization);
+    run_test("test_quantization", test_quantization);
+    run_test("test_checkpointing", test_checkpointing);
+    run_test("test_half_precision", test_half_precision);
+    run_test("test_inference_network", test_inference_network);
+    run_test("test_library", test_library);
+    run_test("test_live_model", test_live_model);
+    run_test("test_pgm", test_pgm);
+    run_test("test_online", test_online);
+    run_test("test_schedules", test_schedules);
+    run_test("test_augmentation", test_augmentation);
+    run_test("test_distillation", test_distillation);
+    run_test("test_memory", test_memory);
+    run_test("test_allreduce", test_allreduce);
+    run_test("test_gradient_check", test_gradient_check);
+    run_test("test_differential", test_differential);
 
     double end = timestamp();
 
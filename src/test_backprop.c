@@ -138,6 +138,60 @@ void test_back_propagation()
     assert_array("nabla_b3", 3, nabla_b3, network.biases_grad[3]);
     assert_array("nabla_b4", 2, nabla_b4, network.biases_grad[4]);
 
+    // compare gradients of the 16-bit passes, undoing the loss scale
+    {
+        MixedPrecision *mixed = mixed_create(network, 1, PRECISION_BF16);
+        mixed_zero_gradients(mixed, 0, network);
+        double mixed_loss = mixed_sample(mixed, 0, network, inputs, label);
+        assert_close("bf16 loss", 1, &loss, &mixed_loss, 0.05);
+        for (int l = 1; l < 5; l++)
+        {
+            for (int i = 0; i < dims[l] * dims[l - 1]; i++)
+            {
+                network.weights_grad[l][i] = mixed->weights_grad[0][l][i] / mixed->loss_scale;
+            }
+            for (int i = 0; i < dims[l]; i++)
+            {
+                network.biases_grad[l][i] = mixed->biases_grad[0][l][i] / mixed->loss_scale;
+            }
+        }
+        assert_close("bf16 nabla_w1", 6, nabla_w1, network.weights_grad[1], 0.05);
+        assert_close("bf16 nabla_w2", 12, nabla_w2, network.weights_grad[2], 0.05);
+        assert_close("bf16 nabla_w3", 12, nabla_w3, network.weights_grad[3], 0.05);
+        assert_close("bf16 nabla_w4", 6, nabla_w4, network.weights_grad[4], 0.05);
+        assert_close("bf16 nabla_b1", 3, nabla_b1, network.biases_grad[1], 0.05);
+        assert_close("bf16 nabla_b2", 4, nabla_b2, network.biases_grad[2], 0.05);
+        assert_close("bf16 nabla_b3", 3, nabla_b3, network.biases_grad[3], 0.05);
+        assert_close("bf16 nabla_b4", 2, nabla_b4, network.biases_grad[4], 0.05);
+        mixed_destroy(mixed, network);
+    }
+    {
+        MixedPrecision *mixed = mixed_create(network, 1, PRECISION_FP16);
+        mixed_zero_gradients(mixed, 0, network);
+        double mixed_loss = mixed_sample(mixed, 0, network, inputs, label);
+        assert_close("fp16 loss", 1, &loss, &mixed_loss, 0.005);
+        for (int l = 1; l < 5; l++)
+        {
+            for (int i = 0; i < dims[l] * dims[l - 1]; i++)
+            {
+                network.weights_grad[l][i] = mixed->weights_grad[0][l][i] / mixed->loss_scale;
+            }
+            for (int i = 0; i < dims[l]; i++)
+            {
+                network.biases_grad[l][i] = mixed->biases_grad[0][l][i] / mixed->loss_scale;
+            }
+        }
+        assert_close("fp16 nabla_w1", 6, nabla_w1, network.weights_grad[1], 0.005);
+        assert_close("fp16 nabla_w2", 12, nabla_w2, network.weights_grad[2], 0.005);
+        assert_close("fp16 nabla_w3", 12, nabla_w3, network.weights_grad[3], 0.005);
+        assert_close("fp16 nabla_w4", 6, nabla_w4, network.weights_grad[4], 0.005);
+        assert_close("fp16 nabla_b1", 3, nabla_b1, network.biases_grad[1], 0.005);
+        assert_close("fp16 nabla_b2", 4, nabla_b2, network.biases_grad[2], 0.005);
+        assert_close("fp16 nabla_b3", 3, nabla_b3, network.biases_grad[3], 0.005);
+        assert_close("fp16 nabla_b4", 2, nabla_b4, network.biases_grad[4], 0.005);
+        mixed_destroy(mixed, network);
+    }
+
     // free gradients
     free(nabla_w1);
     free(nabla_w2);